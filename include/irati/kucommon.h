@@ -821,6 +821,71 @@ struct irati_ctrldev_ctldata {
 #define IRATI_CTRL_FLOW_BIND _IOW(0xAF, 0x01, struct irati_ctrldev_ctldata)
 #define IRATI_IOCTL_MSS_GET _IOR(0xAF, 0x02, struct irati_iodev_ctldata)
 
+/*
+ * Shared-memory SDU rings of a flow I/O device. IRATI_IOCTL_RING_SETUP
+ * allocates a RX ring (filled by the kernel) and a TX ring (filled by
+ * the application), which are then mmap()ed from offset 0 of the device:
+ * the RX ring starts at offset 0, the TX ring at offset ring_size.
+ *
+ * Each ring starts with a struct irati_ring_hdr, followed by num_slots
+ * slots of IRATI_RING_SLOT_STRIDE(slot_size) bytes. The producer fills
+ * the slot at (head % num_slots) and then advances head, the consumer
+ * drains the slot at (tail % num_slots) and then advances tail; both
+ * indexes are free running. IRATI_IOCTL_RING_RXSYNC refills the RX ring
+ * (blocking if it is empty and the device is in blocking mode), while
+ * IRATI_IOCTL_RING_TXSYNC transmits the SDUs posted in the TX ring.
+ */
+struct irati_ring_hdr {
+	uint32_t head;
+	uint32_t pad0[15];
+	uint32_t tail;
+	uint32_t pad1[15];
+};
+
+struct irati_ring_slot {
+	uint32_t len;
+	uint32_t flags;
+	unsigned char data[0];
+};
+
+#define IRATI_RING_SLOT_STRIDE(slot_size)				\
+	(((uint32_t)sizeof(struct irati_ring_slot) + (slot_size) + 63) & ~63U)
+
+#define IRATI_RING_SLOT(hdr, slot_size, num_slots, idx)			\
+	((struct irati_ring_slot *)((unsigned char *)((hdr) + 1) +	\
+	 ((idx) & ((num_slots) - 1)) * IRATI_RING_SLOT_STRIDE(slot_size)))
+
+#define IRATI_RING_MAX_SLOTS 4096
+
+struct irati_iodev_ringreq {
+	uint32_t num_slots; /* in: power of two */
+	uint32_t slot_size; /* in: at least the MSS of the flow */
+	uint32_t ring_size; /* out: mmap() size of each ring */
+};
+
+#define IRATI_IOCTL_RING_SETUP _IOWR(0xAF, 0x03, struct irati_iodev_ringreq)
+#define IRATI_IOCTL_RING_RXSYNC _IO(0xAF, 0x04)
+#define IRATI_IOCTL_RING_TXSYNC _IO(0xAF, 0x05)
+
+/*
+ * Batched I/O on a flow I/O device. The buffer holds a sequence of
+ * records, each made of a 32 bit SDU length in host byte order followed
+ * by the SDU, padded to a multiple of 4 bytes. On input count is the
+ * number of records to write (or the maximum number of SDUs to read),
+ * on output the number of SDUs actually moved.
+ */
+struct irati_iodev_batch {
+	uint64_t buf;
+	uint32_t buf_len;
+	uint32_t count;
+};
+
+#define IRATI_BATCH_REC_SIZE(len)					\
+	(((uint32_t)sizeof(uint32_t) + (len) + 3) & ~3U)
+
+#define IRATI_IOCTL_READ_BATCH _IOWR(0xAF, 0x06, struct irati_iodev_batch)
+#define IRATI_IOCTL_WRITE_BATCH _IOWR(0xAF, 0x07, struct irati_iodev_batch)
+
 #ifdef __cplusplus
 }
 #endif
@@ -30,6 +30,10 @@
 #include "rds/robjects.h"
 #include "iodev.h"
 #include "ctrldev.h"
+#include "rmt.h"
+#include "du.h"
+#include "rds/rqueue.h"
+#include "rds/rds.h"
 
 #define MK_RINA_VERSION(MAJOR, MINOR, MICRO)                            \
         (((MAJOR & 0xFF) << 24) | ((MINOR & 0xFF) << 16) | (MICRO & 0xFFFF))
@@ -71,8 +75,65 @@ static int __init mod_init(void)
                 return -1;
 	}
 
+        LOG_DBG("Creating DU caches");
+        if (du_init()) {
+                robject_del(&core_object);
+                return -1;
+        }
+        if (rqueue_init()) {
+                du_fini();
+                robject_del(&core_object);
+                return -1;
+        }
+
+#ifdef CONFIG_RINA_RMT_REGRESSION_TESTS
+        LOG_DBG("Starting RMT regression tests");
+        if (!regression_tests_rmt()) {
+                LOG_ERR("RMT regression tests failed, bailing out");
+                rqueue_fini();
+                du_fini();
+                robject_del(&core_object);
+                return -1;
+        }
+#endif
+
+#ifdef CONFIG_RINA_RFIFO_REGRESSION_TESTS
+        LOG_DBG("Starting RDS regression tests");
+        if (!regression_tests_rds()) {
+                LOG_ERR("RDS regression tests failed, bailing out");
+                rqueue_fini();
+                du_fini();
+                robject_del(&core_object);
+                return -1;
+        }
+#endif
+
+#ifdef CONFIG_RINA_DU_REGRESSION_TESTS
+        LOG_DBG("Starting DU regression tests");
+        if (!regression_tests_du()) {
+                LOG_ERR("DU regression tests failed, bailing out");
+                rqueue_fini();
+                du_fini();
+                robject_del(&core_object);
+                return -1;
+        }
+#endif
+
+#ifdef CONFIG_RINA_PCI_REGRESSION_TESTS
+        LOG_DBG("Starting PCI regression tests");
+        if (!regression_tests_pci()) {
+                LOG_ERR("PCI regression tests failed, bailing out");
+                rqueue_fini();
+                du_fini();
+                robject_del(&core_object);
+                return -1;
+        }
+#endif
+
         LOG_DBG("Initializing IODEV");
         if (iodev_init()) {
+                rqueue_fini();
+                du_fini();
                 robject_del(&core_object);
                 return -1;
         }
@@ -80,6 +141,8 @@ static int __init mod_init(void)
         LOG_DBG("Initializing CTRLDEV");
         if (ctrldev_init()) {
                 iodev_fini();
+                rqueue_fini();
+                du_fini();
                 robject_del(&core_object);
                 return -1;
         }
@@ -88,6 +151,8 @@ static int __init mod_init(void)
         if (kipcm_init(&core_object)) {
         	ctrldev_fini();
                 iodev_fini();
+                rqueue_fini();
+                du_fini();
                 robject_del(&core_object);
                 return -1;
         }
@@ -114,6 +179,12 @@ static void __exit mod_exit(void)
 	iodev_fini();
 	LOG_INFO("IODEV finalized successfully");
 
+	/* Wait for objects reclaimed after an RCU grace period */
+	rcu_barrier();
+
+	rqueue_fini();
+	du_fini();
+
 	robject_del(&core_object);
 	LOG_INFO("IRATI RINA implementation kernel modules removed");
 }
@@ -36,6 +36,11 @@ struct delim_def_priv {
 	struct du_list * pending_dus;
 	bool reassembly_in_process;
 	int total_length;
+
+	/* Fragments reference the SDU and reassembly chains them in
+	 * reasm_du, instead of copying the data */
+	bool zero_copy;
+	struct du * reasm_du;
 };
 
 static struct delim_def_priv * delim_def_priv_create(void)
@@ -49,6 +54,8 @@ static struct delim_def_priv * delim_def_priv_create(void)
 	priv->pending_dus = du_list_create();
 	priv->reassembly_in_process = false;
 	priv->total_length = 0;
+	priv->zero_copy = false;
+	priv->reasm_du = NULL;
 
 	return priv;
 }
@@ -62,6 +69,9 @@ static void delim_def_priv_destroy(struct delim_def_priv * priv)
 		du_list_destroy(priv->pending_dus, true);
 	}
 
+	if (priv->reasm_du)
+		du_destroy(priv->reasm_du);
+
 	rkfree(priv);
 }
 
@@ -71,6 +81,10 @@ static void delim_def_priv_reset(struct delim_def_priv * priv)
 		return;
 
 	du_list_clear(priv->pending_dus, true);
+	if (priv->reasm_du) {
+		du_destroy(priv->reasm_du);
+		priv->reasm_du = NULL;
+	}
 	priv->reassembly_in_process = false;
 	priv->total_length = 0;
 }
@@ -133,6 +147,33 @@ static int copy_du_fragment_to_list(int length, int offset, char * flags,
 	return 0;
 }
 
+static int ref_du_fragment_to_list(int length, int offset, char * flags,
+				   struct du * du, struct du_list * du_list)
+{
+	struct du * frag_du;
+
+	frag_du = du_create_fragment_ni(du, offset, length, 1);
+	if (!frag_du) {
+		LOG_ERR("Problems creating du");
+		du_destroy(du);
+		return -1;
+	}
+
+	memcpy(du_buffer(frag_du), flags, 1);
+
+	if (add_du_to_list_ni(du_list, frag_du)) {
+		LOG_ERR("Problems adding DU to list");
+		du_destroy(frag_du);
+		du_destroy(du);
+		return -1;
+	}
+
+	LOG_DBG("Referenced fragment of length %d, offset %d and flags %d",
+		 length, offset, *flags);
+
+	return 0;
+}
+
 /* Does not use SDU sequence numbers, assumes that max SDU gap
  * for the flow is either 0 or -1 (don't care). It relies on PDU
  * sequence numbers for in-order delivery.
@@ -141,6 +182,8 @@ int default_delim_fragment(struct delim_ps * ps, struct du * du,
 			   struct du_list * du_list)
 {
 	struct delim * delim;
+	struct delim_def_priv * priv;
+	int (* add_fragment)(int, int, char *, struct du *, struct du_list *);
 	int pending_du_len;
 	int length;
 	int offset;
@@ -159,6 +202,12 @@ int default_delim_fragment(struct delim_ps * ps, struct du * du,
 		return fragment_single_full_sdu(du, du_list);
 	}
 
+	priv = (struct delim_def_priv *) ps->priv;
+	if (priv && priv->zero_copy)
+		add_fragment = ref_du_fragment_to_list;
+	else
+		add_fragment = copy_du_fragment_to_list;
+
 	first_frag = true;
 	offset = 0;
 	length = 0;
@@ -178,8 +227,7 @@ int default_delim_fragment(struct delim_ps * ps, struct du * du,
 			length = pending_du_len;
 		}
 
-		if (copy_du_fragment_to_list(length, offset,
-					     &flags, du, du_list)) {
+		if (add_fragment(length, offset, &flags, du, du_list)) {
 			return -1;
 		}
 
@@ -239,6 +287,23 @@ static int append_pending_du(struct delim_def_priv * priv, struct du * du)
 {
 	priv->total_length = priv->total_length + du_len(du) - 1;
 
+	if (priv->zero_copy) {
+		/* Drop the flags, the data is chained as it is */
+		du_head_shrink(du, 1);
+		if (!priv->reasm_du) {
+			priv->reasm_du = du;
+		} else if (du_chain(priv->reasm_du, du)) {
+			LOG_ERR("Problems chaining DU to the reassembly buffer");
+			delim_def_priv_reset(priv);
+			du_destroy(du);
+			return -1;
+		}
+
+		LOG_DBG("Chained DU, total length is %d", priv->total_length);
+
+		return 0;
+	}
+
 	if (add_du_to_list_ni(priv->pending_dus, du)) {
 		LOG_ERR("Problems adding DU to pending DUs list");
 		delim_def_priv_reset(priv);
@@ -290,6 +355,13 @@ static int process_last_fragment(struct delim_def_priv * priv,
 		return -1;
 	}
 
+	if (priv->zero_copy) {
+		/* Linearized only if it has to be, see du_linearize() */
+		frag_sdu = priv->reasm_du;
+		priv->reasm_du = NULL;
+		goto deliver;
+	}
+
 	frag_sdu = du_create_ni(priv->total_length);
 	if (!frag_sdu) {
 		LOG_ERR("Could not create SDU");
@@ -305,6 +377,7 @@ static int process_last_fragment(struct delim_def_priv * priv,
 		offset = offset + length;
 	}
 
+ deliver:
 	if (add_du_to_list(du_list, frag_sdu)) {
 		LOG_ERR("Problems adding DU to list");
 		delim_def_priv_reset(priv);
@@ -382,6 +455,46 @@ int default_delim_process_udf(struct delim_ps * ps, struct du * du,
 	return 0;
 }
 
+static int delim_ps_default_set_policy_set_param(struct ps_base * bps,
+						 const char * name,
+						 const char * value)
+{
+	struct delim_ps * ps = container_of(bps, struct delim_ps, base);
+	struct delim_def_priv * priv = ps->priv;
+	int int_value;
+	int ret;
+
+	if (!name) {
+		LOG_ERR("Null parameter name");
+		return -1;
+	}
+
+	if (!value) {
+		LOG_ERR("Null parameter value");
+		return -1;
+	}
+
+	if (strcmp(name, "zeroCopy") == 0) {
+		ret = kstrtoint(value, 10, &int_value);
+		if (ret) {
+			LOG_ERR("Invalid value for zeroCopy: %s", value);
+			return -1;
+		}
+
+		/* Switching mode drops a reassembly in progress */
+		if (priv->zero_copy != !!int_value)
+			delim_def_priv_reset(priv);
+		priv->zero_copy = !!int_value;
+		LOG_DBG("Zero-copy fragmentation is %s",
+			priv->zero_copy ? "on" : "off");
+	} else {
+		LOG_ERR("Unknown parameter %s", name);
+		return -1;
+	}
+
+	return 0;
+}
+
 struct ps_base * delim_ps_default_create(struct rina_component * component)
 {
         struct delim * delim = delim_from_component(component);
@@ -391,7 +504,7 @@ struct ps_base * delim_ps_default_create(struct rina_component * component)
                 return NULL;
         }
 
-        ps->base.set_policy_set_param   = NULL;
+        ps->base.set_policy_set_param   = delim_ps_default_set_policy_set_param;
         ps->dm                          = delim;
         ps->priv                        = delim_def_priv_create();
         if (!ps->priv) {
@@ -30,6 +30,8 @@
 #include "policies.h"
 #include "sdup.h"
 #include "delim-ps.h"
+#include "efcp-str.h"
+#include "dtp.h"
 #include "irati/kucommon.h"
 #include "rds/rmem.h"
 
@@ -211,6 +213,18 @@ int delim_set_policy_set_param(struct delim * delim,
 }
 EXPORT_SYMBOL(delim_set_policy_set_param);
 
+int delim_write(struct delim * delim, struct du * du)
+{
+	if (!delim->efcp->dtp) {
+		LOG_ERR("No DTP to write the UDF to");
+		du_destroy(du);
+		return -1;
+	}
+
+	return dtp_write(delim->efcp->dtp, du);
+}
+EXPORT_SYMBOL(delim_write);
+
 int delim_ps_publish(struct ps_factory * factory)
 {
 	if (factory == NULL) {
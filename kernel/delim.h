@@ -53,6 +53,8 @@ int delim_set_policy_set_param(struct delim * delim,
 			       const char * path,
 			       const char * name,
 			       const char * value);
+/* For policy sets that send UDFs outside of delim_fragment */
+int delim_write(struct delim * delim, struct du * du);
 int delim_ps_publish(struct ps_factory * factory);
 int delim_ps_unpublish(const char * name);
 
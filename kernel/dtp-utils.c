@@ -22,6 +22,7 @@
  */
 
 #include <linux/list.h>
+#include <linux/log2.h>
 
 #define RINA_PREFIX "dt-utils"
 
@@ -327,30 +328,128 @@ void cwq_deliver(struct cwq * queue,
         return;
 }
 
-static struct rtxq_entry * rtxq_entry_create_gfp(struct du * du, gfp_t flag)
+#define RTXQ_DEFAULT_SIZE 64
+#define RTXQ_MAX_SIZE     (1 << 16)
+#define RTXW_MASK         (RTXW_SLOTS - 1)
+/* Entries further away than this wait in the far list */
+#define RTXW_LVL1_SPAN    (RTXW_SLOTS * (RTXW_SLOTS - 1))
+/* Max PDUs retransmitted per round while the queue lock is released */
+#define RTX_BATCH         16
+
+static inline struct rtxq_entry * rtxqueue_slot(struct rtxqueue * q,
+                                                seq_num_t         sn)
+{ return &q->ring[sn & q->mask]; }
+
+/* Returns the entry for sn, NULL if not queued */
+static struct rtxq_entry * rtxqueue_find(struct rtxqueue * q, seq_num_t sn)
 {
-        struct rtxq_entry * tmp;
+        struct rtxq_entry * cur;
 
-        tmp = rkzalloc(sizeof(*tmp), flag);
-        if (!tmp)
+        if (sn - q->head >= q->span)
                 return NULL;
 
-        tmp->du        = du;
-        tmp->time_stamp = jiffies;
-        tmp->retries    = 0;
+        cur = rtxqueue_slot(q, sn);
 
-        INIT_LIST_HEAD(&tmp->next);
+        return cur->du ? cur : NULL;
+}
 
-        return tmp;
+static void rtxw_insert(struct rtxqueue * q, struct rtxq_entry * cur)
+{
+        unsigned long delta;
+
+        if (time_before(cur->due, q->clock)) {
+                list_add_tail(&cur->next, &q->expired);
+                return;
+        }
+
+        delta = cur->due - q->clock;
+        if (delta < RTXW_SLOTS)
+                list_add_tail(&cur->next, &q->lvl0[cur->due & RTXW_MASK]);
+        else if (delta < RTXW_LVL1_SPAN)
+                list_add_tail(&cur->next,
+                              &q->lvl1[(cur->due >> RTXW_BITS) & RTXW_MASK]);
+        else
+                list_add_tail(&cur->next, &q->far);
 }
 
-#if 0
-static struct rtxq_entry * rtxq_entry_create(struct du * du)
-{ return rtxq_entry_create_gfp(du, GFP_KERNEL); }
-#endif
+static void rtxw_init(struct rtxqueue * q)
+{
+        int i;
 
-static struct rtxq_entry * rtxq_entry_create_ni(struct du * du)
-{ return rtxq_entry_create_gfp(du, GFP_ATOMIC); }
+        for (i = 0; i < RTXW_SLOTS; i++) {
+                INIT_LIST_HEAD(&q->lvl0[i]);
+                INIT_LIST_HEAD(&q->lvl1[i]);
+        }
+        INIT_LIST_HEAD(&q->far);
+        INIT_LIST_HEAD(&q->expired);
+}
+
+/* Hooks all the queued entries to the wheel again, e.g. after moving them */
+static void rtxw_rebuild(struct rtxqueue * q)
+{
+        struct rtxq_entry * cur;
+        unsigned int        i;
+
+        rtxw_init(q);
+        for (i = 0; i < q->span; i++) {
+                cur = rtxqueue_slot(q, q->head + i);
+                if (cur->du)
+                        rtxw_insert(q, cur);
+        }
+}
+
+static void rtxw_cascade(struct rtxqueue * q, struct list_head * list)
+{
+        struct rtxq_entry * cur, * n;
+        LIST_HEAD(tmp);
+
+        list_splice_init(list, &tmp);
+        list_for_each_entry_safe(cur, n, &tmp, next) {
+                list_del(&cur->next);
+                rtxw_insert(q, cur);
+        }
+}
+
+/* Moves the entries due up to now to the expired list */
+static void rtxw_advance(struct rtxqueue * q, unsigned long now)
+{
+        unsigned int idx, l1;
+
+        if (!q->len) {
+                q->clock = now + 1;
+                return;
+        }
+
+        if (time_after_eq(now, q->clock + RTXW_LVL1_SPAN)) {
+                q->clock = now + 1;
+                rtxw_rebuild(q);
+                return;
+        }
+
+        while (time_before_eq(q->clock, now)) {
+                idx = q->clock & RTXW_MASK;
+                if (!idx) {
+                        l1 = (q->clock >> RTXW_BITS) & RTXW_MASK;
+                        if (!l1)
+                                rtxw_cascade(q, &q->far);
+                        rtxw_cascade(q, &q->lvl1[l1]);
+                }
+                list_splice_tail_init(&q->lvl0[idx], &q->expired);
+                q->clock++;
+        }
+}
+
+/* Exponential backoff after each retransmission */
+static unsigned long time_to_rtx(struct rtxq_entry * cur, unsigned int tr)
+{
+	unsigned long rtx_wtime;
+
+	rtx_wtime = (1 + cur->retries*cur->retries)*tr;
+	if (rtx_wtime > MAX_RTX_WAIT_TIME)
+		rtx_wtime = MAX_RTX_WAIT_TIME;
+
+	return cur->time_stamp + rtx_wtime;
+}
 
 int rtxq_entry_destroy(struct rtxq_entry * entry)
 {
@@ -358,41 +457,62 @@ int rtxq_entry_destroy(struct rtxq_entry * entry)
                 return -1;
 
         du_destroy(entry->du);
-        list_del(&entry->next);
-        rkfree(entry);
+        entry->du = NULL;
+        list_del_init(&entry->next);
 
         return 0;
 }
 EXPORT_SYMBOL(rtxq_entry_destroy);
 
-static struct rtxqueue * rtxqueue_create_gfp(gfp_t flags)
+static struct rtxqueue * rtxqueue_create_gfp(unsigned int size, gfp_t flags)
 {
         struct rtxqueue * tmp;
 
+        size = roundup_pow_of_two(clamp_t(unsigned int, size,
+                                          RTXQ_DEFAULT_SIZE, RTXQ_MAX_SIZE));
+
         tmp = rkzalloc(sizeof(*tmp), flags);
         if (!tmp)
                 return NULL;
 
-        INIT_LIST_HEAD(&tmp->head);
+        tmp->ring = rkzalloc(size * sizeof(*tmp->ring), flags);
+        if (!tmp->ring) {
+                rkfree(tmp);
+                return NULL;
+        }
+
+        tmp->mask  = size - 1;
+        tmp->clock = jiffies;
+        rtxw_init(tmp);
 	tmp->len = 0;
 	tmp->drop_pdus = 0;
 
         return tmp;
 }
 
-static struct rtxqueue * rtxqueue_create(void)
-{ return rtxqueue_create_gfp(GFP_KERNEL); }
+static struct rtxqueue * rtxqueue_create(unsigned int size)
+{ return rtxqueue_create_gfp(size, GFP_KERNEL); }
 
-static void rtxqueue_flush(struct rtxqueue * q)
+/* Drops the oldest slot, which must be in use or a hole */
+static void rtxqueue_pop_head(struct rtxqueue * q)
 {
-        struct rtxq_entry * cur, * n;
-
-        ASSERT(q);
+        struct rtxq_entry * cur;
 
-        list_for_each_entry_safe(cur, n, &q->head, next) {
+        cur = rtxqueue_slot(q, q->head);
+        if (cur->du) {
                 rtxq_entry_destroy(cur);
-		q->len --;
+                q->len--;
         }
+        q->head++;
+        q->span--;
+}
+
+static void rtxqueue_flush(struct rtxqueue * q)
+{
+        ASSERT(q);
+
+        while (q->span)
+                rtxqueue_pop_head(q);
 }
 
 static int rtxqueue_destroy(struct rtxqueue * q)
@@ -401,95 +521,165 @@ static int rtxqueue_destroy(struct rtxqueue * q)
                 return -1;
 
         rtxqueue_flush(q);
+        rkfree(q->ring);
         rkfree(q);
 
         return 0;
 
 }
 
+/* Doubles the ring until it fits span slots */
+static int rtxqueue_grow(struct rtxqueue * q, unsigned int span)
+{
+        struct rtxq_entry * ring;
+        unsigned int        size, i;
+        seq_num_t           sn;
+
+        size = q->mask + 1;
+        while (size < span)
+                size <<= 1;
+        if (size > RTXQ_MAX_SIZE) {
+                LOG_ERR("Too many PDUs in the rtx queue (%u)", span);
+                return -1;
+        }
+
+        ring = rkzalloc(size * sizeof(*ring), GFP_ATOMIC);
+        if (!ring)
+                return -1;
+
+        for (i = 0; i < q->span; i++) {
+                sn = q->head + i;
+                ring[sn & (size - 1)] = q->ring[sn & q->mask];
+        }
+
+        rkfree(q->ring);
+        q->ring = ring;
+        q->mask = size - 1;
+        rtxw_rebuild(q);
+
+        return 0;
+}
+
+/* Cumulative ack: everything up to seq_num goes away */
 static int rtxqueue_entries_ack(struct rtxqueue * q,
                                 seq_num_t         seq_num)
 {
-        struct rtxq_entry * cur, * n;
+        unsigned int acked;
 
         ASSERT(q);
 
-        list_for_each_entry_safe(cur, n, &q->head, next) {
-                seq_num_t    seq;
+        acked = seq_num - q->head + 1;
+        if (!q->span || (int) acked <= 0) {
+                LOG_DBG("Nothing to ack up to %u", seq_num);
+                return 0;
+        }
 
-                seq = pci_sequence_number_get(&cur->du->pci);
-                if (seq <= seq_num) {
-                        LOG_DBG("Seq num acked: %u. Size %d", seq, q->len);
-                        rtxq_entry_destroy(cur);
-			q->len--;
-                } else
-                        return 0;
+        if (acked >= q->span) {
+                rtxqueue_flush(q);
+                q->head = seq_num + 1;
+                return 0;
         }
 
+        while (acked--)
+                rtxqueue_pop_head(q);
+
+        LOG_DBG("Seq num acked: %u. Size %d", seq_num, q->len);
+
         return 0;
 }
 
+/* Retransmission accounting, returns false if cur has to be dropped */
+static bool rtxqueue_entry_rtx(struct rtxqueue * q,
+                               struct rtxq_entry * cur,
+                               uint_t data_rtx_max)
+{
+        cur->retries++;
+        if (cur->retries >= data_rtx_max) {
+                rtxq_entry_destroy(cur);
+                q->len--;
+                q->drop_pdus++;
+                return false;
+        }
+
+        return true;
+}
+
+/* Charges a retransmission to the rate, returns true if it is exceeded */
+static bool rtx_rate_exceeded(struct dtp * dtp, struct rtxq_entry * cur)
+{
+        struct dtcp * dtcp;
+        int sz;
+        uint_t sc;
+
+        dtcp = dtp ? dtp->dtcp : NULL;
+        if (!dtcp || !dtcp_rate_based_fctrl(dtcp->cfg))
+                return false;
+
+        sz = du_data_len(cur->du);
+        sc = dtcp->sv->pdus_sent_in_time_unit;
+
+        if(sz >= 0) {
+                if ( (sz + sc) >= dtcp->sv->sndr_rate) {
+                        dtcp->sv->pdus_sent_in_time_unit =
+                                dtcp->sv->sndr_rate;
+                } else {
+                        dtcp->sv->pdus_sent_in_time_unit += sz;
+                }
+        }
+
+        if(dtcp_rate_exceeded(dtcp, 1)) {
+                dtp->sv->rate_fulfiled = true;
+                dtp_start_rate_timer(dtp, dtcp);
+                return true;
+        }
+
+        return false;
+}
+
+/* Rehooks cur to the wheel after a retransmission */
+static void rtxqueue_rearm(struct rtxqueue *   q,
+                           struct rtxq_entry * cur,
+                           unsigned int        tr)
+{
+        list_del(&cur->next);
+        cur->due = time_to_rtx(cur, tr);
+        rtxw_insert(q, cur);
+}
+
 static int rtxqueue_entries_nack(struct rtxqueue * q,
                                  struct dtp *      dtp,
                                  struct rmt *      rmt,
                                  seq_num_t         seq_num,
-                                 uint_t            data_rtx_max)
+                                 uint_t            data_rtx_max,
+                                 unsigned int      tr)
 {
-        struct rtxq_entry * cur, * p;
-        struct du *        tmp;
-        // Used by rbfc.
-        struct dtcp *	    dtcp;
-
-        int sz;
-	uint_t sc;
-
-        dtcp = dtp->dtcp;
+        struct rtxq_entry * cur;
+        struct du *         tmp;
+        unsigned int        off;
+
+        /* Everything from seq_num on is retransmitted, in order */
+        off = seq_num - q->head;
+        if ((int) off < 0)
+                off = 0;
+
+        for (; off < q->span; off++) {
+                cur = rtxqueue_slot(q, q->head + off);
+                if (!cur->du)
+                        continue;
+
+                if (!rtxqueue_entry_rtx(q, cur, data_rtx_max)) {
+                        LOG_ERR("Maximum number of rtx has been "
+                                "achieved. Can't maintain QoS");
+                        continue;
+                }
 
-        /*
-         * FIXME: this should be change since we are sending in inverse order
-         * and it could be problematic because of gaps and A timer
-         */
-        list_for_each_entry_safe_reverse(cur, p, &q->head, next) {
-                if (pci_sequence_number_get(&cur->du->pci) >=
-                    seq_num) {
-                        cur->retries++;
-                        if (cur->retries >= data_rtx_max) {
-                                LOG_ERR("Maximum number of rtx has been "
-                                        "achieved. Can't maintain QoS");
-                                rtxq_entry_destroy(cur);
-				q->len--;
-				q->drop_pdus++;
-                                continue;
-                        }
-			if(dtp &&
-				dtcp &&
-				dtcp_rate_based_fctrl(dtcp->cfg)) {
-
-				sz = du_data_len(cur->du);
-				sc = dtcp->sv->pdus_sent_in_time_unit;
-
-				if(sz >= 0) {
-					if ( (sz + sc) >= dtcp->sv->sndr_rate) {
-						dtcp->sv->pdus_sent_in_time_unit =
-							dtcp->sv->sndr_rate;
-					} else {
-						dtcp->sv->pdus_sent_in_time_unit += sz;
-					}
-				}
+                if (rtx_rate_exceeded(dtp, cur))
+                        break;
 
-				if(dtcp_rate_exceeded(dtcp, 1)) {
-					dtp->sv->rate_fulfiled = true;
-					dtp_start_rate_timer(dtp, dtcp);
-					break;
-				}
-			}
-                        tmp = du_dup_ni(cur->du);
-                        if (dtp_pdu_send(dtp,
-					 rmt,
-					 tmp))
-                                continue;
-                } else
-                        return 0;
+                rtxqueue_rearm(q, cur, tr);
+                tmp = du_dup_ni(cur->du);
+                if (dtp_pdu_send(dtp, rmt, tmp))
+                        continue;
         }
 
         return 0;
@@ -498,97 +688,72 @@ static int rtxqueue_entries_nack(struct rtxqueue * q,
 unsigned long rtxqueue_entry_timestamp(struct rtxqueue * q, seq_num_t sn)
 {
         struct rtxq_entry * cur;
-        seq_num_t           csn;
 
-        list_for_each_entry(cur, &q->head, next) {
-                csn = pci_sequence_number_get(&cur->du->pci);
-                if (csn > sn) {
-                        LOG_WARN("PDU not in rtxq. Received "
-                        		"SN: %u, RtxQ SN: %u. Size: %u",
-					sn, csn, q->len);
-                        return -1;
-                }
-                if (csn == sn) {
-                	/* Ignore time_stamps from retransmitted PDUs */
-                        if (cur->retries != 0)
-                        	return 0;
-
-                        return cur->time_stamp;
-                }
+        cur = rtxqueue_find(q, sn);
+        if (!cur) {
+                LOG_WARN("PDU not in rtxq. Received SN: %u, RtxQ head: %u. "
+                         "Size: %u", sn, q->head, q->len);
+                return -1;
         }
 
-        return -1;
+        /* Ignore time_stamps from retransmitted PDUs */
+        if (cur->retries != 0)
+                return 0;
+
+        return cur->time_stamp;
 }
 
 /* push in seq_num order */
-static int rtxqueue_push_ni(struct rtxqueue * q, struct du * du)
+static int rtxqueue_push_ni(struct rtxqueue * q,
+                            struct du *       du,
+                            unsigned int      tr)
 {
-        struct rtxq_entry * tmp, * cur, * last = NULL;
-        seq_num_t           csn, psn;
+        struct rtxq_entry * cur;
+        seq_num_t           csn;
+        unsigned int        off;
 
         csn  = pci_sequence_number_get(&du->pci);
 
-        tmp = rtxq_entry_create_ni(du);
-        if (!tmp)
-                return -1;
+        if (!q->span)
+                q->head = csn;
+        if (!q->len)
+                q->clock = jiffies;
 
-        if (list_empty(&q->head)) {
-                list_add(&tmp->next, &q->head);
-		q->len++;
-                LOG_DBG("First PDU with seqnum: %u push to rtxq at: %pk",
-                        csn, q);
-                return 0;
+        off = csn - q->head;
+        if (off > RTXQ_MAX_SIZE * 2) {
+                LOG_ERR("PDU %u is behind the rtx queue (head %u)",
+                        csn, q->head);
+                return -1;
         }
 
-        last = list_last_entry(&q->head, struct rtxq_entry, next);
-        if (!last)
+        if (off >= q->mask + 1 && rtxqueue_grow(q, off + 1))
                 return -1;
 
-        psn = pci_sequence_number_get(&last->du->pci);
-        if (csn == psn) {
+        cur = rtxqueue_slot(q, csn);
+        if (off < q->span && cur->du) {
                 LOG_ERR("Another PDU with the same seq_num %u, is in "
                         "the rtx queue!", csn);
                 return -1;
         }
-        if (csn > psn) {
-                list_add_tail(&tmp->next, &q->head);
-		q->len++;
-		LOG_DBG("Last PDU with seqnum: %u push to rtxq at: %pk",
-                        csn, q);
-                return 0;
-        }
 
-        list_for_each_entry(cur, &q->head, next) {
-                psn = pci_sequence_number_get(&cur->du->pci);
-                if (csn == psn) {
-                        LOG_ERR("Another PDU with the same seq_num is in "
-                                "the rtx queue!");
-                        return -1;
-                }
-                if (csn > psn) {
-                        list_add(&tmp->next, &cur->next);
-			q->len++;
-			LOG_DBG("Middle PDU with seqnum: %u push to "
-                                "rtxq at: %pk", csn, q);
-                        return 0;
-                }
+        /* Sequence numbers skipped in between are left as holes */
+        while (q->span < off) {
+                rtxqueue_slot(q, q->head + q->span)->du = NULL;
+                q->span++;
         }
+        if (off == q->span)
+                q->span++;
 
-        LOG_ERR("PDU not pushed!");
-
-        return -1;
-}
-
-/* Exponential backoff after each retransmission */
-static unsigned long time_to_rtx(struct rtxq_entry * cur, unsigned int tr)
-{
-	unsigned long rtx_wtime;
+        cur->du         = du;
+        cur->time_stamp = jiffies;
+        cur->retries    = 0;
+        cur->due        = time_to_rtx(cur, tr);
+        rtxw_insert(q, cur);
+        q->len++;
 
-	rtx_wtime = (1 + cur->retries*cur->retries)*tr;
-	if (rtx_wtime > MAX_RTX_WAIT_TIME)
-		rtx_wtime = MAX_RTX_WAIT_TIME;
+        LOG_DBG("PDU with seqnum: %u push to rtxq at: %pk", csn, q);
 
-	return cur->time_stamp + rtx_wtime;
+        return 0;
 }
 
 /* Called while holding the rtx queueu lock */
@@ -597,14 +762,14 @@ static int rtxqueue_rtx(struct rtxq * q,
                         struct dtp * dtp,
                         uint_t       data_rtx_max)
 {
-        struct rtxq_entry * cur, * n;
-        struct du *        tmp;
+        struct rtxq_entry * cur;
+        struct du *        tmp[RTX_BATCH];
         seq_num_t           seq = 0;
         // Used by rbfc.
         struct dtcp *	    dtcp;
-        int sz, res;
-        uint_t sc, dropped_sn, dropped_pdus, cwq_max_size;
-        bool start_rv_timer;
+        int i, n;
+        uint_t dropped_sn, dropped_pdus, cwq_max_size;
+        bool start_rv_timer, rate_exceeded;
         timeout_t rv;
 
         ASSERT(q);
@@ -614,63 +779,51 @@ static int rtxqueue_rtx(struct rtxq * q,
         dtcp = dtp->dtcp;
         dropped_pdus = 0;
         dropped_sn = 0;
+        rate_exceeded = false;
 
-        list_for_each_entry_safe(cur, n, &q->queue->head, next) {
-                seq = pci_sequence_number_get(&cur->du->pci);
+        /* Only the entries whose time has come are looked at */
+        rtxw_advance(q->queue, jiffies);
 
-                LOG_DBG("Checking RTX PDU %u, now: %lu >?< %lu + %u",
-                        seq, jiffies, cur->time_stamp, tr);
+        while (!rate_exceeded && !list_empty(&q->queue->expired)) {
+                n = 0;
+                while (n < RTX_BATCH && !list_empty(&q->queue->expired)) {
+                        cur = list_first_entry(&q->queue->expired,
+                                               struct rtxq_entry, next);
+                        seq = pci_sequence_number_get(&cur->du->pci);
 
-                if (time_before_eq(time_to_rtx(cur, tr), jiffies)) {
-                        cur->retries++;
-                        if (cur->retries >= data_rtx_max) {
+                        LOG_DBG("RTX PDU %u, now: %lu, due: %lu",
+                                seq, jiffies, cur->due);
+
+                        if (!rtxqueue_entry_rtx(q->queue, cur,
+                                                data_rtx_max)) {
                                 LOG_WARN("Maximum number of rtx has been "
                                         "achieved for SeqN %u. Dropping "
                                         "PDU, data is lost", seq);
-                                rtxq_entry_destroy(cur);
-				q->queue->len--;
-				q->queue->drop_pdus++;
 				dropped_pdus++;
 				if (seq > dropped_sn)
 					dropped_sn = seq;
                                 continue;
                         }
 
-                        if (dtp && dtcp &&
-                            dtcp_rate_based_fctrl(dtcp->cfg)) {
-                        	sz = du_data_len(cur->du);
-				sc = dtcp->sv->pdus_sent_in_time_unit;
-
-				if(sz >= 0) {
-					if ( (sz + sc) >= dtcp->sv->sndr_rate) {
-						dtcp->sv->pdus_sent_in_time_unit = 
-							dtcp->sv->sndr_rate;
-					} else {
-						dtcp->sv->pdus_sent_in_time_unit += sz; 
-					}
-				}
-
-				if(dtcp_rate_exceeded(dtcp, 1)) {
-					dtp->sv->rate_fulfiled = true;
-					dtp_start_rate_timer(dtp, dtcp);
-					break;
-				}
+                        if (rtx_rate_exceeded(dtp, cur)) {
+                                /* Stays expired, retried next time */
+                                cur->retries--;
+                                rate_exceeded = true;
+                                break;
                         }
 
-                        tmp = du_dup_ni(cur->du);
+                        rtxqueue_rearm(q->queue, cur, tr);
 
-                        spin_unlock(&q->lock);
-                        res = dtp_pdu_send(dtp, q->rmt, tmp);
-                        spin_lock(&q->lock);
-
-                        if (res) continue;
+                        tmp[n++] = du_dup_ni(cur->du);
+                }
 
-                        LOG_DBG("Retransmitted PDU with seqN %u", seq);
-                } else {
-                        LOG_DBG("RTX timer: from here PDUs still have time,"
-                                "finishing...");
-                        break;
+                spin_unlock(&q->lock);
+                for (i = 0; i < n; i++) {
+                        if (dtp_pdu_send(dtp, q->rmt, tmp[i]))
+                                continue;
+                        LOG_DBG("Retransmitted PDU %d of %d", i + 1, n);
                 }
+                spin_lock(&q->lock);
         }
 
         LOG_DBG("RTXQ %pK has delivered until %u", q, seq);
@@ -723,7 +876,7 @@ static bool rtxqueue_empty(struct rtxqueue * q)
         if (!q)
                 return true;
 
-        return list_empty(&q->head);
+        return !q->len;
 }
 
 #if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
@@ -796,7 +949,9 @@ struct rtxq * rtxq_create(struct dtp * dtp,
 
         rtimer_init(rtx_timer_func, &dtp->timers.rtx, dtp);
 
-        tmp->queue = rtxqueue_create();
+        /* In flight PDUs are bounded by the window, if there is one */
+        tmp->queue = rtxqueue_create(dtcp_window_based_fctrl(dtcp_cfg) ?
+                                     dtcp_initial_credit(dtcp_cfg) : 0);
         if (!tmp->queue) {
                 LOG_ERR("Failed to create retransmission queue");
                 rtxq_destroy(tmp);
@@ -863,7 +1018,7 @@ int rtxq_push_ni(struct rtxq * q,
         /* is the first transmitted PDU */
         rtimer_start(&q->parent->timers.rtx, q->parent->sv->tr);
 
-        res = rtxqueue_push_ni(q->queue, du);
+        res = rtxqueue_push_ni(q->queue, du, q->parent->sv->tr);
 
         spin_unlock_bh(&q->lock);
 
@@ -932,7 +1087,8 @@ int rtxq_nack(struct rtxq * q,
                               q->parent,
                               q->rmt,
                               seq_num,
-                              data_retransmit_max);
+                              data_retransmit_max,
+                              tr);
         if (rtimer_restart(&q->parent->timers.rtx, tr)) {
                 spin_unlock(&q->lock);
                 return -1;
@@ -983,36 +1139,8 @@ int dtp_pdu_send(struct dtp *  dtp,
 EXPORT_SYMBOL(dtp_pdu_send);
 
 /* Here begins the RTT estimator when there is not RTX*/
-static struct rtt_entry * rtt_entry_create_gfp(seq_num_t sn, gfp_t flag)
-{
-        struct rtt_entry * tmp;
-
-        tmp = rkzalloc(sizeof(*tmp), flag);
-        if (!tmp)
-                return NULL;
-
-        tmp->sn = sn;
-        tmp->time_stamp = jiffies;
-
-        INIT_LIST_HEAD(&tmp->next);
-
-        return tmp;
-}
-
-static struct rtt_entry * rtt_entry_create(seq_num_t sn)
-{ return rtt_entry_create_gfp(sn, GFP_ATOMIC); }
-
-static int rtt_entry_destroy(struct rtt_entry * entry)
-{
-        if (!entry)
-                return -1;
-
-        list_del(&entry->next);
-        rkfree(entry);
-
-        return 0;
-}
 
+/* Time stamps are kept by sequence number, 0 meaning no sample */
 static struct rttq * rttq_create_gfp(gfp_t flags)
 {
         struct rttq * tmp;
@@ -1021,7 +1149,15 @@ static struct rttq * rttq_create_gfp(gfp_t flags)
         if (!tmp)
                 return NULL;
 
-        INIT_LIST_HEAD(&tmp->head);
+        tmp->stamps = rkzalloc(RTXQ_DEFAULT_SIZE * sizeof(*tmp->stamps),
+                               flags);
+        if (!tmp->stamps) {
+                rkfree(tmp);
+                return NULL;
+        }
+
+        tmp->mask = RTXQ_DEFAULT_SIZE - 1;
+        spin_lock_init(&tmp->lock);
 
         return tmp;
 }
@@ -1030,22 +1166,15 @@ struct rttq * rttq_create(void)
 { return rttq_create_gfp(GFP_KERNEL); }
 EXPORT_SYMBOL(rttq_create);
 
-static int rttq_entry_destroy(struct rtt_entry * entry)
-{
-	list_del(&entry->next);
-	rkfree(entry);
-	return 0;
-}
-
 /* No locking required, it's always called with DTP-SV lock taken */
 int rttq_flush(struct rttq * q)
 {
-        struct rtt_entry * cur, * n;
-
         ASSERT(q);
 
-        list_for_each_entry_safe(cur, n, &q->head, next) {
-                rttq_entry_destroy(cur);
+        while (q->span) {
+                q->stamps[q->head & q->mask] = 0;
+                q->head++;
+                q->span--;
         }
 
         return 0;
@@ -1061,6 +1190,7 @@ int rttq_destroy(struct rttq * q)
         rttq_flush(q);
         spin_unlock(&q->lock);
 
+        rkfree(q->stamps);
         rkfree(q);
 
         return 0;
@@ -1069,20 +1199,10 @@ EXPORT_SYMBOL(rttq_destroy);
 
 static unsigned long rttqueue_entry_timestamp(struct rttq * q, seq_num_t sn)
 {
-        struct rtt_entry * cur;
-        seq_num_t           csn;
-
-        list_for_each_entry(cur, &q->head, next) {
-                csn = cur->sn;
-                if (csn > sn) {
-                        return 0;
-                }
-                if (csn == sn) {
-                        return cur->time_stamp;
-                }
-        }
+        if (sn - q->head >= q->span)
+                return 0;
 
-        return 0;
+        return q->stamps[sn & q->mask];
 }
 
 unsigned long rttq_entry_timestamp(struct rttq * q, seq_num_t sn)
@@ -1100,51 +1220,65 @@ unsigned long rttq_entry_timestamp(struct rttq * q, seq_num_t sn)
 }
 EXPORT_SYMBOL(rttq_entry_timestamp);
 
+static int rttq_grow(struct rttq * q, unsigned int span)
+{
+        unsigned long * stamps;
+        unsigned int    size, i;
+        seq_num_t       sn;
+
+        size = q->mask + 1;
+        while (size < span)
+                size <<= 1;
+        if (size > RTXQ_MAX_SIZE) {
+                LOG_ERR("Too many SNs in the RTT queue (%u)", span);
+                return -1;
+        }
+
+        stamps = rkzalloc(size * sizeof(*stamps), GFP_ATOMIC);
+        if (!stamps)
+                return -1;
+
+        for (i = 0; i < q->span; i++) {
+                sn = q->head + i;
+                stamps[sn & (size - 1)] = q->stamps[sn & q->mask];
+        }
+
+        rkfree(q->stamps);
+        q->stamps = stamps;
+        q->mask   = size - 1;
+
+        return 0;
+}
+
 static int rttq_push_ni(struct rttq * q, seq_num_t sn)
 {
-	struct rtt_entry * new, * cur, * last = NULL;
-	seq_num_t          psn;
+	unsigned int off;
 
-	new = rtt_entry_create(sn);
-	if (!new) {
-		LOG_ERR("Could not create an rtt queue entry");
-		return -1;
+	if (!q->span)
+		q->head = sn;
+
+	off = sn - q->head;
+	if (off > RTXQ_MAX_SIZE * 2) {
+		LOG_ERR("SN %u is behind the RTT queue (head %u)",
+			sn, q->head);
+		return 0;
 	}
 
-	if (list_empty(&q->head)) {
-		list_add(&new->next, &q->head);
+	if (off < q->span && q->stamps[sn & q->mask]) {
+		LOG_ERR("Another PDU with the same seq_num %u, is in "
+			"the RTT queue!", sn);
 		return 0;
 	}
 
-    	last = list_last_entry(&q->head, struct rtt_entry, next);
-    	if (!last)
-            	return -1;
-
-    	psn = last->sn;
-    	if (sn == psn) {
-            	LOG_ERR("Another PDU with the same seq_num %u, is in "
-            			"the RTT queue!", sn);
-            	return 0;
-    	}
-    	if (sn > psn) {
-            	list_add_tail(&new->next, &q->head);
-            	return 0;
-    	}
-
-    	list_for_each_entry(cur, &q->head, next) {
-            	psn = cur->sn;
-            	if (sn == psn) {
-                    LOG_ERR("Another PDU with the same seq_num is in "
-                            "the RTT queue!");
-                    return 0;
-            }
-            if (sn > psn) {
-                    list_add(&new->next, &cur->next);
-                    return 0;
-            }
-    	}
-
-    	LOG_ERR("SN not pushed!");
+	if (off > q->mask && rttq_grow(q, off + 1))
+		return -1;
+
+	while (q->span <= off) {
+		q->stamps[(q->head + q->span) & q->mask] = 0;
+		q->span++;
+	}
+
+	q->stamps[sn & q->mask] = jiffies;
 
 	return 0;
 }
@@ -1161,22 +1295,26 @@ int rttq_push(struct rttq * q, seq_num_t sn)
 }
 EXPORT_SYMBOL(rttq_push);
 
+/* Cumulative, drops every SN up to sn */
 int rttq_drop(struct rttq * q, seq_num_t sn)
 {
-	struct rtt_entry * cur, * n;
+	unsigned int drop;
 
 	spin_lock_bh(&q->lock);
-	if (list_empty(&q->head)) {
+	drop = sn - q->head + 1;
+	if ((int) drop <= 0) {
 		spin_unlock_bh(&q->lock);
 		return 0;
 	}
-	cur = NULL;
-	list_for_each_entry_safe(cur, n, &q->head, next) {
-		if (cur->sn <= sn) {
-			rtt_entry_destroy(cur);
-		} else {
-			spin_unlock_bh(&q->lock);
-			return 0;
+
+	if (drop >= q->span) {
+		rttq_flush(q);
+		q->head = sn + 1;
+	} else {
+		while (drop--) {
+			q->stamps[q->head & q->mask] = 0;
+			q->head++;
+			q->span--;
 		}
 	}
 	spin_unlock_bh(&q->lock);
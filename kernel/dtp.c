@@ -21,6 +21,8 @@
  * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
  */
 
+#include <linux/bitmap.h>
+#include <linux/log2.h>
 #include <linux/random.h>
 #include <linux/uaccess.h>
 #include <linux/version.h>
@@ -202,16 +204,31 @@ int dtp_initial_sequence_number(struct dtp * instance)
         return 0;
 }
 
-/* Sequencing/reassembly queue */
+/*
+ * Sequencing/reassembly queue
+ *
+ * Out of order PDUs are kept in a ring indexed by sequence number, holding
+ * the PDUs in [LWE + 1, LWE + size]. Insertion and in-order removal touch
+ * a single slot; the A timer walks the occupied slots in sequence order
+ * through the bitmap. The ring is sized from the initial receiver window
+ * (see dtp_squeue_size_set) and grows, up to SEQQ_MAX_SIZE, when a PDU
+ * inside a wider window does not fit. Without window based flow control
+ * PDUs too far ahead of the left window edge are dropped.
+ */
 
-struct seq_queue {
-        struct list_head head;
-};
+#define SEQQ_DEFAULT_SIZE 64
+#define SEQQ_MAX_SIZE     4096
 
 struct seq_queue_entry {
         unsigned long    time_stamp;
         struct du *      du;
-        struct list_head next;
+};
+
+struct seq_queue {
+        struct seq_queue_entry * ring;
+        unsigned long *          map;
+        unsigned int             mask;
+        unsigned int             count;
 };
 
 struct squeue {
@@ -219,57 +236,53 @@ struct squeue {
         struct seq_queue * queue;
 };
 
-static struct seq_queue * seq_queue_create(void)
+static int seq_queue_destroy(struct seq_queue * seq_queue);
+
+static struct seq_queue * seq_queue_create(unsigned int size)
 {
         struct seq_queue * tmp;
 
+        size = roundup_pow_of_two(clamp_t(unsigned int, size,
+                                          SEQQ_DEFAULT_SIZE, SEQQ_MAX_SIZE));
+
         tmp = rkzalloc(sizeof(*tmp), GFP_KERNEL);
         if (!tmp)
                 return NULL;
 
-        INIT_LIST_HEAD(&tmp->head);
-
-        return tmp;
-}
-
-static struct seq_queue_entry * seq_queue_entry_create_gfp(struct du *  du,
-                                                           gfp_t        flags)
-{
-        struct seq_queue_entry * tmp;
-
-        tmp = rkzalloc(sizeof(*tmp), flags);
-        if (!tmp)
+        tmp->mask = size - 1;
+        tmp->ring = rkzalloc(size * sizeof(*tmp->ring), GFP_KERNEL);
+        tmp->map  = rkzalloc(BITS_TO_LONGS(size) * sizeof(unsigned long),
+                             GFP_KERNEL);
+        if (!tmp->ring || !tmp->map) {
+                seq_queue_destroy(tmp);
                 return NULL;
-
-        INIT_LIST_HEAD(&tmp->next);
-
-        tmp->du = du;
-        tmp->time_stamp = jiffies;
+        }
 
         return tmp;
 }
 
-static void seq_queue_entry_destroy(struct seq_queue_entry * seq_entry)
+static void seq_queue_clear(struct seq_queue * q)
 {
-        ASSERT(seq_entry);
-
-        if (seq_entry->du) du_destroy(seq_entry->du);
-        rkfree(seq_entry);
+        unsigned int slot;
 
-        return;
+        for_each_set_bit(slot, q->map, q->mask + 1) {
+                du_destroy(q->ring[slot].du);
+                q->ring[slot].du = NULL;
+                clear_bit(slot, q->map);
+        }
+        q->count = 0;
 }
 
 static int seq_queue_destroy(struct seq_queue * seq_queue)
 {
-        struct seq_queue_entry * cur, * n;
-
         ASSERT(seq_queue);
 
-        list_for_each_entry_safe(cur, n, &seq_queue->head, next) {
-                list_del(&cur->next);
-                seq_queue_entry_destroy(cur);
+        if (seq_queue->map) {
+                seq_queue_clear(seq_queue);
+                rkfree(seq_queue->map);
         }
-
+        if (seq_queue->ring)
+                rkfree(seq_queue->ring);
         rkfree(seq_queue);
 
         return 0;
@@ -277,102 +290,155 @@ static int seq_queue_destroy(struct seq_queue * seq_queue)
 
 void dtp_squeue_flush(struct dtp * dtp)
 {
-        struct seq_queue_entry * cur, * n;
-        struct seq_queue *       seq_queue;
-
         if (!dtp)
                 return;
 
         ASSERT(dtp->seqq);
 
-        seq_queue = dtp->seqq->queue;
-
-        list_for_each_entry_safe(cur, n, &seq_queue->head, next) {
-                list_del(&cur->next);
-                seq_queue_entry_destroy(cur);
-        }
+        seq_queue_clear(dtp->seqq->queue);
 
         return;
 }
 
-static struct du * seq_queue_pop(struct seq_queue * q)
+static inline bool seq_queue_is_empty(struct seq_queue * q)
+{ return !q->count; }
+
+/* Empties an occupied slot, returning its PDU */
+static struct du * seq_queue_take(struct seq_queue * q, unsigned int slot)
 {
-        struct seq_queue_entry * p;
-        struct du *              du;
+        struct du * du;
+
+        du = q->ring[slot].du;
+        q->ring[slot].du = NULL;
+        clear_bit(slot, q->map);
+        q->count--;
+
+        return du;
+}
+
+/* Pops the PDU with sequence number seq_num, if present */
+static struct du * seq_queue_pop(struct seq_queue * q, seq_num_t seq_num)
+{
+        unsigned int slot = seq_num & q->mask;
 
-        if (list_empty(&q->head)) {
-                LOG_DBG("Seq Queue is empty!");
+        if (!test_bit(slot, q->map))
                 return NULL;
-        }
 
-        p = list_first_entry(&q->head, struct seq_queue_entry, next);
-        if (!p)
+        if (pci_sequence_number_get(&q->ring[slot].du->pci) != seq_num)
                 return NULL;
 
-        du = p->du;
-        p->du = NULL;
+        return seq_queue_take(q, slot);
+}
 
-        list_del(&p->next);
-        seq_queue_entry_destroy(p);
+/*
+ * Returns the slot of the first PDU found from seq_num on, in sequence
+ * order, or -1 if the queue is empty
+ */
+static int seq_queue_next(struct seq_queue * q, seq_num_t seq_num)
+{
+        unsigned int size = q->mask + 1;
+        unsigned int start = seq_num & q->mask;
+        unsigned int slot;
 
-        return du;
+        if (seq_queue_is_empty(q))
+                return -1;
+
+        slot = find_next_bit(q->map, size, start);
+        if (slot >= size) {
+                slot = find_first_bit(q->map, start);
+                if (slot >= start)
+                        return -1;
+        }
+
+        return (int) slot;
 }
 
-static int seq_queue_push_ni(struct seq_queue * q, struct du * du)
+/*
+ * Grows the ring so that it holds at least size PDUs, moving the queued
+ * ones to their slots in the new ring. They all are in [LWE + 1, LWE +
+ * old size], so they can't collide.
+ */
+static int seq_queue_grow_ni(struct seq_queue * q, unsigned int size)
 {
-        static struct seq_queue_entry * tmp, * cur, * last = NULL;
-        seq_num_t                       csn, psn;
+        struct seq_queue_entry * ring;
+        unsigned long *          map;
+        unsigned int             slot, new_slot;
+        seq_num_t                csn;
 
-        tmp = seq_queue_entry_create_gfp(du, GFP_ATOMIC);
-        if (!tmp) {
-                LOG_ERR("Could not create sequencing queue entry");
+        size = roundup_pow_of_two(min_t(unsigned int, size, SEQQ_MAX_SIZE));
+        if (size <= q->mask + 1)
                 return -1;
-        }
 
-        csn = pci_sequence_number_get(&du->pci);
-        if (list_empty(&q->head)) {
-                list_add(&tmp->next, &q->head);
-                LOG_DBG("First PDU with seqnum: %u push to seqq at: %pk",
-                        csn, q);
-                return 0;
+        ring = rkzalloc(size * sizeof(*ring), GFP_ATOMIC);
+        map  = rkzalloc(BITS_TO_LONGS(size) * sizeof(unsigned long),
+                        GFP_ATOMIC);
+        if (!ring || !map) {
+                if (ring) rkfree(ring);
+                if (map) rkfree(map);
+                return -1;
         }
 
-        last = list_last_entry(&q->head, struct seq_queue_entry, next);
-        if (!last) {
-                LOG_ERR("Could not retrieve last pdu from seqq");
-                seq_queue_entry_destroy(tmp);
-                return 0;
+        for_each_set_bit(slot, q->map, q->mask + 1) {
+                csn = pci_sequence_number_get(&q->ring[slot].du->pci);
+                new_slot = csn & (size - 1);
+                ring[new_slot] = q->ring[slot];
+                set_bit(new_slot, map);
         }
 
-        psn  = pci_sequence_number_get(&last->du->pci);
-        if (csn == psn) {
-                LOG_ERR("Another PDU with the same seq_num is in the seqq");
-                seq_queue_entry_destroy(tmp);
-                return -1;
-        }
+        rkfree(q->ring);
+        rkfree(q->map);
+        q->ring = ring;
+        q->map  = map;
+        q->mask = size - 1;
 
-        if (csn > psn) {
-                list_add_tail(&tmp->next, &q->head);
-                LOG_DBG("Last PDU with seqnum: %u push to seqq at: %pk",
-                        csn, q);
-                return 0;
+        LOG_DBG("Sequencing queue grown to %u PDUs", size);
+
+        return 0;
+}
+
+/*
+ * The caller keeps the ownership of the PDU if this fails. RWE is the
+ * receiver right window edge, the ring grows to cover it if it has to,
+ * pass LWE if there is no window.
+ */
+static int seq_queue_push_ni(struct seq_queue * q,
+                             struct du *        du,
+                             seq_num_t          LWE,
+                             seq_num_t          RWE)
+{
+        seq_num_t    csn;
+        unsigned int slot;
+        struct du *  old;
+
+        csn = pci_sequence_number_get(&du->pci);
+        if (csn - LWE - 1 > q->mask && csn - LWE <= RWE - LWE)
+                seq_queue_grow_ni(q, RWE - LWE);
+
+        if (csn - LWE - 1 > q->mask) {
+                LOG_DBG("PDU %u out of the reordering window (LWE %u)",
+                        csn, LWE);
+                return -1;
         }
 
-        list_for_each_entry(cur, &q->head, next) {
-                psn = pci_sequence_number_get(&cur->du->pci);
-                if (csn == psn) {
-                        LOG_ERR("Another PDU with the same seq_num is in the rtx queue!");
-                        seq_queue_entry_destroy(tmp);
-                        return 0;
-                }
-                if (csn > psn) {
-                        list_add(&tmp->next, &cur->next);
-                        LOG_DBG("Middle PDU with seqnum: %u push to "
-                                "seqq at: %pk", csn, q);
-                        return 0;
+        slot = csn & q->mask;
+        if (test_bit(slot, q->map)) {
+                old = q->ring[slot].du;
+                if (pci_sequence_number_get(&old->pci) == csn) {
+                        LOG_ERR("Another PDU with the same seq_num is in the seqq");
+                        return -1;
                 }
+
+                /* Left behind by the window edge, no longer wanted */
+                du_destroy(seq_queue_take(q, slot));
         }
 
+        q->ring[slot].du = du;
+        q->ring[slot].time_stamp = jiffies;
+        set_bit(slot, q->map);
+        q->count++;
+
+        LOG_DBG("PDU with seqnum: %u push to seqq at: %pk", csn, q);
+
         return 0;
 }
 
@@ -396,7 +462,7 @@ static struct squeue * squeue_create(struct dtp * dtp)
         if (!tmp)
                 return NULL;
 
-        tmp->queue = seq_queue_create();
+        tmp->queue = seq_queue_create(SEQQ_DEFAULT_SIZE);
         if (!tmp->queue) {
                 squeue_destroy(tmp);
                 return NULL;
@@ -407,6 +473,34 @@ static struct squeue * squeue_create(struct dtp * dtp)
         return tmp;
 }
 
+/* Sizes the reordering ring after the receiver window, in PDUs */
+int dtp_squeue_size_set(struct dtp * dtp, uint_t window)
+{
+        struct seq_queue * queue, * old;
+
+        if (!dtp || !dtp->seqq)
+                return -1;
+
+        queue = seq_queue_create(window);
+        if (!queue)
+                return -1;
+
+        spin_lock_bh(&dtp->sv_lock);
+        old = dtp->seqq->queue;
+        if (!seq_queue_is_empty(old)) {
+                spin_unlock_bh(&dtp->sv_lock);
+                LOG_ERR("Cannot resize a non-empty sequencing queue");
+                seq_queue_destroy(queue);
+                return -1;
+        }
+        dtp->seqq->queue = queue;
+        spin_unlock_bh(&dtp->sv_lock);
+
+        seq_queue_destroy(old);
+
+        return 0;
+}
+
 static inline int pdu_post(struct dtp * instance,
                     	   struct du * du)
 {
@@ -559,7 +653,9 @@ struct pci * process_A_expiration(struct dtp * dtp, struct dtcp * dtcp)
         bool			 a_timer_expired;
         seq_num_t                max_sdu_gap;
         timeout_t                a;
-        struct seq_queue_entry * pos, * n;
+        struct seq_queue_entry * pos;
+        seq_num_t                next;
+        int                      slot;
         struct dtp_ps *          ps;
         struct dtcp_ps *         dtcp_ps;
         struct pci *             pci_ret = NULL;
@@ -592,26 +688,33 @@ struct pci * process_A_expiration(struct dtp * dtp, struct dtcp * dtcp)
         LOG_DBG("LWEU: Original LWE = %u", LWE);
         LOG_DBG("LWEU: MAX GAPS     = %u", max_sdu_gap);
 
-        list_for_each_entry_safe(pos, n, &seqq->queue->head, next) {
+        /* Walk the queued PDUs in sequence order */
+        next = LWE + 1;
+        while ((slot = seq_queue_next(seqq->queue, next)) >= 0) {
+                pos = &seqq->queue->ring[slot];
                 du = pos->du;
                 seq_num = pci_sequence_number_get(&du->pci);
                 LOG_DBG("Seq number: %u", seq_num);
 
+                if (seq_num - LWE - 1 > seqq->queue->mask) {
+                        LOG_DBG("Dropping PDU %u behind the LWE", seq_num);
+                        du_destroy(seq_queue_take(seqq->queue, slot));
+                        continue;
+                }
+
                 a_timer_expired = time_before_eq(pos->time_stamp + a, jiffies);
 
                 if (a_timer_expired || (seq_num - LWE - 1 <= max_sdu_gap)) {
                         if (a_timer_expired && dtcp &&
                         		dtcp_rtx_ctrl(dtcp->cfg)) {
                                 LOG_DBG("Retransmissions will be required");
-                                list_del(&pos->next);
-                                seq_queue_entry_destroy(pos);
+                                du_destroy(seq_queue_take(seqq->queue, slot));
+                                next = seq_num + 1;
                                 continue;
                         }
 
                 	dtp->sv->rcv_left_window_edge = seq_num;
-                        pos->du = NULL;
-                        list_del(&pos->next);
-                        seq_queue_entry_destroy(pos);
+                        seq_queue_take(seqq->queue, slot);
 
                         if (ringq_push(dtp->to_post, du)) {
                                 LOG_ERR("Could not post PDU %u while A timer"
@@ -621,6 +724,7 @@ struct pci * process_A_expiration(struct dtp * dtp, struct dtcp * dtcp)
                         LOG_DBG("Atimer: PDU %u posted", seq_num);
 
                         LWE = seq_num;
+                        next = seq_num + 1;
                         pci_ret = &du->pci;
                         continue;
                 }
@@ -653,7 +757,7 @@ static bool seqq_is_empty(struct squeue * queue)
                 return false;
 
         spin_lock(&queue->dtp->sv_lock);
-        ret = list_empty(&queue->queue->head) ? true : false;
+        ret = seq_queue_is_empty(queue->queue);
         spin_unlock(&queue->dtp->sv_lock);
 
         return ret;
@@ -1449,6 +1553,7 @@ int dtp_write(struct dtp * instance,
 
                         if (rtxq_push_ni(instance->rtxq, cdu)) {
                                 LOG_ERR("Couldn't push to rtxq");
+                                du_destroy(cdu);
                                 goto pdu_stats_err_exit;
                         }
                 } else if (instance->rttq) {
@@ -1502,6 +1607,15 @@ stats_nounlock_err_exit:
 	return -1;
 }
 
+/* Receiver right window edge, LWE if there's no window. Called with sv lock */
+static seq_num_t rcv_window_edge(struct dtcp * dtcp, seq_num_t LWE)
+{
+        if (dtcp && dtcp_window_based_fctrl(dtcp->cfg))
+                return dtcp->sv->rcvr_rt_wind_edge;
+
+        return LWE;
+}
+
 /* Must be called with sv lock taken */
 static bool is_fc_overrun(struct dtp * dtp, struct dtcp * dtcp,
 			  seq_num_t seq_num, int pdul)
@@ -1532,26 +1646,6 @@ static bool is_fc_overrun(struct dtp * dtp, struct dtcp * dtcp,
         return to_ret;
 }
 
-static bool are_there_pdus(struct seq_queue * queue, seq_num_t LWE)
-{
-        struct seq_queue_entry * p;
-        seq_num_t sn;
-
-        if (list_empty(&queue->head)) {
-                LOG_DBG("Seq Queue is empty!");
-                return false;
-        }
-        p = list_first_entry(&queue->head, struct seq_queue_entry, next);
-        if (!p)
-                return false;
-
-        sn = pci_sequence_number_get(&p->du->pci);
-        if (sn == (LWE+1))
-                return true;
-
-        return false;
-}
-
 int dtp_pdu_ctrl_send(struct dtp * dtp, struct du * du)
 {
 	return ringq_push(dtp->to_send, du);
@@ -1560,6 +1654,7 @@ int dtp_pdu_ctrl_send(struct dtp * dtp, struct du * du)
 int dtp_receive(struct dtp * instance,
                 struct du * du)
 {
+        struct du *      ready;
         struct dtp_ps *  ps;
         struct dtcp *    dtcp;
         struct dtcp_ps * dtcp_ps;
@@ -1746,15 +1841,15 @@ int dtp_receive(struct dtp * instance,
         	instance->sv->rcv_left_window_edge = seq_num;
                 ringq_push(instance->to_post, du);
                 LWE = seq_num;
-        } else {
-                seq_queue_push_ni(instance->seqq->queue, du);
+        } else if (seq_queue_push_ni(instance->seqq->queue, du, LWE,
+                                     rcv_window_edge(dtcp, LWE))) {
+                du_destroy(du);
+                du = NULL;
         }
 
-        while (are_there_pdus(instance->seqq->queue, LWE)) {
-                du = seq_queue_pop(instance->seqq->queue);
-                if (!du)
-                        break;
-                seq_num = pci_sequence_number_get(&du->pci);
+        while ((ready = seq_queue_pop(instance->seqq->queue, LWE + 1))) {
+                du = ready;
+                seq_num = LWE + 1;
                 LWE     = seq_num;
                 instance->sv->rcv_left_window_edge = seq_num;
                 ringq_push(instance->to_post, du);
@@ -1762,7 +1857,7 @@ int dtp_receive(struct dtp * instance,
 
         spin_unlock_bh(&instance->sv_lock);
 
-        if (dtcp) {
+        if (dtcp && du) {
                 if (dtcp_sv_update(dtcp, &du->pci)) {
                         LOG_ERR("Failed to update dtcp sv");
                 }
@@ -1770,7 +1865,7 @@ int dtp_receive(struct dtp * instance,
 
         dtp_send_pending_ctrl_pdus(instance);
 
-        if (list_empty(&instance->seqq->queue->head))
+        if (seq_queue_is_empty(instance->seqq->queue))
                 rtimer_stop(&instance->timers.a);
         else
                 rtimer_start(&instance->timers.a, a/AF);
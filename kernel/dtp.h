@@ -61,6 +61,7 @@ int          dtp_receive(struct dtp * instance,
 int          dtp_initial_sequence_number(struct dtp * instance);
 
 void         dtp_squeue_flush(struct dtp * dtp);
+int          dtp_squeue_size_set(struct dtp * dtp, uint_t window);
 
 // Does not start the timer(return false) if it's not necessary and packets can
 // be processed.
@@ -30,12 +30,42 @@
 #include "utils.h"
 #include "debug.h"
 #include "du.h"
+#include "rds/rcache.h"
 
 /* If this is defined PCI is considered when growing/shrinking PDUs in SDUP */
 #define PDU_HEAD_GROW_WITH_PCI
 #define MAX_PCIS_LEN (40 * 5)
 #define MAX_TAIL_LEN 20
 
+/* One DU (and list item) is allocated per PDU, keep them in slabs */
+static struct rcache * du_cache;
+static struct rcache * du_item_cache;
+
+int du_init(void)
+{
+	du_cache = rcache_create("rina-du", sizeof(struct du));
+	if (!du_cache)
+		return -1;
+
+	du_item_cache = rcache_create("rina-du-list-item",
+				      sizeof(struct du_list_item));
+	if (!du_item_cache) {
+		rcache_destroy(du_cache);
+		du_cache = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+void du_fini(void)
+{
+	rcache_destroy(du_item_cache);
+	du_item_cache = NULL;
+	rcache_destroy(du_cache);
+	du_cache = NULL;
+}
+
 int du_destroy(struct du * du)
 {
 	bool free_du = false;
@@ -49,11 +79,11 @@ int du_destroy(struct du * du)
 			free_du = true;
 		kfree_skb(du->skb); /* this destroys pci too */
 		if (likely(free_du))
-			rkfree(du);
+			rcache_free(du_cache, du);
 		return 0;
 	}
 
-	rkfree(du);
+	rcache_free(du_cache, du);
 	return 0;
 }
 EXPORT_SYMBOL(du_destroy);
@@ -79,13 +109,13 @@ struct du *du_create_gfp(size_t data_len, gfp_t flags)
 {
 	struct du *tmp;
 
-	tmp = rkzalloc(sizeof(*tmp), flags);
+	tmp = rcache_zalloc(du_cache, flags);
 	if (unlikely(!tmp))
 		return NULL;
 
 	tmp->skb = alloc_skb(MAX_PCIS_LEN + data_len + MAX_TAIL_LEN, flags);
 	if (unlikely(!tmp->skb)) {
-		rkfree(tmp);
+		rcache_free(du_cache, tmp);
 		LOG_ERR("Could not allocate DU...");
 		return NULL;
 	}
@@ -119,12 +149,9 @@ struct pci * du_pci(struct du * du)
 }
 EXPORT_SYMBOL(du_pci);
 
-/*XXX: This works well if buffer is linear */
+/* Only the linear part of the DU, see du_linearize() for the rest */
 unsigned char * du_buffer(const struct du * du)
 {
-	if (skb_is_nonlinear(du->skb)) {
-		LOG_WARN("sk_buff contains fragments");
-	}
 	return du->skb->data;
 }
 EXPORT_SYMBOL(du_buffer);
@@ -160,6 +187,11 @@ int du_decap(struct du * du)
 	pdu_type_t type;
 	ssize_t pci_len;
 
+	if (unlikely(du->skb->len < pci_base_size(du->cfg))) {
+		LOG_ERR("Could not decap DU. Shorter than the base PCI");
+		return -1;
+	}
+
 	du->pci.h = du->skb->data;
 	type = pci_type(&du->pci);
 	if (unlikely(!pdu_type_is_ok(type))) {
@@ -173,6 +205,11 @@ int du_decap(struct du * du)
 		return -1;
 	}
 
+	if (unlikely(du->skb->len < pci_len)) {
+		LOG_ERR("Could not decap DU. Shorter than its PCI");
+		return -1;
+	}
+
 	/* Make up for tail padding introduced at lower layers. */
 	if (du->skb->len > pci_length(&du->pci)) {
 		du_tail_shrink(du, du->skb->len - pci_length(&du->pci));
@@ -190,13 +227,13 @@ static struct du *du_dup_gfp(gfp_t flags,
 {
 	struct du *tmp;
 
-	tmp = rkmalloc(sizeof(*tmp), flags);
+	tmp = rcache_zalloc(du_cache, flags);
 	if (!tmp)
 		return NULL;
 
 	tmp->skb = skb_clone(du->skb, flags);
 	if (!tmp->skb) {
-		rkfree(tmp);
+		rcache_free(du_cache, tmp);
 		return NULL;
 	}
 
@@ -232,7 +269,7 @@ struct du * du_create_from_skb(struct sk_buff* skb)
 		return NULL;
 	}
 
-	tmp = rkzalloc(sizeof(*tmp), GFP_ATOMIC);
+	tmp = rcache_zalloc(du_cache, GFP_ATOMIC);
 	if (unlikely(!tmp))
 		return NULL;
 
@@ -251,6 +288,9 @@ EXPORT_SYMBOL(du_create_from_skb);
 
 int du_tail_grow(struct du *du, size_t bytes)
 {
+	if (unlikely(du_linearize(du)))
+		return -1;
+
 	if (unlikely(skb_tailroom(du->skb) < bytes)){
 		LOG_DBG("Could not grow DU tail, no mem... (%d < %zd)",
 			skb_tailroom(du->skb), bytes);
@@ -363,13 +403,13 @@ struct du * du_create_gfp_efcp(pdu_type_t type, struct efcp_config *cfg,
 	pci_len = pci_calculate_size(cfg, type);
 	ASSERT(pci_len > 0);
 
-	tmp = rkzalloc(sizeof(*tmp), flags);
+	tmp = rcache_zalloc(du_cache, flags);
 	if (unlikely(!tmp))
 		return NULL;
 
 	tmp->skb = alloc_skb(MAX_PCIS_LEN + MAX_TAIL_LEN, flags);
 	if (unlikely(!tmp->skb)) {
-		rkfree(tmp);
+		rcache_free(du_cache, tmp);
 		return NULL;
 	}
 	skb_reserve(tmp->skb, MAX_PCIS_LEN);
@@ -406,11 +446,138 @@ int du_shrink(struct du * du, size_t bytes)
 }
 EXPORT_SYMBOL(du_shrink);
 
+/*
+ * Creates a DU with hlen bytes of its own, followed by the [offset,
+ * offset + len) range of du. The range is referenced through a clone
+ * chained in the frag_list, not copied, and headers are always pushed
+ * into the new linear part, so the shared data is never written.
+ */
+struct du *du_create_fragment_ni(const struct du *du,
+				 size_t offset,
+				 size_t len,
+				 size_t hlen)
+{
+	struct du *tmp;
+	struct sk_buff *frag;
+
+	tmp = du_create_ni(hlen);
+	if (!tmp)
+		return NULL;
+
+	frag = skb_clone(du->skb, GFP_ATOMIC);
+	if (!frag) {
+		du_destroy(tmp);
+		return NULL;
+	}
+
+	/* Only moves the pointers of the clone when du is linear */
+	if (!pskb_pull(frag, offset) || pskb_trim(frag, len)) {
+		kfree_skb(frag);
+		du_destroy(tmp);
+		return NULL;
+	}
+
+	skb_shinfo(tmp->skb)->frag_list = frag;
+	tmp->skb->len	   += frag->len;
+	tmp->skb->data_len += frag->len;
+	tmp->skb->truesize += frag->truesize;
+	tmp->cfg = du->cfg;
+
+	return tmp;
+}
+EXPORT_SYMBOL(du_create_fragment_ni);
+
+/*
+ * Gives du a private copy of the skb head if it shares it with a clone,
+ * e.g. one held by a packet tap, keeping our pointers into the head.
+ */
+static int du_unclone(struct du *du)
+{
+	ptrdiff_t pci_off = 0, sdup_off = 0;
+
+	if (likely(!skb_cloned(du->skb)))
+		return 0;
+
+	if (du->pci.h)
+		pci_off = du->pci.h - du->skb->data;
+	if (du->sdup_head)
+		sdup_off = (unsigned char *) du->sdup_head - du->skb->data;
+
+	if (skb_unclone(du->skb, GFP_ATOMIC)) {
+		LOG_ERR("Could not unclone DU");
+		return -1;
+	}
+
+	if (du->pci.h)
+		du->pci.h = du->skb->data + pci_off;
+	if (du->sdup_head)
+		du->sdup_head = du->skb->data + sdup_off;
+
+	return 0;
+}
+
+/*
+ * Appends the data of frag at the end of du, consuming frag. On failure
+ * both DUs are left untouched and owned by the caller.
+ */
+int du_chain(struct du *du, struct du *frag)
+{
+	struct sk_buff *skb;
+	struct sk_buff **tail;
+
+	/* The frag_list lives in the shared info, never modify a shared one */
+	if (du_unclone(du))
+		return -1;
+
+	skb = du_detach_skb(frag);
+	du_destroy(frag);
+
+	tail = &skb_shinfo(du->skb)->frag_list;
+	while (*tail)
+		tail = &(*tail)->next;
+	*tail = skb;
+
+	du->skb->len	  += skb->len;
+	du->skb->data_len += skb->len;
+	du->skb->truesize += skb->truesize;
+
+	return 0;
+}
+EXPORT_SYMBOL(du_chain);
+
+/* Pulls chained data into the linear buffer, for byte-level access */
+int du_linearize(struct du *du)
+{
+	ptrdiff_t pci_off = 0, sdup_off = 0;
+
+	if (likely(!skb_is_nonlinear(du->skb)))
+		return 0;
+
+	/* The head may be reallocated, keep the offsets of our pointers */
+	if (du->pci.h)
+		pci_off = du->pci.h - du->skb->data;
+	if (du->sdup_head)
+		sdup_off = (unsigned char *) du->sdup_head - du->skb->data;
+
+	if (skb_linearize(du->skb)) {
+		LOG_ERR("Could not linearize DU");
+		return -1;
+	}
+
+	if (du->pci.h)
+		du->pci.h = du->skb->data + pci_off;
+	if (du->sdup_head)
+		du->sdup_head = du->skb->data + sdup_off;
+
+	return 0;
+}
+EXPORT_SYMBOL(du_linearize);
+
 struct du_list_item * du_list_item_create_gfp(struct du * du, gfp_t flags)
 {
 	struct du_list_item * item;
 
-	item = rkzalloc(sizeof(*item), flags);
+	item = rcache_zalloc(du_item_cache, flags);
 	if (unlikely(!item))
 		return NULL;
 
@@ -465,7 +632,7 @@ int du_list_item_destroy(struct du_list_item * item, bool destroy_du)
 	if (destroy_du)
 		du_destroy(item->du);
 
-	rkfree(item);
+	rcache_free(du_item_cache, item);
 
 	return 0;
 }
@@ -523,3 +690,107 @@ int du_list_clear(struct du_list * du_list, bool destroy_dus)
 	return 0;
 }
 EXPORT_SYMBOL(du_list_clear);
+
+#ifdef CONFIG_RINA_DU_REGRESSION_TESTS
+#define DU_TEST_HEAD_LEN 64
+#define DU_TEST_FRAG_LEN 32
+
+static bool du_test_fill(struct du *du, unsigned char first)
+{
+	unsigned char *data = du_buffer(du);
+	int i;
+
+	if (!data)
+		return false;
+
+	for (i = 0; i < du_len(du); i++)
+		data[i] = first + i;
+
+	return true;
+}
+
+/* Chaining onto a DU whose skb is shared with a tap must not touch the tap */
+static bool du_test_chain_cloned(void)
+{
+	unsigned char buf[DU_TEST_HEAD_LEN + 2 * DU_TEST_FRAG_LEN];
+	struct du *du, *frag;
+	struct sk_buff *tap;
+	bool ok = false;
+	int i;
+
+	du = du_create(DU_TEST_HEAD_LEN);
+	if (!du || !du_test_fill(du, 0)) {
+		LOG_ERR("Could not create the head DU");
+		goto out_du;
+	}
+
+	tap = skb_clone(du->skb, GFP_KERNEL);
+	if (!tap) {
+		LOG_ERR("Could not clone the head DU");
+		goto out_du;
+	}
+
+	for (i = 0; i < 2; i++) {
+		frag = du_create(DU_TEST_FRAG_LEN);
+		if (!frag || !du_test_fill(frag, DU_TEST_HEAD_LEN +
+					   i * DU_TEST_FRAG_LEN)) {
+			LOG_ERR("Could not create fragment %d", i);
+			if (frag)
+				du_destroy(frag);
+			goto out_tap;
+		}
+
+		if (du_chain(du, frag)) {
+			LOG_ERR("Could not chain fragment %d", i);
+			du_destroy(frag);
+			goto out_tap;
+		}
+	}
+
+	if (skb_shinfo(tap)->frag_list || tap->len != DU_TEST_HEAD_LEN ||
+	    tap->data_len) {
+		LOG_ERR("Chaining modified the cloned skb");
+		goto out_tap;
+	}
+
+	if (skb_shinfo(du->skb) == skb_shinfo(tap)) {
+		LOG_ERR("The head DU still shares its skb head");
+		goto out_tap;
+	}
+
+	if (du_len(du) != sizeof(buf) ||
+	    skb_copy_bits(du->skb, 0, buf, sizeof(buf))) {
+		LOG_ERR("Wrong length after chaining: %d", du_len(du));
+		goto out_tap;
+	}
+
+	for (i = 0; i < sizeof(buf); i++) {
+		if (buf[i] != (unsigned char) i) {
+			LOG_ERR("Wrong data at offset %d after chaining", i);
+			goto out_tap;
+		}
+	}
+
+	ok = true;
+
+ out_tap:
+	kfree_skb(tap);
+ out_du:
+	if (du)
+		du_destroy(du);
+
+	return ok;
+}
+
+bool regression_tests_du(void)
+{
+	if (!du_test_chain_cloned()) {
+		LOG_ERR("Chaining on a cloned DU test failed");
+		return false;
+	}
+
+	LOG_DBG("DU regression tests passed");
+
+	return true;
+}
+#endif
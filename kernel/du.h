@@ -43,6 +43,10 @@ struct du_list_item {
 	struct du * du;
 };
 
+/* Slab caches backing DUs, set up at core module load */
+int du_init(void);
+void du_fini(void);
+
 struct pci * du_pci(struct du * du);
 struct du * du_create_ni(size_t data_len);
 struct du * du_create(size_t data_len);
@@ -68,6 +72,10 @@ int du_head_shrink(struct du * du, size_t bytes);
 void * du_sdup_head(struct du *du);
 int du_sdup_head_set(struct du *pdu, void *header);
 int du_shrink(struct du * du, size_t bytes);
+struct du *du_create_fragment_ni(const struct du *du, size_t offset,
+				 size_t len, size_t hlen);
+int du_chain(struct du *du, struct du *frag);
+int du_linearize(struct du *du);
 struct du_list_item * du_list_item_create(struct du * du);
 struct du_list_item * du_list_item_create_ni(struct du * du);
 int add_du_to_list(struct du_list * du_list, struct du * du);
@@ -78,4 +86,8 @@ struct du_list * du_list_create_ni(void);
 int du_list_destroy(struct du_list * du_list, bool destroy_dus);
 int du_list_clear(struct du_list * du_list, bool destroy_dus);
 
+#ifdef CONFIG_RINA_DU_REGRESSION_TESTS
+bool regression_tests_du(void);
+#endif
+
 #endif
@@ -91,6 +91,8 @@ struct rtxq_entry {
         unsigned long    time_stamp;
         struct du *      du;
         int              retries;
+        /* When it is due for retransmission, and its RTX wheel slot */
+        unsigned long    due;
         struct list_head next;
 };
 
@@ -99,10 +101,27 @@ struct cwq {
         spinlock_t      lock;
 };
 
+#define RTXW_BITS  6
+#define RTXW_SLOTS (1 << RTXW_BITS)
+
+/*
+ * Retransmission queue: a ring indexed by sequence number holding the
+ * PDUs in [head, head + span), with holes for the sequence numbers never
+ * pushed. Entries are also hooked to a two level timer wheel by their
+ * retransmission time, with a 1 jiffy level and a RTXW_SLOTS jiffies one.
+ */
 struct rtxqueue {
 	int len;
 	int drop_pdus;
-        struct list_head head;
+        struct rtxq_entry * ring;
+        unsigned int        mask;
+        seq_num_t           head;
+        unsigned int        span;
+        unsigned long       clock;
+        struct list_head    lvl0[RTXW_SLOTS];
+        struct list_head    lvl1[RTXW_SLOTS];
+        struct list_head    far;
+        struct list_head    expired;
 };
 
 struct rtxq {
@@ -112,16 +131,14 @@ struct rtxq {
         struct rtxqueue *         queue;
 };
 
-struct rtt_entry {
-	unsigned long time_stamp;
-	seq_num_t sn;
-        struct list_head next;
-};
-
+/* RTT estimation without retransmissions, same layout as the rtxqueue */
 struct rttq {
 	spinlock_t lock;
 	struct dtp * parent;
-        struct list_head head;
+        unsigned long * stamps;
+        unsigned int    mask;
+        seq_num_t       head;
+        unsigned int    span;
 };
 
 /* This is the DT-SV part maintained by DTP */
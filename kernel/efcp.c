@@ -155,6 +155,12 @@ static int efcp_destroy(struct efcp * instance)
                                 instance->connection->port_id);
         }
 
+        /* Delimiting may still be holding UDFs for DTP, e.g. packed ones */
+        if (instance->delim) {
+        	delim_destroy(instance->delim);
+        	instance->delim = NULL;
+        }
+
         if (instance->dtp) {
                 /*
                  * FIXME:
@@ -181,10 +187,6 @@ static int efcp_destroy(struct efcp * instance)
                 connection_destroy(instance->connection);
         }
 
-        if (instance->delim) {
-        	delim_destroy(instance->delim);
-        }
-
 	robject_del(&instance->robj);
         rkfree(instance);
 
@@ -649,6 +651,11 @@ cep_id_t efcp_connection_create(struct efcp_container * container,
                 }
 
                 efcp->dtp->dtcp = dtcp;
+
+                if (dtcp_window_based_fctrl(dtcp_cfg) &&
+                    dtp_squeue_size_set(efcp->dtp,
+                                        dtcp_initial_credit(dtcp_cfg)))
+                        LOG_WARN("Could not size the sequencing queue");
         }
 
         if (dtcp_window_based_fctrl(dtcp_cfg) ||
@@ -31,6 +31,8 @@
 #include <linux/sched.h>
 #include <linux/spinlock.h>
 #include <linux/compat.h>
+#include <linux/uio.h>
+#include <linux/version.h>
 
 #define RINA_PREFIX "iodev"
 
@@ -42,6 +44,7 @@
 #include "kfa.h"
 #include "kfa-utils.h"
 #include "ctrldev.h"
+#include "sdu-ring.h"
 #include "irati/kernel-msg.h"
 
 extern struct kipcm *default_kipcm;
@@ -52,6 +55,10 @@ struct iodev_priv {
         struct iowaitqs * wqs;
         spinlock_t 	flow_dealloc_lock;
         int		flow_dealloc;
+
+        /* Shared-memory SDU rings, if set up */
+        struct mutex	rings_lock;
+        struct sdu_rings * rings;
 };
 
 static ssize_t iodev_write(struct file *f, const char __user *buffer, 
@@ -183,30 +190,23 @@ static ssize_t iodev_read_iter(struct kiocb * kio, struct iov_iter * iov)
 	return common_read(size, blocking, priv->port_id, NULL, iov);
 }	
 
-/* Conservative implementation: we always pretend to be ready.
- * This needs to be implemented properly once it is possible to
- * ask lower layers for the status of receive/send queues. */
 static unsigned int iodev_poll(struct file *f, poll_table *wait)
 {
         struct kfa *kfa = kipcm_kfa(default_kipcm);
         struct iodev_priv *priv = f->private_data;
-        unsigned int mask = 0;
-        int res;
 
         if (!is_port_id_ok(priv->port_id)) {
-                return -ENXIO;
+                return POLLERR;
         }
 
-        /* Set POLLIN if the receive queue is not empty or
-         * the flow has been deallocated. Also call poll_wait(),
-         * as required by the caller. */
-        res = kfa_flow_readable(kfa, priv->port_id, &mask, f, wait);
-        if (res == 0) {
-        	/* If the flow is there, allow writes on the port-id */
-        	mask |= POLLOUT | POLLWRNORM;
-        }
+        /* The waitqueues are owned by the file, so they can be registered
+         * even if the flow goes away in the meantime. The KFA wakes up
+         * the read queue when SDUs are posted or the flow is deallocated,
+         * and the write queue when the IPCP enables writes again. */
+        poll_wait(f, &priv->wqs->read_wqueue, wait);
+        poll_wait(f, &priv->wqs->write_wqueue, wait);
 
-        return mask;
+        return kfa_flow_poll_mask(kfa, priv->port_id);
 }
 
 static int iodev_open(struct inode *inode, struct file *f)
@@ -221,6 +221,7 @@ static int iodev_open(struct inode *inode, struct file *f)
         priv->port_id = port_id_bad();
         priv->flow_dealloc = 0;
         spin_lock_init(&priv->flow_dealloc_lock);
+        mutex_init(&priv->rings_lock);
         priv->wqs = rkzalloc(sizeof(struct iowaitqs), GFP_KERNEL);
         if (!priv->wqs) {
         	rkfree(priv);
@@ -268,6 +269,8 @@ static int iodev_release(struct inode *inode, struct file *f)
 
         deallocate_flow(priv);
 
+        /* The KFA dropped its reference to the RX ring in deallocate_flow */
+        sdu_rings_destroy(priv->rings);
         rkfree(priv->wqs);
         rkfree(priv);
 
@@ -284,6 +287,172 @@ static int iodev_flush(struct file * f, fl_owner_t id) {
 	return 0;
 }
 
+static int iodev_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct iodev_priv *priv = f->private_data;
+	int ret;
+
+	mutex_lock(&priv->rings_lock);
+	if (!priv->rings) {
+		mutex_unlock(&priv->rings_lock);
+		return -EINVAL;
+	}
+	ret = sdu_rings_mmap(priv->rings, vma);
+	mutex_unlock(&priv->rings_lock);
+
+	return ret;
+}
+
+static int iodev_ring_setup(struct iodev_priv *priv,
+			    struct irati_iodev_ringreq __user *p)
+{
+	struct kfa *kfa = kipcm_kfa(default_kipcm);
+	struct irati_iodev_ringreq req;
+	struct sdu_rings *rings;
+	size_t max_sdu_size;
+
+	if (copy_from_user(&req, p, sizeof(req)))
+		return -EFAULT;
+
+	if (!is_port_id_ok(priv->port_id))
+		return -ENXIO;
+
+	max_sdu_size = kfa_flow_max_sdu_size(kfa, priv->port_id);
+	if (req.slot_size < max_sdu_size) {
+		LOG_ERR("Ring slots of %u bytes cannot hold SDUs of %zd bytes",
+			req.slot_size, max_sdu_size);
+		return -EINVAL;
+	}
+
+	mutex_lock(&priv->rings_lock);
+	if (priv->rings) {
+		mutex_unlock(&priv->rings_lock);
+		return -EBUSY;
+	}
+
+	rings = sdu_rings_create(req.num_slots, req.slot_size);
+	if (!rings) {
+		mutex_unlock(&priv->rings_lock);
+		return -ENOMEM;
+	}
+
+	if (kfa_flow_rx_ring_set(kfa, priv->port_id, &rings->rx)) {
+		mutex_unlock(&priv->rings_lock);
+		sdu_rings_destroy(rings);
+		return -ENXIO;
+	}
+	priv->rings = rings;
+	mutex_unlock(&priv->rings_lock);
+
+	req.ring_size = rings->ring_size;
+	if (copy_to_user(p, &req, sizeof(req)))
+		return -EFAULT;
+
+	LOG_DBG("Set up SDU rings for port id %d", priv->port_id);
+
+	return 0;
+}
+
+/* Transmits the SDUs posted in the TX ring, returns how many were sent */
+static long iodev_ring_txsync(struct iodev_priv *priv, bool blocking)
+{
+	struct sdu_ring *ring;
+	struct iov_iter iter;
+	struct kvec kv;
+	unsigned char *data;
+	size_t len;
+	long sent = 0;
+	int ret = 0;
+
+	mutex_lock(&priv->rings_lock);
+	if (!priv->rings) {
+		mutex_unlock(&priv->rings_lock);
+		return -EINVAL;
+	}
+
+	ring = &priv->rings->tx;
+	while (sent < ring->num_slots) {
+		ret = sdu_ring_peek(ring, &data, &len);
+		if (ret)
+			break;
+
+		kv.iov_base = data;
+		kv.iov_len = len;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,20,0)
+		iov_iter_kvec(&iter, ITER_KVEC | WRITE, &kv, 1, len);
+#else
+		iov_iter_kvec(&iter, WRITE, &kv, 1, len);
+#endif
+		ret = kipcm_du_write(default_kipcm, priv->port_id, NULL,
+				     &iter, len, blocking);
+		if (ret < 0)
+			break;
+
+		sdu_ring_consume(ring);
+		sent++;
+	}
+	mutex_unlock(&priv->rings_lock);
+
+	if (sent || ret == -EAGAIN)
+		return sent;
+
+	return ret;
+}
+
+/* SDUs dequeued from the KFA with a single lock acquisition */
+#define IODEV_READ_BURST 16
+
+static long iodev_read_batch(struct iodev_priv *priv,
+			     struct irati_iodev_batch *batch,
+			     bool blocking)
+{
+	struct kfa *kfa = kipcm_kfa(default_kipcm);
+	char __user *buf = (char __user *)(uintptr_t) batch->buf;
+	struct du *dus[IODEV_READ_BURST];
+	unsigned int done = 0;
+	size_t offset = 0;
+	uint32_t len;
+	int burst, n, i;
+	long ret = 0;
+
+	while (done < batch->count) {
+		/* Only wait for the first SDU, then take what is there */
+		burst = min_t(unsigned int, IODEV_READ_BURST,
+			      batch->count - done);
+		n = kfa_flow_du_read_batch(kfa, priv->port_id, dus, burst,
+					   batch->buf_len - offset,
+					   blocking && !done);
+		if (n <= 0) {
+			ret = n;
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			len = du_len(dus[i]);
+			if (put_user(len, (uint32_t __user *) (buf + offset)) ||
+			    copy_to_user(buf + offset + sizeof(len),
+					 du_buffer(dus[i]), len)) {
+				LOG_ERR("Error copying data to user space");
+				ret = -EFAULT;
+				break;
+			}
+			offset += IRATI_BATCH_REC_SIZE(len);
+			done++;
+			du_destroy(dus[i]);
+		}
+
+		/* Whatever was not copied goes back for the next read */
+		if (i < n)
+			kfa_flow_du_unread_batch(kfa, priv->port_id,
+						 dus + i, n - i);
+
+		if (ret || n < burst)
+			break;
+	}
+
+	return done ? done : ret;
+}
+
 static long iodev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
         struct kfa *kfa = kipcm_kfa(default_kipcm);
@@ -291,6 +460,7 @@ static long iodev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         void __user *p = (void __user *)arg;
         struct irati_iodev_ctldata data;
         size_t max_sdu_size;
+        bool blocking = !(f->f_flags & O_NONBLOCK);
 
         switch(cmd) {
 
@@ -339,6 +509,39 @@ static long iodev_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
         	break;
         }
 
+        case IRATI_IOCTL_READ_BATCH:
+        case IRATI_IOCTL_WRITE_BATCH: {
+        	struct irati_iodev_batch batch;
+        	long ret;
+
+        	if (copy_from_user(&batch, p, sizeof(batch)))
+        		return -EFAULT;
+
+        	if (cmd == IRATI_IOCTL_READ_BATCH)
+        		ret = iodev_read_batch(priv, &batch, blocking);
+        	else
+        		ret = kfa_flow_ub_write_batch(kfa, priv->port_id,
+        				(const char __user *)(uintptr_t) batch.buf,
+					batch.buf_len, batch.count, blocking);
+
+        	batch.count = ret > 0 ? ret : 0;
+        	if (copy_to_user(p, &batch, sizeof(batch)))
+        		return -EFAULT;
+
+        	return ret;
+        }
+
+        case IRATI_IOCTL_RING_SETUP:
+        	return iodev_ring_setup(priv, p);
+
+        case IRATI_IOCTL_RING_RXSYNC:
+        	if (!priv->rings)
+        		return -EINVAL;
+        	return kfa_flow_rx_ring_sync(kfa, priv->port_id, blocking);
+
+        case IRATI_IOCTL_RING_TXSYNC:
+        	return iodev_ring_txsync(priv, blocking);
+
         default:
         	LOG_ERR("Invalid cmd %u", cmd);
         	return -EINVAL;
@@ -364,6 +567,7 @@ static const struct file_operations irati_fops = {
 	.write_iter	= iodev_write_iter,
 	.read_iter	= iodev_read_iter,
         .poll           = iodev_poll,
+        .mmap           = iodev_mmap,
         .unlocked_ioctl = iodev_ioctl,
 	.flush		= iodev_flush,
 #ifdef CONFIG_COMPAT
@@ -70,6 +70,19 @@ struct ipcp_instance_ops {
                           struct du *                 du,
                           bool                        blocking);
 
+        /*
+         * Optional, writes a batch of SDUs on the same port. Takes the
+         * ownership of the SDUs it consumes (sent or dropped) and returns
+         * how many they were, always from the head of the array. The rest
+         * could not be written for now (as with -EAGAIN in du_write) and
+         * are still owned by the caller.
+         */
+        int  (* du_write_batch)(struct ipcp_instance_data * data,
+                                port_id_t                   id,
+                                struct du **                dus,
+                                int                         count,
+                                bool                        blocking);
+
         cep_id_t (* connection_create)(struct ipcp_instance_data * data,
         			       struct ipcp_instance *      user_ipcp,
                                        port_id_t                   port_id,
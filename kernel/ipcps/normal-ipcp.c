@@ -1016,6 +1016,10 @@ static int efcp_select_policy_set(struct efcp * efcp,
                 return dtcp_select_policy_set(efcp->dtp->dtcp,
                 			      path + offset,
                                               ps_name);
+        } else if (cmplen && strncmp(path, "delim", cmplen) == 0
+        		&& efcp->delim) {
+                return delim_select_policy_set(efcp->delim, path + offset,
+                                               ps_name);
         }
 
         /* Currently there are no policy sets specified for EFCP (strictly
@@ -1081,6 +1085,9 @@ static int efcp_set_policy_set_param(struct efcp * efcp,
         } else if (strncmp(path, "dtcp", cmplen) == 0 && efcp->dtp->dtcp) {
                 return dtcp_set_policy_set_param(efcp->dtp->dtcp,
                                         path + offset, name, value);
+        } else if (strncmp(path, "delim", cmplen) == 0 && efcp->delim) {
+                return delim_set_policy_set_param(efcp->delim,
+                                        path + offset, name, value);
         }
 
         /* Currently there are no parametric policies specified for EFCP
@@ -1242,6 +1249,7 @@ static struct ipcp_instance_ops normal_instance_ops = {
 
         .du_enqueue               = normal_du_enqueue,
         .du_write                 = normal_du_write,
+        .du_write_batch           = NULL,
 
         .mgmt_du_write            = normal_mgmt_du_write,
         .mgmt_du_post             = normal_mgmt_du_post,
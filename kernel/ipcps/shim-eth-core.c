@@ -28,6 +28,11 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/if_ether.h>
+#include <linux/etherdevice.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/percpu.h>
+#include <linux/rculist.h>
 #include <linux/string.h>
 #include <linux/list.h>
 #include <linux/if.h>
@@ -114,6 +119,10 @@ enum port_id_state {
 struct shim_eth_flow {
         struct list_head       list;
 
+        /* In flows_by_ha once dest_ha is known, looked up under RCU */
+        struct hlist_node      hnode;
+        struct rcu_head        rcu;
+
         struct gha *           dest_ha;
         struct gpa *           dest_pa;
 
@@ -138,6 +147,15 @@ enum vlan_mode {
         VLAN_MODE_AUTO = 2
 };
 
+/* Receive counters, kept per CPU so that RX queues do not share them */
+struct eth_rcv_stats {
+        u64 rx_pdus;
+        u64 rx_bytes;
+        u64 rx_drops;
+};
+
+#define FLOWS_BY_HA_BITS 7
+
 /*
  * Contains all the information associated to an instance of a
  * shim Ethernet IPC Process
@@ -166,6 +184,14 @@ struct ipcp_instance_data {
         spinlock_t             lock;
         struct list_head       flows;
 
+        /*
+         * Flows with a known peer, hashed by its MAC. Updated under lock,
+         * looked up locklessly by the receive path
+         */
+        DECLARE_HASHTABLE(flows_by_ha, FLOWS_BY_HA_BITS);
+
+        struct eth_rcv_stats __percpu * rcv_stats;
+
         /* FIXME: Remove it as soon as the kipcm_kfa gets removed */
         struct kfa *           kfa;
 
@@ -255,6 +281,21 @@ static int eth_shim_dbg_inst_info_show(struct seq_file *s, void *v)
                            data->info->spoof_mac[4], data->info->spoof_mac[5]);
         }
 
+        if (data->rcv_stats) {
+                struct eth_rcv_stats * st;
+                u64 pdus = 0, bytes = 0, drops = 0;
+                int cpu;
+
+                for_each_possible_cpu(cpu) {
+                        st = per_cpu_ptr(data->rcv_stats, cpu);
+                        pdus  += st->rx_pdus;
+                        bytes += st->rx_bytes;
+                        drops += st->rx_drops;
+                }
+                seq_printf(s, "RX PDUs: %llu, bytes: %llu, drops: %llu\n",
+                           pdus, bytes, drops);
+        }
+
         return 0;
 }
 
@@ -453,19 +494,28 @@ static struct gpa * name_to_gpa(const struct name * name)
         return gpa;
 }
 
+static u32 flow_ha_hash(const unsigned char * mac)
+{ return jhash(mac, ETH_ALEN, 0); }
+
+/* Must be called under data->lock, with flow->dest_ha already set */
+static void flow_hash_add(struct ipcp_instance_data * data,
+                          struct shim_eth_flow *      flow)
+{
+        hash_add_rcu(data->flows_by_ha, &flow->hnode,
+                     flow_ha_hash(gha_address(flow->dest_ha)));
+}
+
+/* Must be called under RCU or data->lock */
 static struct shim_eth_flow *
-find_flow_by_gha(struct ipcp_instance_data * data,
-                 const struct gha *          addr)
+find_flow_by_mac_rcu(struct ipcp_instance_data * data,
+                     const unsigned char *       mac)
 {
         struct shim_eth_flow * flow;
 
-        ASSERT(data);
-        ASSERT(gha_is_ok(addr));
-
-        list_for_each_entry(flow, &data->flows, list) {
-                if (gha_is_equal(addr, flow->dest_ha)) {
+        hash_for_each_possible_rcu(data->flows_by_ha, flow, hnode,
+                                   flow_ha_hash(mac)) {
+                if (ether_addr_equal(gha_address(flow->dest_ha), mac))
                         return flow;
-                }
         }
 
         return NULL;
@@ -547,6 +597,19 @@ static string_t * create_vlan_interface_name(string_t * interface_name,
         return complete_interface;
 }
 
+static void flow_free_rcu(struct rcu_head * head)
+{
+        struct shim_eth_flow * flow;
+
+        flow = container_of(head, struct shim_eth_flow, rcu);
+
+        if (flow->dest_pa) gpa_destroy(flow->dest_pa);
+        if (flow->dest_ha) gha_destroy(flow->dest_ha);
+        if (flow->sdu_queue)
+                rfifo_destroy(flow->sdu_queue, (void (*)(void *)) du_destroy);
+        rkfree(flow);
+}
+
 static int flow_destroy(struct ipcp_instance_data * data,
                         struct shim_eth_flow *      flow)
 {
@@ -558,13 +621,12 @@ static int flow_destroy(struct ipcp_instance_data * data,
                 LOG_DBG("Deleting flow %d from list and destroying it", flow->port_id);
                 list_del(&flow->list);
         }
+        if (!hlist_unhashed(&flow->hnode))
+                hash_del_rcu(&flow->hnode);
         spin_unlock(&data->lock);
 
-        if (flow->dest_pa) gpa_destroy(flow->dest_pa);
-        if (flow->dest_ha) gha_destroy(flow->dest_ha);
-        if (flow->sdu_queue)
-                rfifo_destroy(flow->sdu_queue, (void (*)(void *)) du_destroy);
-        rkfree(flow);
+        /* The receive path may still be looking at it */
+        call_rcu(&flow->rcu, flow_free_rcu);
 
         return 0;
 }
@@ -647,10 +709,14 @@ static void rinarp_resolve_handler(void *             opaque,
 
         if (flow->port_id_state == PORT_STATE_PENDING) {
                 if (!timed_out) {
-                        flow->port_id_state = PORT_STATE_ALLOCATED;
+                        flow->dest_ha = gha_dup_ni(dest_ha);
+                        if (flow->dest_ha)
+                                flow_hash_add(data, flow);
+                        /* Pairs with eth_recv_process_packet() */
+                        smp_store_release(&flow->port_id_state,
+                                          PORT_STATE_ALLOCATED);
                         spin_unlock_bh(&data->lock);
 
-                        flow->dest_ha = gha_dup_ni(dest_ha);
                         user_ipcp = flow->user_ipcp;
                         ASSERT(user_ipcp);
 
@@ -874,30 +940,39 @@ eth_flow_allocate_response(struct ipcp_instance_data * data,
                 }
 
                 spin_lock(&data->lock);
-                flow->port_id_state = PORT_STATE_ALLOCATED;
                 flow->port_id   = port_id;
                 flow->user_ipcp = user_ipcp;
-                spin_unlock(&data->lock);
 
                 ASSERT(flow->sdu_queue);
 
+                /*
+                 * Frames keep being queued while the flow is pending, so
+                 * drain the queue until it is seen empty under the lock,
+                 * and only then publish the state. The release pairs
+                 * with the acquire in eth_recv_process_packet(), which
+                 * then sees port_id and user_ipcp, and no new frame can
+                 * overtake a queued one.
+                 */
                 while (!rfifo_is_empty(flow->sdu_queue)) {
                         struct du * tmp = NULL;
 
                         tmp = rfifo_pop(flow->sdu_queue);
+                        spin_unlock(&data->lock);
                         ASSERT(tmp);
 
                         LOG_DBG("Got a new element from the fifo");
 
-                        ASSERT(flow->user_ipcp->ops->sdu_enqueue);
-                        if (flow->user_ipcp->ops->
-                            du_enqueue(flow->user_ipcp->data,
-                                        flow->port_id,
-                                        tmp)) {
+                        ASSERT(user_ipcp->ops->du_enqueue);
+                        if (user_ipcp->ops->du_enqueue(user_ipcp->data,
+                                                       port_id,
+                                                       tmp))
                                 LOG_ERR("Couldn't enqueue SDU to KFA ...");
-                                return -1;
-                        }
+
+                        spin_lock(&data->lock);
                 }
+                smp_store_release(&flow->port_id_state,
+                                  PORT_STATE_ALLOCATED);
+                spin_unlock(&data->lock);
 
                 rfifo_destroy(flow->sdu_queue, (void (*)(void *)) du_destroy);
                 flow->sdu_queue = NULL;
@@ -1153,26 +1228,21 @@ static void eth_skb_destructor(struct sk_buff *skb)
         }
 }
 
-static int eth_du_write(struct ipcp_instance_data * data,
-                        port_id_t                   id,
-                        struct du *                 du,
-                        bool                        blocking)
+/*
+ * Transmits a single SDU on an allocated flow. Returns 0 if it was sent,
+ * -EAGAIN if the device cannot take it now (the SDU is left untouched)
+ * or -1 if it was dropped.
+ */
+static int eth_du_xmit(struct ipcp_instance_data * data,
+                       struct du *                 du,
+                       const unsigned char *       src_hw,
+                       const unsigned char *       dest_hw)
 {
-        struct shim_eth_flow *   flow;
         struct sk_buff *         skb;
         struct sk_buff *	 bup_skb;
-        const unsigned char *    src_hw;
-        const unsigned char *    dest_hw;
         int                      hlen, tlen, length;
         int                      retval;
 
-        LOG_DBG("Entered the sdu-write");
-
-        if (unlikely(!data)) {
-                LOG_ERR("Bogus data passed, bailing out");
-                return -1;
-        }
-
         hlen   = sizeof(struct ethhdr);
         tlen   = data->dev->needed_tailroom;
         length = du_len(du);
@@ -1183,41 +1253,6 @@ static int eth_du_write(struct ipcp_instance_data * data,
                 return -1;
         }
 
-        flow = find_flow(data, id);
-        if (!flow) {
-                LOG_ERR("Flow does not exist, you shouldn't call this");
-                du_destroy(du);
-                return -1;
-        }
-
-        spin_lock_bh(&data->lock);
-        if (flow->port_id_state != PORT_STATE_ALLOCATED) {
-                LOG_ERR("Flow is not in the right state to call this");
-                du_destroy(du);
-                spin_unlock_bh(&data->lock);
-                return -1;
-        }
-
-        if (data->tx_busy) {
-                spin_unlock_bh(&data->lock);
-                return -EAGAIN;
-        }
-        spin_unlock_bh(&data->lock);
-
-        src_hw = data->dev->dev_addr;
-        if (!src_hw) {
-                LOG_ERR("Failed to get source HW addr");
-                du_destroy(du);
-                return -1;
-        }
-
-        dest_hw = gha_address(flow->dest_ha);
-        if (!dest_hw) {
-                LOG_ERR("Destination HW address is unknown");
-                du_destroy(du);
-                return -1;
-        }
-
         /* FIXME: sdu_detach_skb() has to be removed */
         skb = du_detach_skb(du);
         bup_skb = skb_clone(skb, GFP_ATOMIC);
@@ -1271,6 +1306,124 @@ static int eth_du_write(struct ipcp_instance_data * data,
         return 0;
 }
 
+/*
+ * Checks that flow id can be written and gets the addresses to use. Returns
+ * the flow, or NULL with *err set to -EAGAIN if the device is busy or to -1
+ * if the SDUs have to be dropped.
+ */
+static struct shim_eth_flow * eth_tx_prepare(struct ipcp_instance_data * data,
+                                             port_id_t                   id,
+                                             const unsigned char **      src_hw,
+                                             const unsigned char **      dest_hw,
+                                             int *                       err)
+{
+        struct shim_eth_flow * flow;
+
+        *err = -1;
+
+        flow = find_flow(data, id);
+        if (!flow) {
+                LOG_ERR("Flow does not exist, you shouldn't call this");
+                return NULL;
+        }
+
+        spin_lock_bh(&data->lock);
+        if (flow->port_id_state != PORT_STATE_ALLOCATED) {
+                LOG_ERR("Flow is not in the right state to call this");
+                spin_unlock_bh(&data->lock);
+                return NULL;
+        }
+
+        if (data->tx_busy) {
+                spin_unlock_bh(&data->lock);
+                *err = -EAGAIN;
+                return NULL;
+        }
+        spin_unlock_bh(&data->lock);
+
+        *src_hw = data->dev->dev_addr;
+        if (!*src_hw) {
+                LOG_ERR("Failed to get source HW addr");
+                return NULL;
+        }
+
+        *dest_hw = gha_address(flow->dest_ha);
+        if (!*dest_hw) {
+                LOG_ERR("Destination HW address is unknown");
+                return NULL;
+        }
+
+        return flow;
+}
+
+static int eth_du_write(struct ipcp_instance_data * data,
+                        port_id_t                   id,
+                        struct du *                 du,
+                        bool                        blocking)
+{
+        const unsigned char *    src_hw;
+        const unsigned char *    dest_hw;
+        int                      err;
+
+        LOG_DBG("Entered the sdu-write");
+
+        if (unlikely(!data)) {
+                LOG_ERR("Bogus data passed, bailing out");
+                return -1;
+        }
+
+        if (!eth_tx_prepare(data, id, &src_hw, &dest_hw, &err)) {
+                if (err != -EAGAIN)
+                        du_destroy(du);
+                return err;
+        }
+
+        return eth_du_xmit(data, du, src_hw, dest_hw);
+}
+
+/*
+ * Flow lookup, state checks and address resolution are done once for the
+ * whole batch. The frames are queued back to back within a single BH
+ * section, so that the qdisc can dequeue them in bulk and let the driver
+ * defer the doorbell (xmit_more) until the last one.
+ */
+static int eth_du_write_batch(struct ipcp_instance_data * data,
+                              port_id_t                   id,
+                              struct du **                dus,
+                              int                         count,
+                              bool                        blocking)
+{
+        const unsigned char *    src_hw;
+        const unsigned char *    dest_hw;
+        int                      i, err;
+
+        LOG_DBG("Entered the sdu-write-batch (%d SDUs)", count);
+
+        if (unlikely(!data)) {
+                LOG_ERR("Bogus data passed, bailing out");
+                for (i = 0; i < count; i++)
+                        du_destroy(dus[i]);
+                return count;
+        }
+
+        if (!eth_tx_prepare(data, id, &src_hw, &dest_hw, &err)) {
+                if (err == -EAGAIN)
+                        return 0;
+                for (i = 0; i < count; i++)
+                        du_destroy(dus[i]);
+                return count;
+        }
+
+        local_bh_disable();
+        for (i = 0; i < count; i++) {
+                if (eth_du_xmit(data, dus[i], src_hw, dest_hw) == -EAGAIN)
+                        break;
+        }
+        local_bh_enable();
+
+        return i;
+}
+
 static int eth_rcv_worker(void * o)
 {
         struct ipcp_instance_data *     data;
@@ -1410,42 +1563,153 @@ static int eth_rcv_worker(void * o)
         return 0;
 }
 
-static int eth_recv_process_packet(struct sk_buff *    skb,
-                                   struct net_device * dev)
+/* Hands a DU to the user IPCP of an allocated flow */
+static int eth_rcv_deliver(struct ipcp_instance_data * data,
+                           struct ipcp_instance *      user_ipcp,
+                           port_id_t                   port_id,
+                           struct du *                 du)
 {
-        struct ethhdr *                 mh;
-        unsigned char *                 saddr;
-        struct ipcp_instance_data *     data;
-        struct interface_data_mapping * mapping;
-        struct shim_eth_flow *          flow;
-        struct gha *                    ghaddr;
-        struct du *                     du;
-        struct sk_buff *                linear_skb;
+        if (!user_ipcp) {
+                LOG_ERR("Flow is being deallocated, dropping PDU");
+                this_cpu_inc(data->rcv_stats->rx_drops);
+                du_destroy(du);
+                return -1;
+        }
+
+        ASSERT(user_ipcp->ops);
+        ASSERT(user_ipcp->ops->du_enqueue);
+        if (user_ipcp->ops->du_enqueue(user_ipcp->data, port_id, du)) {
+                LOG_ERR("Couldn't enqueue SDU to user IPCP");
+                this_cpu_inc(data->rcv_stats->rx_drops);
+                return -1;
+        }
 
+        return 0;
+}
+
+/*
+ * Frames from unknown peers or for flows not allocated yet. Creates the
+ * flow for a new peer and queues the DU until the flow is allocated.
+ */
+static int eth_rcv_slow_path(struct ipcp_instance_data * data,
+                             const unsigned char *       saddr,
+                             struct du *                 du)
+{
+        struct shim_eth_flow *          flow;
+        struct ipcp_instance *          user_ipcp;
+        port_id_t                       port_id;
         struct rcv_work_data          * wdata;
         struct rwq_work_item          * item;
 
-        /* C-c-c-checks */
-        if (!skb) {
-                LOG_ERR("Bogus skb passed, bailing out");
-                return -1;
+        spin_lock(&data->lock);
+        flow = find_flow_by_mac_rcu(data, saddr);
+        if (!flow) {
+                /* Create flow and its queue to handle next packets */
+                flow = rkzalloc(sizeof(*flow), GFP_ATOMIC);
+                if (!flow) {
+                        spin_unlock(&data->lock);
+			LOG_ERR("Could not create flow struct");
+                        goto drop;
+                }
+
+                flow->port_id_state = PORT_STATE_PENDING;
+                INIT_LIST_HEAD(&flow->list);
+                flow->dest_ha = gha_create_ni(MAC_ADDR_802_3, saddr);
+                flow->sdu_queue = rfifo_create_ni();
+                if (!flow->dest_ha || !flow->sdu_queue ||
+                    rfifo_push_ni(flow->sdu_queue, du)) {
+                        spin_unlock(&data->lock);
+                        LOG_ERR("Couldn't set up a new flow");
+                        if (flow->sdu_queue)
+                                rfifo_destroy(flow->sdu_queue,
+                                              (void (*)(void *)) du_destroy);
+                        if (flow->dest_ha)
+                                gha_destroy(flow->dest_ha);
+                        rkfree(flow);
+                        goto drop;
+                }
+
+                /* Published to the receive path, other frames queue up */
+                list_add(&flow->list, &data->flows);
+                flow_hash_add(data, flow);
+                spin_unlock(&data->lock);
+
+                wdata = rkzalloc(sizeof(* wdata), GFP_ATOMIC);
+                if (!wdata) {
+                        flow_destroy(data, flow);
+                        return -1;
+                }
+                wdata->dev  = data->dev;
+                wdata->flow = flow;
+                wdata->data = data;
+                item  = rwq_work_create_ni(eth_rcv_worker, wdata);
+                if (!item) {
+                        rkfree(wdata);
+                        flow_destroy(data, flow);
+                        return -1;
+                }
+
+                rwq_work_post(rcv_wq, item);
+
+                LOG_DBG("eth_recv_process_packet added work");
+                return 0;
         }
 
-        if (!dev) {
-                LOG_ERR("Bogus dev passed, bailing out");
-                return -1;
+        LOG_DBG("Flow exists, queueing or delivering or dropping");
+        if (flow->port_id_state == PORT_STATE_ALLOCATED) {
+                /* Allocated since the lockless lookup */
+                user_ipcp = flow->user_ipcp;
+                port_id   = flow->port_id;
+                spin_unlock(&data->lock);
+
+                return eth_rcv_deliver(data, user_ipcp, port_id, du);
         }
 
-        mapping = inst_data_mapping_get(dev);
-        if (!mapping) {
-                LOG_ERR("Failed to get mapping");
-                kfree_skb(skb);
+        if (flow->port_id_state == PORT_STATE_PENDING) {
+                LOG_DBG("Queueing frame");
+
+                if (rfifo_push_ni(flow->sdu_queue, du)) {
+                        spin_unlock(&data->lock);
+                        LOG_ERR("Failed to write %zd bytes into the fifo",
+                                du_len(du));
+                        goto drop;
+                }
+
+                spin_unlock(&data->lock);
+                return 0;
+        }
+
+        spin_unlock(&data->lock);
+
+ drop:
+        this_cpu_inc(data->rcv_stats->rx_drops);
+        du_destroy(du);
+        return -1;
+}
+
+/*
+ * Runs on the CPU the frame was steered to. Frames of allocated flows
+ * are delivered without taking any instance-wide lock, so the RX queues
+ * of a multi-queue NIC are processed in parallel.
+ */
+static int eth_recv_process_packet(struct sk_buff *            skb,
+                                   struct ipcp_instance_data * data)
+{
+        unsigned char                   saddr[ETH_ALEN];
+        struct shim_eth_flow *          flow;
+        struct ipcp_instance *          user_ipcp;
+        port_id_t                       port_id;
+        struct du *                     du;
+        struct sk_buff *                linear_skb;
+
+        /* C-c-c-checks */
+        if (!skb) {
+                LOG_ERR("Bogus skb passed, bailing out");
                 return -1;
         }
 
-        data = mapping->data;
         if (!data) {
-		LOG_ERR("Failed to get data from mapping");
+		LOG_ERR("No shim instance bound to the packet handler");
                 kfree_skb(skb);
                 return -1;
         }
@@ -1463,22 +1727,8 @@ static int eth_recv_process_packet(struct sk_buff *    skb,
                 return -1;
         }
 
-        mh    = eth_hdr(skb);
-        saddr = mh->h_source;
-        if (!saddr) {
-                LOG_ERR("Couldn't get source address");
-                kfree_skb(skb);
-                return -1;
-        }
-
-        /* Get correct flow based on hwaddr */
-        ghaddr = gha_create_ni(MAC_ADDR_802_3, saddr);
-        if (!ghaddr) {
-		LOG_ERR("Could not create GHAddr");
-                kfree_skb(skb);
-                return -1;
-        }
-        ASSERT(gha_is_ok(ghaddr));
+        /* The header goes away if the skb is copied below */
+        ether_addr_copy(saddr, eth_hdr(skb)->h_source);
 
         /* FIXME: If skb is not linear we need to make a copy... */
         linear_skb = skb;
@@ -1487,6 +1737,7 @@ static int eth_recv_process_packet(struct sk_buff *    skb,
                 linear_skb = skb_copy(skb, GFP_ATOMIC);
                 if (!linear_skb) {
                         LOG_ERR("Could not linearize received SKB");
+                        this_cpu_inc(data->rcv_stats->rx_drops);
                         kfree_skb(skb);
                         return -1;
                 }
@@ -1497,116 +1748,38 @@ static int eth_recv_process_packet(struct sk_buff *    skb,
         du = du_create_from_skb(linear_skb);
         if (!du) {
                 LOG_ERR("Could not create SDU from buffer");
+                this_cpu_inc(data->rcv_stats->rx_drops);
                 kfree_skb(linear_skb);
                 return -1;
         }
 
-        spin_lock(&data->lock);
-        flow = find_flow_by_gha(data, ghaddr);
-        if (!flow) {
-                spin_unlock(&data->lock);
-                /* Create flow and its queue to handle next packets */
-                flow = rkzalloc(sizeof(*flow), GFP_ATOMIC);
-                if (!flow) {
-			LOG_ERR("Could not create flow struct");
-                        du_destroy(du);
-                        gha_destroy(ghaddr);
-                        return -1;
-                }
-
-                flow->port_id_state = PORT_STATE_PENDING;
-                flow->dest_ha       = ghaddr;
-                INIT_LIST_HEAD(&flow->list);
-                flow->sdu_queue = rfifo_create_ni();
-                if (!flow->sdu_queue) {
-                        LOG_ERR("Couldn't create the SDU queue "
-                                "for a new flow");
-                        du_destroy(du);
-                        gha_destroy(ghaddr);
-                        rkfree(flow);
-                        return -1;
-                }
+        this_cpu_inc(data->rcv_stats->rx_pdus);
+        this_cpu_add(data->rcv_stats->rx_bytes, du_len(du));
 
-                /* Store SDU in queue */
-                if (rfifo_push_ni(flow->sdu_queue, du)) {
-                        LOG_ERR("Could not push a SDU into the flow queue");
-                        du_destroy(du);
-                        gha_destroy(ghaddr);
-                        rkfree (flow);
-                        rfifo_destroy(flow->sdu_queue,
-                                      (void (*)(void *)) du_destroy);
-                        return -1;
-                }
+        rcu_read_lock();
+        flow = find_flow_by_mac_rcu(data, saddr);
+        /* Pairs with the release that publishes an allocated flow */
+        if (flow &&
+            smp_load_acquire(&flow->port_id_state) == PORT_STATE_ALLOCATED) {
+                user_ipcp = flow->user_ipcp;
+                port_id   = flow->port_id;
+                rcu_read_unlock();
 
-                spin_lock(&data->lock);
-                list_add(&flow->list, &data->flows);
-                spin_unlock(&data->lock);
-
-                /*FIXME: add checks */
-
-                wdata = rkzalloc(sizeof(* wdata), GFP_ATOMIC);
-                wdata->dev  = dev;
-                wdata->flow = flow;
-                wdata->data = data;
-                item  = rwq_work_create_ni(eth_rcv_worker, wdata);
-
-                rwq_work_post(rcv_wq, item);
-
-                LOG_DBG("eth_recv_process_packet added work");
-        } else {
-                gha_destroy(ghaddr);
-                LOG_DBG("Flow exists, queueing or delivering or dropping");
-                if (flow->port_id_state == PORT_STATE_ALLOCATED) {
-                        if (!flow->user_ipcp) {
-                                spin_unlock(&data->lock);
-                                LOG_ERR("Flow is being deallocated, dropping PDU");
-                                du_destroy(du);
-                                return -1;
-                        }
-
-                        spin_unlock(&data->lock);
-
-                        ASSERT(flow->user_ipcp->ops);
-                        ASSERT(flow->user_ipcp->ops->sdu_enqueue);
-                        if (flow->user_ipcp->ops->
-                            du_enqueue(flow->user_ipcp->data,
-                                       flow->port_id,
-                                       du)) {
-                                LOG_ERR("Couldn't enqueue SDU to user IPCP");
-                                return -1;
-                        }
-
-                } else if (flow->port_id_state == PORT_STATE_PENDING) {
-                        LOG_DBG("Queueing frame");
-
-                        if (rfifo_push_ni(flow->sdu_queue, du)) {
-                                LOG_ERR("Failed to write %zd bytes"
-                                        "into the fifo",
-                                        sizeof(struct sdu *));
-                                spin_unlock(&data->lock);
-                                du_destroy(du);
-                                return -1;
-                        }
-
-                        spin_unlock(&data->lock);
-                } else if (flow->port_id_state == PORT_STATE_NULL) {
-                        spin_unlock(&data->lock);
-                        du_destroy(du);
-                }
-
-                LOG_DBG("eth_recv_process_packet ends ...");
+                return eth_rcv_deliver(data, user_ipcp, port_id, du);
         }
+        rcu_read_unlock();
 
-        return 0;
+        return eth_rcv_slow_path(data, saddr, du);
 }
 
 static int eth_rcv(struct sk_buff *     skb,
                    struct net_device *  dev,
-                   struct packet_type * pt,       /* not used */
+                   struct packet_type * pt,
                    struct net_device *  orig_dev) /* not used */
 {
         ASSERT(skb);
         ASSERT(dev);
+        ASSERT(pt);
 
         LOG_DBG("eth_rcv started, skb received");
         skb = skb_share_check(skb, GFP_ATOMIC);
@@ -1615,7 +1788,8 @@ static int eth_rcv(struct sk_buff *     skb,
                 return 0;
         }
 
-        if (eth_recv_process_packet(skb, dev))
+        /* Each instance registers its own handler, no lookup needed */
+        if (eth_recv_process_packet(skb, pt->af_packet_priv))
                 LOG_DBG("Failed to process packet");
 
         LOG_DBG("eth_rcv ends");
@@ -1844,6 +2018,7 @@ static int eth_assign_to_dif(struct ipcp_instance_data * data,
         /* Add the packet handler for RINA. */
         data->eth_packet_type->type = cpu_to_be16(ETH_P_RINA);
         data->eth_packet_type->func = eth_rcv;
+        data->eth_packet_type->af_packet_priv = data;
 
         /* Store in list for retrieval later on */
         mapping = rkmalloc(sizeof(*mapping), GFP_ATOMIC);
@@ -1919,6 +2094,7 @@ static int eth_update_dif_config(struct ipcp_instance_data * data,
         /* Add the packet handler. */
         data->eth_packet_type->type = cpu_to_be16(ETH_P_RINA);
         data->eth_packet_type->func = eth_rcv;
+        data->eth_packet_type->af_packet_priv = data;
 
         /* Update the network device we use for this IPCP instance. */
         result = data->vlan_mode == VLAN_MODE_COMPAT ?
@@ -2019,6 +2195,7 @@ static struct ipcp_instance_ops eth_instance_ops = {
 
         .du_enqueue                = NULL,
         .du_write                  = eth_du_write,
+        .du_write_batch            = eth_du_write_batch,
 
         .mgmt_du_write             = NULL,
         .mgmt_du_post              = NULL,
@@ -2176,6 +2353,8 @@ static void inst_cleanup(struct ipcp_instance * inst)
                         name_destroy(inst->data->name);
                 if (inst->data->eth_packet_type)
                         rkfree(inst->data->eth_packet_type);
+                if (inst->data->rcv_stats)
+                        free_percpu(inst->data->rcv_stats);
 
                 rkfree(inst->data);
         }
@@ -2235,6 +2414,13 @@ static struct ipcp_instance* eth_create(struct ipcp_factory_data*  data,
                 return NULL;
         }
 
+        inst->data->rcv_stats = alloc_percpu(struct eth_rcv_stats);
+        if (!inst->data->rcv_stats) {
+                LOG_ERR("Could not allocate the receive counters");
+                inst_cleanup(inst);
+                return NULL;
+        }
+
         inst->data->id = id;
         inst->data->vlan_mode = VLAN_MODE_AUTO;
 
@@ -2283,6 +2469,7 @@ static struct ipcp_instance* eth_create(struct ipcp_factory_data*  data,
         spin_lock_init(&inst->data->lock);
 
         INIT_LIST_HEAD(&(inst->data->flows));
+        hash_init(inst->data->flows_by_ha);
 
         /*
          * Bind the shim-instance to the shims set, to keep all our data
@@ -2371,15 +2558,15 @@ static int eth_destroy(struct ipcp_factory_data * data,
                                 debugfs_remove(instance->data->dbg);
 #endif
 
+                        /* Stop receiving before the flows go away */
+                        if (pos->eth_packet_type->dev)
+                                dev_remove_pack(pos->eth_packet_type);
+
                         /* Destroy existing flows */
                         list_for_each_entry_safe(flow, nflow, &pos->flows, list) {
                                 unbind_and_destroy_flow(pos, flow);
                         }
 
-                        /* Remove packet handler if there is one */
-                        if (pos->eth_packet_type->dev)
-                                __dev_remove_pack(pos->eth_packet_type);
-
                         /* Unbind from the instances set */
                         list_del(&pos->list);
 
@@ -2434,14 +2621,10 @@ static int eth_destroy(struct ipcp_factory_data * data,
 
                         robject_del(&instance->robj);
 
-                        /*
-                         * Might cause problems:
-                         * The packet type might still be in use by receivers
-                         * and must not be freed until after all
-                         * the CPU's have gone through a quiescent state.
-                         */
+                        /* dev_remove_pack() waited for the receivers */
                         if (pos->eth_packet_type)
                                 rkfree(pos->eth_packet_type);
+                        free_percpu(pos->rcv_stats);
 
                         rkfree(pos);
                         rkfree(instance);
@@ -2656,6 +2839,9 @@ static void __exit mod_exit(void)
         flush_workqueue(rcv_wq);
         destroy_workqueue(rcv_wq);
 
+        /* Flows are freed after a grace period */
+        rcu_barrier();
+
 #ifdef CONFIG_DEBUG_FS
         if (eth_data.dbg)
                 debugfs_remove(eth_data.dbg);
@@ -31,8 +31,14 @@
 #include <linux/workqueue.h>
 #include <linux/mutex.h>
 #include <linux/inet.h>
+#include <linux/hashtable.h>
+#include <linux/jhash.h>
+#include <linux/kref.h>
+#include <linux/rculist.h>
+#include <linux/udp.h>
 #include <net/sock.h>
 #include <linux/version.h>
+#include <asm/unaligned.h>
 
 #define SHIM_NAME     "shim-tcp-udp"
 #define SHIM_NAME_RWQ SHIM_NAME "-rwq"
@@ -52,32 +58,47 @@
 
 #define CUBE_UNRELIABLE 0
 #define CUBE_RELIABLE   1
-#define SEND_WQ_MAX_SIZE 1000
+#define SND_QUEUE_SIZE  512
+#define FLOW_HASH_BITS  6
+
+/* Bounds of a batch of SDUs handed to a single kernel_sendmsg() */
+#define SND_BATCH_MAX   16
+#define SND_BATCH_BYTES (63 * 1024)
+
+/* Per TCP flow buffer, frames fitting in it are read in one go */
+#define RCV_BUF_SIZE     (16 * 1024)
+/* Large enough for a full UDP GRO super-datagram */
+#define RCV_GRO_BUF_SIZE (64 * 1024)
 
 static struct workqueue_struct * rcv_wq;
 static struct workqueue_struct * snd_wq;
-static struct work_struct        rcv_work;
-static struct work_struct        snd_work;
-static struct list_head          rcv_wq_data;
-static struct list_head          snd_wq_data;
-static int snd_wq_size;
-static DEFINE_SPINLOCK(rcv_wq_lock);
-static DEFINE_SPINLOCK(snd_wq_lock);
+
+/*
+ * Batching: the SDUs queued on a flow are coalesced into one
+ * kernel_sendmsg() (corked with MSG_MORE on TCP, as UDP_SEGMENT GSO
+ * segments on UDP) and UDP sockets receive GRO super-datagrams.
+ */
+static bool tcp_udp_batching = false;
+module_param(tcp_udp_batching, bool, 0444);
+MODULE_PARM_DESC(tcp_udp_batching, "Coalesce SDUs with GSO/GRO and MSG_MORE");
 
 static int parse_assign_conf(struct ipcp_instance_data * data,
                              const struct dif_config *   config);
 
-/* Structure for the workqueue */
-struct rcv_data {
-        struct list_head list;
-        struct sock *    sk;
-};
-
-struct snd_data {
-        struct list_head            list;
-        struct ipcp_instance_data * data;
-        port_id_t                   id;
-        struct du *                 du;
+/*
+ * Receive context of a socket, hung off sk_user_data while the shim owns
+ * the socket callbacks. Each socket has its own work item, so sockets are
+ * serviced in parallel while the frames of a socket stay in order. Every
+ * queued execution of the work item holds a reference.
+ */
+struct rcv_ctx {
+        struct sock *        sk;
+        void              (* data_ready)(struct sock * sk);
+        struct work_struct   work;
+        struct kref          ref;
+
+        /* UDP sockets with GRO on only */
+        char *               gro_buf;
 };
 
 /* FIXME: To be removed ABSOLUTELY */
@@ -117,6 +138,9 @@ struct reg_app_data {
 
 struct shim_tcp_udp_flow {
         struct list_head       list;
+        struct hlist_node      port_node;
+        struct hlist_node      sock_node;
+        struct rcu_head        rcu;
 
         port_id_t              port_id;
         enum port_id_state     port_id_state;
@@ -134,7 +158,19 @@ struct shim_tcp_udp_flow {
         int                    lbuf;
         struct du *            du;
 
+        /* TCP frames received but not handed over yet */
+        char *                 rbuf;
+        int                    rlen;
+
         struct ipcp_instance * user_ipcp;
+
+        /* Outgoing SDUs, drained by the flow's own work item */
+        struct ipcp_instance_data * data;
+        struct rfifo *         snd_queue;
+        struct work_struct     snd_work;
+        bool                   snd_blocked;
+        bool                   snd_dead;
+        bool                   snd_gso;
 };
 
 struct ipcp_instance_data {
@@ -149,8 +185,10 @@ struct ipcp_instance_data {
 
         struct flow_spec ** qos;
 
-        /* Stores the state of flows indexed by port_id */
+        /* Stores the state of flows, hashed by port_id and by socket */
         struct list_head    flows;
+        DECLARE_HASHTABLE(flows_by_port, FLOW_HASH_BITS);
+        DECLARE_HASHTABLE(flows_by_sock, FLOW_HASH_BITS);
 
         /* Holds reg_app_data, e.g. the registered applications */
         struct list_head    reg_apps;
@@ -272,6 +310,20 @@ static unsigned sockaddr_copy(union address * src, union address * dst)
 	unreachable();
 }
 
+/* Hashes the fields compared by sockaddr_is_equal() */
+static u32 sockaddr_hash(const union address * a, u32 seed)
+{
+	switch (a->family) {
+	case AF_INET:
+		return jhash_2words(a->in.sin_addr.s_addr, a->in.sin_port,
+				    seed);
+	case AF_INET6:
+		return jhash2(a->in6.sin6_addr.s6_addr32, 4,
+			      seed ^ a->in6.sin6_port);
+	}
+	unreachable();
+}
+
 static ssize_t shim_tcp_udp_ipcp_sysfs_show(struct kobject *   kobj,
 					    struct attribute * attr,
 					    char *             buf)
@@ -444,6 +496,35 @@ static struct exp_reg * find_exp_reg(struct ipcp_instance_data * data,
         return NULL;
 }
 
+/*
+ * TCP flows own their socket and are keyed by it alone, UDP flows on the
+ * server side share the application socket and are keyed by peer too
+ */
+static u32 flow_sock_key(const struct socket * sock,
+                         const union address * addr)
+{
+        u32 key = hash_ptr(sock, 32);
+
+        return addr ? sockaddr_hash(addr, key) : key;
+}
+
+/* Called with data->lock held */
+static void flow_hash_port(struct ipcp_instance_data * data,
+                           struct shim_tcp_udp_flow *  flow)
+{
+        list_add(&flow->list, &data->flows);
+        hash_add_rcu(data->flows_by_port, &flow->port_node, flow->port_id);
+}
+
+/* Called with data->lock held, once flow->sock and flow->addr are set */
+static void flow_hash_sock(struct ipcp_instance_data * data,
+                           struct shim_tcp_udp_flow *  flow)
+{
+        hash_add(data->flows_by_sock, &flow->sock_node,
+                 flow_sock_key(flow->sock,
+                               flow->fspec_id ? NULL : &flow->addr));
+}
+
 static struct shim_tcp_udp_flow *
 find_flow_by_port(struct ipcp_instance_data * data,
                   port_id_t                   id)
@@ -455,7 +536,7 @@ find_flow_by_port(struct ipcp_instance_data * data,
 
         spin_lock_bh(&data->lock);
 
-        list_for_each_entry(flow, &data->flows, list) {
+        hash_for_each_possible(data->flows_by_port, flow, port_node, id) {
                 if (flow->port_id == id) {
                         spin_unlock_bh(&data->lock);
                         return flow;
@@ -467,6 +548,7 @@ find_flow_by_port(struct ipcp_instance_data * data,
         return NULL;
 }
 
+/* Only TCP flows are keyed by their socket alone */
 static struct shim_tcp_udp_flow *
 find_flow_by_socket(struct ipcp_instance_data * data,
                     const struct socket *       sock)
@@ -477,8 +559,9 @@ find_flow_by_socket(struct ipcp_instance_data * data,
 
         spin_lock_bh(&data->lock);
 
-        list_for_each_entry(flow, &data->flows, list) {
-                if (flow->sock == sock) {
+        hash_for_each_possible(data->flows_by_sock, flow, sock_node,
+                               flow_sock_key(sock, NULL)) {
+                if (flow->sock == sock && flow->fspec_id) {
                         spin_unlock_bh(&data->lock);
                         return flow;
                 }
@@ -501,8 +584,9 @@ find_udp_flow(struct ipcp_instance_data * data,
         ASSERT(addr);
         ASSERT(sock);
 
-        list_for_each_entry(flow, &data->flows, list) {
-                if (flow->sock == sock &&
+        hash_for_each_possible(data->flows_by_sock, flow, sock_node,
+                               flow_sock_key(sock, addr)) {
+                if (flow->sock == sock && !flow->fspec_id &&
                     sockaddr_is_equal(addr, &flow->addr)) {
                         return flow;
                 }
@@ -567,6 +651,163 @@ static struct reg_app_data * find_app_by_name(struct ipcp_instance_data * data,
         return NULL;
 }
 
+static void rcv_ctx_release(struct kref * ref)
+{
+        struct rcv_ctx * ctx = container_of(ref, struct rcv_ctx, ref);
+
+        if (ctx->gro_buf)
+                rkfree(ctx->gro_buf);
+        rkfree(ctx);
+}
+
+static void tcp_udp_rcv(struct sock * sk)
+{
+        struct rcv_ctx * ctx;
+
+        if (!sk) {
+                LOG_ERR("Bad socket passed to callback, bailing out");
+                return;
+        }
+        LOG_DBG("Callback on socket %pK", sk->sk_socket);
+
+        read_lock_bh(&sk->sk_callback_lock);
+        ctx = sk->sk_user_data;
+        if (ctx) {
+                kref_get(&ctx->ref);
+                if (!queue_work(rcv_wq, &ctx->work))
+                        kref_put(&ctx->ref, rcv_ctx_release);
+        }
+        read_unlock_bh(&sk->sk_callback_lock);
+}
+
+static void tcp_udp_rcv_worker(struct work_struct * work);
+
+static int udp_setsockopt_int(struct socket * sock, int optname, int val)
+{
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,8,0)
+        return kernel_setsockopt(sock, SOL_UDP, optname,
+                                 (char *) &val, sizeof(val));
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(5,9,0)
+        return sock->ops->setsockopt(sock, SOL_UDP, optname,
+                                     KERNEL_SOCKPTR(&val), sizeof(val));
+#else
+        return -EOPNOTSUPP;
+#endif
+}
+
+/* Returns the buffer GRO super-datagrams are received in, if enabled */
+static char * udp_gro_enable(struct socket * sock)
+{
+#ifdef UDP_GRO
+        char * buf;
+
+        buf = rkmalloc(RCV_GRO_BUF_SIZE, GFP_KERNEL);
+        if (!buf)
+                return NULL;
+
+        if (udp_setsockopt_int(sock, UDP_GRO, 1)) {
+                LOG_DBG("UDP GRO not available on socket %pK", sock);
+                rkfree(buf);
+                return NULL;
+        }
+
+        return buf;
+#else
+        return NULL;
+#endif
+}
+
+static int tcp_udp_sock_attach(struct socket * sock)
+{
+        struct sock *    sk = sock->sk;
+        struct rcv_ctx * ctx;
+
+        ctx = rkzalloc(sizeof(*ctx), GFP_KERNEL);
+        if (!ctx) {
+                LOG_ERR("Could not allocate receive context");
+                return -1;
+        }
+
+        ctx->sk = sk;
+        INIT_WORK(&ctx->work, tcp_udp_rcv_worker);
+        kref_init(&ctx->ref);
+
+        if (tcp_udp_batching && sock->type == SOCK_DGRAM)
+                ctx->gro_buf = udp_gro_enable(sock);
+
+        write_lock_bh(&sk->sk_callback_lock);
+        ctx->data_ready   = sk->sk_data_ready;
+        sk->sk_user_data  = ctx;
+        sk->sk_data_ready = tcp_udp_rcv;
+        write_unlock_bh(&sk->sk_callback_lock);
+
+        return 0;
+}
+
+/*
+ * Gives the socket callbacks back. Unless called from the socket's own
+ * work item (sync == false), waits for the work item to be done with it.
+ */
+static void tcp_udp_sock_detach(struct socket * sock, bool sync)
+{
+        struct sock *    sk = sock->sk;
+        struct rcv_ctx * ctx;
+
+        write_lock_bh(&sk->sk_callback_lock);
+        if (sk->sk_data_ready != tcp_udp_rcv) {
+                write_unlock_bh(&sk->sk_callback_lock);
+                return;
+        }
+        ctx = sk->sk_user_data;
+        sk->sk_data_ready = ctx->data_ready;
+        sk->sk_user_data  = NULL;
+        WRITE_ONCE(ctx->sk, NULL);
+        write_unlock_bh(&sk->sk_callback_lock);
+
+        if (sync && cancel_work_sync(&ctx->work))
+                kref_put(&ctx->ref, rcv_ctx_release);
+        kref_put(&ctx->ref, rcv_ctx_release);
+}
+
+static void tcp_udp_sock_release(struct socket * sock)
+{
+        tcp_udp_sock_detach(sock, true);
+        sock_release(sock);
+}
+
+static void tcp_udp_write_worker(struct work_struct * work);
+
+static struct shim_tcp_udp_flow * flow_create(struct ipcp_instance_data * data,
+                                              gfp_t                       flags)
+{
+        struct shim_tcp_udp_flow * flow;
+
+        flow = rkzalloc(sizeof(*flow), flags);
+        if (!flow)
+                return NULL;
+
+        flow->snd_queue = (flags == GFP_KERNEL) ?
+                rfifo_create_ring(SND_QUEUE_SIZE, RFIFO_SPSC) :
+                rfifo_create_ring_ni(SND_QUEUE_SIZE, RFIFO_SPSC);
+        if (!flow->snd_queue) {
+                rkfree(flow);
+                return NULL;
+        }
+
+        flow->data    = data;
+        flow->snd_gso = tcp_udp_batching;
+        spin_lock_init(&flow->lock);
+        INIT_LIST_HEAD(&flow->list);
+        INIT_HLIST_NODE(&flow->port_node);
+        INIT_HLIST_NODE(&flow->sock_node);
+        INIT_WORK(&flow->snd_work, tcp_udp_write_worker);
+
+        return flow;
+}
+
+static void flow_free_rcu(struct rcu_head * head)
+{ rkfree(container_of(head, struct shim_tcp_udp_flow, rcu)); }
+
 static int flow_destroy(struct ipcp_instance_data * data,
                         struct shim_tcp_udp_flow *  flow)
 {
@@ -575,13 +816,26 @@ static int flow_destroy(struct ipcp_instance_data * data,
 
         spin_lock(&data->lock);
         if (!list_empty(&flow->list))
-                list_del(&flow->list);
+                list_del_init(&flow->list);
+        hash_del_rcu(&flow->port_node);
+        hash_del(&flow->sock_node);
         spin_unlock(&data->lock);
 
+        /* Writers still holding the flow back off, then drain what's left */
+        spin_lock_bh(&flow->lock);
+        flow->snd_dead = true;
+        spin_unlock_bh(&flow->lock);
+        cancel_work_sync(&flow->snd_work);
+        rfifo_destroy(flow->snd_queue, (void (*)(void *)) du_destroy);
+
         /* FIXME: Check for leaks */
         if (flow->sdu_queue)
                 rfifo_destroy(flow->sdu_queue, (void (*)(void *)) du_destroy);
-        rkfree(flow);
+        if (flow->du)
+                du_destroy(flow->du);
+        if (flow->rbuf)
+                rkfree(flow->rbuf);
+        call_rcu(&flow->rcu, flow_free_rcu);
 
         return 0;
 }
@@ -633,37 +887,11 @@ static int tcp_unbind_and_destroy_flow(struct ipcp_instance_data * data,
         ASSERT(data);
         ASSERT(flow);
 
-        sock_release(flow->sock);
+        tcp_udp_sock_release(flow->sock);
 
         return unbind_and_destroy_flow(data, flow);
 }
 
-static void tcp_udp_rcv(struct sock * sk)
-{
-        struct rcv_data * recvd;
-
-        if (!sk) {
-                LOG_ERR("Bad socket passed to callback, bailing out");
-                return;
-        }
-        LOG_DBG("Callback on socket %pK", sk->sk_socket);
-
-        recvd = rkmalloc(sizeof(struct rcv_data), GFP_ATOMIC);
-        if (!recvd) {
-                LOG_ERR("Could not allocate rcv_data");
-                return;
-        }
-
-        recvd->sk = sk;
-        INIT_LIST_HEAD(&recvd->list);
-
-        spin_lock(&rcv_wq_lock);
-        list_add_tail(&recvd->list, &rcv_wq_data);
-        spin_unlock(&rcv_wq_lock);
-
-        queue_work(rcv_wq, &rcv_work);
-}
-
 static int
 tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                               struct ipcp_instance *      user_ipcp,
@@ -686,7 +914,7 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
 
         flow = find_flow_by_port(data, id);
         if (!flow) {
-                flow = rkzalloc(sizeof(*flow), GFP_KERNEL);
+                flow = flow_create(data, GFP_KERNEL);
                 if (!flow) {
                         LOG_ERR("Could not allocate memory for flow");
                         return -1;
@@ -696,9 +924,8 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                 flow->port_id_state = PORT_STATE_PENDING;
                 flow->user_ipcp     = user_ipcp;
 
-                INIT_LIST_HEAD(&flow->list);
                 spin_lock(&data->lock);
-                list_add(&flow->list, &data->flows);
+                flow_hash_port(data, flow);
                 spin_unlock(&data->lock);
                 LOG_DBG("Allocate request flow added");
 
@@ -707,8 +934,7 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                 if (!entry) {
                         LOG_ERR("Directory entry not found for <APN=%s AEN=%s>",
                                 dest->process_name, dest->entity_name);
-                        list_del(&flow->list);
-                        rkfree(flow);
+                        flow_destroy(data, flow);
                         return -1;
                 }
                 LOG_DBG("Directory entry found");
@@ -742,12 +968,15 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                                 return -1;
                         }
 
-                        write_lock_bh(&flow->sock->sk->sk_callback_lock);
-                        flow->sock->sk->sk_user_data  =
-                                flow->sock->sk->sk_data_ready;
-                        flow->sock->sk->sk_data_ready =
-                                tcp_udp_rcv;
-                        write_unlock_bh(&flow->sock->sk->sk_callback_lock);
+                        spin_lock(&data->lock);
+                        flow_hash_sock(data, flow);
+                        spin_unlock(&data->lock);
+
+                        if (tcp_udp_sock_attach(flow->sock)) {
+                                sock_release(flow->sock);
+                                unbind_and_destroy_flow(data, flow);
+                                return -1;
+                        }
                 } else {
                         LOG_DBG("Reliable flow requested");
                         flow->fspec_id = 1;
@@ -774,12 +1003,15 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                                 return -1;
                         }
 
-                        write_lock_bh(&flow->sock->sk->sk_callback_lock);
-                        flow->sock->sk->sk_user_data  =
-                                flow->sock->sk->sk_data_ready;
-                        flow->sock->sk->sk_data_ready =
-                                tcp_udp_rcv;
-                        write_unlock_bh(&flow->sock->sk->sk_callback_lock);
+                        spin_lock(&data->lock);
+                        flow_hash_sock(data, flow);
+                        spin_unlock(&data->lock);
+
+                        if (tcp_udp_sock_attach(flow->sock)) {
+                                sock_release(flow->sock);
+                                unbind_and_destroy_flow(data, flow);
+                                return -1;
+                        }
                 }
 
                 flow->port_id_state = PORT_STATE_ALLOCATED;
@@ -788,7 +1020,7 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                         LOG_ERR("KIPCM could not retrieve this IPCP");
                         if (fspec->ordered_delivery) {
                                 kernel_sock_shutdown(flow->sock, SHUT_RDWR);
-                                sock_release(flow->sock);
+                                tcp_udp_sock_release(flow->sock);
                         }
                         unbind_and_destroy_flow(data, flow);
                         return -1;
@@ -804,7 +1036,7 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                         LOG_ERR("Could not bind flow with user_ipcp");
                         if (fspec->ordered_delivery) {
                                 kernel_sock_shutdown(flow->sock, SHUT_RDWR);
-                                sock_release(flow->sock);
+                                tcp_udp_sock_release(flow->sock);
                         }
                         unbind_and_destroy_flow(data, flow);
                         return -1;
@@ -821,7 +1053,7 @@ tcp_udp_flow_allocate_request(struct ipcp_instance_data * data,
                         LOG_ERR("Couldn't tell flow is allocated to KIPCM");
                         if (fspec->ordered_delivery) {
                                 kernel_sock_shutdown(flow->sock, SHUT_RDWR);
-                                sock_release(flow->sock);
+                                tcp_udp_sock_release(flow->sock);
                         }
                         unbind_and_destroy_flow(data, flow);
                         return -1;
@@ -946,7 +1178,7 @@ tcp_udp_flow_allocate_response(struct ipcp_instance_data * data,
                  * don't want to close this socket
                  */
                 if (!app)
-                        sock_release(flow->sock);
+                        tcp_udp_sock_release(flow->sock);
 
                 /*
                  *  If we would destroy the flow, the application
@@ -967,26 +1199,18 @@ static int flow_deallocate(struct ipcp_instance_data * data,
 			   struct shim_tcp_udp_flow * flow)
 {
         struct reg_app_data *      app;
-        struct rcv_data *          recvd;
 
 	ASSERT(data);
 	ASSERT(flow);
 
         app = find_app_by_socket(data, flow->sock);
 
+        /* Stop the socket's work item before closing it under its feet */
+        if (!app)
+                tcp_udp_sock_detach(flow->sock, true);
+
         if ( (flow->fspec_id == 1 || (flow->fspec_id == 0 && !app)) &&
             flow->port_id_state == PORT_STATE_ALLOCATED) {
-
-                /* FIXME: better cleanup (= removing from list) */
-                spin_lock_bh(&rcv_wq_lock);
-                list_for_each_entry(recvd, &rcv_wq_data, list) {
-                        if (recvd->sk->sk_socket == flow->sock) {
-                                LOG_DBG("Setting socket to NULL");
-                                recvd->sk = NULL;
-                        }
-                }
-                spin_unlock_bh(&rcv_wq_lock);
-
                 LOG_DBG("Closing socket");
                 kernel_sock_shutdown(flow->sock, SHUT_RDWR);
         }
@@ -1078,44 +1302,20 @@ int send_msg(struct socket *      sock,
         return size;
 }
 
-static int udp_process_msg(struct ipcp_instance_data * data,
-                           struct socket *             sock)
+/* Hands an SDU received from addr on sock over to its flow */
+static int udp_deliver_du(struct ipcp_instance_data * data,
+                          struct socket *             sock,
+                          union address *             addr,
+                          struct du *                 du)
 {
         struct shim_tcp_udp_flow *  flow;
-        union address               addr;
         struct reg_app_data *       app;
         struct name *               sname;
-        struct du *                 du;
-        int                         size;
         struct ipcp_instance      * ipcp, * user_ipcp;
         char			    api_string[12];
 
-	/* Create SDU with max allowable size removing PCI and TAIL room */
-	du = du_create_ni(CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE);
-        if (!du) {
-                LOG_ERR("Couldn't create sdu");
-                return -1;
-        }
-
-        if ((size = recv_msg(sock, &addr, sizeof(addr),
-                             du_buffer(du),
-			     CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE)) < 0) {
-                if (size != -EAGAIN)
-                        LOG_ERR("Error during UDP recv: %d", size);
-                du_destroy(du);
-                return -1;
-        }
-
-        LOG_DBG("Received message of %d bytes", size);
-
-	if (du_shrink(du, CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE - size)) {
-		LOG_ERR("Could not shrink SDU");
-		du_destroy(du);
-		return -1;
-	}
-
         spin_lock_bh(&data->lock);
-        flow = find_udp_flow(data, &addr, sock);
+        flow = find_udp_flow(data, addr, sock);
         if (!flow) {
                 spin_unlock_bh(&data->lock);
                 LOG_DBG("No flow found, creating it");
@@ -1141,7 +1341,7 @@ static int udp_process_msg(struct ipcp_instance_data * data,
                         return -1;
                 }
 
-                flow = rkzalloc(sizeof(*flow), GFP_ATOMIC);
+                flow = flow_create(data, GFP_ATOMIC);
                 if (!flow) {
                         LOG_ERR("Could not allocate flow");
                         du_destroy(du);
@@ -1154,7 +1354,7 @@ static int udp_process_msg(struct ipcp_instance_data * data,
                 flow->sock          = sock;
                 flow->fspec_id      = 0;
 
-                sockaddr_copy(&addr, &flow->addr);
+                sockaddr_copy(addr, &flow->addr);
 
                 if (!is_port_id_ok(flow->port_id)) {
                         LOG_ERR("Port id is not ok");
@@ -1165,8 +1365,8 @@ static int udp_process_msg(struct ipcp_instance_data * data,
                 }
 
                 spin_lock_bh(&data->lock);
-                INIT_LIST_HEAD(&flow->list);
-                list_add(&flow->list, &data->flows);
+                flow_hash_port(data, flow);
+                flow_hash_sock(data, flow);
                 spin_unlock_bh(&data->lock);
                 LOG_DBG("Added UDP flow");
 
@@ -1297,115 +1497,234 @@ static int udp_process_msg(struct ipcp_instance_data * data,
                 }
         }
 
-        return size;
+        return 0;
 }
 
-static int tcp_recv_new_message(struct ipcp_instance_data * data,
-                                struct socket *             sock,
-                                struct shim_tcp_udp_flow *  flow)
-{
-        struct du *    du;
-        char            sbuf[2];
-        int             size;
-        __be16          nlen;
+#ifdef UDP_GRO
+/*
+ * Receives a GRO super-datagram, i.e. back to back datagrams of a peer
+ * coalesced by the stack, and splits it back into SDUs
+ */
+static int udp_recv_gro(struct ipcp_instance_data * data,
+                        struct socket *             sock,
+                        char *                      buf)
+{
+        union {
+                struct cmsghdr hdr;
+                char           buf[CMSG_SPACE(sizeof(int))];
+        }                           ctl;
+        union address               addr;
+        struct msghdr               msg;
+        struct kvec                 iov;
+        struct du *                 du;
+        int                         size, seg, off, len;
 
-        size = recv_msg(sock, NULL, 0, sbuf, 2);
-        if (size <= 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name       = &addr;
+        msg.msg_namelen    = sizeof(addr);
+        msg.msg_control    = &ctl;
+        msg.msg_controllen = sizeof(ctl);
+
+        iov.iov_base = buf;
+        iov.iov_len  = RCV_GRO_BUF_SIZE;
+
+        size = kernel_recvmsg(sock, &msg, &iov, 1, RCV_GRO_BUF_SIZE,
+                              MSG_DONTWAIT);
+        if (size < 0) {
+                if (size != -EAGAIN)
+                        LOG_ERR("Error during UDP recv: %d", size);
                 return size;
         }
 
-        if (size != 2) {
-                LOG_DBG("Didn't read both bytes for size %d", size);
+        /* put_cmsg() consumed part of the control buffer if GRO kicked in */
+        seg = size;
+        if (msg.msg_controllen < sizeof(ctl) &&
+            ctl.hdr.cmsg_level == SOL_UDP && ctl.hdr.cmsg_type == UDP_GRO)
+                seg = *(int *) CMSG_DATA(&ctl.hdr);
+        if (seg <= 0)
+                seg = size;
 
-                /*
-                 * Shim can't function correct when only one size byte is read,
-                 * loop till the second byte is received
-                 */
-                size = -EAGAIN;
-                while (size == -EAGAIN) {
-                        size = recv_msg(sock, NULL, 0, &sbuf[1], 1);
-                        if (size != -EAGAIN && size <= 0) {
-                                LOG_ERR("Can't read 2nd size byte %d", size);
-                                return size;
-                        }
+        LOG_DBG("Received %d bytes in segments of %d", size, seg);
+
+        for (off = 0; off < size; off += len) {
+                len = min(seg, size - off);
+
+                du = du_create_ni(len);
+                if (!du) {
+                        LOG_ERR("Couldn't create sdu");
+                        return -1;
                 }
+                memcpy(du_buffer(du), buf + off, len);
+
+                if (udp_deliver_du(data, sock, &addr, du))
+                        return -1;
         }
 
-        memcpy(&nlen, &sbuf[0], 2);
-        flow->bytes_left = (int) ntohs(nlen);
-        LOG_DBG("Incoming message is %d bytes long", flow->bytes_left);
+        return size;
+}
+#endif
+
+static int udp_process_msg(struct ipcp_instance_data * data,
+                           struct socket *             sock,
+                           char *                      gro_buf)
+{
+        union address               addr;
+        struct du *                 du;
+        int                         size;
+
+#ifdef UDP_GRO
+        if (gro_buf)
+                return udp_recv_gro(data, sock, gro_buf);
+#endif
 
-	du = du_create_ni(flow->bytes_left);
+	/* Create SDU with max allowable size removing PCI and TAIL room */
+	du = du_create_ni(CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE);
         if (!du) {
                 LOG_ERR("Couldn't create sdu");
                 return -1;
         }
 
-        size = recv_msg(sock, NULL, 0, du_buffer(du), flow->bytes_left);
-        if (size <= 0) {
-                if (size != -EAGAIN) {
-                        LOG_ERR("Error during TCP receive (%d)", size);
-                        du_destroy(du);
-                }
-
-                flow->lbuf = flow->bytes_left;
-                flow->du = du;
-                return size;
+        if ((size = recv_msg(sock, &addr, sizeof(addr),
+                             du_buffer(du),
+			     CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE)) < 0) {
+                if (size != -EAGAIN)
+                        LOG_ERR("Error during UDP recv: %d", size);
+                du_destroy(du);
+                return -1;
         }
 
-        if (size == flow->bytes_left) {
-                flow->bytes_left = 0;
-                spin_lock_bh(&data->lock);
-                if (flow->port_id_state == PORT_STATE_ALLOCATED) {
-                        spin_unlock_bh(&data->lock);
+        LOG_DBG("Received message of %d bytes", size);
 
-                        if (!flow->user_ipcp) {
-                        	LOG_ERR("Flow is being deallocated, dropping SDU");
-                        	du_destroy(du);
-                        	return -1;
-                        }
+	if (du_shrink(du, CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE - size)) {
+		LOG_ERR("Could not shrink SDU");
+		du_destroy(du);
+		return -1;
+	}
 
-                        ASSERT(flow->user_ipcp->ops);
-                        ASSERT(flow->user_ipcp->ops->sdu_enqueue);
+        if (udp_deliver_du(data, sock, &addr, du))
+                return -1;
 
-                        if (flow->user_ipcp->ops->
-                            du_enqueue(flow->user_ipcp->data,
-                                        flow->port_id,
-                                        du)) {
-                                LOG_ERR("Couldn't enqueue SDU to user IPCP");
-                                return -1;
-                        }
-                } else if (flow->port_id_state == PORT_STATE_PENDING) {
-                        LOG_DBG("Port is PENDING, "
-                                "queueing frame in SDU queue");
+        return size;
+}
 
-                        if (rfifo_push_ni(flow->sdu_queue, du)) {
-                                spin_unlock_bh(&data->lock);
+/* Hands a complete SDU of a TCP flow over */
+static int tcp_deliver_du(struct ipcp_instance_data * data,
+                          struct shim_tcp_udp_flow *  flow,
+                          struct du *                 du)
+{
+        spin_lock_bh(&data->lock);
+        if (flow->port_id_state == PORT_STATE_ALLOCATED) {
+                spin_unlock_bh(&data->lock);
 
-                                LOG_ERR("Failed to write %zd bytes"
-                                        "into the fifo",
-                                        sizeof(struct sdu *));
+                if (!flow->user_ipcp) {
+                        LOG_ERR("Flow is being deallocated, dropping SDU");
+                        du_destroy(du);
+                        return -1;
+                }
 
-                                du_destroy(du);
-                                return -1;
-                        }
+                ASSERT(flow->user_ipcp->ops);
+                ASSERT(flow->user_ipcp->ops->du_enqueue);
 
+                if (flow->user_ipcp->ops->
+                    du_enqueue(flow->user_ipcp->data,
+                                flow->port_id,
+                                du)) {
+                        LOG_ERR("Couldn't enqueue SDU to user IPCP");
+                        return -1;
+                }
+        } else if (flow->port_id_state == PORT_STATE_PENDING) {
+                LOG_DBG("Port is PENDING, "
+                        "queueing frame in SDU queue");
+
+                if (rfifo_push_ni(flow->sdu_queue, du)) {
                         spin_unlock_bh(&data->lock);
-                } else if (flow->port_id_state == PORT_STATE_NULL) {
-                        spin_unlock_bh(&data->lock);
+
+                        LOG_ERR("Failed to write %zd bytes"
+                                "into the fifo",
+                                sizeof(struct du *));
+
                         du_destroy(du);
+                        return -1;
                 }
 
-                return size;
+                spin_unlock_bh(&data->lock);
         } else {
-                LOG_DBG("Didn't receive complete message, missing %d bytes", flow->bytes_left);
+                spin_unlock_bh(&data->lock);
+                du_destroy(du);
+        }
 
-                flow->lbuf = flow->bytes_left;
-                flow->bytes_left = flow->bytes_left - size;
-                flow->du = du;
+        return 0;
+}
 
-                return -1;
+/*
+ * Receives as much of the stream as fits in the flow's buffer with a
+ * single kernel_recvmsg() and hands over every complete frame in it. The
+ * remainder of a frame that did not fit is received straight into its
+ * DU by tcp_recv_partial_message().
+ */
+static int tcp_recv_frames(struct ipcp_instance_data * data,
+                           struct socket *             sock,
+                           struct shim_tcp_udp_flow *  flow)
+{
+        struct du * du;
+        char *      p, * end;
+        int         size, len, avail;
+
+        if (!flow->rbuf) {
+                flow->rbuf = rkmalloc(RCV_BUF_SIZE, GFP_KERNEL);
+                if (!flow->rbuf) {
+                        LOG_ERR("Could not allocate receive buffer");
+                        return -1;
+                }
         }
+
+        size = recv_msg(sock, NULL, 0, flow->rbuf + flow->rlen,
+                        RCV_BUF_SIZE - flow->rlen);
+        if (size <= 0)
+                return size;
+
+        p   = flow->rbuf;
+        end = p + flow->rlen + size;
+        while (end - p >= 2) {
+                len   = get_unaligned_be16(p);
+                avail = end - p - 2;
+                p    += 2;
+
+                LOG_DBG("Incoming message is %d bytes long", len);
+
+                if (!len)
+                        continue;
+
+                du = du_create_ni(len);
+                if (!du) {
+                        LOG_ERR("Couldn't create sdu");
+                        flow->rlen = 0;
+                        return -1;
+                }
+
+                if (avail >= len) {
+                        memcpy(du_buffer(du), p, len);
+                        p += len;
+                        tcp_deliver_du(data, flow, du);
+                        continue;
+                }
+
+                LOG_DBG("Didn't receive complete message, missing %d bytes",
+                        len - avail);
+
+                memcpy(du_buffer(du), p, avail);
+                p += avail;
+
+                flow->du         = du;
+                flow->lbuf       = len;
+                flow->bytes_left = len - avail;
+        }
+
+        /* Keep a split length prefix for the next round */
+        flow->rlen = end - p;
+        memmove(flow->rbuf, p, flow->rlen);
+
+        return size;
 }
 
 static int tcp_recv_partial_message(struct ipcp_instance_data * data,
@@ -1428,43 +1747,8 @@ static int tcp_recv_partial_message(struct ipcp_instance_data * data,
                 flow->bytes_left = 0;
 		du = flow->du;
 		flow->du = NULL;
-                spin_lock_bh(&data->lock);
-                if (flow->port_id_state == PORT_STATE_ALLOCATED) {
-                        spin_unlock_bh(&data->lock);
 
-                        if (!flow->user_ipcp) {
-                        	LOG_ERR("Flow is being deallocated, dropping SDU");
-                        	du_destroy(du);
-                        	return -1;
-                        }
-
-                        if (flow->user_ipcp->ops->
-                            du_enqueue(flow->user_ipcp->data,
-                                        flow->port_id,
-                                        du)) {
-                                LOG_ERR("Couldn't enqueue SDU to user IPCP");
-                                return -1;
-                        }
-                } else if (flow->port_id_state == PORT_STATE_PENDING) {
-                        LOG_DBG("Port is PENDING, "
-                                "queueing frame in SDU queue");
-
-                        if (rfifo_push_ni(flow->sdu_queue, du)) {
-                                spin_unlock_bh(&data->lock);
-
-                                LOG_ERR("Failed to write %zd bytes"
-                                        "into the fifo",
-                                        sizeof(struct du *));
-
-                                du_destroy(du);
-                                return -1;
-                        }
-
-                        spin_unlock_bh(&data->lock);
-                } else if (flow->port_id_state == PORT_STATE_NULL) {
-                        spin_unlock_bh(&data->lock);
-                        du_destroy(du);
-                }
+                tcp_deliver_du(data, flow, du);
 
                 return size;
         } else {
@@ -1480,7 +1764,6 @@ static int tcp_process_msg(struct ipcp_instance_data * data,
                            struct socket *             sock)
 {
         struct shim_tcp_udp_flow * flow;
-        struct rcv_data *          recvd;
         int                        size;
 
         ASSERT(data);
@@ -1494,7 +1777,7 @@ static int tcp_process_msg(struct ipcp_instance_data * data,
         }
 
         if (flow->bytes_left == 0)
-                size = tcp_recv_new_message(data, sock, flow);
+                size = tcp_recv_frames(data, sock, flow);
         else
                 size = tcp_recv_partial_message(data, sock, flow);
 
@@ -1509,49 +1792,154 @@ static int tcp_process_msg(struct ipcp_instance_data * data,
                         LOG_DBG("Port was PENDING");
                 }
 
-                write_lock_bh(&flow->sock->sk->sk_callback_lock);
-                flow->sock->sk->sk_data_ready = flow->sock->sk->sk_user_data;
-                flow->sock->sk->sk_user_data  = NULL;
-                write_unlock_bh(&flow->sock->sk->sk_callback_lock);
+                /* We run on the socket's own work item, don't wait on it */
+                tcp_udp_sock_detach(flow->sock, false);
+                sock_release(flow->sock);
 
-                /* FIXME: better cleanup */
-                spin_lock_bh(&rcv_wq_lock);
-                list_for_each_entry(recvd, &rcv_wq_data, list) {
-                        if (recvd->sk->sk_socket == flow->sock)
-                                recvd->sk = NULL;
+                /* FIXME: remove the msleep */
+                while (flow->sdu_queue != NULL) {
+                        LOG_DBG("Waiting the SDU queue to become empty ...");
+                        msleep(2);
                 }
-                spin_unlock_bh(&rcv_wq_lock);
 
-                sock_release(flow->sock);
+                LOG_DBG("Notifying KIPCM about deallocate");
+                kipcm_notify_flow_dealloc(data->id, 0, flow->port_id, 1);
+                kfa_port_id_release(data->kfa, flow->port_id);
+                unbind_and_destroy_flow(data, flow);
+
+                return 0;
+        }
+
+        LOG_DBG("Got message of %d bytes", size);
+
+        return size;
+}
+
+/* Sets up a flow for a connection accepted on a registered app's socket */
+static int tcp_accept_flow(struct ipcp_instance_data * data,
+                           struct reg_app_data *       app,
+                           struct socket *             acsock)
+{
+        struct shim_tcp_udp_flow * flow;
+        struct name *              sname;
+        struct ipcp_instance     * ipcp, * user_ipcp;
+        char	   		   api_string[12];
+
+        flow = flow_create(data, GFP_KERNEL);
+        if (!flow) {
+                LOG_ERR("Could not allocate flow");
+
+                sock_release(acsock);
+                return -1;
+        }
+
+        user_ipcp = kipcm_find_ipcp_by_name(default_kipcm,
+                                            app->app_name);
+        if (!user_ipcp)
+                user_ipcp = kfa_ipcp_instance(data->kfa);
+        ASSERT(user_ipcp);
+
+        ipcp = kipcm_find_ipcp(default_kipcm, data->id);
+
+        flow->port_id_state = PORT_STATE_PENDING;
+        flow->fspec_id      = 1;
+        flow->port_id       = kfa_port_id_reserve(data->kfa, data->id);
+        flow->sock          = acsock;
+
+        if (!is_port_id_ok(flow->port_id)) {
+                flow->port_id_state = PORT_STATE_NULL;
+                LOG_ERR("Port id is not ok");
+
+                sock_release(acsock);
+                if (flow_destroy(data, flow))
+                        LOG_ERR("Problems destroying flow");
+
+                return -1;
+        }
+
+        spin_lock_bh(&data->lock);
+        flow_hash_port(data, flow);
+        flow_hash_sock(data, flow);
+        spin_unlock_bh(&data->lock);
+        LOG_DBG("TCP flow added");
+
+        if (!user_ipcp->ops->ipcp_name(user_ipcp->data)) {
+                LOG_DBG("This flow goes for an app");
+                if (kfa_flow_create(data->kfa, flow->port_id, ipcp,
+                		    data->id, NULL, false)) {
+                        LOG_ERR("Could not create flow in KFA");
+                        kfa_port_id_release(data->kfa, flow->port_id);
+                        if (flow_destroy(data, flow))
+                                LOG_ERR("Problems destroying flow");
+                        return -1;
+                }
+        }
+
+        flow->sdu_queue = rfifo_create_ni();
+        if (!flow->sdu_queue) {
+                LOG_ERR("Couldn't create the sdu queue "
+                        "for a new flow");
+                kfa_port_id_release(data->kfa, flow->port_id);
+                tcp_unbind_and_destroy_flow(data, flow);
+                return -1;
+        }
+
+        LOG_DBG("Queue has been created");
+
+        /*
+         * The socket gets its own work item only now that the flow
+         * can take SDUs, kick it for what arrived in the meantime
+         */
+        if (tcp_udp_sock_attach(acsock)) {
+                kfa_port_id_release(data->kfa, flow->port_id);
+                tcp_unbind_and_destroy_flow(data, flow);
+                return -1;
+        }
+        tcp_udp_rcv(acsock->sk);
 
-                /* FIXME: remove the msleep */
-                while (flow->sdu_queue != NULL) {
-                        LOG_DBG("Waiting the SDU queue to become empty ...");
-                        msleep(2);
-                }
+        if (sprintf(&api_string[0], "%d", flow->port_id) < 0){
+        	kfa_port_id_release(data->kfa, flow->port_id);
+        	unbind_and_destroy_flow(data, flow);
+                return -1;
+        }
 
-                LOG_DBG("Notifying KIPCM about deallocate");
-                kipcm_notify_flow_dealloc(data->id, 0, flow->port_id, 1);
+        sname = name_create_ni();
+        if (!name_init_from_ni(sname,
+        		       "Unknown app",
+				       (const string_t*) &api_string[0],
+				       "",
+				       "")) {
+                name_destroy(sname);
                 kfa_port_id_release(data->kfa, flow->port_id);
-                unbind_and_destroy_flow(data, flow);
+                tcp_unbind_and_destroy_flow(data, flow);
+                return -1;
+        }
 
-                return 0;
+        if (kipcm_flow_arrived(default_kipcm,
+                               data->id,
+                               flow->port_id,
+                               data->dif_name,
+                               app->app_name,
+                               sname,
+                               data->qos[CUBE_RELIABLE])) {
+                LOG_ERR("Couldn't tell the KIPCM about the flow");
+                kfa_port_id_release(data->kfa, flow->port_id);
+                tcp_unbind_and_destroy_flow(data, flow);
+                name_destroy(sname);
+                return -1;
         }
 
-        LOG_DBG("Got message of %d bytes", size);
+        name_destroy(sname);
+        LOG_DBG("TCP flow created");
 
-        return size;
+        return 0;
 }
 
 static int tcp_process(struct ipcp_instance_data * data, struct socket * sock)
 {
-        struct shim_tcp_udp_flow * flow;
         struct reg_app_data *      app;
         struct socket *            acsock;
-        struct name *              sname;
-        int                        err;
-        struct ipcp_instance     * ipcp, * user_ipcp;
-        char	   		   api_string[12];
+        int                        err, ret;
 
         ASSERT(sock);
 
@@ -1564,122 +1952,29 @@ static int tcp_process(struct ipcp_instance_data * data, struct socket * sock)
                 while (err > 0)
                         err = tcp_process_msg(data, sock);
                 return err;
-        } else {
-                /* accept connection */
+        }
+
+        /*
+         * Wake-ups that come while the socket's work is pending are
+         * merged into one run, so accept the whole backlog
+         */
+        ret = 0;
+        for (;;) {
                 err = kernel_accept(app->tcpsock, &acsock, O_NONBLOCK);
+                if (err == -EAGAIN)
+                        return ret;
                 if (err < 0) {
                         LOG_ERR("Could not accept socket");
                         return -1;
                 }
                 LOG_DBG("Socket accepted");
 
-                write_lock_bh(&acsock->sk->sk_callback_lock);
-                acsock->sk->sk_user_data  = acsock->sk->sk_data_ready;
-                acsock->sk->sk_data_ready = tcp_udp_rcv;
-                write_unlock_bh(&acsock->sk->sk_callback_lock);
-
-                flow = rkzalloc(sizeof(*flow), GFP_KERNEL);
-                if (!flow) {
-                        LOG_ERR("Could not allocate flow");
-
-                        sock_release(acsock);
-                        return -1;
-                }
-
-                user_ipcp = kipcm_find_ipcp_by_name(default_kipcm,
-                                                    app->app_name);
-                if (!user_ipcp)
-                        user_ipcp = kfa_ipcp_instance(data->kfa);
-                ASSERT(user_ipcp);
-
-                ipcp = kipcm_find_ipcp(default_kipcm, data->id);
-
-                flow->port_id_state = PORT_STATE_PENDING;
-                flow->fspec_id      = 1;
-                flow->port_id       = kfa_port_id_reserve(data->kfa, data->id);
-                flow->sock          = acsock;
-
-                spin_lock_bh(&data->lock);
-                INIT_LIST_HEAD(&flow->list);
-                list_add(&flow->list, &data->flows);
-                spin_unlock_bh(&data->lock);
-                LOG_DBG("TCP flow added");
-
-                if (!is_port_id_ok(flow->port_id)) {
-                        flow->port_id_state = PORT_STATE_NULL;
-                        LOG_ERR("Port id is not ok");
-
-                        sock_release(acsock);
-                        if (flow_destroy(data, flow))
-                                LOG_ERR("Problems destroying flow");
-
-                        return -1;
-                }
-                LOG_DBG("Added flow to the list");
-
-                if (!user_ipcp->ops->ipcp_name(user_ipcp->data)) {
-                        LOG_DBG("This flow goes for an app");
-                        if (kfa_flow_create(data->kfa, flow->port_id, ipcp,
-                        		    data->id, NULL, false)) {
-                                LOG_ERR("Could not create flow in KFA");
-                                kfa_port_id_release(data->kfa, flow->port_id);
-                                if (flow_destroy(data, flow))
-                                        LOG_ERR("Problems destroying flow");
-                                return -1;
-                        }
-                }
-
-                flow->sdu_queue = rfifo_create_ni();
-                if (!flow->sdu_queue) {
-                        LOG_ERR("Couldn't create the sdu queue "
-                                "for a new flow");
-                        kfa_port_id_release(data->kfa, flow->port_id);
-                        tcp_unbind_and_destroy_flow(data, flow);
-                        return -1;
-                }
-
-                LOG_DBG("Queue has been created");
-
-                if (sprintf(&api_string[0], "%d", flow->port_id) < 0){
-                	kfa_port_id_release(data->kfa, flow->port_id);
-                	unbind_and_destroy_flow(data, flow);
-                        return -1;
-                }
-
-                sname = name_create_ni();
-                if (!name_init_from_ni(sname,
-                		       "Unknown app",
-				       (const string_t*) &api_string[0],
-				       "",
-				       "")) {
-                        name_destroy(sname);
-                        kfa_port_id_release(data->kfa, flow->port_id);
-                        tcp_unbind_and_destroy_flow(data, flow);
-                        return -1;
-                }
-
-                if (kipcm_flow_arrived(default_kipcm,
-                                       data->id,
-                                       flow->port_id,
-                                       data->dif_name,
-                                       app->app_name,
-                                       sname,
-                                       data->qos[CUBE_RELIABLE])) {
-                        LOG_ERR("Couldn't tell the KIPCM about the flow");
-                        kfa_port_id_release(data->kfa, flow->port_id);
-                        tcp_unbind_and_destroy_flow(data, flow);
-                        name_destroy(sname);
-                        return -1;
-                }
-
-                name_destroy(sname);
-                LOG_DBG("TCP flow created");
-
-                return 0;
+                if (tcp_accept_flow(data, app, acsock))
+                        ret = -1;
         }
 }
 
-static int tcp_udp_rcv_process_msg(struct sock * sk)
+static int tcp_udp_rcv_process_msg(struct rcv_ctx * ctx, struct sock * sk)
 {
         struct ipcp_instance_data *         data;
         struct hostname                     host_name;
@@ -1724,7 +2019,7 @@ static int tcp_udp_rcv_process_msg(struct sock * sk)
         }
 
         if (sk->sk_socket->type == SOCK_DGRAM) {
-                do res = udp_process_msg(data, sock);
+                do res = udp_process_msg(data, sock, ctx->gro_buf);
                 while (res > 0);
                 return res;
         } else
@@ -1733,29 +2028,23 @@ static int tcp_udp_rcv_process_msg(struct sock * sk)
 
 static void tcp_udp_rcv_worker(struct work_struct * work)
 {
-        struct rcv_data * recvd, * next;
-
-        /* FIXME: more efficient locking and better cleanup */
-        spin_lock_bh(&rcv_wq_lock);
-        list_for_each_entry_safe(recvd, next, &rcv_wq_data, list) {
-                list_del(&recvd->list);
-                spin_unlock_bh(&rcv_wq_lock);
+        struct rcv_ctx * ctx;
+        struct sock *    sk;
 
-                LOG_DBG("Worker on %pK", recvd->sk);
+        ctx = container_of(work, struct rcv_ctx, work);
 
-                if (recvd->sk != NULL) {
-                        int res = tcp_udp_rcv_process_msg(recvd->sk);
-                        if (res <= 0)
-                                LOG_DBG("TCP/UDP processing returned %d", res);
-                }
+        /* NULL once the socket got detached while we were queued */
+        sk = READ_ONCE(ctx->sk);
 
-                rkfree(recvd);
+        LOG_DBG("Worker on %pK", sk);
 
-                spin_lock_bh(&rcv_wq_lock);
+        if (sk) {
+                int res = tcp_udp_rcv_process_msg(ctx, sk);
+                if (res <= 0)
+                        LOG_DBG("TCP/UDP processing returned %d", res);
         }
-        spin_unlock_bh(&rcv_wq_lock);
 
-        LOG_DBG("Worker finished for now");
+        kref_put(&ctx->ref, rcv_ctx_release);
 }
 
 static int tcp_udp_application_register(struct ipcp_instance_data * data,
@@ -1828,10 +2117,12 @@ static int tcp_udp_application_register(struct ipcp_instance_data * data,
                 return -1;
         }
 
-        write_lock_bh(&app->udpsock->sk->sk_callback_lock);
-        app->udpsock->sk->sk_user_data = app->udpsock->sk->sk_data_ready;
-        app->udpsock->sk->sk_data_ready = tcp_udp_rcv;
-        write_unlock_bh(&app->udpsock->sk->sk_callback_lock);
+        if (tcp_udp_sock_attach(app->udpsock)) {
+                sock_release(app->udpsock);
+                name_destroy(app->app_name);
+                rkfree(app);
+                return -1;
+        }
 
         LOG_DBG("UDP socket ready");
 
@@ -1844,7 +2135,7 @@ static int tcp_udp_application_register(struct ipcp_instance_data * data,
 #endif
         if (err < 0) {
                 LOG_ERR("could not create TCP socket for registration");
-                sock_release(app->udpsock);
+                tcp_udp_sock_release(app->udpsock);
                 name_destroy(app->app_name);
                 rkfree(app);
                 return -1;
@@ -1854,7 +2145,7 @@ static int tcp_udp_application_register(struct ipcp_instance_data * data,
         if (err < 0) {
                 LOG_ERR("Could not bind TCP socket for registration");
                 sock_release(app->tcpsock);
-                sock_release(app->udpsock);
+                tcp_udp_sock_release(app->udpsock);
                 name_destroy(app->app_name);
                 rkfree(app);
                 return -1;
@@ -1864,16 +2155,19 @@ static int tcp_udp_application_register(struct ipcp_instance_data * data,
         if (err < 0) {
                 LOG_ERR("Could not listen on TCP socket for registration");
                 sock_release(app->tcpsock);
-                sock_release(app->udpsock);
+                tcp_udp_sock_release(app->udpsock);
                 name_destroy(app->app_name);
                 rkfree(app);
                 return -1;
         }
 
-        write_lock_bh(&app->tcpsock->sk->sk_callback_lock);
-        app->tcpsock->sk->sk_user_data  = app->tcpsock->sk->sk_data_ready;
-        app->tcpsock->sk->sk_data_ready = tcp_udp_rcv;
-        write_unlock_bh(&app->tcpsock->sk->sk_callback_lock);
+        if (tcp_udp_sock_attach(app->tcpsock)) {
+                sock_release(app->tcpsock);
+                tcp_udp_sock_release(app->udpsock);
+                name_destroy(app->app_name);
+                rkfree(app);
+                return -1;
+        }
 
         LOG_DBG("TCP socket ready");
 
@@ -1892,25 +2186,13 @@ static int application_unregister(struct ipcp_instance_data * data,
 	ASSERT(data);
         ASSERT(app);
 
-	lock_sock(app->udpsock->sk);
-	write_lock_bh(&app->udpsock->sk->sk_callback_lock);
-	app->udpsock->sk->sk_data_ready = app->udpsock->sk->sk_user_data;
-	app->udpsock->sk->sk_user_data  = NULL;
-	write_unlock_bh(&app->udpsock->sk->sk_callback_lock);
-	release_sock(app->udpsock->sk);
-
+	tcp_udp_sock_detach(app->udpsock, true);
 	kernel_sock_shutdown(app->udpsock, SHUT_RDWR);
 	sock_release(app->udpsock);
 
 	LOG_DBG("UDP socket destroyed");
 
-	lock_sock(app->tcpsock->sk);
-	write_lock_bh(&app->tcpsock->sk->sk_callback_lock);
-	app->tcpsock->sk->sk_data_ready = app->tcpsock->sk->sk_user_data;
-	app->tcpsock->sk->sk_user_data  = NULL;
-	write_unlock_bh(&app->tcpsock->sk->sk_callback_lock);
-	release_sock(app->tcpsock->sk);
-
+	tcp_udp_sock_detach(app->tcpsock, true);
 	kernel_sock_shutdown(app->tcpsock, SHUT_RDWR);
 	sock_release(app->tcpsock);
 
@@ -2407,177 +2689,311 @@ static int tcp_udp_update_dif_config(struct ipcp_instance_data * data,
         return 0;
 }
 
-static int tcp_sdu_write(struct shim_tcp_udp_flow * flow,
-                         int                        len,
-                         char *                     sbuf)
+/* Sends the whole iovec, advancing it over partial sends */
+static int send_iov_all(struct socket * sock,
+                        struct kvec *   iov,
+                        size_t          nr,
+                        size_t          len,
+                        int             flags)
 {
-        uint16_t length;
-        int    size, total;
+        struct msghdr msg;
+        int           size;
 
-        ASSERT(flow);
-        ASSERT(len);
-        ASSERT(sbuf);
+        while (len) {
+                memset(&msg, 0, sizeof(msg));
+                msg.msg_flags = flags;
 
-        length = htons((short)len);
+                size = kernel_sendmsg(sock, &msg, iov, nr, len);
+                if (size <= 0)
+                        return size ? size : -EPIPE;
+                len -= size;
 
-        total = 0;
-        while (total < sizeof(uint16_t)) {
-                size = send_msg(flow->sock, NULL, 0, (char*)(&length+total),
-                                sizeof(uint16_t) - total);
-                if (size < 0) {
-                        LOG_ERR("error during sdu write (tcp): %d", size);
-                        return -1;
+                while (nr && size >= iov->iov_len) {
+                        size -= iov->iov_len;
+                        iov++;
+                        nr--;
                 }
-                total += size;
-        }
-        total = 0;
-        while (total < len) {
-                size = send_msg(flow->sock, NULL, 0, sbuf+total,
-                                len - total);
-                if (size < 0) {
-                        LOG_ERR("error during sdu write (tcp): %d", size);
-                        return -1;
+                if (size) {
+                        iov->iov_base += size;
+                        iov->iov_len  -= size;
                 }
-                total += size;
         }
 
         return 0;
 }
 
-static int tcp_udp_du_write(struct ipcp_instance_data * data,
-                            port_id_t                   id,
-                            struct du *                 du,
-                            bool                        blocking)
+/*
+ * Frames the SDUs with their length and sends them with one
+ * kernel_sendmsg(), corked while more SDUs wait in the queue
+ */
+static int tcp_sdu_write(struct shim_tcp_udp_flow * flow,
+                         struct du **               dus,
+                         int                        n,
+                         size_t                     total)
 {
-        struct snd_data * snd_data;
+        struct kvec iov[2 * SND_BATCH_MAX];
+        __be16      length[SND_BATCH_MAX];
+        int         i, size;
 
-        LOG_DBG("Callback on tcp_udp_sdu_write");
+        ASSERT(flow);
+        ASSERT(n > 0 && n <= SND_BATCH_MAX);
 
-        spin_lock_bh(&snd_wq_lock);
-        if (snd_wq_size == SEND_WQ_MAX_SIZE) {
-        	spin_unlock_bh(&snd_wq_lock);
-        	LOG_DBG("Output SDU queue is full, try later");
-        	return -EAGAIN;
+        for (i = 0; i < n; i++) {
+                length[i]            = htons((u16) du_len(dus[i]));
+                iov[2 * i].iov_base  = &length[i];
+                iov[2 * i].iov_len   = sizeof(length[i]);
+                iov[2 * i + 1].iov_base = du_buffer(dus[i]);
+                iov[2 * i + 1].iov_len  = du_len(dus[i]);
         }
 
-        snd_data = rkmalloc(sizeof(*snd_data), GFP_ATOMIC);
-        if (!snd_data) {
-                LOG_ERR("Could not allocate snd_data");
+        size = send_iov_all(flow->sock, iov, 2 * n,
+                            total + n * sizeof(__be16),
+                            rfifo_is_empty(flow->snd_queue) ? 0 : MSG_MORE);
+        if (size < 0) {
+                LOG_ERR("error during sdu write (tcp): %d", size);
                 return -1;
         }
 
-        snd_data->data = data;
-        snd_data->id   = id;
-        snd_data->du  = du;
-        INIT_LIST_HEAD(&snd_data->list);
+        return 0;
+}
+
+#ifdef UDP_SEGMENT
+/*
+ * Sends the SDUs as a single UDP_SEGMENT GSO super-datagram, the stack
+ * (or the NIC) splits it back in one datagram per SDU
+ */
+static int udp_gso_write(struct shim_tcp_udp_flow * flow,
+                         struct du **               dus,
+                         int                        n,
+                         size_t                     total)
+{
+        union {
+                struct cmsghdr hdr;
+                char           buf[CMSG_SPACE(sizeof(u16))];
+        }             ctl;
+        struct kvec   iov[SND_BATCH_MAX];
+        struct msghdr msg;
+        int           i;
+
+        for (i = 0; i < n; i++) {
+                iov[i].iov_base = du_buffer(dus[i]);
+                iov[i].iov_len  = du_len(dus[i]);
+        }
+
+        memset(&ctl, 0, sizeof(ctl));
+        ctl.hdr.cmsg_level = SOL_UDP;
+        ctl.hdr.cmsg_type  = UDP_SEGMENT;
+        ctl.hdr.cmsg_len   = CMSG_LEN(sizeof(u16));
+        *(u16 *) CMSG_DATA(&ctl.hdr) = du_len(dus[0]);
 
-        list_add_tail(&snd_data->list, &snd_wq_data);
-        snd_wq_size++;
-        spin_unlock_bh(&snd_wq_lock);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name       = &flow->addr;
+        msg.msg_namelen    = sizeof(flow->addr);
+        msg.msg_control    = &ctl;
+        msg.msg_controllen = sizeof(ctl);
 
-        queue_work(snd_wq, &snd_work);
-        return 0;
+        return kernel_sendmsg(flow->sock, &msg, iov, n, total);
 }
+#endif
 
-static int __tcp_udp_sdu_write(struct ipcp_instance_data * data,
-                               port_id_t                   id,
-                               struct du *                 du)
+/*
+ * Queues the SDU on the flow and kicks the flow's work item. A full queue
+ * pushes back with -EAGAIN, the writer is re-enabled once it drains.
+ */
+static int tcp_udp_du_write(struct ipcp_instance_data * data,
+                            port_id_t                   id,
+                            struct du *                 du,
+                            bool                        blocking)
 {
         struct shim_tcp_udp_flow * flow;
-        int                        size;
-	ssize_t                    slen;
+        int                        ret = 0;
 
-        flow = find_flow_by_port(data, id);
+        LOG_DBG("Callback on tcp_udp_sdu_write");
+
+        rcu_read_lock();
+        hash_for_each_possible_rcu(data->flows_by_port, flow, port_node, id) {
+                if (flow->port_id == id)
+                        break;
+        }
         if (!flow) {
+                rcu_read_unlock();
                 LOG_ERR("Could not find flow with specified port-id");
                 du_destroy(du);
                 return -1;
         }
 
+        spin_lock_bh(&flow->lock);
+        if (flow->snd_dead) {
+                LOG_ERR("Flow is being destroyed, dropping SDU");
+                du_destroy(du);
+                ret = -1;
+        } else if (rfifo_push_ni(flow->snd_queue, du)) {
+                LOG_DBG("Output SDU queue is full, try later");
+                flow->snd_blocked = true;
+                ret = -EAGAIN;
+        }
+        /* Also when full, so that a drain racing with us sees snd_blocked */
+        if (!flow->snd_dead)
+                queue_work(snd_wq, &flow->snd_work);
+        spin_unlock_bh(&flow->lock);
+        rcu_read_unlock();
+
+        return ret;
+}
+
+/*
+ * Pops the SDUs that can go out with a single kernel_sendmsg(): up to
+ * SND_BATCH_MAX of them on TCP, a run of equally sized ones (the last one
+ * may be shorter) for UDP GSO. Returns how many, 0 if the queue is empty.
+ */
+static int snd_batch_pop(struct shim_tcp_udp_flow * flow,
+                         struct du **               dus,
+                         size_t *                   total)
+{
+        struct du * du;
+        size_t      len, seg = 0;
+        int         n, max;
+
+        max = 1;
+        if (tcp_udp_batching && (flow->fspec_id || flow->snd_gso))
+                max = SND_BATCH_MAX;
+
+        *total = 0;
+        for (n = 0; n < max; n++) {
+                du = rfifo_peek(flow->snd_queue);
+                if (!du)
+                        break;
+
+                /* The socket is fed from a single buffer */
+                if (du_linearize(du)) {
+                        rfifo_pop(flow->snd_queue);
+                        du_destroy(du);
+                        n--;
+                        continue;
+                }
+
+                len = du_len(du);
+                if (n && *total + len > SND_BATCH_BYTES)
+                        break;
+                if (!flow->fspec_id) {
+                        if (!n)
+                                seg = len;
+                        else if (len > seg || du_len(dus[n - 1]) < seg)
+                                break;
+                }
+
+                dus[n]  = rfifo_pop(flow->snd_queue);
+                *total += len;
+        }
+
+        return n;
+}
+
+static int __tcp_udp_sdu_write(struct ipcp_instance_data * data,
+                               struct shim_tcp_udp_flow *  flow,
+                               struct du **                dus,
+                               int                         n,
+                               size_t                      total)
+{
+        int                        i, size, ret = 0;
+
         spin_lock_bh(&data->lock);
         if (flow->port_id_state != PORT_STATE_ALLOCATED) {
-                du_destroy(du);
                 spin_unlock_bh(&data->lock);
 
                 LOG_ERR("Flow is not in the right state to call this");
 
-                return -1;
+                ret = -1;
+                goto out;
         }
         spin_unlock_bh(&data->lock);
 
-	slen = du_len(du);
-        if (flow->fspec_id == 0) {
-                /* We are sending an UDP message */
+        if (flow->fspec_id) {
+                /* We are sending a TCP message */
+                if (tcp_sdu_write(flow, dus, n, total)) {
+                        LOG_ERR("Could not send SDU on TCP flow");
+                        ret = -1;
+                }
+                goto out;
+        }
+
+#ifdef UDP_SEGMENT
+        if (n > 1) {
+                size = udp_gso_write(flow, dus, n, total);
+                if (size == total)
+                        goto out;
+
+                /*
+                 * Only give up on GSO when it can't do it at all, e.g.
+                 * segments over the MTU or no support in the device. A
+                 * transient error such as a full socket buffer keeps it.
+                 */
+                if (size == -EINVAL || size == -EIO) {
+                        LOG_DBG("UDP GSO write failed (%d), disabling it",
+                                size);
+                        flow->snd_gso = false;
+                }
+        }
+#endif
+
+        /* We are sending UDP messages */
+        for (i = 0; i < n; i++) {
                 size = send_msg(flow->sock, &flow->addr, sizeof(flow->addr),
-                                du_buffer(du),
-                                slen);
+                                du_buffer(dus[i]),
+                                du_len(dus[i]));
                 if (size < 0) {
                         LOG_ERR("Error during SDU write (udp): %d", size);
-                        du_destroy(du);
-                        return -1;
-                } else if (size < slen) {
+                        ret = -1;
+                } else if (size < du_len(dus[i])) {
                         LOG_ERR("Could not completely send SDU");
-                        du_destroy(du);
-                        return -1;
-                }
-        } else {
-                /* We are sending a TCP message */
-                if (tcp_sdu_write(flow, slen,
-                                  du_buffer(du))) {
-                        LOG_ERR("Could not send SDU on TCP flow");
-                        du_destroy(du);
-                        return -1;
+                        ret = -1;
                 }
         }
 
-        LOG_DBG("SDU sent");
-        du_destroy(du);
+ out:
+        for (i = 0; i < n; i++)
+                du_destroy(dus[i]);
 
-        return 0;
-}
-
-static void enable_all_flows(void)
-{
-	struct ipcp_instance_data * pos, *next;
-	struct shim_tcp_udp_flow  * flow, *nflow;
+        if (!ret)
+                LOG_DBG("%d SDU(s) sent", n);
 
-	list_for_each_entry_safe(pos, next, &(tcp_udp_data.instances), list) {
-		spin_lock_bh(&pos->lock);
-		list_for_each_entry_safe(flow, nflow, &pos->flows, list) {
-			if (flow->user_ipcp && flow->user_ipcp->ops)
-				flow->user_ipcp->ops->enable_write(flow->user_ipcp->data,
-								   flow->port_id);
-		}
-		spin_unlock_bh(&pos->lock);
-	}
+        return ret;
 }
 
-static void tcp_udp_write_worker(struct work_struct * w)
+static void tcp_udp_write_worker(struct work_struct * work)
 {
-        struct snd_data           * snd_data, * next;
-
-        /* FIXME: more efficient locking and better cleanup */
-        spin_lock_bh(&snd_wq_lock);
-
-        list_for_each_entry_safe(snd_data, next, &snd_wq_data, list) {
-                list_del(&snd_data->list);
-                snd_wq_size --;
-                if (snd_wq_size == SEND_WQ_MAX_SIZE - 1) {
-                	spin_unlock_bh(&snd_wq_lock);
-                	enable_all_flows();
-                	spin_lock_bh(&snd_wq_lock);
-                }
-                spin_unlock_bh(&snd_wq_lock);
-
-                __tcp_udp_sdu_write(snd_data->data,
-                                    snd_data->id,
-                                    snd_data->du);
+        struct shim_tcp_udp_flow  * flow;
+        struct ipcp_instance_data * data;
+        struct du                 * dus[SND_BATCH_MAX];
+        size_t                      total;
+        int                         budget, n;
+        bool                        blocked;
+
+        flow = container_of(work, struct shim_tcp_udp_flow, snd_work);
+        data = flow->data;
+
+        /* Flows sharing the workqueue get their turn after a queue-full */
+        for (budget = SND_QUEUE_SIZE; budget > 0; budget -= n) {
+                n = snd_batch_pop(flow, dus, &total);
+                if (!n)
+                        break;
+                __tcp_udp_sdu_write(data, flow, dus, n, total);
+        }
+        if (budget <= 0)
+                queue_work(snd_wq, work);
 
-                rkfree(snd_data);
+        spin_lock_bh(&flow->lock);
+        blocked = flow->snd_blocked;
+        flow->snd_blocked = false;
+        spin_unlock_bh(&flow->lock);
 
-                spin_lock_bh(&snd_wq_lock);
+        if (blocked) {
+                spin_lock_bh(&data->lock);
+                if (flow->user_ipcp && flow->user_ipcp->ops)
+                        flow->user_ipcp->ops->enable_write(flow->user_ipcp->data,
+                                                           flow->port_id);
+                spin_unlock_bh(&data->lock);
         }
-        spin_unlock_bh(&snd_wq_lock);
 
         LOG_DBG("Writer worker finished for now");
 }
@@ -2648,6 +3064,7 @@ static struct ipcp_instance_ops tcp_udp_instance_ops = {
 
         .du_enqueue               = NULL,
         .du_write                 = tcp_udp_du_write,
+        .du_write_batch           = NULL,
 
         .mgmt_du_write            = NULL,
         .mgmt_du_post             = NULL,
@@ -2679,16 +3096,8 @@ static int tcp_udp_init(struct ipcp_factory_data * data)
         bzero(&tcp_udp_data, sizeof(tcp_udp_data));
         INIT_LIST_HEAD(&(data->instances));
 
-        INIT_LIST_HEAD(&rcv_wq_data);
-        INIT_LIST_HEAD(&snd_wq_data);
-
         spin_lock_init(&data->lock);
 
-        INIT_WORK(&rcv_work, tcp_udp_rcv_worker);
-        INIT_WORK(&snd_work, tcp_udp_write_worker);
-
-        snd_wq_size = 0;
-
         LOG_INFO("%s initialized", SHIM_NAME);
 
         return 0;
@@ -2861,6 +3270,8 @@ static struct ipcp_instance * tcp_udp_create(struct ipcp_factory_data * data,
         spin_lock_init(&inst->data->lock);
 
         INIT_LIST_HEAD(&(inst->data->flows));
+        hash_init(inst->data->flows_by_port);
+        hash_init(inst->data->flows_by_sock);
         INIT_LIST_HEAD(&(inst->data->reg_apps));
         INIT_LIST_HEAD(&(inst->data->directory));
         INIT_LIST_HEAD(&(inst->data->exp_regs));
@@ -2952,15 +3363,19 @@ static int __init mod_init(void)
 {
         BUILD_BUG_ON(CONFIG_RINA_SHIM_TCP_UDP_BUFFER_SIZE <= 0);
 
+        /*
+         * Concurrency managed: every socket (or flow, for the sender) has
+         * its own work item, which runs on the CPU that queued it
+         */
         rcv_wq = alloc_workqueue(SHIM_NAME_RWQ,
-                                 WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_UNBOUND, 1);
+                                 WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
         if (!rcv_wq) {
                 LOG_CRIT("Cannot create the receiver-wq");
                 return -1;
         }
 
         snd_wq = alloc_workqueue(SHIM_NAME_WWQ,
-                                 WQ_MEM_RECLAIM | WQ_HIGHPRI | WQ_UNBOUND, 1);
+                                 WQ_MEM_RECLAIM | WQ_HIGHPRI, 0);
         if (!snd_wq) {
                 LOG_CRIT("Cannot create the sender-wq");
                 destroy_workqueue(rcv_wq);
@@ -2981,26 +3396,16 @@ static int __init mod_init(void)
 
 static void __exit mod_exit(void)
 {
-        struct rcv_data * recvd, * nxt_r;
-        struct rcv_data * sendd, * nxt_s;
-
         LOG_DBG("Disposing receiver-wq");
         flush_workqueue(rcv_wq);
         destroy_workqueue(rcv_wq);
-        list_for_each_entry_safe(recvd, nxt_r, &rcv_wq_data, list) {
-                LOG_DBG("Disposing stale data in receiver-wq");
-                list_del(&recvd->list);
-                rkfree(recvd);
-        }
 
         LOG_DBG("Disposing sender-wq");
         flush_workqueue(snd_wq);
         destroy_workqueue(snd_wq);
-        list_for_each_entry_safe(sendd, nxt_s, &snd_wq_data, list) {
-                LOG_DBG("Disposing stale data in sender-wq");
-                list_del(&sendd->list);
-                rkfree(sendd);
-        }
+
+        /* Wait for the flows freed after a grace period */
+        rcu_barrier();
 
         kipcm_ipcp_factory_unregister(default_kipcm, shim);
 
@@ -22,6 +22,7 @@
 #include <linux/list.h>
 #include <linux/debugfs.h>
 #include <linux/seq_file.h>
+#include <linux/rcupdate.h>
 
 #define RINA_PREFIX "kfa-utils"
 
@@ -33,6 +34,9 @@
 
 /*
  * PMAPs
+ *
+ * Lookups may run either under the caller's lock or under rcu_read_lock(),
+ * while additions and removals must be serialized by the caller.
  */
 
 #define PMAP_HASH_BITS 7
@@ -46,6 +50,7 @@ struct kfa_pmap_entry {
         struct ipcp_flow * value_flow;
 
         struct hlist_node  hlist;
+        struct rcu_head    rcu;
 };
 
 struct kfa_pmap * kfa_pmap_create(void)
@@ -96,7 +101,7 @@ static struct kfa_pmap_entry * pmap_entry_find(struct kfa_pmap * map,
         ASSERT(map);
 
         head = &map->table[pmap_hash(map->table, key)];
-        hlist_for_each_entry(entry, head, hlist) {
+        hlist_for_each_entry_rcu(entry, head, hlist) {
                 if (entry->key == key)
                         return entry;
         }
@@ -152,7 +157,7 @@ static int kfa_pmap_add_gfp(gfp_t              flags,
         tmp->value_flow = value_flow;
         INIT_HLIST_NODE(&tmp->hlist);
 
-        hash_add(map->table, &tmp->hlist, key);
+        hash_add_rcu(map->table, &tmp->hlist, key);
 
         return 0;
 }
@@ -167,6 +172,9 @@ int kfa_pmap_add_ni(struct kfa_pmap *  map,
                     struct ipcp_flow * value_flow)
 { return kfa_pmap_add_gfp(GFP_ATOMIC, map, key, value_flow); }
 
+static void pmap_entry_free_rcu(struct rcu_head * head)
+{ rkfree(container_of(head, struct kfa_pmap_entry, rcu)); }
+
 int kfa_pmap_remove(struct kfa_pmap * map,
                     port_id_t         key)
 {
@@ -178,8 +186,9 @@ int kfa_pmap_remove(struct kfa_pmap * map,
         if (!cur)
                 return -1;
 
-        hash_del(&cur->hlist);
-        rkfree(cur);
+        /* Lookups may still be walking over it */
+        hash_del_rcu(&cur->hlist);
+        call_rcu(&cur->rcu, pmap_entry_free_rcu);
 
         return 0;
 }
@@ -189,16 +198,17 @@ int kfa_pmap_debugfs_show(struct kfa_pmap *map, struct seq_file * s,
                           void (* flow_show_func)(struct ipcp_flow *, struct seq_file *))
 {
         struct kfa_pmap_entry *entry;
-        struct hlist_node *tmp;
         int bucket;
 
         ASSERT(map);
         ASSERT(flow_show_func);
 
         seq_printf(s, "Current flows:\n");
-        hash_for_each_safe(map->table, bucket, tmp, entry, hlist) {
+        rcu_read_lock();
+        hash_for_each_rcu(map->table, bucket, entry, hlist) {
                 flow_show_func(entry->value_flow, s);
         }
+        rcu_read_unlock();
 
         return 0;
 }
@@ -28,6 +28,7 @@
 #include <linux/version.h>
 #include <linux/debugfs.h>
 #include <linux/hashtable.h>
+#include <linux/rcupdate.h>
 
 #define RINA_PREFIX "kfa"
 
@@ -39,9 +40,23 @@
 #include "kfa-utils.h"
 #include "rina-device.h"
 #include "ipcp-utils.h"
+#include "sdu-ring.h"
 
 #define RINA_IP_FLOW_ENT_NAME "RINA_IP"
+/*
+ * Initial room for the SDUs waiting to be read from a flow. The queue
+ * grows when the reader lags: reliable flows have already acked them.
+ */
+#define KFA_SDU_READY_SIZE 1024
 
+/*
+ * The port map is an RCU hash: the I/O paths look flows up without taking
+ * instance->lock, which only serializes the port-id allocator and updates
+ * to the map. Each flow has its own lock, protecting its state, queues and
+ * waitqueues, and a reference count: the map owns one reference until the
+ * flow is deallocated, lookups take one for the duration of the operation,
+ * and whoever drops the last one destroys the flow.
+ */
 struct kfa {
 	spinlock_t		 lock;
 	struct pidm             *pidm;
@@ -65,20 +80,19 @@ enum flow_state {
 
 struct ipcp_flow {
 	port_id_t	       port_id;
+	spinlock_t	       lock;
+	atomic_t	       refs;
 	enum flow_state	       state;
 	struct ipcp_instance * ipc_process;
 	struct rfifo         * sdu_ready;
 	struct iowaitqs	     * wqs;
-	atomic_t	       readers;
-	atomic_t	       writers;
-	atomic_t	       posters;
+	struct sdu_ring      * rx_ring;
 	bool		       msg_boundaries;
 	struct rina_device   * ip_dev;
+	struct rcu_head	       rcu;
 };
 
 struct flowdel_data {
-	struct kfa *kfa;
-	port_id_t  id;
 	struct rina_device *ip_dev;
 };
 
@@ -121,7 +135,7 @@ static void kfa_flows_dbg_flow_show(struct ipcp_flow *flow, struct seq_file *s)
 
     if (flow->ipc_process->ops->dif_name) {
         n = flow->ipc_process->ops->dif_name(flow->ipc_process->data);
-        ns = name_tostring(n);
+        ns = name_tostring_ni(n);
         if (ns) {
             seq_printf(s, "IPCP DIF name: %s\n", ns);
             rkfree(ns);
@@ -132,7 +146,7 @@ static void kfa_flows_dbg_flow_show(struct ipcp_flow *flow, struct seq_file *s)
 
     if (flow->ipc_process->ops->ipcp_name) {
         n = flow->ipc_process->ops->ipcp_name(flow->ipc_process->data);
-        ns = name_tostring(n);
+        ns = name_tostring_ni(n);
         if (ns) {
             seq_printf(s, "IPCP Name: %s\n", ns);
             rkfree(ns);
@@ -198,12 +212,15 @@ port_id_t kfa_port_id_reserve(struct kfa      * instance,
 }
 EXPORT_SYMBOL(kfa_port_id_reserve);
 
-/* NOTE: Add instance-locking IFF exporting to API */
+static void kfa_flow_free_rcu(struct rcu_head *head)
+{ rkfree(container_of(head, struct ipcp_flow, rcu)); }
+
+/* Called when the last reference to the flow is dropped */
 static int kfa_flow_destroy(struct kfa       *instance,
-			    struct ipcp_flow *flow,
-			    port_id_t	      id)
+			    struct ipcp_flow *flow)
 {
 	int retval = 0;
+	port_id_t id = flow->port_id;
 	struct rina_device * ip_dev;
 	struct rwq_work_item * item;
 	struct flowdel_data  * wqdata;
@@ -212,17 +229,18 @@ static int kfa_flow_destroy(struct kfa       *instance,
 
 	LOG_DBG("We are destroying flow %d", id);
 
-	/* FIXME: Should we ASSERT() here ? */
-	if (!flow->sdu_ready) {
-		LOG_WARN("Instance %pK SDU-ready FIFO is NULL", instance);
-	} else {
-		if (rfifo_destroy(flow->sdu_ready,
-				  (void (*) (void *)) du_destroy)) {
-			LOG_ERR("Flow %d FIFO has not been destroyed", id);
-			retval = -1;
-		}
+	/* Detach the I/O dev before the flow leaves the map, so that
+	 * kfa_flow_cancel_iowqs() either finds the flow or finds it gone */
+	spin_lock_bh(&flow->lock);
+	if (flow->wqs) {
+		wake_up_interruptible_all(&flow->wqs->read_wqueue);
+		wake_up_interruptible_all(&flow->wqs->write_wqueue);
+		flow->wqs = NULL;
 	}
+	flow->rx_ring = NULL;
+	spin_unlock_bh(&flow->lock);
 
+	spin_lock_bh(&instance->lock);
 	if (kfa_pmap_remove(instance->flows, id)) {
 		LOG_ERR("Could not remove pending flow with port-id %d", id);
 		retval = -1;
@@ -232,23 +250,32 @@ static int kfa_flow_destroy(struct kfa       *instance,
 		LOG_ERR("Could not release pid %d from the map", id);
 		retval = -1;
 	}
+	spin_unlock_bh(&instance->lock);
 
-	if (flow->wqs) {
-		wake_up_interruptible_all(&flow->wqs->read_wqueue);
-		wake_up_interruptible_all(&flow->wqs->write_wqueue);
+	/* FIXME: Should we ASSERT() here ? */
+	if (!flow->sdu_ready) {
+		LOG_WARN("Instance %pK SDU-ready FIFO is NULL", instance);
+	} else {
+		if (rfifo_destroy(flow->sdu_ready,
+				  (void (*) (void *)) du_destroy)) {
+			LOG_ERR("Flow %d FIFO has not been destroyed", id);
+			retval = -1;
+		}
 	}
 
 	ip_dev = flow->ip_dev;
 	flow->ip_dev = NULL;
-	rkfree(flow);
+
+	/* Lookups may still be walking over it */
+	call_rcu(&flow->rcu, kfa_flow_free_rcu);
 
 	if(!ip_dev)
 		return retval;
 
 	//the net device can not be unregistered in atomic, postpone it...
 	wqdata	       = rkzalloc(sizeof(*wqdata), GFP_ATOMIC);
-	wqdata->kfa    = NULL;
-	wqdata->id     = 0;
+	if (!wqdata)
+		return -1;
 	wqdata->ip_dev = ip_dev;
 
 	item = rwq_work_create_ni(kfa_flow_deallocate_worker, (void *) wqdata);
@@ -262,6 +289,30 @@ static int kfa_flow_destroy(struct kfa       *instance,
 	return retval;
 }
 
+/* Takes a reference to the flow, to be dropped with kfa_flow_put() */
+static struct ipcp_flow *kfa_flow_get(struct kfa *instance, port_id_t id)
+{
+	struct ipcp_flow *flow;
+
+	rcu_read_lock();
+	flow = kfa_pmap_find(instance->flows, id);
+	/* A zero count means the flow is being destroyed */
+	if (flow && !atomic_inc_not_zero(&flow->refs))
+		flow = NULL;
+	rcu_read_unlock();
+
+	return flow;
+}
+
+static void kfa_flow_put(struct kfa *instance, struct ipcp_flow *flow)
+{
+	if (!atomic_dec_and_test(&flow->refs))
+		return;
+
+	if (kfa_flow_destroy(instance, flow))
+		LOG_ERR("Could not destroy the flow correctly");
+}
+
 int  kfa_port_id_release(struct kfa *instance,
 			 port_id_t   port_id)
 {
@@ -281,8 +332,8 @@ int  kfa_port_id_release(struct kfa *instance,
 
 	/* To avoid releasing the port if it is used by a flow in the KFA
 	 * (to an app) which will be automatically destroyed when the flow is
-	 * unbound by the provider IPCP and the writers/readers/posters in KFA
-	 * are 0. This avoids allocating the freed port again before the KFA
+	 * unbound by the provider IPCP and the last reference to it is
+	 * dropped. This avoids allocating the freed port again before the KFA
 	 * finally destroys everything.
 	 */
 	flow = kfa_pmap_find(instance->flows, port_id);
@@ -311,9 +362,6 @@ EXPORT_SYMBOL(kfa_port_id_release);
 
 static int kfa_flow_deallocate_worker(void *data)
 {
-	struct ipcp_flow    * flow;
-	struct kfa          * instance;
-	port_id_t	      id;
 	struct flowdel_data * wqdata;
 	struct rina_device  * ip_dev;
 
@@ -323,67 +371,18 @@ static int kfa_flow_deallocate_worker(void *data)
 		return -1;
 	}
 
-	instance = wqdata->kfa;
-	id = wqdata->id;
 	ip_dev = wqdata->ip_dev;
 	rkfree(wqdata);
 
-	//If we only need to clean the rina device
-	if(ip_dev)
-		return rina_dev_destroy(ip_dev);
-
-	// In any other case
-	if (!instance) {
-		LOG_ERR("Bogus instance passed, bailing out");
-		return -1;
-	}
-
-	if (!is_port_id_ok(id)) {
-		LOG_ERR("Bogus flow-id, bailing out");
-		return -1;
-	}
-
-	spin_lock_bh(&instance->lock);
-
-	flow = kfa_pmap_find(instance->flows, id);
-	if (!flow) {
-		spin_unlock_bh(&instance->lock);
-		LOG_ERR("The flow with port-id %d was already destroyed", id);
-		return 0;
-	}
-
-	if (flow->state != PORT_STATE_DEALLOCATED) {
-		spin_unlock_bh(&instance->lock);
-		LOG_ERR("Port %u should be deallocated but it is not...", id);
-		return 0;
-	}
-
-	if ((atomic_read(&flow->readers) == 0) &&
-	    (atomic_read(&flow->writers) == 0) &&
-	    (atomic_read(&flow->posters) == 0)) {
-		if (kfa_flow_destroy(instance, flow, id))
-			LOG_ERR("Could not destroy the flow correctly");
-		spin_unlock_bh(&instance->lock);
-		return 0;
-	}
-
-	spin_unlock_bh(&instance->lock);
-
-	if (flow->wqs) {
-		wake_up_interruptible_all(&flow->wqs->read_wqueue);
-		wake_up_interruptible_all(&flow->wqs->write_wqueue);
-	}
-
-	return 0;
+	return rina_dev_destroy(ip_dev);
 }
 
 static int kfa_flow_deallocate(struct ipcp_instance_data *data,
 			       port_id_t		  id)
 {
-	struct rwq_work_item *item;
-	struct flowdel_data  *wqdata;
 	struct ipcp_flow     *flow;
 	struct kfa           *instance;
+	bool		      unmap;
 
 	if (!data) {
 		LOG_ERR("Bogus data passed, bailing out");
@@ -400,40 +399,30 @@ static int kfa_flow_deallocate(struct ipcp_instance_data *data,
 		return -1;
 	}
 
-	spin_lock_bh(&instance->lock);
-
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow created with port-id %d", id);
 		return -1;
 	}
 
+	spin_lock_bh(&flow->lock);
+	unmap = flow->state != PORT_STATE_DEALLOCATED;
 	flow->state = PORT_STATE_DEALLOCATED;
 
-	if ((atomic_read(&flow->readers) == 0) &&
-	    (atomic_read(&flow->writers) == 0) &&
-	    (atomic_read(&flow->posters) == 0)) {
-		LOG_DBG("Destroying kfa flow now...");
-		if (kfa_flow_destroy(instance, flow, id))
-			LOG_ERR("Could not destroy the flow correctly");
-		spin_unlock_bh(&instance->lock);
-		return 0;
-	}
-
-	wqdata	       = rkzalloc(sizeof(*wqdata), GFP_ATOMIC);
-	wqdata->kfa    = instance;
-	wqdata->id     = id;
-	wqdata->ip_dev = NULL;
-
-	item = rwq_work_create_ni(kfa_flow_deallocate_worker, (void *) wqdata);
-	if (!item) {
-		rkfree(wqdata);
-		return -1;
+	/* Let readers, writers and pollers see the EOF right away */
+	if (flow->wqs) {
+		wake_up_interruptible_poll(&flow->wqs->read_wqueue,
+					   POLLIN | POLLRDNORM | POLLHUP);
+		wake_up_interruptible_poll(&flow->wqs->write_wqueue,
+					   POLLOUT | POLLHUP);
 	}
+	spin_unlock_bh(&flow->lock);
 
-	rwq_work_post(data->kfa->flowdelq, item);
-	spin_unlock_bh(&instance->lock);
+	/* Drop the reference owned by the map, the flow is destroyed as
+	 * soon as the readers, writers and posters still using it are done */
+	if (unmap)
+		kfa_flow_put(instance, flow);
+	kfa_flow_put(instance, flow);
 
 	return 0;
 }
@@ -445,10 +434,6 @@ static bool ok_write(struct ipcp_flow *flow)
 		 flow->state == PORT_STATE_DEALLOCATED);
 }
 
-/*
- * NOTE: This function does NOT take the mutex, because it will be called only
- *	 during a write operation and then the mutex will be already taken.
- */
 static int disable_write(struct ipcp_instance_data *data, port_id_t id)
 {
 	struct ipcp_flow *flow;
@@ -470,23 +455,24 @@ static int disable_write(struct ipcp_instance_data *data, port_id_t id)
 	}
 	LOG_DBG("DISABLED write op");
 
-	spin_lock_bh(&instance->lock);
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow bound to port-id %d", id);
 		return -1;
 	}
 
+	spin_lock_bh(&flow->lock);
 	if (flow->state == PORT_STATE_DEALLOCATED) {
-		spin_unlock_bh(&instance->lock);
+		spin_unlock_bh(&flow->lock);
+		kfa_flow_put(instance, flow);
 		LOG_DBG("Flow with port-id %d is already deallocated", id);
 		return 0;
 	}
 
 	flow->state = PORT_STATE_DISABLED;
 	LOG_DBG("Disabled write in port id %d", id);
-	spin_unlock_bh(&instance->lock);
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
 
 	LOG_DBG("IPCP notified CWQ exhausted");
 
@@ -497,7 +483,6 @@ static int enable_write(struct ipcp_instance_data *data, port_id_t id)
 {
 	struct ipcp_flow  *flow;
 	struct kfa        *instance;
-	wait_queue_head_t *wq;
 
 	if (!data) {
 		LOG_ERR("Bogus ipcp data instance passed, can't enable pid");
@@ -516,34 +501,31 @@ static int enable_write(struct ipcp_instance_data *data, port_id_t id)
 
 	LOG_DBG("ENABLED write op");
 
-	spin_lock_bh(&instance->lock);
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow bound to port-id %d", id);
 		return -1;
 	}
 
+	spin_lock_bh(&flow->lock);
 	if (flow->state == PORT_STATE_DEALLOCATED) {
-		spin_unlock_bh(&instance->lock);
 		LOG_DBG("Flow with port-id %d is already deallocated", id);
-		return 0;
-	}
-	if (flow->state == PORT_STATE_DISABLED) {
+	} else if (flow->state == PORT_STATE_DISABLED) {
 		flow->state = PORT_STATE_ALLOCATED;
+		/* Wake up under the lock, the waitqueues belong to the I/O dev */
 		if (flow->wqs) {
-			wq = &flow->wqs->write_wqueue;
-			spin_unlock_bh(&instance->lock);
+			wake_up_interruptible_poll(&flow->wqs->write_wqueue,
+						   POLLOUT | POLLWRNORM |
+						   POLLWRBAND);
 			LOG_DBG("IPCP notified CWQ is now enabled");
 			LOG_DBG("Enabled write in port id %d", id);
-			wake_up_interruptible(wq);
-			return 0;
 		}
 	} else {
 		LOG_DBG("IPCP notified CWQ already enabled");
 	}
+	spin_unlock_bh(&flow->lock);
 
-	spin_unlock_bh(&instance->lock);
+	kfa_flow_put(instance, flow);
 
 	return 0;
 }
@@ -578,17 +560,18 @@ int kfa_flow_ub_write(struct kfa * instance,
 
 	LOG_DBG("Trying to write SDU to port-id %d", id);
 
-	spin_lock_bh(&instance->lock);
-
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow bound to port-id %d", id);
 		if (skb) kfree_skb(skb);
 		return -EBADF;
 	}
+
+	spin_lock_bh(&flow->lock);
+
 	if (flow->state == PORT_STATE_DEALLOCATED) {
-		spin_unlock_bh(&instance->lock);
+		spin_unlock_bh(&flow->lock);
+		kfa_flow_put(instance, flow);
 		LOG_ERR("Flow with port-id %d is already deallocated", id);
 		if (skb) kfree_skb(skb);
 		return -ESHUTDOWN;
@@ -597,17 +580,16 @@ int kfa_flow_ub_write(struct kfa * instance,
 	ipcp = flow->ipc_process;
 	max_sdu_size = ipcp->ops->max_sdu_size(ipcp->data);
 	if (flow->msg_boundaries && left > max_sdu_size) {
-		spin_unlock_bh(&instance->lock);
+		spin_unlock_bh(&flow->lock);
+		kfa_flow_put(instance, flow);
 		LOG_ERR("SDU is larger than the max SDU handled by "
 				"the IPCP: %zd, %zd", max_sdu_size, left);
 		if (skb) kfree_skb(skb);
 	        return -EMSGSIZE;
 	}
 
-	atomic_inc(&flow->writers);
-
 	while (left) {
-		spin_unlock_bh(&instance->lock);
+		spin_unlock_bh(&flow->lock);
 
 		copylen = min(left, max_sdu_size);
 
@@ -617,14 +599,14 @@ int kfa_flow_ub_write(struct kfa * instance,
 			if (!du) {
 				kfree_skb(skb);
 				retval = -ENOMEM;
-				goto finish;
+				goto finish_unlocked;
 			}
 		} else {
 			/* This SDU comes from the I/O device */
 			du = du_create(copylen);
 			if (!du) {
 				retval = -ENOMEM;
-				goto finish;
+				goto finish_unlocked;
 			}
 
 			/* NOTE: We don't handle partial copies */
@@ -642,11 +624,11 @@ int kfa_flow_ub_write(struct kfa * instance,
 			if (retval) {
 				du_destroy(du);
 				retval = -EIO;
-				goto finish;
+				goto finish_unlocked;
 			}
 		}
 
-		spin_lock_bh(&instance->lock);
+		spin_lock_bh(&flow->lock);
 
 		if (blocking) { /* blocking I/O */
 			if (flow->wqs == 0) {
@@ -658,8 +640,9 @@ int kfa_flow_ub_write(struct kfa * instance,
 				wqs = flow->wqs;
 			}
 
+			/* Our reference keeps the flow around while sleeping */
 			while (!ok_write(flow)) {
-				spin_unlock_bh(&instance->lock);
+				spin_unlock_bh(&flow->lock);
 
 				LOG_DBG("Going to sleep on wait queue %pK (writing)",
 						&wqs->write_wqueue);
@@ -684,16 +667,7 @@ int kfa_flow_ub_write(struct kfa * instance,
 					}
 				}
 
-				spin_lock_bh(&instance->lock);
-
-				flow = kfa_pmap_find(instance->flows, id);
-				if (!flow) {
-					spin_unlock_bh(&instance->lock);
-					du_destroy(du);
-					LOG_ERR("No more flow bound to port-id %d", id);
-					retval = -EBADF;
-					goto finish;
-				}
+				spin_lock_bh(&flow->lock);
 
 				if (flow->wqs == 0) {
 					LOG_ERR("Waitqueues are null, flow %d is being deallocated", id);
@@ -706,75 +680,55 @@ int kfa_flow_ub_write(struct kfa * instance,
 					du_destroy(du);
 					goto finish;
 				}
-
-				if (flow->state == PORT_STATE_DEALLOCATED) {
-					du_destroy(du);
-					retval = -ESHUTDOWN;
-					goto finish;
-				}
 			}
 
-			ipcp = flow->ipc_process;
-			if (!ipcp) {
-				retval = -EBADF;
+			if (flow->state == PORT_STATE_DEALLOCATED) {
 				du_destroy(du);
+				retval = -ESHUTDOWN;
 				goto finish;
 			}
-
-			spin_unlock_bh(&instance->lock);
-			if (ipcp->ops->du_write(ipcp->data, id, du, blocking)) {
-				spin_lock_bh(&instance->lock);
-				LOG_ERR("Couldn't write SDU on port-id %d", id);
-				retval = -EIO;
-				goto finish;
-			}
-			spin_lock_bh(&instance->lock);
 		} else { /* non-blocking I/O */
 			if (flow->state == PORT_STATE_PENDING
 					|| flow->state == PORT_STATE_DISABLED) {
 				LOG_DBG("Flow %d is not ready for writing", id);
+				du_destroy(du);
 				retval = -EAGAIN;
 				goto finish;
 			}
 
 			if (flow->state == PORT_STATE_DEALLOCATED) {
 				LOG_ERR("Flow %d has been deallocated", id);
+				du_destroy(du);
 				retval = -ESHUTDOWN;
 				goto finish;
 			}
+		}
 
-			ipcp = flow->ipc_process;
-			if (!ipcp) {
-				retval = -EBADF;
-				du_destroy(du);
-				goto finish;
-			}
+		ipcp = flow->ipc_process;
+		if (!ipcp) {
+			retval = -EBADF;
+			du_destroy(du);
+			goto finish;
+		}
 
-			spin_unlock_bh(&instance->lock);
-			if (ipcp->ops->du_write(ipcp->data, id, du, blocking)) {
-				spin_lock_bh(&instance->lock);
-				LOG_ERR("Couldn't write SDU on port-id %d", id);
-				retval = -EIO;
-				goto finish;
-			}
-			spin_lock_bh(&instance->lock);
+		spin_unlock_bh(&flow->lock);
+		if (ipcp->ops->du_write(ipcp->data, id, du, blocking)) {
+			LOG_ERR("Couldn't write SDU on port-id %d", id);
+			retval = -EIO;
+			goto finish_unlocked;
 		}
+		spin_lock_bh(&flow->lock);
 
 		left -= copylen;
 		data_written += copylen;
 	}
 
  finish:
+	spin_unlock_bh(&flow->lock);
+ finish_unlocked:
 	LOG_DBG("Finishing (write)");
 
-	if (atomic_dec_and_test(&flow->writers) &&
-	    (atomic_read(&flow->readers) == 0)	&&
-	    (atomic_read(&flow->posters) == 0)	&&
-	    (flow->state == PORT_STATE_DEALLOCATED))
-		if (kfa_flow_destroy(instance, flow, id))
-			LOG_ERR("Could not destroy the flow correctly");
-
-	spin_unlock_bh(&instance->lock);
+	kfa_flow_put(instance, flow);
 
 	if (data_written == 0)
 		return retval;
@@ -805,47 +759,38 @@ static bool queue_ready(struct ipcp_flow *flow)
 	return false;
 }
 
-int kfa_flow_readable(struct kfa       *instance,
-                      port_id_t        id,
-                      unsigned int     *mask,
-                      struct file      *f,
-                      poll_table       *wait)
+unsigned int kfa_flow_poll_mask(struct kfa * instance,
+				port_id_t    id)
 {
-        struct ipcp_flow *flow;
-
-	if (!instance) {
-		LOG_ERR("Bogus instance passed, bailing out");
-                *mask |= POLLERR;
-                return -1;
-	}
+	struct ipcp_flow *flow;
+	unsigned int	  mask = 0;
 
-	if (!is_port_id_ok(id)) {
-		LOG_ERR("Bogus port-id, bailing out");
-                *mask |= POLLERR;
-		return -1;
-	}
+	if (!instance || !is_port_id_ok(id))
+		return POLLERR;
 
-	spin_lock_bh(&instance->lock);
+	flow = kfa_flow_get(instance, id);
+	if (!flow)
+		/* EOF for readers, writers would fail right away */
+		return POLLIN | POLLRDNORM | POLLHUP;
 
-	flow = kfa_pmap_find(instance->flows, id);
-	if (!flow) {
-		spin_unlock_bh(&instance->lock);
-		LOG_ERR("There is no flow bound to port-id %d", id);
-		*mask |= POLLIN | POLLRDNORM;
-		return 0;
-	}
+	spin_lock_bh(&flow->lock);
 
-        poll_wait(f, &flow->wqs->read_wqueue, wait);
+	if (flow->state == PORT_STATE_DEALLOCATED) {
+		mask = POLLIN | POLLRDNORM | POLLHUP;
+	} else {
+		if (queue_ready(flow) ||
+		    (flow->rx_ring && !sdu_ring_is_empty(flow->rx_ring)))
+			mask |= POLLIN | POLLRDNORM;
 
-        /* We set a POLLIN event if there is something in the receive queue
-         * or if the flow has been deallocated, which is our EOF condition. */
-        if (queue_ready(flow)) {
-                *mask |= POLLIN | POLLRDNORM;
-        }
+		/* Writable until the IPCP pushes back through disable_write() */
+		if (flow->state != PORT_STATE_PENDING && ok_write(flow))
+			mask |= POLLOUT | POLLWRNORM;
+	}
 
-	spin_unlock_bh(&instance->lock);
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
 
-	return 0;
+	return mask;
 }
 
 int kfa_flow_set_iowqs(struct kfa * instance,
@@ -864,18 +809,17 @@ int kfa_flow_set_iowqs(struct kfa * instance,
 		return -1;
 	}
 
-	spin_lock_bh(&instance->lock);
-
-	flow = kfa_pmap_find(instance->flows, pid);
+	flow = kfa_flow_get(instance, pid);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow bound to port-id %d", pid);
 		return -1;
 	}
 
+	spin_lock_bh(&flow->lock);
 	flow->wqs = wqs;
+	spin_unlock_bh(&flow->lock);
 
-	spin_unlock_bh(&instance->lock);
+	kfa_flow_put(instance, flow);
 
 	return 0;
 }
@@ -884,7 +828,7 @@ int kfa_flow_cancel_iowqs(struct kfa      * instance,
 			   port_id_t pid)
 {
         struct ipcp_flow *flow;
-        struct iowaitqs * wqs;
+        struct iowaitqs * wqs = NULL;
 
 	if (!instance)
 		return -1;
@@ -892,26 +836,25 @@ int kfa_flow_cancel_iowqs(struct kfa      * instance,
 	if (!is_port_id_ok(pid))
 		return -1;
 
-	spin_lock_bh(&instance->lock);
-
+	/* No reference taken: this may run while the flow is being
+	 * destroyed, which detaches the waitqueues under the flow lock
+	 * before unmapping it, and frees it after a grace period */
+	rcu_read_lock();
 	flow = kfa_pmap_find(instance->flows, pid);
-	if (!flow) {
-		spin_unlock_bh(&instance->lock);
-		return -1;
-	}
-
-	wqs = flow->wqs;
-	flow->wqs = 0;
-
-	spin_unlock_bh(&instance->lock);
-
-	if (wqs) {
-		wake_up_interruptible_all(&wqs->read_wqueue);
-		wake_up_interruptible_all(&wqs->write_wqueue);
-		return 0;
+	if (flow) {
+		spin_lock_bh(&flow->lock);
+		wqs = flow->wqs;
+		flow->wqs = 0;
+		flow->rx_ring = NULL;
+		if (wqs) {
+			wake_up_interruptible_all(&wqs->read_wqueue);
+			wake_up_interruptible_all(&wqs->write_wqueue);
+		}
+		spin_unlock_bh(&flow->lock);
 	}
+	rcu_read_unlock();
 
-	return -1;
+	return wqs ? 0 : -1;
 }
 
 struct du * get_du_to_read(struct ipcp_flow * flow, size_t size)
@@ -951,22 +894,20 @@ int kfa_flow_du_read(struct kfa  *instance,
 
 	LOG_DBG("Trying to read SDU from port-id %d", id);
 
-	spin_lock_bh(&instance->lock);
-
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
 		LOG_ERR("There is no flow bound to port-id %d", id);
-		spin_unlock_bh(&instance->lock);
 		return -EBADF;
 	}
+
+	spin_lock_bh(&flow->lock);
+
 	if (flow->state == PORT_STATE_DEALLOCATED) {
 		LOG_ERR("Flow with port-id %d is already deallocated", id);
-		spin_unlock_bh(&instance->lock);
-		return -ESHUTDOWN;
+		retval = -ESHUTDOWN;
+		goto finish;
 	}
 
-	atomic_inc(&flow->readers);
-
 	if (blocking) { /* blocking I/O */
 		if (flow->wqs == 0) {
 			LOG_ERR("Waitqueues are null, flow %d is being deallocated", id);
@@ -976,9 +917,10 @@ int kfa_flow_du_read(struct kfa  *instance,
 			wqs = flow->wqs;
 		}
 
+		/* Our reference keeps the flow around while sleeping */
 		while (flow->state == PORT_STATE_PENDING ||
 				rfifo_is_empty(flow->sdu_ready)) {
-			spin_unlock_bh(&instance->lock);
+			spin_unlock_bh(&flow->lock);
 
 			LOG_DBG("Going to sleep on wait queue %pK (reading)",
 					&wqs->read_wqueue);
@@ -1001,13 +943,7 @@ int kfa_flow_du_read(struct kfa  *instance,
 				}
 			}
 
-			spin_lock_bh(&instance->lock);
-			flow = kfa_pmap_find(instance->flows, id);
-			if (!flow) {
-				spin_unlock_bh(&instance->lock);
-				LOG_ERR("No more flow bound to port-id %d", id);
-				return 0;
-			}
+			spin_lock_bh(&flow->lock);
 
 			if (flow->wqs == 0) {
 				LOG_ERR("Waitqueues are null, flow %d is being deallocated", id);
@@ -1062,14 +998,381 @@ int kfa_flow_du_read(struct kfa  *instance,
  finish:
 	LOG_DBG("Finishing (read)");
 
-	if (atomic_dec_and_test(&flow->readers) &&
-	    (atomic_read(&flow->writers) == 0)	&&
-	    (atomic_read(&flow->posters) == 0)	&&
-	    (flow->state == PORT_STATE_DEALLOCATED))
-		if (kfa_flow_destroy(instance, flow, id))
-			LOG_ERR("Could not destroy the flow correctly");
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
 
-	spin_unlock_bh(&instance->lock);
+	return retval;
+}
+
+int kfa_flow_du_read_batch(struct kfa  * instance,
+			   port_id_t    id,
+			   struct du ** dus,
+			   int          max,
+			   size_t       budget,
+			   bool         blocking)
+{
+	struct ipcp_flow *flow;
+	struct iowaitqs  *wqs;
+	struct du	 *du;
+	int		  retval = 0;
+	int		  n = 0;
+
+	if (!instance || !is_port_id_ok(id) || !dus || max <= 0)
+		return -EINVAL;
+
+	flow = kfa_flow_get(instance, id);
+	if (!flow) {
+		LOG_ERR("There is no flow bound to port-id %d", id);
+		return -EBADF;
+	}
+
+	spin_lock_bh(&flow->lock);
+
+	while (flow->state == PORT_STATE_PENDING ||
+	       rfifo_is_empty(flow->sdu_ready)) {
+		if (flow->state == PORT_STATE_DEALLOCATED || !flow->wqs) {
+			retval = 0;
+			goto finish;
+		}
+
+		if (!blocking) {
+			retval = -EAGAIN;
+			goto finish;
+		}
+
+		wqs = flow->wqs;
+		spin_unlock_bh(&flow->lock);
+
+		retval = wait_event_interruptible(wqs->read_wqueue,
+						  queue_ready(flow));
+
+		spin_lock_bh(&flow->lock);
+
+		if (retval < 0)
+			goto finish;
+	}
+
+	/* Dequeue as many SDUs as fit in the caller's buffer */
+	while (n < max && !rfifo_is_empty(flow->sdu_ready)) {
+		du = rfifo_peek(flow->sdu_ready);
+		if (IRATI_BATCH_REC_SIZE(du_len(du)) > budget)
+			break;
+
+		budget -= IRATI_BATCH_REC_SIZE(du_len(du));
+		dus[n++] = rfifo_pop(flow->sdu_ready);
+	}
+
+	retval = n ? n : -EMSGSIZE;
+
+ finish:
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
+
+	return retval;
+}
+
+void kfa_flow_du_unread_batch(struct kfa  * instance,
+			      port_id_t    id,
+			      struct du ** dus,
+			      int          n)
+{
+	struct ipcp_flow *flow;
+	int		  i = n;
+
+	flow = kfa_flow_get(instance, id);
+	if (flow) {
+		spin_lock_bh(&flow->lock);
+		/* Last one first, so that they end up in the original order */
+		for (; i > 0; i--) {
+			if (rfifo_head_push_ni(flow->sdu_ready, dus[i - 1]))
+				break;
+		}
+		spin_unlock_bh(&flow->lock);
+		kfa_flow_put(instance, flow);
+	}
+
+	if (i)
+		LOG_ERR("Could not requeue %d SDUs on port-id %d, dropped",
+			i, id);
+	for (; i > 0; i--)
+		du_destroy(dus[i - 1]);
+}
+
+/* Called with the flow lock and a reference to the flow held */
+static int flow_wait_writable(struct ipcp_flow * flow,
+			      bool               blocking)
+{
+	struct iowaitqs *wqs;
+	int		 retval;
+
+	while (!ok_write(flow)) {
+		if (!blocking)
+			return -EAGAIN;
+
+		if (!flow->wqs)
+			return -EBADF;
+
+		wqs = flow->wqs;
+		spin_unlock_bh(&flow->lock);
+
+		retval = wait_event_interruptible(wqs->write_wqueue,
+						  ok_write(flow));
+
+		spin_lock_bh(&flow->lock);
+
+		if (retval < 0)
+			return retval;
+	}
+
+	if (flow->state == PORT_STATE_DEALLOCATED)
+		return -ESHUTDOWN;
+
+	return 0;
+}
+
+/*
+ * Builds DUs out of the records in buffer and hands them to the IPCP
+ * in bursts, through du_write_batch where the IPCP provides it. The flow
+ * lock is taken once per burst rather than once per SDU.
+ */
+#define KFA_WRITE_BURST 16
+
+int kfa_flow_ub_write_batch(struct kfa *	  instance,
+			    port_id_t		  id,
+			    const char __user * buffer,
+			    size_t		  size,
+			    unsigned int	  count,
+			    bool		  blocking)
+{
+	struct ipcp_flow     *flow;
+	struct ipcp_instance *ipcp;
+	struct du	     *dus[KFA_WRITE_BURST];
+	size_t		      max_sdu_size;
+	size_t		      offset = 0;
+	unsigned int	      written = 0;
+	uint32_t	      len;
+	int		      retval = 0;
+	int		      n, sent, consumed, i;
+
+	if (!instance || !is_port_id_ok(id) || !buffer)
+		return -EINVAL;
+
+	flow = kfa_flow_get(instance, id);
+	if (!flow) {
+		LOG_ERR("There is no flow bound to port-id %d", id);
+		return -EBADF;
+	}
+
+	spin_lock_bh(&flow->lock);
+
+	while (written < count) {
+		retval = flow_wait_writable(flow, blocking);
+		if (retval)
+			goto finish;
+
+		ipcp = flow->ipc_process;
+		if (!ipcp) {
+			retval = -EBADF;
+			goto finish;
+		}
+		max_sdu_size = ipcp->ops->max_sdu_size(ipcp->data);
+		spin_unlock_bh(&flow->lock);
+
+		/* Copy in the next burst of records */
+		for (n = 0; n < KFA_WRITE_BURST && written + n < count; n++) {
+			if (offset + sizeof(len) > size ||
+			    get_user(len, (const uint32_t __user *)
+				     (buffer + offset))) {
+				retval = -EFAULT;
+				break;
+			}
+
+			if (!len || len > max_sdu_size ||
+			    offset + IRATI_BATCH_REC_SIZE(len) > size) {
+				retval = len > max_sdu_size ? -EMSGSIZE :
+							      -EINVAL;
+				break;
+			}
+
+			dus[n] = du_create(len);
+			if (!dus[n]) {
+				retval = -ENOMEM;
+				break;
+			}
+
+			if (copy_from_user(du_buffer(dus[n]),
+					   buffer + offset + sizeof(len),
+					   len)) {
+				du_destroy(dus[n]);
+				retval = -EFAULT;
+				break;
+			}
+
+			offset += IRATI_BATCH_REC_SIZE(len);
+		}
+
+		/* Hand the burst to the IPCP, it owns what it consumes */
+		if (n && ipcp->ops->du_write_batch) {
+			sent = ipcp->ops->du_write_batch(ipcp->data, id, dus,
+							 n, blocking);
+			if (sent < 0)
+				sent = 0;
+			consumed = sent;
+		} else {
+			for (sent = 0; sent < n; sent++)
+				if (ipcp->ops->du_write(ipcp->data, id,
+							dus[sent], blocking))
+					break;
+
+			/* A failing du_write() disposes of the DU anyway */
+			consumed = sent;
+			if (sent < n) {
+				LOG_ERR("Couldn't write SDU on port-id %d", id);
+				retval = -EIO;
+				consumed++;
+			}
+		}
+
+		/* The IPCP owns the first consumed DUs, the rest are ours */
+		for (i = consumed; i < n; i++)
+			du_destroy(dus[i]);
+
+		written += sent;
+
+		spin_lock_bh(&flow->lock);
+
+		if (retval)
+			goto finish;
+
+		if (sent < n) {
+			retval = -EAGAIN;
+			goto finish;
+		}
+	}
+
+ finish:
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
+
+	return written ? written : retval;
+}
+
+/* Moves the SDUs queued while the RX ring was full into the ring */
+static void rx_ring_refill(struct ipcp_flow * flow)
+{
+	struct du * du;
+	int	    ret;
+
+	while (!rfifo_is_empty(flow->sdu_ready)) {
+		du = rfifo_peek(flow->sdu_ready);
+		ret = sdu_ring_put(flow->rx_ring, du);
+		if (ret == -ENOSPC)
+			break;
+
+		if (ret)
+			LOG_ERR("SDU of %zd bytes does not fit the RX ring of "
+				"port-id %d, dropping it",
+				du_len(du), flow->port_id);
+
+		du_destroy(rfifo_pop(flow->sdu_ready));
+	}
+}
+
+static bool rx_ring_ready(struct ipcp_flow * flow)
+{
+	return flow->state == PORT_STATE_DEALLOCATED ||
+	       !flow->rx_ring ||
+	       !sdu_ring_is_empty(flow->rx_ring) ||
+	       !rfifo_is_empty(flow->sdu_ready);
+}
+
+int kfa_flow_rx_ring_set(struct kfa      * instance,
+			 port_id_t         id,
+			 struct sdu_ring * ring)
+{
+	struct ipcp_flow *flow;
+
+	if (!instance || !is_port_id_ok(id))
+		return -1;
+
+	flow = kfa_flow_get(instance, id);
+	if (!flow) {
+		LOG_ERR("There is no flow bound to port-id %d", id);
+		return -1;
+	}
+
+	spin_lock_bh(&flow->lock);
+	flow->rx_ring = ring;
+	if (ring)
+		rx_ring_refill(flow);
+	spin_unlock_bh(&flow->lock);
+
+	kfa_flow_put(instance, flow);
+
+	return 0;
+}
+
+int kfa_flow_rx_ring_sync(struct kfa * instance,
+			  port_id_t    id,
+			  bool         blocking)
+{
+	struct ipcp_flow *flow;
+	struct iowaitqs  *wqs;
+	int		  retval = 0;
+
+	if (!instance || !is_port_id_ok(id))
+		return -EINVAL;
+
+	flow = kfa_flow_get(instance, id);
+	if (!flow) {
+		LOG_ERR("There is no flow bound to port-id %d", id);
+		return -EBADF;
+	}
+
+	spin_lock_bh(&flow->lock);
+
+	if (!flow->rx_ring) {
+		retval = -EINVAL;
+		goto finish;
+	}
+
+	/* Our reference keeps the flow around while sleeping */
+	rx_ring_refill(flow);
+	while (sdu_ring_is_empty(flow->rx_ring)) {
+		if (flow->state == PORT_STATE_DEALLOCATED || !flow->wqs) {
+			retval = 0;
+			goto finish;
+		}
+
+		if (!blocking) {
+			retval = -EAGAIN;
+			goto finish;
+		}
+
+		wqs = flow->wqs;
+		spin_unlock_bh(&flow->lock);
+
+		retval = wait_event_interruptible(wqs->read_wqueue,
+						  rx_ring_ready(flow));
+
+		spin_lock_bh(&flow->lock);
+
+		if (retval < 0)
+			goto finish;
+
+		if (!flow->rx_ring) {
+			retval = 0;
+			goto finish;
+		}
+
+		rx_ring_refill(flow);
+	}
+
+	retval = sdu_ring_count(flow->rx_ring);
+
+ finish:
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
 
 	return retval;
 }
@@ -1099,49 +1402,63 @@ static int kfa_du_post(struct ipcp_instance_data *data,
 
 	LOG_DBG("Posting DU to port-id %d ", id);
 
-	spin_lock_bh(&instance->lock);
-	flow = kfa_pmap_find(instance->flows, id);
+	flow = kfa_flow_get(instance, id);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("There is no flow bound to port-id %d", id);
 		du_destroy(du);
 		return -1;
 	}
 
-	if (flow->state == PORT_STATE_DEALLOCATED) {
-		spin_unlock_bh(&instance->lock);
-		LOG_ERR("Flow with port-id %d is already deallocated", id);
-		du_destroy(du);
-		return -1;
-	}
-
 	if (flow->ip_dev) {
-		/* SDU will be consumed through IP networking stack */
+		/* SDU will be consumed through IP networking stack, the
+		 * device stays around as long as we hold the reference */
+		if (READ_ONCE(flow->state) == PORT_STATE_DEALLOCATED) {
+			kfa_flow_put(instance, flow);
+			LOG_ERR("Flow with port-id %d is already deallocated", id);
+			du_destroy(du);
+			return -1;
+		}
 		skb = du_detach_skb(du);
 		du_destroy(du);
 		retval = rina_dev_rcv(skb, flow->ip_dev);
-	} else {
-		/* SDU will be consumed through I/O dev */
-		if (rfifo_push_ni(flow->sdu_ready, du)) {
-			LOG_ERR("Could not write %zd bytes into port-id %d",
-				sizeof(struct du *), id);
-			retval = -1;
-		}
+		kfa_flow_put(instance, flow);
+		return retval;
 	}
 
-	atomic_inc(&flow->posters);
-	if (atomic_dec_and_test(&flow->posters) &&
-	    (atomic_read(&flow->writers) == 0)	&&
-	    (atomic_read(&flow->readers) == 0)	&&
-	    (flow->state == PORT_STATE_DEALLOCATED)) {
-		if (kfa_flow_destroy(instance, flow, id))
-			LOG_ERR("Could not destroy the flow correctly");
-		flow = NULL;
+	/* Reassembled SDUs are only made contiguous for user space */
+	if (du_linearize(du)) {
+		kfa_flow_put(instance, flow);
+		du_destroy(du);
+		return -1;
 	}
 
-	spin_unlock_bh(&instance->lock);
+	spin_lock_bh(&flow->lock);
 
-	if (flow && (retval == 0) && (flow->wqs != 0)) {
+	if (flow->state == PORT_STATE_DEALLOCATED) {
+		spin_unlock_bh(&flow->lock);
+		kfa_flow_put(instance, flow);
+		LOG_ERR("Flow with port-id %d is already deallocated", id);
+		du_destroy(du);
+		return -1;
+	}
+
+	/* SDU will be consumed through I/O dev, possibly through the
+	 * shared RX ring if there is room and no SDUs queued before */
+	if (flow->rx_ring)
+		rx_ring_refill(flow);
+
+	if (flow->rx_ring && rfifo_is_empty(flow->sdu_ready) &&
+	    !sdu_ring_put(flow->rx_ring, du)) {
+		du_destroy(du);
+	} else if (rfifo_push_ni(flow->sdu_ready, du)) {
+		LOG_ERR("Could not write %zd bytes into port-id %d",
+			du_len(du), id);
+		du_destroy(du);
+		retval = -1;
+	}
+
+	/* Wake up under the lock, the waitqueues belong to the I/O dev */
+	if ((retval == 0) && (flow->wqs != 0)) {
 		wq = &flow->wqs->read_wqueue;
 		ASSERT(wq);
 
@@ -1151,6 +1468,9 @@ static int kfa_du_post(struct ipcp_instance_data *data,
 		LOG_DBG("SDU posted");
 	}
 
+	spin_unlock_bh(&flow->lock);
+	kfa_flow_put(instance, flow);
+
 	return retval;
 }
 
@@ -1162,9 +1482,9 @@ struct ipcp_flow *kfa_flow_find_by_pid(struct kfa *instance, port_id_t pid)
 	if (!instance)
 		return NULL;
 
-	spin_lock(&instance->lock);
+	rcu_read_lock();
 	tmp = kfa_pmap_find(instance->flows, pid);
-	spin_unlock(&instance->lock);
+	rcu_read_unlock();
 
 	return tmp;
 }
@@ -1187,9 +1507,10 @@ int kfa_flow_create(struct kfa           *instance,
 		LOG_ERR("Failed to created flow, bailing out");
 		return -1;
 	}
-	atomic_set(&flow->readers, 0);
-	atomic_set(&flow->writers, 0);
-	atomic_set(&flow->posters, 0);
+	/* Reference owned by the port map, dropped on deallocation */
+	atomic_set(&flow->refs, 1);
+	spin_lock_init(&flow->lock);
+	flow->port_id = pid;
 	flow->wqs = 0;
 
 	flow->ipc_process = ipcp;
@@ -1238,6 +1559,8 @@ static int kfa_flow_ipcp_bind(struct ipcp_instance_data *data,
 {
 	struct ipcp_flow *flow;
 	struct kfa       *instance;
+	struct rfifo     *sdu_ready;
+	bool              unmap;
 
 	LOG_DBG("Binding IPCP %pK to flow on port %d", ipcp, pid);
 
@@ -1261,27 +1584,34 @@ static int kfa_flow_ipcp_bind(struct ipcp_instance_data *data,
 		return -1;
 	}
 
-	spin_lock_bh(&instance->lock);
-	flow = kfa_pmap_find(instance->flows, pid);
+	flow = kfa_flow_get(instance, pid);
 	if (!flow) {
-		spin_unlock_bh(&instance->lock);
 		LOG_ERR("Cannot bind IPCP %pK, missing flow on port %d",
 			ipcp,
 			pid);
 		return -1;
 	}
 
-	flow->ipc_process = ipcp;
-	flow->state	  = PORT_STATE_ALLOCATED;
-	flow->sdu_ready	  = rfifo_create_ni();
-	if (!flow->sdu_ready) {
-		kfa_pmap_remove(instance->flows, pid);
-		rkfree(flow);
-		spin_unlock_bh(&instance->lock);
+	sdu_ready = rfifo_create_ring_ni(KFA_SDU_READY_SIZE, RFIFO_GROW);
+	if (!sdu_ready) {
+		/* Drop the map reference too, unmapping the flow */
+		spin_lock_bh(&flow->lock);
+		unmap = flow->state != PORT_STATE_DEALLOCATED;
+		flow->state = PORT_STATE_DEALLOCATED;
+		spin_unlock_bh(&flow->lock);
+		if (unmap)
+			kfa_flow_put(instance, flow);
+		kfa_flow_put(instance, flow);
 		return -1;
 	}
 
-	spin_unlock_bh(&instance->lock);
+	spin_lock_bh(&flow->lock);
+	flow->ipc_process = ipcp;
+	flow->sdu_ready	  = sdu_ready;
+	flow->state	  = PORT_STATE_ALLOCATED;
+	spin_unlock_bh(&flow->lock);
+
+	kfa_flow_put(instance, flow);
 
 	LOG_DBG("Flow bound to port-id %d", pid);
 
@@ -1425,10 +1755,10 @@ bool kfa_flow_exists(struct kfa *kfa, port_id_t port_id)
 {
         struct ipcp_flow *flow;
 
-        spin_lock_bh(&kfa->lock);
+        rcu_read_lock();
         flow = kfa_pmap_find(kfa->flows, port_id);
         /* XXX check flow->state ? */
-        spin_unlock_bh(&kfa->lock);
+        rcu_read_unlock();
 
         return flow != NULL;
 }
@@ -1439,15 +1769,13 @@ size_t kfa_flow_max_sdu_size(struct kfa * kfa, port_id_t port_id)
 	size_t result;
 	struct ipcp_flow *flow;
 
-        spin_lock_bh(&kfa->lock);
-        flow = kfa_pmap_find(kfa->flows, port_id);
-        if (!flow) {
-        	result = 0;
-        } else {
-        	result = flow->ipc_process->
-        			ops->max_sdu_size(flow->ipc_process->data);
-        }
-        spin_unlock_bh(&kfa->lock);
+        flow = kfa_flow_get(kfa, port_id);
+        if (!flow)
+        	return 0;
+
+        result = flow->ipc_process->
+        		ops->max_sdu_size(flow->ipc_process->data);
+        kfa_flow_put(kfa, flow);
 
         return result;
 }
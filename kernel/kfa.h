@@ -65,11 +65,37 @@ int kfa_flow_du_read(struct kfa  * instance,
 		     size_t       size,
                      bool blocking);
 
-int kfa_flow_readable(struct kfa       *instance,
-                      port_id_t        id,
-                      unsigned int     *mask,
-                      struct file      *f,
-                      poll_table       *wait);
+/*
+ * Batched I/O, see struct irati_iodev_batch. The read dequeues at most
+ * max SDUs whose records fit in budget bytes, the write sends count
+ * records from buffer. Both return the number of SDUs moved.
+ */
+int kfa_flow_du_read_batch(struct kfa  * instance,
+			   port_id_t    id,
+			   struct du ** dus,
+			   int          max,
+			   size_t       budget,
+			   bool         blocking);
+
+/*
+ * Gives back SDUs taken by kfa_flow_du_read_batch() that could not be
+ * delivered, they are read again first. Takes ownership of the SDUs.
+ */
+void kfa_flow_du_unread_batch(struct kfa  * instance,
+			      port_id_t    id,
+			      struct du ** dus,
+			      int          n);
+
+int kfa_flow_ub_write_batch(struct kfa *	  instance,
+			    port_id_t		  id,
+			    const char __user * buffer,
+			    size_t		  size,
+			    unsigned int	  count,
+			    bool		  blocking);
+
+/* Returns the POLL* events currently ready on the flow */
+unsigned int kfa_flow_poll_mask(struct kfa * instance,
+				port_id_t    id);
 
 int kfa_flow_set_iowqs(struct kfa      * instance,
 		       struct iowaitqs * wqs,
@@ -78,6 +104,17 @@ int kfa_flow_set_iowqs(struct kfa      * instance,
 int kfa_flow_cancel_iowqs(struct kfa      * instance,
 			   port_id_t pid);
 
+/* Binds a shared RX ring of the I/O dev to the flow (NULL unbinds it) */
+struct sdu_ring;
+int kfa_flow_rx_ring_set(struct kfa      * instance,
+			 port_id_t         id,
+			 struct sdu_ring * ring);
+
+/* Returns the SDUs available in the RX ring, 0 on EOF */
+int kfa_flow_rx_ring_sync(struct kfa * instance,
+			  port_id_t    id,
+			  bool         blocking);
+
 #if 0
 struct ipcp_flow *kfa_flow_find_by_pid(struct kfa *instance,
 				       port_id_t   pid);
@@ -85,7 +122,7 @@ struct ipcp_flow *kfa_flow_find_by_pid(struct kfa *instance,
 
 struct rmt;
 
-/* structure automatically freed when there are no more readers or writers */
+/* structure automatically freed when the last reference is dropped */
 int kfa_flow_create(struct kfa           *instance,
 		    port_id_t		  pid,
 		    struct ipcp_instance *ipcp,
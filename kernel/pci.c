@@ -25,6 +25,7 @@
 #include <linux/types.h>
 #include <linux/skbuff.h>
 #include <linux/version.h>
+#include <asm/unaligned.h>
 
 #define RINA_PREFIX "pci"
 
@@ -124,19 +125,38 @@ enum pci_field_index {
  *};
 */
 
+/*
+ * The offsets table handed out in efcp_config is the head of a kernel-only
+ * layout, which also records the specialized accessors for its dt_cons.
+ * Keeping the offsets first means that rkfree() of the table releases the
+ * whole layout.
+ */
+struct pci_accessors;
+
+struct pci_layout {
+	ssize_t                      offsets[PCI_FIELD_INDEX_MAX];
+	/* Accessors specialized for this layout, NULL if generic */
+	const struct pci_accessors * acc;
+};
+
+static const struct pci_accessors *
+pci_accessors_select(const struct dt_cons * dt_cons);
+
 ssize_t *pci_offset_table_create(struct dt_cons *dt_cons)
 {
+	struct pci_layout *layout;
 	ssize_t *pci_offsets;
 	ssize_t offset = 0;
 	ssize_t base_offset = 0;
 	int i;
 
-	pci_offsets = rkzalloc(PCI_FIELD_INDEX_MAX * sizeof(offset),
-			       GFP_KERNEL);
-	if (!pci_offsets) {
+	layout = rkzalloc(sizeof(*layout), GFP_KERNEL);
+	if (!layout) {
 		LOG_ERR("Could not allocate memory for PCI offsets table");
 		return NULL;
 	}
+	layout->acc = pci_accessors_select(dt_cons);
+	pci_offsets = layout->offsets;
 
 	for (i = 0; i < PCI_FIELD_INDEX_MAX; i++) {
 		pci_offsets[i] = offset;
@@ -275,6 +295,10 @@ static struct efcp_config *__pci_efcp_config_get(const struct pci *pci)
 	return pdu->cfg;
 }
 
+static inline struct pci_layout *
+__pci_layout_get(const struct efcp_config *cfg)
+{ return container_of(cfg->pci_offset_table, struct pci_layout, offsets[0]); }
+
 #define PCI_GETTER(pci, pci_index, dt_cons_field, type)			\
 	{struct efcp_config *cfg;					\
 	cfg = __pci_efcp_config_get(pci);				\
@@ -345,41 +369,235 @@ static struct efcp_config *__pci_efcp_config_get(const struct pci *pci)
 	}								\
 	return 0;}
 
+/*
+ * Accessors specialized for the most common data transfer constants.
+ * With the field widths known at compile time every offset folds into a
+ * constant, so each access is a single load or store instead of a
+ * container_of, an offsets table lookup and a switch on the dt_cons
+ * width. One variant is selected per EFCP config by pci_accessors_select();
+ * any other layout keeps using the generic macros above.
+ */
+struct pci_accessors {
+	const char * name;
+	uint16_t     address_length;
+	uint16_t     qos_id_length;
+	uint16_t     cep_id_length;
+	uint16_t     length_length;
+	uint16_t     seq_num_length;
+
+	pdu_type_t   (* type)(const unsigned char * h);
+	pdu_flags_t  (* flags)(const unsigned char * h);
+	address_t    (* destination)(const unsigned char * h);
+	address_t    (* source)(const unsigned char * h);
+	qos_id_t     (* qos_id)(const unsigned char * h);
+	cep_id_t     (* cep_destination)(const unsigned char * h);
+	cep_id_t     (* cep_source)(const unsigned char * h);
+	ssize_t      (* length)(const unsigned char * h);
+	seq_num_t    (* sequence_number)(const unsigned char * h);
+	void         (* flags_set)(unsigned char * h, pdu_flags_t flags);
+	void         (* format)(unsigned char * h,
+				cep_id_t     src_cep_id,
+				cep_id_t     dst_cep_id,
+				address_t    src_address,
+				address_t    dst_address,
+				seq_num_t    sequence_number,
+				qos_id_t     qos_id,
+				pdu_flags_t  flags,
+				ssize_t      length,
+				pdu_type_t   type);
+};
+
+/* Same byte order as the generic macros, just without alignment needs */
+#define PCI_LD(h, off, w)						\
+	((w) == 1 ? *((const __u8 *) ((h) + (off))) :			\
+	 (w) == 2 ? get_unaligned((const __u16 *) ((h) + (off))) :	\
+	 get_unaligned((const __u32 *) ((h) + (off))))
+
+#define PCI_ST(h, off, w, val)						\
+	do {								\
+		if ((w) == 1)						\
+			*((__u8 *) ((h) + (off))) = (val);		\
+		else if ((w) == 2)					\
+			put_unaligned((__u16) (val),			\
+				      (__u16 *) ((h) + (off)));		\
+		else							\
+			put_unaligned((__u32) (val),			\
+				      (__u32 *) ((h) + (off)));		\
+	} while (0)
+
+/* Base PCI offsets, as computed by pci_offset_table_create() */
+#define PCI_OFF_DST(A, Q, C, L)   (VERSION_SIZE)
+#define PCI_OFF_SRC(A, Q, C, L)   (PCI_OFF_DST(A, Q, C, L) + (A))
+#define PCI_OFF_QOS(A, Q, C, L)   (PCI_OFF_SRC(A, Q, C, L) + (A))
+#define PCI_OFF_DCEP(A, Q, C, L)  (PCI_OFF_QOS(A, Q, C, L) + (Q))
+#define PCI_OFF_SCEP(A, Q, C, L)  (PCI_OFF_DCEP(A, Q, C, L) + (C))
+#define PCI_OFF_TYPE(A, Q, C, L)  (PCI_OFF_SCEP(A, Q, C, L) + (C))
+#define PCI_OFF_FLAGS(A, Q, C, L) (PCI_OFF_TYPE(A, Q, C, L) + TYPE_SIZE)
+#define PCI_OFF_LEN(A, Q, C, L)   (PCI_OFF_FLAGS(A, Q, C, L) + FLAGS_SIZE)
+#define PCI_OFF_SN(A, Q, C, L)    (PCI_OFF_LEN(A, Q, C, L) + (L))
+
+#define PCI_ACCESSORS_DEFINE(sfx, A, Q, C, L, S)			\
+static pdu_type_t pci_type_##sfx(const unsigned char * h)		\
+{ return PCI_LD(h, PCI_OFF_TYPE(A, Q, C, L), TYPE_SIZE); }		\
+static pdu_flags_t pci_flags_##sfx(const unsigned char * h)		\
+{ return PCI_LD(h, PCI_OFF_FLAGS(A, Q, C, L), FLAGS_SIZE); }		\
+static address_t pci_dst_##sfx(const unsigned char * h)		\
+{ return (address_t) PCI_LD(h, PCI_OFF_DST(A, Q, C, L), A); }		\
+static address_t pci_src_##sfx(const unsigned char * h)		\
+{ return (address_t) PCI_LD(h, PCI_OFF_SRC(A, Q, C, L), A); }		\
+static qos_id_t pci_qos_##sfx(const unsigned char * h)			\
+{ return (qos_id_t) PCI_LD(h, PCI_OFF_QOS(A, Q, C, L), Q); }		\
+static cep_id_t pci_dcep_##sfx(const unsigned char * h)		\
+{ return (cep_id_t) PCI_LD(h, PCI_OFF_DCEP(A, Q, C, L), C); }		\
+static cep_id_t pci_scep_##sfx(const unsigned char * h)		\
+{ return (cep_id_t) PCI_LD(h, PCI_OFF_SCEP(A, Q, C, L), C); }		\
+static ssize_t pci_len_##sfx(const unsigned char * h)			\
+{ return (ssize_t) PCI_LD(h, PCI_OFF_LEN(A, Q, C, L), L); }		\
+static seq_num_t pci_sn_##sfx(const unsigned char * h)			\
+{ return (seq_num_t) PCI_LD(h, PCI_OFF_SN(A, Q, C, L), S); }		\
+static void pci_flags_set_##sfx(unsigned char * h, pdu_flags_t flags)	\
+{ PCI_ST(h, PCI_OFF_FLAGS(A, Q, C, L), FLAGS_SIZE, flags); }		\
+static void pci_format_##sfx(unsigned char * h,			\
+			     cep_id_t    src_cep_id,			\
+			     cep_id_t    dst_cep_id,			\
+			     address_t   src_address,			\
+			     address_t   dst_address,			\
+			     seq_num_t   sequence_number,		\
+			     qos_id_t    qos_id,			\
+			     pdu_flags_t flags,				\
+			     ssize_t     length,			\
+			     pdu_type_t  type)				\
+{									\
+	PCI_ST(h, 0, VERSION_SIZE, VERSION);				\
+	PCI_ST(h, PCI_OFF_DST(A, Q, C, L), A, dst_address);		\
+	PCI_ST(h, PCI_OFF_SRC(A, Q, C, L), A, src_address);		\
+	PCI_ST(h, PCI_OFF_QOS(A, Q, C, L), Q, qos_id);			\
+	PCI_ST(h, PCI_OFF_DCEP(A, Q, C, L), C, dst_cep_id);		\
+	PCI_ST(h, PCI_OFF_SCEP(A, Q, C, L), C, src_cep_id);		\
+	PCI_ST(h, PCI_OFF_TYPE(A, Q, C, L), TYPE_SIZE, type);		\
+	PCI_ST(h, PCI_OFF_FLAGS(A, Q, C, L), FLAGS_SIZE, flags);	\
+	PCI_ST(h, PCI_OFF_LEN(A, Q, C, L), L, length);			\
+	PCI_ST(h, PCI_OFF_SN(A, Q, C, L), S, sequence_number);		\
+}									\
+static const struct pci_accessors pci_acc_##sfx = {			\
+	.name            = #sfx,					\
+	.address_length  = A,						\
+	.qos_id_length   = Q,						\
+	.cep_id_length   = C,						\
+	.length_length   = L,						\
+	.seq_num_length  = S,						\
+	.type            = pci_type_##sfx,				\
+	.flags           = pci_flags_##sfx,				\
+	.destination     = pci_dst_##sfx,				\
+	.source          = pci_src_##sfx,				\
+	.qos_id          = pci_qos_##sfx,				\
+	.cep_destination = pci_dcep_##sfx,				\
+	.cep_source      = pci_scep_##sfx,				\
+	.length          = pci_len_##sfx,				\
+	.sequence_number = pci_sn_##sfx,				\
+	.flags_set       = pci_flags_set_##sfx,				\
+	.format          = pci_format_##sfx,				\
+}
+
+/*                  address qos cep len seqnum */
+PCI_ACCESSORS_DEFINE(a16,       2,  2,  2,  2,  4);
+PCI_ACCESSORS_DEFINE(a32,       4,  2,  2,  2,  4);
+PCI_ACCESSORS_DEFINE(a32c32,    4,  2,  4,  4,  4);
+
+static const struct pci_accessors * pci_accessors_table[] = {
+	&pci_acc_a16,
+	&pci_acc_a32,
+	&pci_acc_a32c32,
+};
+
+static const struct pci_accessors *
+pci_accessors_select(const struct dt_cons * dt_cons)
+{
+	const struct pci_accessors * ops;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pci_accessors_table); i++) {
+		ops = pci_accessors_table[i];
+		if (dt_cons->address_length == ops->address_length &&
+		    dt_cons->qos_id_length  == ops->qos_id_length  &&
+		    dt_cons->cep_id_length  == ops->cep_id_length  &&
+		    dt_cons->length_length  == ops->length_length  &&
+		    dt_cons->seq_num_length == ops->seq_num_length) {
+			LOG_DBG("Using specialized PCI accessors (%s)",
+				ops->name);
+			return ops;
+		}
+	}
+
+	LOG_DBG("No specialized PCI accessors, using the generic ones");
+	return NULL;
+}
+
+#define PCI_ACC_GETTER(pci, op)						\
+	{const struct pci_accessors *ops;				\
+	ops = __pci_layout_get(__pci_efcp_config_get(pci))->acc;	\
+	if (likely(ops))						\
+		return ops->op(pci->h);}
+
 /* Base getters */
 cep_id_t pci_version(const struct pci *pci)
 { PCI_GETTER_NO_DTC(pci, PCI_BASE_VERSION, VERSION_SIZE, version_t); }
 EXPORT_SYMBOL(pci_version);
 
 cep_id_t pci_cep_source(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_SRC_CEP, cep_id_length, cep_id_t); }
+{
+	PCI_ACC_GETTER(pci, cep_source);
+	PCI_GETTER(pci, PCI_BASE_SRC_CEP, cep_id_length, cep_id_t);
+}
 EXPORT_SYMBOL(pci_cep_source);
 
 cep_id_t pci_cep_destination(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_DST_CEP, cep_id_length, cep_id_t); }
+{
+	PCI_ACC_GETTER(pci, cep_destination);
+	PCI_GETTER(pci, PCI_BASE_DST_CEP, cep_id_length, cep_id_t);
+}
 EXPORT_SYMBOL(pci_cep_destination);
 
 address_t pci_destination(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_DST_ADD, address_length, address_t); }
+{
+	PCI_ACC_GETTER(pci, destination);
+	PCI_GETTER(pci, PCI_BASE_DST_ADD, address_length, address_t);
+}
 EXPORT_SYMBOL(pci_destination);
 
 address_t pci_source(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_SRC_ADD, address_length, address_t); }
+{
+	PCI_ACC_GETTER(pci, source);
+	PCI_GETTER(pci, PCI_BASE_SRC_ADD, address_length, address_t);
+}
 EXPORT_SYMBOL(pci_source);
 
 qos_id_t pci_qos_id(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_QOS_ID, qos_id_length, qos_id_t); }
+{
+	PCI_ACC_GETTER(pci, qos_id);
+	PCI_GETTER(pci, PCI_BASE_QOS_ID, qos_id_length, qos_id_t);
+}
 EXPORT_SYMBOL(pci_qos_id);
 
 pdu_type_t pci_type(const struct pci *pci)
-{ PCI_GETTER_NO_DTC(pci, PCI_BASE_TYPE, TYPE_SIZE, pdu_type_t); }
+{
+	PCI_ACC_GETTER(pci, type);
+	PCI_GETTER_NO_DTC(pci, PCI_BASE_TYPE, TYPE_SIZE, pdu_type_t);
+}
 EXPORT_SYMBOL(pci_type);
 
 pdu_flags_t pci_flags_get(const struct pci *pci)
-{ PCI_GETTER_NO_DTC(pci, PCI_BASE_FLAGS, FLAGS_SIZE, pdu_flags_t); }
+{
+	PCI_ACC_GETTER(pci, flags);
+	PCI_GETTER_NO_DTC(pci, PCI_BASE_FLAGS, FLAGS_SIZE, pdu_flags_t);
+}
 EXPORT_SYMBOL(pci_flags_get);
 
 ssize_t pci_length(const struct pci *pci)
-{ PCI_GETTER(pci, PCI_BASE_LEN, length_length, ssize_t); }
+{
+	PCI_ACC_GETTER(pci, length);
+	PCI_GETTER(pci, PCI_BASE_LEN, length_length, ssize_t);
+}
 EXPORT_SYMBOL(pci_length);
 
 /* Base setters */
@@ -416,7 +634,16 @@ int pci_type_set(struct pci *pci, pdu_type_t type)
 EXPORT_SYMBOL(pci_type_set);
 
 int pci_flags_set(struct pci *pci, pdu_flags_t flags)
-{ PCI_SETTER_NO_DTC(pci, PCI_BASE_FLAGS, FLAGS_SIZE, flags); }
+{
+	const struct pci_accessors *ops =
+		__pci_layout_get(__pci_efcp_config_get(pci))->acc;
+
+	if (likely(ops)) {
+		ops->flags_set(pci->h, flags);
+		return 0;
+	}
+	PCI_SETTER_NO_DTC(pci, PCI_BASE_FLAGS, FLAGS_SIZE, flags);
+}
 EXPORT_SYMBOL(pci_flags_set);
 
 int pci_len_set(struct pci *pci, ssize_t len)
@@ -434,6 +661,16 @@ int pci_format(struct pci *pci,
 	       ssize_t   length,
 	       pdu_type_t type)
 {
+	const struct pci_accessors *ops =
+		__pci_layout_get(__pci_efcp_config_get(pci))->acc;
+
+	if (likely(ops)) {
+		ops->format(pci->h, src_cep_id, dst_cep_id, src_address,
+			    dst_address, sequence_number, qos_id, flags,
+			    length, type);
+		return 0;
+	}
+
 	if (pci_version_set(pci, VERSION)                 ||
 	    pci_type_set(pci, type)                       ||
 	    pci_cep_destination_set(pci, dst_cep_id)      ||
@@ -488,12 +725,20 @@ ssize_t pci_calculate_size(struct efcp_config *cfg, pdu_type_t type)
 }
 EXPORT_SYMBOL(pci_calculate_size);
 
+/* Length of the fields common to all PDU types, type and addresses included */
+ssize_t pci_base_size(struct efcp_config *cfg)
+{
+	return cfg->pci_offset_table[PCI_DT_MGMT_SN];
+}
+EXPORT_SYMBOL(pci_base_size);
+
 /* Custom getters */
 seq_num_t pci_sequence_number_get(const struct pci *pci)
 {
 	switch (pci_type(pci)) {
 	case PDU_TYPE_DT:
 	case PDU_TYPE_MGMT:
+		PCI_ACC_GETTER(pci, sequence_number);
 		PCI_GETTER(pci, PCI_DT_MGMT_SN, seq_num_length, seq_num_t);
 	/* FIXME: we need to make sure the type exists, maybe redefine
 	 * pdu_type_t as union
@@ -906,3 +1151,115 @@ fail:
 }
 EXPORT_SYMBOL(pci_getset_test);
 #endif
+
+#ifdef CONFIG_RINA_PCI_REGRESSION_TESTS
+#include <linux/ktime.h>
+
+#define PCI_TEST_ROUNDS 1000000
+#define PCI_TEST_HLEN   64
+
+/* Formats and parses a DT PCI PCI_TEST_ROUNDS times, returns a checksum */
+static u64 pci_test_run(struct du * du, u64 * encap_ns, u64 * decap_ns)
+{
+	struct pci * pci = &du->pci;
+	u64 sum = 0;
+	ktime_t start;
+	int i;
+
+	start = ktime_get();
+	for (i = 0; i < PCI_TEST_ROUNDS; i++)
+		pci_format(pci, i & 0x7fff, (i + 1) & 0x7fff, i & 0xffff,
+			   (i + 2) & 0xffff, i, i & 0x7f, PDU_FLAGS_DATA_RUN,
+			   (i + 3) & 0xffff, PDU_TYPE_DT);
+	*encap_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	start = ktime_get();
+	for (i = 0; i < PCI_TEST_ROUNDS; i++) {
+		pci->h[PCI_TEST_HLEN - 1] = i;
+		sum += pci_destination(pci) + pci_source(pci) +
+		       pci_qos_id(pci) + pci_cep_destination(pci) +
+		       pci_cep_source(pci) + pci_flags_get(pci) +
+		       pci_length(pci) + pci_sequence_number_get(pci);
+	}
+	*decap_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	return sum;
+}
+
+/*
+ * Checks that the specialized accessors produce the same PCI as the
+ * generic ones, and reports the encap/decap cost of both per layout
+ */
+bool regression_tests_pci(void)
+{
+	unsigned char generic_h[PCI_TEST_HLEN];
+	unsigned char specialized_h[PCI_TEST_HLEN];
+	u64 generic_sum, specialized_sum;
+	u64 g_encap, g_decap, s_encap, s_decap;
+	const struct pci_accessors * ops;
+	struct pci_layout * layout;
+	struct efcp_config cfg;
+	struct dt_cons dt_cons;
+	struct du du;
+	bool ok = true;
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pci_accessors_table); i++) {
+		ops = pci_accessors_table[i];
+
+		memset(&dt_cons, 0, sizeof(dt_cons));
+		dt_cons.address_length      = ops->address_length;
+		dt_cons.qos_id_length       = ops->qos_id_length;
+		dt_cons.cep_id_length       = ops->cep_id_length;
+		dt_cons.length_length       = ops->length_length;
+		dt_cons.seq_num_length      = ops->seq_num_length;
+		dt_cons.ctrl_seq_num_length = ops->seq_num_length;
+		dt_cons.rate_length         = 4;
+		dt_cons.frame_length        = 4;
+
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.dt_cons = &dt_cons;
+		cfg.pci_offset_table = pci_offset_table_create(&dt_cons);
+		if (!cfg.pci_offset_table)
+			return false;
+
+		layout = __pci_layout_get(&cfg);
+		if (layout->acc != ops) {
+			LOG_ERR("Layout %s not selected for its own dt_cons",
+				ops->name);
+			ok = false;
+		}
+
+		memset(&du, 0, sizeof(du));
+		du.cfg = &cfg;
+
+		memset(generic_h, 0, sizeof(generic_h));
+		du.pci.h = generic_h;
+		du.pci.len = cfg.pci_offset_table[PCI_DT_MGMT_SIZE];
+		layout->acc = NULL;
+		generic_sum = pci_test_run(&du, &g_encap, &g_decap);
+
+		memset(specialized_h, 0, sizeof(specialized_h));
+		du.pci.h = specialized_h;
+		layout->acc = ops;
+		specialized_sum = pci_test_run(&du, &s_encap, &s_decap);
+
+		if (generic_sum != specialized_sum ||
+		    memcmp(generic_h, specialized_h, du.pci.len)) {
+			LOG_ERR("Layout %s does not match the generic PCI",
+				ops->name);
+			ok = false;
+		}
+
+		LOG_INFO("PCI layout %s: encap %llu/%llu ns, "
+			 "decap %llu/%llu ns (generic/specialized, %d rounds)",
+			 ops->name, g_encap, s_encap, g_decap, s_decap,
+			 PCI_TEST_ROUNDS);
+
+		rkfree(cfg.pci_offset_table);
+	}
+
+	return ok;
+}
+EXPORT_SYMBOL(regression_tests_pci);
+#endif
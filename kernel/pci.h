@@ -96,6 +96,7 @@ struct pci {
 ssize_t	* pci_offset_table_create(struct dt_cons *dt_cons);
 bool pci_is_ok(const struct pci *pci);
 ssize_t	pci_calculate_size(struct efcp_config *cfg,pdu_type_t type);
+ssize_t	pci_base_size(struct efcp_config *cfg);
 int pci_cep_source_set(struct pci *pci, cep_id_t src_cep_id);
 int pci_cep_destination_set(struct pci *pci, cep_id_t dst_cep_id);
 int pci_destination_set(struct pci *pci, address_t dst_address);
@@ -155,4 +156,7 @@ int			pci_release(struct pci *pci); /* This should be called only after process_
 #if 0
 booli			pci_getset_test(void);
 #endif
+#ifdef CONFIG_RINA_PCI_REGRESSION_TESTS
+bool			regression_tests_pci(void);
+#endif
 #endif
@@ -0,0 +1,151 @@
+/*
+ * RINA object caches
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/export.h>
+#include <linux/irqflags.h>
+#include <linux/percpu.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#define RINA_PREFIX "rcache"
+
+#include "logs.h"
+#include "debug.h"
+#include "rmem.h"
+#include "rcache.h"
+
+#define RCACHE_MAGAZINE_SIZE 32
+
+struct rcache_magazine {
+        unsigned int count;
+        void *       objs[RCACHE_MAGAZINE_SIZE];
+};
+
+struct rcache {
+        struct kmem_cache *               slab;
+        size_t                            size;
+        struct rcache_magazine __percpu * mags;
+};
+
+struct rcache * rcache_create(const char * name, size_t size)
+{
+        struct rcache * cache;
+
+        if (!name || !size) {
+                LOG_ERR("Bogus input parameters, can't create rcache");
+                return NULL;
+        }
+
+        cache = rkzalloc(sizeof(*cache), GFP_KERNEL);
+        if (!cache)
+                return NULL;
+
+        cache->size = size;
+        cache->slab = kmem_cache_create(name, size, 0,
+                                        SLAB_HWCACHE_ALIGN, NULL);
+        if (!cache->slab) {
+                LOG_ERR("Cannot create slab cache %s", name);
+                rkfree(cache);
+                return NULL;
+        }
+
+        cache->mags = alloc_percpu(struct rcache_magazine);
+        if (!cache->mags) {
+                kmem_cache_destroy(cache->slab);
+                rkfree(cache);
+                return NULL;
+        }
+
+        return cache;
+}
+EXPORT_SYMBOL(rcache_create);
+
+/* No user of the cache can be around anymore */
+void rcache_destroy(struct rcache * cache)
+{
+        struct rcache_magazine * mag;
+        int                      cpu;
+
+        if (!cache)
+                return;
+
+        for_each_possible_cpu(cpu) {
+                mag = per_cpu_ptr(cache->mags, cpu);
+                while (mag->count)
+                        kmem_cache_free(cache->slab,
+                                        mag->objs[--mag->count]);
+        }
+
+        free_percpu(cache->mags);
+        kmem_cache_destroy(cache->slab);
+        rkfree(cache);
+}
+EXPORT_SYMBOL(rcache_destroy);
+
+void * rcache_alloc(struct rcache * cache, gfp_t flags)
+{
+        struct rcache_magazine * mag;
+        unsigned long            irqflags;
+        void *                   obj = NULL;
+
+        /* Objects are freed from any context, including hard IRQs */
+        local_irq_save(irqflags);
+        mag = this_cpu_ptr(cache->mags);
+        if (mag->count)
+                obj = mag->objs[--mag->count];
+        local_irq_restore(irqflags);
+
+        if (likely(obj))
+                return obj;
+
+        return kmem_cache_alloc(cache->slab, flags);
+}
+EXPORT_SYMBOL(rcache_alloc);
+
+void * rcache_zalloc(struct rcache * cache, gfp_t flags)
+{
+        void * obj;
+
+        obj = rcache_alloc(cache, flags);
+        if (obj)
+                memset(obj, 0, cache->size);
+
+        return obj;
+}
+EXPORT_SYMBOL(rcache_zalloc);
+
+void rcache_free(struct rcache * cache, void * obj)
+{
+        struct rcache_magazine * mag;
+        unsigned long            irqflags;
+
+        if (!obj)
+                return;
+
+        local_irq_save(irqflags);
+        mag = this_cpu_ptr(cache->mags);
+        if (mag->count < RCACHE_MAGAZINE_SIZE) {
+                mag->objs[mag->count++] = obj;
+                obj = NULL;
+        }
+        local_irq_restore(irqflags);
+
+        if (unlikely(obj))
+                kmem_cache_free(cache->slab, obj);
+}
+EXPORT_SYMBOL(rcache_free);
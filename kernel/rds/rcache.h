@@ -0,0 +1,38 @@
+/*
+ * RINA object caches
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RINA_RCACHE_H
+#define RINA_RCACHE_H
+
+#include <linux/types.h>
+
+/*
+ * Fixed size objects allocated from a dedicated slab, fronted by a small
+ * per-CPU magazine of free objects so that the alloc/free pairs done for
+ * every PDU do not reach the slab allocator in the common case.
+ */
+struct rcache;
+
+struct rcache * rcache_create(const char * name, size_t size);
+void            rcache_destroy(struct rcache * cache);
+
+void *          rcache_alloc(struct rcache * cache, gfp_t flags);
+void *          rcache_zalloc(struct rcache * cache, gfp_t flags);
+void            rcache_free(struct rcache * cache, void * obj);
+
+#endif
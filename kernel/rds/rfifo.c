@@ -21,6 +21,8 @@
 #include <linux/export.h>
 #include <linux/list.h>
 #include <linux/types.h>
+#include <linux/log2.h>
+#include <asm/barrier.h>
 
 #define RINA_PREFIX "rfifo"
 
@@ -30,9 +32,21 @@
 #include "rqueue.h"
 #include "rfifo.h"
 
-/* The crappiest implementation we could have at the moment ... */
+/*
+ * Either backed by an rqueue (unbounded, one allocation per push) or by
+ * a ring of entries. Ring indexes are free running, the slot is the index
+ * masked with size - 1, so the length is always tail - head. The producer
+ * publishes tail and the consumer publishes head with release semantics,
+ * which is all the SPSC mode needs and free for the serialized one.
+ */
 struct rfifo {
         struct rqueue * q;
+        void **         ring;
+        unsigned int    mask;
+        unsigned int    head;
+        unsigned int    tail;
+        bool            spsc;
+        bool            grow;
 };
 
 /* FIXME: This extern has to disappear from here */
@@ -65,6 +79,126 @@ struct rfifo * rfifo_create_ni(void)
 { return rfifo_create_gfp(GFP_ATOMIC); }
 EXPORT_SYMBOL(rfifo_create_ni);
 
+static struct rfifo * rfifo_create_ring_gfp(gfp_t        gfp,
+                                            unsigned int size,
+                                            unsigned int flags)
+{
+        struct rfifo * f;
+
+        if (!size || size > (1U << 31)) {
+                LOG_ERR("Bogus ring size %u", size);
+                return NULL;
+        }
+        size = roundup_pow_of_two(size);
+
+        f = rkzalloc(sizeof(*f), gfp);
+        if (!f)
+                return NULL;
+
+        f->ring = rkzalloc(size * sizeof(*f->ring), gfp);
+        if (!f->ring) {
+                rkfree(f);
+                return NULL;
+        }
+        f->mask = size - 1;
+        f->spsc = (flags & RFIFO_SPSC) ? true : false;
+        f->grow = !f->spsc && (flags & RFIFO_GROW);
+
+        LOG_DBG("Ring FIFO %pK created successfully (%u entries)", f, size);
+
+        return f;
+}
+
+struct rfifo * rfifo_create_ring(unsigned int size, unsigned int flags)
+{ return rfifo_create_ring_gfp(GFP_KERNEL, size, flags); }
+EXPORT_SYMBOL(rfifo_create_ring);
+
+struct rfifo * rfifo_create_ring_ni(unsigned int size, unsigned int flags)
+{ return rfifo_create_ring_gfp(GFP_ATOMIC, size, flags); }
+EXPORT_SYMBOL(rfifo_create_ring_ni);
+
+/* Doubles a full ring, the entries keep their free running indexes */
+static int ring_grow(struct rfifo * f)
+{
+        unsigned int size = (f->mask + 1) * 2;
+        void **      ring;
+        unsigned int i;
+
+        if (size > (1U << 31))
+                return -1;
+
+        ring = rkzalloc(size * sizeof(*ring), GFP_ATOMIC);
+        if (!ring)
+                return -1;
+
+        for (i = f->head; i != f->tail; i++)
+                ring[i & (size - 1)] = f->ring[i & f->mask];
+
+        rkfree(f->ring);
+        f->ring = ring;
+        f->mask = size - 1;
+
+        LOG_DBG("Ring FIFO %pK grown to %u entries", f, size);
+
+        return 0;
+}
+
+static int ring_push(struct rfifo * f, void * e)
+{
+        unsigned int tail = f->tail;
+
+        if (tail - smp_load_acquire(&f->head) > f->mask &&
+            (!f->grow || ring_grow(f)))
+                return -1;
+
+        f->ring[tail & f->mask] = e;
+        smp_store_release(&f->tail, tail + 1);
+
+        return 0;
+}
+
+static int ring_head_push(struct rfifo * f, void * e)
+{
+        unsigned int head = f->head;
+
+        if (f->spsc) {
+                LOG_ERR("Can't push into the head of a SPSC fifo");
+                return -1;
+        }
+        if (f->tail - head > f->mask && (!f->grow || ring_grow(f)))
+                return -1;
+
+        head--;
+        f->ring[head & f->mask] = e;
+        f->head = head;
+
+        return 0;
+}
+
+static void * ring_peek(struct rfifo * f)
+{
+        unsigned int head = f->head;
+
+        if (head == smp_load_acquire(&f->tail))
+                return NULL;
+
+        return f->ring[head & f->mask];
+}
+
+static void * ring_pop(struct rfifo * f)
+{
+        unsigned int head = f->head;
+        void *       e;
+
+        if (head == smp_load_acquire(&f->tail))
+                return NULL;
+
+        e = f->ring[head & f->mask];
+        smp_store_release(&f->head, head + 1);
+
+        return e;
+}
+
 int rfifo_destroy(struct rfifo * f,
                   void        (* dtor)(void * e))
 {
@@ -77,7 +211,11 @@ int rfifo_destroy(struct rfifo * f,
                 return -1;
         }
 
-        if (rqueue_destroy(f->q, dtor))
+        if (f->ring) {
+                while (f->head != f->tail)
+                        dtor(ring_pop(f));
+                rkfree(f->ring);
+        } else if (rqueue_destroy(f->q, dtor))
                 return -1;
         rkfree(f);
 
@@ -94,6 +232,9 @@ int rfifo_push(struct rfifo * f, void * e)
                 return -1;
         }
 
+        if (f->ring)
+                return ring_push(f, e);
+
         return rqueue_tail_push(f->q, e);
 }
 EXPORT_SYMBOL(rfifo_push);
@@ -105,6 +246,9 @@ int rfifo_push_ni(struct rfifo * f, void * e)
                 return -1;
         }
 
+        if (f->ring)
+                return ring_push(f, e);
+
         return rqueue_tail_push_ni(f->q, e);
 }
 EXPORT_SYMBOL(rfifo_push_ni);
@@ -116,6 +260,9 @@ int rfifo_head_push_ni(struct rfifo * f, void * e)
                 return -1;
         }
 
+        if (f->ring)
+                return ring_head_push(f, e);
+
         return rqueue_head_push_ni(f->q, e);
 }
 EXPORT_SYMBOL(rfifo_head_push_ni);
@@ -127,6 +274,9 @@ void * rfifo_pop(struct rfifo * f)
                 return NULL;
         }
 
+        if (f->ring)
+                return ring_pop(f);
+
         return rqueue_head_pop(f->q);
 }
 EXPORT_SYMBOL(rfifo_pop);
@@ -138,6 +288,9 @@ void * rfifo_peek(struct rfifo * f)
                 return NULL;
         }
 
+        if (f->ring)
+                return ring_peek(f);
+
         return rqueue_head_peek(f->q);
 }
 EXPORT_SYMBOL(rfifo_peek);
@@ -149,22 +302,342 @@ bool rfifo_is_empty(struct rfifo * f)
                 return false;
         }
 
+        if (f->ring)
+                return READ_ONCE(f->head) == READ_ONCE(f->tail);
+
         return rqueue_is_empty(f->q);
 }
 EXPORT_SYMBOL(rfifo_is_empty);
 
 ssize_t rfifo_length(struct rfifo * f)
 {
+        unsigned int head;
+
         if (!f) {
                 LOG_ERR("Can't get size of a NULL fifo");
                 return -1;
         }
 
+        if (f->ring) {
+                /* Head first, so that the result never goes negative */
+                head = READ_ONCE(f->head);
+                return READ_ONCE(f->tail) - head;
+        }
+
         return rqueue_length(f->q);
 }
 EXPORT_SYMBOL(rfifo_length);
 
 #ifdef CONFIG_RINA_RFIFO_REGRESSION_TESTS
+#include <linux/kthread.h>
+#include <linux/sched.h>
+
+#define RFIFO_TEST_SIZE       8
+#define RFIFO_TEST_SPSC_ITEMS 1000000
+
+static void rfifo_test_dtor(void * e)
+{ }
+
+/* Entries are small integers disguised as pointers, 0 is never used */
+#define TE(i) ((void *) (unsigned long) (i))
+
+static bool rfifo_test_wraparound(void)
+{
+        struct rfifo * f;
+        unsigned long  next_in = 1, next_out = 1;
+        bool           ok = false;
+        int            round, i;
+
+        f = rfifo_create_ring(RFIFO_TEST_SIZE, 0);
+        if (!f)
+                return false;
+
+        if (!rfifo_is_empty(f) || rfifo_pop(f) || rfifo_peek(f)) {
+                LOG_ERR("New ring is not empty");
+                goto out;
+        }
+
+        /* Fill and drain it several times, crossing the end of the array */
+        for (round = 0; round < 5; round++) {
+                for (i = 0; i < RFIFO_TEST_SIZE; i++) {
+                        if (rfifo_push(f, TE(next_in++))) {
+                                LOG_ERR("Push %d failed in round %d",
+                                        i, round);
+                                goto out;
+                        }
+                }
+
+                if (!rfifo_push(f, TE(next_in))) {
+                        LOG_ERR("Push into a full ring succeeded");
+                        goto out;
+                }
+                if (rfifo_length(f) != RFIFO_TEST_SIZE) {
+                        LOG_ERR("Wrong length of a full ring: %zd",
+                                rfifo_length(f));
+                        goto out;
+                }
+
+                /* Leave some behind, so that the indexes drift */
+                for (i = 0; i < RFIFO_TEST_SIZE - round % 3; i++) {
+                        if (rfifo_pop(f) != TE(next_out++)) {
+                                LOG_ERR("Wrong entry popped in round %d",
+                                        round);
+                                goto out;
+                        }
+                }
+                while (rfifo_length(f) > 0) {
+                        if (rfifo_pop(f) != TE(next_out++)) {
+                                LOG_ERR("Wrong entry drained in round %d",
+                                        round);
+                                goto out;
+                        }
+                }
+
+                if (!rfifo_is_empty(f) || rfifo_pop(f)) {
+                        LOG_ERR("Drained ring is not empty");
+                        goto out;
+                }
+        }
+
+        ok = true;
+ out:
+        rfifo_destroy(f, rfifo_test_dtor);
+        return ok;
+}
+
+static bool rfifo_test_mixed(struct rfifo * f, const char * what)
+{
+        unsigned long next_in = 1, next_out = 1;
+        ssize_t       expected = 0;
+        int           i;
+
+        /* Two pushes, one pop per step, then drain */
+        for (i = 0; i < 100; i++) {
+                if (rfifo_push_ni(f, TE(next_in++)) ||
+                    rfifo_push_ni(f, TE(next_in++))) {
+                        LOG_ERR("%s: push failed at step %d", what, i);
+                        return false;
+                }
+                if (rfifo_peek(f) != TE(next_out) ||
+                    rfifo_pop(f) != TE(next_out)) {
+                        LOG_ERR("%s: wrong entry at step %d", what, i);
+                        return false;
+                }
+                next_out++;
+                expected++;
+
+                if (rfifo_length(f) != expected) {
+                        LOG_ERR("%s: length %zd, expected %zd", what,
+                                rfifo_length(f), expected);
+                        return false;
+                }
+        }
+
+        while (!rfifo_is_empty(f)) {
+                if (rfifo_pop(f) != TE(next_out++)) {
+                        LOG_ERR("%s: wrong entry while draining", what);
+                        return false;
+                }
+        }
+
+        if (next_out != next_in || rfifo_length(f) != 0) {
+                LOG_ERR("%s: entries lost", what);
+                return false;
+        }
+
+        return true;
+}
+
+static bool rfifo_test_head_push(void)
+{
+        struct rfifo * f;
+        bool           ok = false;
+        int            i;
+
+        f = rfifo_create_ring(RFIFO_TEST_SIZE, 0);
+        if (!f)
+                return false;
+
+        /* 3 4 at the tail, then 2 and 1 pushed back into the head */
+        if (rfifo_push(f, TE(3)) || rfifo_push(f, TE(4)) ||
+            rfifo_head_push_ni(f, TE(2)) || rfifo_head_push_ni(f, TE(1))) {
+                LOG_ERR("Could not push into the ring");
+                goto out;
+        }
+
+        for (i = 1; i <= 4; i++) {
+                if (rfifo_pop(f) != TE(i)) {
+                        LOG_ERR("Wrong entry %d after head pushes", i);
+                        goto out;
+                }
+        }
+
+        /* Head pushes into a full ring fail too */
+        for (i = 0; i < RFIFO_TEST_SIZE; i++)
+                rfifo_push(f, TE(i + 1));
+        if (!rfifo_head_push_ni(f, TE(100))) {
+                LOG_ERR("Head push into a full ring succeeded");
+                goto out;
+        }
+
+        ok = true;
+ out:
+        rfifo_destroy(f, rfifo_test_dtor);
+        return ok;
+}
+
+static bool rfifo_test_grow(void)
+{
+        struct rfifo * f;
+        bool           ok = false;
+        int            i;
+
+        f = rfifo_create_ring(RFIFO_TEST_SIZE, RFIFO_GROW);
+        if (!f)
+                return false;
+
+        /* Drift the indexes first, so that growing has to unwrap */
+        for (i = 0; i < RFIFO_TEST_SIZE / 2 + 1; i++) {
+                rfifo_push(f, TE(1));
+                rfifo_pop(f);
+        }
+
+        for (i = 1; i <= 10 * RFIFO_TEST_SIZE; i++) {
+                if (rfifo_push(f, TE(i))) {
+                        LOG_ERR("Push %d into a growing ring failed", i);
+                        goto out;
+                }
+        }
+        if (rfifo_head_push_ni(f, TE(i))) {
+                LOG_ERR("Head push into a growing ring failed");
+                goto out;
+        }
+        if (rfifo_pop(f) != TE(i)) {
+                LOG_ERR("Wrong entry at the head of a grown ring");
+                goto out;
+        }
+
+        for (i = 1; i <= 10 * RFIFO_TEST_SIZE; i++) {
+                if (rfifo_pop(f) != TE(i)) {
+                        LOG_ERR("Wrong entry %d in a grown ring", i);
+                        goto out;
+                }
+        }
+
+        ok = rfifo_is_empty(f);
+ out:
+        rfifo_destroy(f, rfifo_test_dtor);
+        return ok;
+}
+
+static int rfifo_test_producer(void * data)
+{
+        struct rfifo * f = data;
+        unsigned long  i;
+
+        for (i = 1; i <= RFIFO_TEST_SPSC_ITEMS; i++) {
+                while (rfifo_push(f, TE(i))) {
+                        if (kthread_should_stop())
+                                return 0;
+                        cond_resched();
+                }
+        }
+
+        while (!kthread_should_stop())
+                schedule_timeout_interruptible(1);
+
+        return 0;
+}
+
+/* One producer thread and this one as the consumer, without locks */
+static bool rfifo_test_spsc(void)
+{
+        struct task_struct * producer;
+        struct rfifo *       f;
+        unsigned long        next = 1;
+        void *               e;
+        bool                 ok = true;
+
+        f = rfifo_create_ring(RFIFO_TEST_SIZE, RFIFO_SPSC);
+        if (!f)
+                return false;
+
+        if (!rfifo_head_push_ni(f, TE(1))) {
+                LOG_ERR("Head push allowed on a SPSC ring");
+                rfifo_destroy(f, rfifo_test_dtor);
+                return false;
+        }
+
+        producer = kthread_run(rfifo_test_producer, f, "rfifo-test");
+        if (IS_ERR(producer)) {
+                rfifo_destroy(f, rfifo_test_dtor);
+                return false;
+        }
+
+        while (next <= RFIFO_TEST_SPSC_ITEMS) {
+                e = rfifo_pop(f);
+                if (!e) {
+                        cond_resched();
+                        continue;
+                }
+                if (e != TE(next)) {
+                        LOG_ERR("SPSC ring out of order: got %lu, "
+                                "expected %lu", (unsigned long) e, next);
+                        ok = false;
+                        break;
+                }
+                next++;
+        }
+
+        kthread_stop(producer);
+        rfifo_destroy(f, rfifo_test_dtor);
+
+        return ok;
+}
+
 bool regression_tests_rfifo(void)
-{ return true; }
+{
+        struct rfifo * f;
+        bool           ok;
+
+        if (!rfifo_test_wraparound()) {
+                LOG_ERR("Ring FIFO wraparound test failed");
+                return false;
+        }
+
+        if (!rfifo_test_head_push()) {
+                LOG_ERR("Ring FIFO head push test failed");
+                return false;
+        }
+
+        f = rfifo_create_ring(256, 0);
+        if (!f)
+                return false;
+        ok = rfifo_test_mixed(f, "ring");
+        rfifo_destroy(f, rfifo_test_dtor);
+        if (!ok)
+                return false;
+
+        f = rfifo_create();
+        if (!f)
+                return false;
+        ok = rfifo_test_mixed(f, "rqueue");
+        rfifo_destroy(f, rfifo_test_dtor);
+        if (!ok)
+                return false;
+
+        if (!rfifo_test_grow()) {
+                LOG_ERR("Ring FIFO grow test failed");
+                return false;
+        }
+
+        if (!rfifo_test_spsc()) {
+                LOG_ERR("Ring FIFO SPSC test failed");
+                return false;
+        }
+
+        LOG_DBG("FIFO regression tests passed");
+
+        return true;
+}
 #endif
@@ -26,6 +26,22 @@ struct rfifo;
 extern struct rfifo * rfifo_create(void);
 extern struct rfifo * rfifo_create_ni(void);
 
+/*
+ * Bounded, allocation-free FIFOs backed by a power-of-two ring holding at
+ * least size entries. Pushing into a full ring fails. Callers serialize
+ * the accesses as for the other FIFOs, unless RFIFO_SPSC is passed: then
+ * one producer and one consumer may run concurrently without locking,
+ * and rfifo_head_push_ni() is not available. With RFIFO_GROW a push into
+ * a full ring doubles it instead of failing (not with RFIFO_SPSC).
+ */
+#define RFIFO_SPSC 0x01
+#define RFIFO_GROW 0x02
+
+extern struct rfifo * rfifo_create_ring(unsigned int size,
+                                        unsigned int flags);
+extern struct rfifo * rfifo_create_ring_ni(unsigned int size,
+                                           unsigned int flags);
+
 /* NOTE: dtor has the ownership of freeing the passed element */
 extern int            rfifo_destroy(struct rfifo * f,
                              	    void        (* dtor)(void * e));
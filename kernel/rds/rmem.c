@@ -29,6 +29,7 @@
 #include "debug.h"
 #include "rmem.h"
 
+#ifndef CONFIG_RINA_PLAIN_KMALLOC
 #ifdef CONFIG_RINA_MEMORY_TAMPERING
 struct memblock_header {
         size_t  inner_length;
@@ -421,3 +422,28 @@ bool regression_tests_rmem(void)
         return true;
 }
 #endif
+
+#else /* CONFIG_RINA_PLAIN_KMALLOC */
+
+/* Out of line versions for modules built without CONFIG_RINA_PLAIN_KMALLOC */
+#undef rkmalloc
+#undef rkzalloc
+#undef rkfree
+#undef rms_dump
+
+void * rkmalloc(size_t size, gfp_t flags)
+{ return kmalloc(size, flags); }
+EXPORT_SYMBOL(rkmalloc);
+
+void * rkzalloc(size_t size, gfp_t flags)
+{ return kzalloc(size, flags); }
+EXPORT_SYMBOL(rkzalloc);
+
+void rkfree(void * ptr)
+{ kfree(ptr); }
+EXPORT_SYMBOL(rkfree);
+
+void rms_dump(void)
+{ }
+
+#endif
@@ -23,10 +23,18 @@
 
 #include <linux/slab.h>
 
+#ifdef CONFIG_RINA_PLAIN_KMALLOC
+/* Production builds: no debugging facilities, straight to the allocator */
+#define rkmalloc(size, flags) kmalloc(size, flags)
+#define rkzalloc(size, flags) kzalloc(size, flags)
+#define rkfree(ptr)           kfree(ptr)
+#define rms_dump()            do { } while (0)
+#else
 void * rkmalloc(size_t size, gfp_t flags);
 void * rkzalloc(size_t size, gfp_t flags);
 void   rkfree(void * ptr);
 void   rms_dump(void);
+#endif
 
 #include <linux/string.h>
 
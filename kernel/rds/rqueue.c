@@ -28,6 +28,7 @@
 #include "debug.h"
 #include "rmem.h"
 #include "rqueue.h"
+#include "rcache.h"
 
 struct rqueue_entry {
         struct list_head next;
@@ -39,6 +40,22 @@ struct rqueue {
         size_t           length;
 };
 
+static struct rcache * entry_cache;
+
+int rqueue_init(void)
+{
+        entry_cache = rcache_create("rina-rqueue-entry",
+                                    sizeof(struct rqueue_entry));
+
+        return entry_cache ? 0 : -1;
+}
+
+void rqueue_fini(void)
+{
+        rcache_destroy(entry_cache);
+        entry_cache = NULL;
+}
+
 struct rqueue * rqueue_create_gfp(gfp_t flags)
 {
         struct rqueue * q;
@@ -74,7 +91,7 @@ static struct rqueue_entry * entry_create(gfp_t flags, void * data)
 {
         struct rqueue_entry * entry;
 
-        entry = rkmalloc(sizeof(*entry), flags);
+        entry = rcache_alloc(entry_cache, flags);
         if (!entry)
                 return NULL;
 
@@ -89,7 +106,7 @@ static int entry_destroy(struct rqueue_entry * entry)
         if (!entry)
                 return -1;
 
-        rkfree(entry);
+        rcache_free(entry_cache, entry);
 
         return 0;
 }
@@ -23,6 +23,10 @@
 
 struct rqueue;
 
+/* Slab cache for the queue entries, set up at core module load */
+int             rqueue_init(void);
+void            rqueue_fini(void);
+
 struct rqueue * rqueue_create(void);
 struct rqueue * rqueue_create_ni(void);
 
@@ -38,6 +38,8 @@
 #include "rds/robjects.h"
 
 #define DEFAULT_Q_MAX 1000
+/* Management PDUs are not subject to q_max, but are bounded as well */
+#define MGT_Q_SIZE    256
 #define rmap_hash(T, K) hash_min(K, HASH_BITS(T))
 
 struct rmt_queue {
@@ -70,7 +72,8 @@ RINA_SYSFS_OPS(rmt_ps);
 RINA_ATTRS(rmt_ps, q_max);
 RINA_KTYPE(rmt_ps);
 
-static struct rmt_queue *rmt_queue_create(port_id_t port)
+static struct rmt_queue *rmt_queue_create(port_id_t port,
+					   unsigned int q_max)
 {
 	struct rmt_queue *tmp;
 
@@ -78,13 +81,13 @@ static struct rmt_queue *rmt_queue_create(port_id_t port)
 	if (!tmp)
 		return NULL;
 
-	tmp->dt_queue = rfifo_create_ni();
+	tmp->dt_queue = rfifo_create_ring_ni(q_max ? q_max : DEFAULT_Q_MAX, 0);
 	if (!tmp->dt_queue) {
 		rkfree(tmp);
 		return NULL;
 	}
 
-	tmp->mgt_queue = rfifo_create_ni();
+	tmp->mgt_queue = rfifo_create_ring_ni(MGT_Q_SIZE, 0);
 	if (!tmp->mgt_queue) {
 		rfifo_destroy(tmp->dt_queue, (void (*)(void *)) du_destroy);
 		rkfree(tmp);
@@ -127,7 +130,7 @@ void * default_rmt_q_create_policy(struct rmt_ps      *ps,
 
 	data = ps->priv;
 
-	queue = rmt_queue_create(n1_port->port_id);
+	queue = rmt_queue_create(n1_port->port_id, data->q_max);
 	if (!queue) {
 		LOG_ERR("Could not create queue for n1_port %u",
 			n1_port->port_id);
@@ -193,7 +196,10 @@ int default_rmt_enqueue_policy(struct rmt_ps *      ps,
 			return RMT_PS_ENQ_SEND;
 		}
 
-		rfifo_push_ni(q->mgt_queue, du);
+		if (rfifo_push_ni(q->mgt_queue, du)) {
+			du_destroy(du);
+			return RMT_PS_ENQ_DROP;
+		}
 		return RMT_PS_ENQ_SCHED;
 	}
 
@@ -205,7 +211,11 @@ int default_rmt_enqueue_policy(struct rmt_ps *      ps,
 		return RMT_PS_ENQ_DROP;
 	}
 
-	rfifo_push_ni(q->dt_queue, du);
+	/* The ring is sized at q_max, a later bigger q_max hits this */
+	if (rfifo_push_ni(q->dt_queue, du)) {
+		du_destroy(du);
+		return RMT_PS_ENQ_DROP;
+	}
 	return RMT_PS_ENQ_SCHED;
 }
 EXPORT_SYMBOL(default_rmt_enqueue_policy);
@@ -29,6 +29,10 @@
 #include <linux/sched.h>
 #include <linux/wait.h>
 #include <linux/string.h>
+#include <linux/moduleparam.h>
+#include <linux/cpumask.h>
+#include <linux/workqueue.h>
+#include <linux/rcupdate.h>
 /* FIXME: to be re-removed after removing tasklets */
 #include <linux/interrupt.h>
 
@@ -50,7 +54,17 @@
 #include "rmt-ps-default.h"
 
 #define rmap_hash(T, K) hash_min(K, HASH_BITS(T))
-#define MAX_PDUS_SENT_PER_CYCLE 10
+#define MAX_PDUS_SENT_PER_CYCLE RMT_TX_BATCH_SIZE
+
+/*
+ * Multi-queue egress: instead of sharing the RMT egress tasklet, each N-1
+ * port gets its own work item, pinned at bind time to a CPU picked in a
+ * round-robin fashion (like XPS does for NIC TX queues), so that a busy
+ * port does not delay the others.
+ */
+static bool rmt_egress_mq = false;
+module_param(rmt_egress_mq, bool, 0444);
+MODULE_PARM_DESC(rmt_egress_mq, "Use per N-1 port, CPU-pinned egress scheduling");
 
 static struct policy_set_list policy_sets = {
 	.head = LIST_HEAD_INIT(policy_sets.head)
@@ -63,20 +77,33 @@ struct pff_cache {
 	size_t count;
 };
 
-struct rmt_address {
-        address_t	 address;
-        struct list_head list;
+/*
+ * Local addresses, normally one (two while renumbering). The receive path
+ * reads them under RCU, updates replace the whole array under rmt->lock.
+ */
+struct rmt_addresses {
+	struct rcu_head rcu;
+	unsigned int	count;
+	address_t	addrs[0];
 };
 
 struct rmt {
 	struct rina_component base;
 	spinlock_t	      lock;
-	struct list_head      addresses;
+	struct rmt_addresses __rcu *addresses;
 	struct ipcp_instance *parent;
 	struct pff *pff;
 	struct kfa *kfa;
 	struct efcp_container *efcpc;
 	struct tasklet_struct egress_tasklet;
+	/* Only used in multi-queue egress mode */
+	struct workqueue_struct *egress_wq;
+	/* Runs the RX path for PDUs unprotected asynchronously */
+	struct workqueue_struct *ingress_wq;
+	/* SDU protection requests deferred by the crypto policy set */
+	atomic_t sdup_pending;
+	wait_queue_head_t sdup_wq;
+	atomic_t egress_next_cpu;
 	struct n1pmap *n1_ports;
 	struct pff_cache cache;
 	struct rmt_config *rmt_cfg;
@@ -93,6 +120,10 @@ struct rmt {
         n1_port->stats.name##_pdus++;					\
 	n1_port->stats.name##_bytes += (unsigned int) bytes;		\
 
+#define stats_add(name, n1_port, pdus, bytes)				\
+	n1_port->stats.name##_pdus += pdus;				\
+	n1_port->stats.name##_bytes += (unsigned int) bytes;		\
+
 static ssize_t rmt_attr_show(struct robject *        robj,
                              struct robj_attribute * attr,
                              char *                  buf)
@@ -172,7 +203,28 @@ RINA_ATTRS(rmt_n1_port, queued_pdus, drop_pdus, err_pdus, tx_pdus,
 	   tx_bytes, rx_pdus, rx_bytes, wbusy, state);
 RINA_KTYPE(rmt_n1_port);
 
-static struct rmt_n1_port *n1_port_create(port_id_t id,
+static void n1_port_egress_worker(struct work_struct *work);
+static void n1_port_ingress_worker(struct work_struct *work);
+static void rmt_sdup_unprotect_done(void * opaque,
+				    struct sdup_port * sdup_port,
+				    struct du * du);
+
+static int rmt_egress_cpu_pick(struct rmt *rmt)
+{
+	int cpu;
+	unsigned int i;
+
+	i = (unsigned int) atomic_inc_return(&rmt->egress_next_cpu) %
+		num_online_cpus();
+	for_each_online_cpu(cpu)
+		if (i-- == 0)
+			return cpu;
+
+	return WORK_CPU_UNBOUND;
+}
+
+static struct rmt_n1_port *n1_port_create(struct rmt *rmt,
+					  port_id_t id,
 					  struct ipcp_instance *n1_ipcp)
 {
 	struct rmt_n1_port *tmp;
@@ -183,14 +235,28 @@ static struct rmt_n1_port *n1_port_create(port_id_t id,
 	if (!tmp)
 		return NULL;
 
+	tmp->tx_done = du_list_create_ni();
+	tmp->rx_done = du_list_create_ni();
+	if (!tmp->tx_done || !tmp->rx_done) {
+		if (tmp->tx_done)
+			du_list_destroy(tmp->tx_done, true);
+		if (tmp->rx_done)
+			du_list_destroy(tmp->rx_done, true);
+		rkfree(tmp);
+		return NULL;
+	}
+
 	robject_init(&tmp->robj, &rmt_n1_port_rtype);
 	INIT_HLIST_NODE(&tmp->hlist);
+	INIT_WORK(&tmp->egress_work, n1_port_egress_worker);
+	INIT_WORK(&tmp->rx_work, n1_port_ingress_worker);
 
 	tmp->port_id = id;
 	tmp->n1_ipcp = n1_ipcp;
 	tmp->state   = N1_PORT_STATE_ENABLED;
 
-	atomic_set(&tmp->refs_c, 0);
+	/* Reference owned by the N-1 ports map, dropped on unbind */
+	atomic_set(&tmp->refs_c, 1);
 	tmp->wbusy = false;
 	tmp->stats.plen = 0;
 	tmp->stats.drop_pdus = 0;
@@ -200,6 +266,9 @@ static struct rmt_n1_port *n1_port_create(port_id_t id,
 	tmp->stats.rx_pdus = 0;
 	tmp->stats.rx_bytes = 0;
 	tmp->sdup_port = 0;
+	tmp->rmt = rmt;
+	tmp->egress_cpu = rmt->egress_wq ? rmt_egress_cpu_pick(rmt) :
+					   WORK_CPU_UNBOUND;
 	spin_lock_init(&tmp->lock);
 
 	LOG_DBG("N-1 port %pK created successfully (port-id = %d)", tmp, id);
@@ -224,25 +293,29 @@ static int n1_port_user_ipcp_unbind(struct rmt_n1_port *n1p)
 	return 0;
 }
 
+static void n1_port_free_rcu(struct rcu_head *head)
+{ rkfree(container_of(head, struct rmt_n1_port, rcu)); }
+
 static int n1_port_destroy(struct rmt_n1_port *n1p)
 {
 	ASSERT(n1p);
 	LOG_DBG("Destroying N-1 port %pK (port-id = %d)", n1p, n1p->port_id);
 
-	hash_del(&n1p->hlist);
-
 	robject_del(&n1p->robj);
 
 	if (n1p->sdup_port)
 		sdup_destroy_port_config(n1p->sdup_port);
 
-	if (n1p->pending_du)
-		du_destroy(n1p->pending_du);
+	while (n1p->pending_n)
+		du_destroy(n1p->pending_dus[--n1p->pending_n]);
+	du_list_destroy(n1p->tx_done, true);
+	du_list_destroy(n1p->rx_done, true);
 
 	if (n1p->wbusy)
 		LOG_WARN("Deleting n1_port with bussy writer... there may be something wrong...");
 
-	rkfree(n1p);
+	/* Lookups may still be walking over it, see n1pmap_find */
+	call_rcu(&n1p->rcu, n1_port_free_rcu);
 
 	return 0;
 }
@@ -266,6 +339,12 @@ static int n1_port_cleanup(struct rmt *instance,
 	return 0;
 }
 
+/*
+ * The N-1 ports map is an RCU hash: lookups take no lock, while bind and
+ * removal serialize on m->lock. Every port is reference counted, the map
+ * owns one reference until the port is unbound, and the port is unhashed
+ * and destroyed when its last reference is released.
+ */
 struct n1pmap {
 	spinlock_t lock;
 	struct rset *rset;
@@ -288,6 +367,8 @@ static int n1pmap_destroy(struct rmt *instance)
 	spin_lock_bh(&m->lock);
 	hash_for_each_safe(m->n1_ports, bucket, tmp, entry, hlist) {
 		ASSERT(entry);
+		hlist_del_init_rcu(&entry->hlist);
+
 		if (n1_port_user_ipcp_unbind(entry))
 			LOG_ERR("Could not destroy entry %pK", entry);
 
@@ -332,10 +413,7 @@ static struct n1pmap *n1pmap_create(struct robject *parent)
 #define n1_port_unlock(port)	\
 	spin_unlock_bh(&port->lock)
 
-#define n1_port_unlock_release(port)	\
-	atomic_dec(&port->refs_c);		\
-	n1_port_unlock(port)
-
+/* Must not be called with the n1_port lock held */
 static void n1pmap_release(struct rmt *instance,
 			   struct rmt_n1_port *n1_port)
 {
@@ -343,28 +421,66 @@ static void n1pmap_release(struct rmt *instance,
 
 	ASSERT(instance);
 
-	m = instance->n1_ports;
-	if (!m)
+	if (!atomic_dec_and_test(&n1_port->refs_c))
 		return;
 
-	n1_port_lock(n1_port);
-	if (atomic_dec_and_test(&n1_port->refs_c) &&
-	    n1_port->state == N1_PORT_STATE_DEALLOCATED) {
-		n1_port_unlock(n1_port);
-		spin_lock_bh(&m->lock);
-		n1_port_cleanup(instance, n1_port);
-		spin_unlock_bh(&m->lock);
+	/* Last reference gone, the port has been unbound */
+	m = instance->n1_ports;
+	spin_lock_bh(&m->lock);
+	hlist_del_init_rcu(&n1_port->hlist);
+	spin_unlock_bh(&m->lock);
+
+	n1_port_cleanup(instance, n1_port);
+}
+
+/*
+ * Schedules the transmission of the PDUs queued in an N-1 port. The caller
+ * must hold a reference to the port.
+ */
+static void rmt_egress_schedule(struct rmt *rmt,
+				struct rmt_n1_port *n1_port)
+{
+	if (!rmt->egress_wq) {
+		tasklet_hi_schedule(&rmt->egress_tasklet);
 		return;
 	}
-	n1_port_unlock(n1_port);
-	return;
+
+	/* A pending egress work item holds a reference to the port */
+	atomic_inc(&n1_port->refs_c);
+	if (!queue_work_on(n1_port->egress_cpu, rmt->egress_wq,
+			   &n1_port->egress_work))
+		atomic_dec(&n1_port->refs_c);
+}
+
+/*
+ * A deferred SDU protection request may complete at any time, from the
+ * crypto completion context. rmt_destroy() waits for all of them before
+ * tearing down the ports and workqueues they use.
+ */
+static void rmt_sdup_pending_inc(struct rmt *rmt)
+{ atomic_inc(&rmt->sdup_pending); }
+
+/* Must be the last access to rmt of a completion, it may be gone after */
+static void rmt_sdup_pending_dec(struct rmt *rmt)
+{
+	rcu_read_lock();
+	if (atomic_dec_and_test(&rmt->sdup_pending))
+		wake_up(&rmt->sdup_wq);
+	rcu_read_unlock();
 }
 
+static void rmt_sdup_wait_idle(struct rmt *rmt)
+{
+	wait_event(rmt->sdup_wq, !atomic_read(&rmt->sdup_pending));
+	/* Let the last completion get out of rmt_sdup_pending_dec() */
+	synchronize_rcu();
+}
+
+/* Takes a reference to the port, to be dropped with n1pmap_release */
 static struct rmt_n1_port *n1pmap_find(struct rmt *instance,
 				       port_id_t id)
 {
 	struct rmt_n1_port *entry;
-	const struct hlist_head *head;
 	struct n1pmap *m;
 
 	ASSERT(instance);
@@ -376,24 +492,78 @@ static struct rmt_n1_port *n1pmap_find(struct rmt *instance,
 	if (!m)
 		return NULL;
 
+	rcu_read_lock();
+	hash_for_each_possible_rcu(m->n1_ports, entry, hlist, id) {
+		if (entry->port_id != id ||
+		    READ_ONCE(entry->state) == N1_PORT_STATE_DEALLOCATED)
+			continue;
+
+		/* A zero count means the port is being destroyed */
+		if (!atomic_inc_not_zero(&entry->refs_c))
+			continue;
+
+		/* Lost a race against rmt_n1port_unbind */
+		if (READ_ONCE(entry->state) == N1_PORT_STATE_DEALLOCATED) {
+			rcu_read_unlock();
+			n1pmap_release(instance, entry);
+			return NULL;
+		}
+
+		rcu_read_unlock();
+		return entry;
+	}
+	rcu_read_unlock();
+
+	return NULL;
+}
+
+/* Publishes a new port, fails if the port-id is already bound */
+static int n1pmap_add(struct rmt *instance,
+		      struct rmt_n1_port *n1_port)
+{
+	struct rmt_n1_port *entry;
+	struct n1pmap *m;
+
+	m = instance->n1_ports;
+
 	spin_lock_bh(&m->lock);
-	head = &m->n1_ports[rmap_hash(m->n1_ports, id)];
-	hlist_for_each_entry(entry, head, hlist)
-		if (entry->port_id == id) {
-			spin_lock(&entry->lock);
-			if (entry->state == N1_PORT_STATE_DEALLOCATED) {
-				spin_unlock(&entry->lock);
-				spin_unlock_bh(&m->lock);
-				return NULL;
-			}
-			atomic_inc(&entry->refs_c);
-			spin_unlock(&entry->lock);
+	hash_for_each_possible(m->n1_ports, entry, hlist, n1_port->port_id)
+		if (entry->port_id == n1_port->port_id &&
+		    READ_ONCE(entry->state) != N1_PORT_STATE_DEALLOCATED) {
 			spin_unlock_bh(&m->lock);
-			return entry;
+			return -1;
 		}
+	hash_add_rcu(m->n1_ports, &n1_port->hlist, n1_port->port_id);
 	spin_unlock_bh(&m->lock);
 
-	return NULL;
+	return 0;
+}
+
+/* Drops the reference owned by the map, returns 0 if the port was bound */
+static int n1pmap_unbind(struct rmt *instance,
+			 port_id_t id)
+{
+	struct rmt_n1_port *n1_port;
+
+	n1_port = n1pmap_find(instance, id);
+	if (!n1_port)
+		return -1;
+
+	n1_port_lock(n1_port);
+	if (n1_port->state == N1_PORT_STATE_DEALLOCATED) {
+		/* Concurrent unbind */
+		n1_port_unlock(n1_port);
+		n1pmap_release(instance, n1_port);
+		return -1;
+	}
+	WRITE_ONCE(n1_port->state, N1_PORT_STATE_DEALLOCATED);
+	n1_port_unlock(n1_port);
+
+	/* We hold a reference, this one cannot be the last */
+	atomic_dec(&n1_port->refs_c);
+	n1pmap_release(instance, n1_port);
+
+	return 0;
 }
 
 static int pff_cache_init(struct pff_cache *c)
@@ -526,24 +696,63 @@ int rmt_set_policy_set_param(struct rmt *rmt,
 }
 EXPORT_SYMBOL(rmt_set_policy_set_param);
 
+static void rmt_addresses_free_rcu(struct rcu_head *head)
+{ rkfree(container_of(head, struct rmt_addresses, rcu)); }
+
+static struct rmt_addresses *rmt_addresses_alloc(unsigned int count)
+{
+	struct rmt_addresses *addrs;
+
+	addrs = rkzalloc(sizeof(*addrs) + count * sizeof(address_t),
+			 GFP_ATOMIC);
+	if (addrs)
+		addrs->count = count;
+
+	return addrs;
+}
+
+/* Called with instance->lock held, new may be NULL (no addresses) */
+static void rmt_addresses_publish(struct rmt *instance,
+				  struct rmt_addresses *new)
+{
+	struct rmt_addresses *old;
+
+	old = rcu_dereference_protected(instance->addresses,
+					lockdep_is_held(&instance->lock));
+	rcu_assign_pointer(instance->addresses, new);
+	if (old)
+		call_rcu(&old->rcu, rmt_addresses_free_rcu);
+}
+
 int rmt_address_add(struct rmt *instance,
 		    address_t address)
 {
-	struct rmt_address * rmt_addr;
+	struct rmt_addresses *old, *new;
+	unsigned int count;
 
 	if (!instance) {
 		LOG_ERR("Bogus instance passed");
 		return -1;
 	}
 
-	rmt_addr = rkzalloc(sizeof(*rmt_addr), GFP_KERNEL);
-	if (!rmt_addr)
+	spin_lock_bh(&instance->lock);
+
+	old = rcu_dereference_protected(instance->addresses,
+					lockdep_is_held(&instance->lock));
+	count = old ? old->count : 0;
+
+	new = rmt_addresses_alloc(count + 1);
+	if (!new) {
+		spin_unlock_bh(&instance->lock);
 		return -1;
-	rmt_addr->address = address;
+	}
+
+	new->addrs[0] = address;
+	if (count)
+		memcpy(&new->addrs[1], old->addrs, count * sizeof(address_t));
+
+	rmt_addresses_publish(instance, new);
 
-	INIT_LIST_HEAD(&rmt_addr->list);
-	spin_lock_bh(&instance->lock);
-	list_add(&rmt_addr->list, &instance->addresses);
 	spin_unlock_bh(&instance->lock);
 
 	return 0;
@@ -553,44 +762,72 @@ EXPORT_SYMBOL(rmt_address_add);
 int rmt_address_remove(struct rmt *instance,
 		       address_t address)
 {
-	struct rmt_address * rmt_addr;
+	struct rmt_addresses *old, *new = NULL;
+	unsigned int i;
 
 	if (!instance) {
 		LOG_ERR("Bogus instance passed");
 		return -1;
 	}
 
-        spin_lock_bh(&instance->lock);
+	spin_lock_bh(&instance->lock);
 
-        list_for_each_entry(rmt_addr, &instance->addresses, list) {
-                if (rmt_addr->address == address) {
-                        if (!list_empty(&rmt_addr->list)) {
-                                list_del(&rmt_addr->list);
-                        }
-                        spin_unlock_bh(&instance->lock);
-                        rkfree(rmt_addr);
-                        return 0;
-                }
-        }
+	old = rcu_dereference_protected(instance->addresses,
+					lockdep_is_held(&instance->lock));
+	for (i = 0; old && i < old->count; i++)
+		if (old->addrs[i] == address)
+			break;
 
-        spin_unlock_bh(&instance->lock);
-        LOG_ERR("Could not find address to be removed: %u", address);
-        return -1;
+	if (!old || i == old->count) {
+		spin_unlock_bh(&instance->lock);
+		LOG_ERR("Could not find address to be removed: %u", address);
+		return -1;
+	}
+
+	if (old->count > 1) {
+		new = rmt_addresses_alloc(old->count - 1);
+		if (!new) {
+			spin_unlock_bh(&instance->lock);
+			return -1;
+		}
+		memcpy(new->addrs, old->addrs, i * sizeof(address_t));
+		memcpy(&new->addrs[i], &old->addrs[i + 1],
+		       (old->count - i - 1) * sizeof(address_t));
+	}
+
+	rmt_addresses_publish(instance, new);
+
+	spin_unlock_bh(&instance->lock);
+
+	return 0;
 }
 EXPORT_SYMBOL(rmt_address_remove);
 
 int rmt_destroy(struct rmt *instance)
 {
-	struct rmt_address * addr, * naddr;
+	struct rmt_addresses *addrs;
 
 	if (!instance) {
 		LOG_ERR("Bogus instance passed, bailing out");
 		return -1;
 	}
 
+	/*
+	 * Completions of deferred SDU protection requests schedule the
+	 * egress path, queue ingress work and use the N-1 ports, so wait
+	 * for them first. Then run the ingress work they queued, since it
+	 * uses the ports too.
+	 */
+	rmt_sdup_wait_idle(instance);
 	tasklet_kill(&instance->egress_tasklet);
+	if (instance->egress_wq)
+		destroy_workqueue(instance->egress_wq);
+	if (instance->ingress_wq)
+		flush_workqueue(instance->ingress_wq);
 	if (instance->n1_ports)
 		n1pmap_destroy(instance);
+	if (instance->ingress_wq)
+		destroy_workqueue(instance->ingress_wq);
 	pff_cache_fini(&instance->cache);
 
 	if (instance->pff)
@@ -600,13 +837,10 @@ int rmt_destroy(struct rmt *instance)
 
 	robject_del(&instance->robj);
 
-	list_for_each_entry_safe(addr, naddr, &instance->addresses, list) {
-		if (!list_empty(&addr->list)) {
-			list_del(&addr->list);
-		}
-
-	        rkfree(addr);
-	}
+	/* No receivers left, nobody can be looking at it */
+	addrs = rcu_dereference_protected(instance->addresses, 1);
+	if (addrs)
+		rkfree(addrs);
 
 	rina_component_fini(&instance->base);
 
@@ -675,6 +909,37 @@ int rmt_config_set(struct rmt *instance,
 }
 EXPORT_SYMBOL(rmt_config_set);
 
+/*
+ * Keeps PDUs the N-1 IPCP could not take for now, to be retried first
+ * once the port gets enabled again. Must be called holding n1_port->lock.
+ */
+static void n1_port_push_back(struct rmt *rmt,
+			      struct rmt_n1_port *n1_port,
+			      struct du **dus,
+			      unsigned int count)
+{
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (n1_port->pending_n == RMT_TX_BATCH_SIZE) {
+			LOG_ERR("Too many pending SDUs for port %d",
+				n1_port->port_id);
+			du_destroy(dus[i]);
+			n1_port->stats.drop_pdus++;
+			continue;
+		}
+
+		n1_port->pending_dus[n1_port->pending_n++] = dus[i];
+		n1_port->stats.plen++;
+	}
+
+	if (n1_port->state == N1_PORT_STATE_DO_NOT_DISABLE) {
+		n1_port->state = N1_PORT_STATE_ENABLED;
+		rmt_egress_schedule(rmt, n1_port);
+	} else
+		n1_port->state = N1_PORT_STATE_DISABLED;
+}
+
 static int n1_port_write_du(struct rmt *rmt,
 			    struct rmt_n1_port *n1_port,
 			    struct du * du)
@@ -691,32 +956,57 @@ static int n1_port_write_du(struct rmt *rmt,
 
 	if (ret == -EAGAIN) {
 		n1_port_lock(n1_port);
-		if (n1_port->pending_du) {
-			LOG_ERR("Already a pending SDU present for port %d",
-					n1_port->port_id);
-			du_destroy(n1_port->pending_du);
-			n1_port->stats.plen--;
-		}
+		n1_port_push_back(rmt, n1_port, &du, 1);
+		n1_port_unlock(n1_port);
+	}
 
-		n1_port->pending_du = du;
-		n1_port->stats.plen++;
+	return ret;
+}
 
-		if (n1_port->state == N1_PORT_STATE_DO_NOT_DISABLE) {
-			n1_port->state = N1_PORT_STATE_ENABLED;
-			tasklet_hi_schedule(&rmt->egress_tasklet);
-		} else
-			n1_port->state = N1_PORT_STATE_DISABLED;
+/*
+ * Hands a batch of protected PDUs down to the N-1 IPCP, in a single call
+ * if it supports du_write_batch. Returns how many PDUs were consumed, the
+ * rest are still owned by the caller.
+ */
+static unsigned int n1_port_write_batch(struct rmt_n1_port *n1_port,
+					struct du **dus,
+					unsigned int count)
+{
+	struct ipcp_instance *n1_ipcp = n1_port->n1_ipcp;
+	unsigned int i;
+	int ret;
 
-		n1_port_unlock(n1_port);
+	if (!count)
+		return 0;
+
+	LOG_DBG("Gonna send %u SDUs to port-id %d", count, n1_port->port_id);
+	if (n1_ipcp->ops->du_write_batch) {
+		ret = n1_ipcp->ops->du_write_batch(n1_ipcp->data,
+						   n1_port->port_id,
+						   dus, count, false);
+		return ret < 0 ? 0 : (unsigned int) ret;
 	}
 
-	return ret;
+	for (i = 0; i < count; i++) {
+		ret = n1_ipcp->ops->du_write(n1_ipcp->data,
+					     n1_port->port_id,
+					     dus[i], false);
+		if (ret == -EAGAIN)
+			break;
+	}
+
+	return i;
 }
 
-static inline int n1_port_write(struct rmt *rmt,
-				struct rmt_n1_port *n1_port,
-				struct du *du)
+/*
+ * Returns -EINPROGRESS if SDU protection kept the PDU to finish it
+ * asynchronously, destroys it on any other error.
+ */
+static inline int n1_port_protect(struct rmt_n1_port *n1_port,
+				  struct du *du)
 {
+	int ret;
+
 	/* SDU Protection */
 	if (sdup_set_lifetime_limit(n1_port->sdup_port, du)){
 		LOG_ERR("Error adding a Lifetime limit to serialized PDU");
@@ -724,27 +1014,179 @@ static inline int n1_port_write(struct rmt *rmt,
 		return -1;
 	}
 
-	if (sdup_protect_pdu(n1_port->sdup_port, du)){
+	/* A deferred PDU holds a reference to the port until it is done */
+	atomic_inc(&n1_port->refs_c);
+	rmt_sdup_pending_inc(n1_port->rmt);
+	ret = sdup_protect_pdu(n1_port->sdup_port, du);
+	if (ret == -EINPROGRESS)
+		/* Queued by rmt_sdup_protect_done() */
+		return ret;
+
+	/* The caller holds a reference, this one cannot be the last */
+	atomic_dec(&n1_port->refs_c);
+	rmt_sdup_pending_dec(n1_port->rmt);
+
+	if (ret) {
 		LOG_ERR("Error Protecting serialized PDU");
 		du_destroy(du);
 		return -1;
 	}
 
+	return 0;
+}
+
+static inline int n1_port_write(struct rmt *rmt,
+				struct rmt_n1_port *n1_port,
+				struct du *du)
+{
+	int ret;
+
+	ret = n1_port_protect(n1_port, du);
+	if (ret)
+		return ret;
+
 	return n1_port_write_du(rmt, n1_port, du);
 }
 
+/*
+ * Called by SDU protection when it finishes protecting a PDU, usually
+ * from the crypto completion context. The PDU is queued in the port and
+ * sent by the egress worker, like any other, so that it goes through
+ * wbusy and keeps its place behind the PDUs pushed back before.
+ */
+static void rmt_sdup_protect_done(void * opaque,
+				  struct sdup_port * sdup_port,
+				  struct du * du)
+{
+	struct rmt_n1_port *n1_port = opaque;
+	struct rmt *rmt = n1_port->rmt;
+
+	/* Dropped by SDU protection */
+	if (!du)
+		goto out;
+
+	n1_port_lock(n1_port);
+	if (add_du_to_list_ni(n1_port->tx_done, du)) {
+		LOG_ERR("Could not queue protected PDU, dropping it");
+		du_destroy(du);
+		n1_port->stats.drop_pdus++;
+	} else {
+		n1_port->stats.plen++;
+		rmt_egress_schedule(rmt, n1_port);
+	}
+	n1_port_unlock(n1_port);
+
+ out:
+	/* Taken by n1_port_protect() */
+	n1pmap_release(rmt, n1_port);
+	rmt_sdup_pending_dec(rmt);
+}
+
+/*
+ * Sends up to MAX_PDUS_SENT_PER_CYCLE PDUs queued in an N-1 port, pushing
+ * them down to the N-1 IPCP as a single batch. Must be called with BHs
+ * disabled, holding n1_port->lock and a reference to the port. Returns
+ * true if the port has to be scheduled again.
+ */
+static bool n1_port_send_burst(struct rmt *rmt,
+			       struct rmt_ps *ps,
+			       struct rmt_n1_port *n1_port)
+{
+	struct du * dus[MAX_PDUS_SENT_PER_CYCLE];
+	struct du_list_item * item;
+	struct du * du;
+	bool reschedule = false;
+	unsigned int npend, count, sent, i;
+	ssize_t bytes;
+
+	if (n1_port->state == N1_PORT_STATE_DISABLED	||
+	    !n1_port->stats.plen) {
+		LOG_DBG("Port state is DISABLED or no PDUs to send");
+		return false;
+	}
+
+	if (n1_port->wbusy) {
+		LOG_DBG("Port is sending a PDU, check afterwards");
+		return true;
+	}
+
+	n1_port->wbusy = true;
+
+	/* PDUs pushed back in a previous cycle go first */
+	npend = n1_port->pending_n;
+	for (i = 0; i < npend; i++)
+		dus[i] = n1_port->pending_dus[i];
+	n1_port->pending_n = 0;
+
+	/* Then the ones protected asynchronously, already protected too */
+	while (npend < MAX_PDUS_SENT_PER_CYCLE &&
+	       !list_empty(&n1_port->tx_done->dus)) {
+		item = list_first_entry(&n1_port->tx_done->dus,
+					struct du_list_item, next);
+		list_del(&item->next);
+		dus[npend++] = item->du;
+		du_list_item_destroy(item, false);
+	}
+	n1_port->stats.plen -= npend;
+
+	count = npend;
+	while ((count < MAX_PDUS_SENT_PER_CYCLE) &&
+		n1_port->stats.plen) {
+		du = ps->rmt_dequeue_policy(ps, n1_port);
+		if (!du) {
+			LOG_ERR("rmt_dequeue_policy returned no pdu but plen is %u",
+					n1_port->stats.plen);
+			break;
+		}
+		n1_port->stats.plen--;
+		dus[count++] = du;
+	}
+
+	spin_unlock(&n1_port->lock);
+
+	/*
+	 * Protect the freshly dequeued PDUs, dropping the ones that fail.
+	 * The ones protected asynchronously are sent on completion.
+	 */
+	sent = npend;
+	for (i = npend; i < count; i++) {
+		if (n1_port_protect(n1_port, dus[i]))
+			continue;
+		dus[sent++] = dus[i];
+	}
+	count = sent;
+
+	bytes = 0;
+	for (i = 0; i < count; i++)
+		bytes += du_len(dus[i]);
+
+	sent = n1_port_write_batch(n1_port, dus, count);
+	for (i = sent; i < count; i++)
+		bytes -= du_len(dus[i]);
+
+	spin_lock(&n1_port->lock);
+
+	stats_add(tx, n1_port, sent, bytes);
+	if (sent < count)
+		n1_port_push_back(rmt, n1_port, dus + sent, count - sent);
+
+	if ((n1_port->state == N1_PORT_STATE_ENABLED ||
+	    n1_port->state == N1_PORT_STATE_DO_NOT_DISABLE) &&
+	    n1_port->stats.plen)
+		reschedule = true;
+
+	n1_port->wbusy = false;
+
+	return reschedule;
+}
+
 static void send_worker(unsigned long o)
 {
 	struct rmt *rmt;
 	struct rmt_n1_port *n1_port;
-	struct hlist_node *ntmp;
 	int bucket;
 	int reschedule = 0;
-	int pdus_sent;
 	struct rmt_ps *ps;
-	struct du * du = NULL;
-	struct du * pendu = NULL;
-	int ret;
 
 	LOG_DBG("Send worker called");
 
@@ -764,103 +1206,61 @@ static void send_worker(unsigned long o)
 		return;
 	}
 
-	spin_lock(&rmt->n1_ports->lock);
-	hash_for_each_safe(rmt->n1_ports->n1_ports, bucket,
-			   ntmp, n1_port, hlist) {
-		if (!n1_port)
+	hash_for_each_rcu(rmt->n1_ports->n1_ports, bucket, n1_port, hlist) {
+		/* Skip ports being destroyed */
+		if (!atomic_inc_not_zero(&n1_port->refs_c))
 			continue;
 
 		spin_lock(&n1_port->lock);
-		spin_unlock(&rmt->n1_ports->lock);
-		if (n1_port->state == N1_PORT_STATE_DEALLOCATED &&
-			atomic_read(&n1_port->refs_c) == 0) {
-			spin_unlock(&n1_port->lock);
-			spin_lock(&rmt->n1_ports->lock);
-			n1_port_cleanup(rmt, n1_port);
-			continue;
-		}
-
-		if (n1_port->state == N1_PORT_STATE_DISABLED	||
-		    !n1_port->stats.plen) {
-			spin_unlock(&n1_port->lock);
-			spin_lock(&rmt->n1_ports->lock);
-			LOG_DBG("Port state is DISABLED or no PDUs to send");
-			continue;
-		}
-
-		if (n1_port->wbusy) {
+		if (n1_port_send_burst(rmt, ps, n1_port))
 			reschedule++;
-			spin_unlock(&n1_port->lock);
-			spin_lock(&rmt->n1_ports->lock);
-			LOG_DBG("Port is sending a PDU, check afterwards");
-			continue;
-		}
-
-		atomic_inc(&n1_port->refs_c);
-		n1_port->wbusy = true;
-
-		pdus_sent = 0;
-		ret = 0;
-		/* Try to send PDUs on that port-id here */
-
-		while ((pdus_sent < MAX_PDUS_SENT_PER_CYCLE) &&
-			n1_port->stats.plen) {
-			du = NULL;
-			pendu = NULL;
-			if (n1_port->pending_du) {
-				pendu = n1_port->pending_du;
-				n1_port->pending_du = NULL;
-				n1_port->stats.plen--;
-			} else {
-				du = ps->rmt_dequeue_policy(ps, n1_port);
-				if (!du) {
-					if (n1_port->stats.plen)
-						LOG_ERR("rmt_dequeue_policy returned no pdu but plen is %u",
-								n1_port->stats.plen);
-					break;
-				}
-				n1_port->stats.plen--;
-			}
+		spin_unlock(&n1_port->lock);
 
-			spin_unlock(&n1_port->lock);
-			if (pendu)
-				ret = n1_port_write_du(rmt, n1_port, pendu);
-			else
-				ret = n1_port_write(rmt, n1_port, du);
-			spin_lock(&n1_port->lock);
+		n1pmap_release(rmt, n1_port);
+	}
+	rcu_read_unlock();
 
-			if (ret < 0)
-				break;
+	if (reschedule) {
+		LOG_DBG("Sheduling policy will schedule again...");
+		tasklet_hi_schedule(&rmt->egress_tasklet);
+	}
+}
 
-			pdus_sent++;
-			stats_inc(tx, n1_port, ret);
-		}
+/* Multi-queue egress counterpart of send_worker, serves a single port */
+static void n1_port_egress_worker(struct work_struct *work)
+{
+	struct rmt_n1_port *n1_port;
+	struct rmt *rmt;
+	struct rmt_ps *ps;
+	bool reschedule = false;
 
-		if ((n1_port->state == N1_PORT_STATE_ENABLED ||
-		    n1_port->state == N1_PORT_STATE_DO_NOT_DISABLE) &&
-		    n1_port->stats.plen)
-			reschedule++;
+	n1_port = container_of(work, struct rmt_n1_port, egress_work);
+	rmt = n1_port->rmt;
 
-		n1_port->wbusy = false;
-		if (atomic_dec_and_test(&n1_port->refs_c) &&
-		    n1_port->state == N1_PORT_STATE_DEALLOCATED) {
-			spin_unlock(&n1_port->lock);
-			spin_lock(&rmt->n1_ports->lock);
-			n1_port_cleanup(rmt, n1_port);
-			continue;
-		}
+	/* Same context the egress tasklet runs the N-1 writes in */
+	local_bh_disable();
 
+	rcu_read_lock();
+	ps = container_of(rcu_dereference(rmt->base.ps),
+			  struct rmt_ps,
+			  base);
+	if (ps && ps->rmt_dequeue_policy) {
+		spin_lock(&n1_port->lock);
+		reschedule = n1_port_send_burst(rmt, ps, n1_port);
 		spin_unlock(&n1_port->lock);
-		spin_lock(&rmt->n1_ports->lock);
-
-	}
-	spin_unlock(&rmt->n1_ports->lock);
+	} else
+		LOG_ERR("Wrong RMT PS");
 	rcu_read_unlock();
 
 	if (reschedule) {
 		LOG_DBG("Sheduling policy will schedule again...");
-		tasklet_hi_schedule(&rmt->egress_tasklet);
+		rmt_egress_schedule(rmt, n1_port);
 	}
+
+	/* Drop the reference taken when this work was queued */
+	n1pmap_release(rmt, n1_port);
+
+	local_bh_enable();
 }
 
 int rmt_send_port_id(struct rmt *instance,
@@ -905,7 +1305,7 @@ int rmt_send_port_id(struct rmt *instance,
 	switch (ret) {
 	case RMT_PS_ENQ_SCHED:
 		n1_port->stats.plen++;
-		tasklet_hi_schedule(&instance->egress_tasklet);
+		rmt_egress_schedule(instance, n1_port);
 		ret = 0;
 		break;
 	case RMT_PS_ENQ_DROP:
@@ -938,7 +1338,7 @@ int rmt_send_port_id(struct rmt *instance,
 		if (ret >= 0) {
 			stats_inc(tx, n1_port, ret);
 			ret = 0;
-		} else if (ret == -EAGAIN)
+		} else if (ret == -EAGAIN || ret == -EINPROGRESS)
 			ret = 0;
 		break;
 	default:
@@ -1040,9 +1440,10 @@ int rmt_enable_port_id(struct rmt *instance,
 
 exit:
 	if (n1_port->stats.plen)
-		tasklet_hi_schedule(&instance->egress_tasklet);
+		rmt_egress_schedule(instance, n1_port);
 
-	n1_port_unlock_release(n1_port);
+	n1_port_unlock(n1_port);
+	n1pmap_release(instance, n1_port);
 
 	return ret;
 }
@@ -1084,7 +1485,7 @@ int rmt_disable_port_id(struct rmt *instance,
 	if (n1_port->state == N1_PORT_STATE_DO_NOT_DISABLE) {
 		n1_port->state = N1_PORT_STATE_ENABLED;
 		if (n1_port->stats.plen)
-			tasklet_hi_schedule(&instance->egress_tasklet);
+			rmt_egress_schedule(instance, n1_port);
 		goto exit;
 	}
 
@@ -1092,7 +1493,8 @@ int rmt_disable_port_id(struct rmt *instance,
 	LOG_DBG("Changed state to DISABLED");
 
 exit:
-	n1_port_unlock_release(n1_port);
+	n1_port_unlock(n1_port);
+	n1pmap_release(instance, n1_port);
 	return ret;
 }
 EXPORT_SYMBOL(rmt_disable_port_id);
@@ -1125,12 +1527,7 @@ int rmt_n1port_bind(struct rmt *instance,
 		return -1;
 	}
 
-	if (n1pmap_find(instance, id)) {
-		LOG_ERR("Queue already exists");
-		return -1;
-	}
-
-	tmp = n1_port_create(id, n1_ipcp);
+	tmp = n1_port_create(instance, id, n1_ipcp);
 	if (!tmp)
 		return -1;
 	if (robject_rset_add(&tmp->robj, instance->n1_ports->rset, "%d", id)) {
@@ -1157,17 +1554,26 @@ int rmt_n1port_bind(struct rmt *instance,
 		return -1;
 	}
 
-	hash_add(instance->n1_ports->n1_ports, &tmp->hlist, id);
-	LOG_DBG("Added send queue to rmt instance %pK for port-id %d",
-		instance, id);
-
 	dif_name = n1_ipcp->ops->dif_name(n1_ipcp->data);
 	tmp->sdup_port = sdup_init_port_config(instance->sdup, dif_name, id);
 	if (!tmp->sdup_port){
 		LOG_ERR("Failed init of SDUP configuration for port-id %d", id);
-		n1_port_destroy(tmp);
+		n1_port_cleanup(instance, tmp);
 		return -1;
 	}
+	tmp->sdup_port->protect_done   = rmt_sdup_protect_done;
+	tmp->sdup_port->unprotect_done = rmt_sdup_unprotect_done;
+	tmp->sdup_port->done_opaque    = tmp;
+
+	/* The port is fully set up before lookups can see it */
+	if (n1pmap_add(instance, tmp)) {
+		LOG_ERR("Queue already exists");
+		n1_port_cleanup(instance, tmp);
+		return -1;
+	}
+
+	LOG_DBG("Added send queue to rmt instance %pK for port-id %d",
+		instance, id);
 
 	return 0;
 }
@@ -1193,19 +1599,9 @@ int rmt_n1port_unbind(struct rmt *instance,
 		return -1;
 	}
 
-	n1_port = n1pmap_find(instance, id);
-	if (!n1_port) {
+	if (n1pmap_unbind(instance, id))
 		LOG_WARN("N1 port already deallocated, nothing to do...");
-		return 0;
-	}
 
-	n1_port_lock(n1_port);
-	n1_port->state = N1_PORT_STATE_DEALLOCATED;
-	n1_port_unlock(n1_port);
-	/* NOTE: Releasing the lock to be able to use n1pmap_release... it is
-	 * not wrong since once in N1_PORT_STATE_DEALLOCATED no other action
-	 * will be performed on the n1_port but this action should be atomic */
-	n1pmap_release(instance, n1_port);
 	return 0;
 }
 EXPORT_SYMBOL(rmt_n1port_unbind);
@@ -1260,67 +1656,102 @@ static int process_dt_pdu(struct rmt *rmt,
 
 int pdu_is_addressed_to_me(struct rmt * rmt, address_t address)
 {
-	struct rmt_address * addr;
+	struct rmt_addresses *addrs;
+	unsigned int i;
+	int ret = 0;
 
-	spin_lock_bh(&rmt->lock);
-	list_for_each_entry(addr, &rmt->addresses, list) {
-                if (addr->address == address) {
-                	spin_unlock_bh(&rmt->lock);
-                	return 1;
-                }
+	rcu_read_lock();
+	addrs = rcu_dereference(rmt->addresses);
+	if (likely(addrs)) {
+		for (i = 0; i < addrs->count; i++) {
+			if (addrs->addrs[i] == address) {
+				ret = 1;
+				break;
+			}
+		}
 	}
+	rcu_read_unlock();
 
-	spin_unlock_bh(&rmt->lock);
-	return 0;
+	return ret;
 }
 
-int rmt_receive(struct rmt *rmt,
-		struct du * du,
-		port_id_t from)
+/*
+ * Transit PDUs are forwarded without decapsulating them: the PCI is only
+ * peeked in place (type, destination and qos-id are at fixed offsets), so
+ * the DU leaves here exactly as du_encap() would have left it. Returns 1
+ * if the PDU is not a transit one and has to go through the full path.
+ */
+static int rmt_relay(struct rmt *rmt,
+		     struct rmt_n1_port *n1_port,
+		     struct du *du)
 {
 	pdu_type_t pdu_type;
 	address_t dst_addr;
-	qos_id_t qos_id;
-	struct rmt_n1_port *n1_port;
-	ssize_t bytes;
+	ssize_t pci_len;
 
-	if (!rmt) {
-		LOG_ERR("No RMT passed");
-		du_destroy(du);
-		return -1;
-	}
-	if (!is_port_id_ok(from)) {
-		LOG_ERR("Wrong port-id %d", from);
-		du_destroy(du);
-		return -1;
-	}
+	/* Runt PDUs are left to the full path, which drops them */
+	if (unlikely(du->skb->len < pci_base_size(du->cfg)))
+		return 1;
 
-	bytes = du_len(du);
-	du->cfg = rmt->efcpc->config;
+	du->pci.h = du->skb->data;
+	pdu_type = pci_type(&du->pci);
+	if (unlikely(!pdu_type_is_ok(pdu_type)))
+		return 1;
 
-	n1_port = n1pmap_find(rmt, from);
-	if (!n1_port) {
-		LOG_ERR("Could not retrieve N-1 port for the received PDU...");
-                du_destroy(du);
+	dst_addr = pci_destination(&du->pci);
+	if (!dst_addr || pdu_is_addressed_to_me(rmt, dst_addr))
+		return 1;
+
+	pci_len = pci_calculate_size(du->cfg, pdu_type);
+	if (unlikely(pci_len <= 0 || du->skb->len < pci_len ||
+		     !is_qos_id_ok(pci_qos_id(&du->pci))))
+		return 1;
+	du->pci.len = pci_len;
+
+	/* Make up for tail padding introduced at lower layers. */
+	if (du->skb->len > pci_length(&du->pci))
+		du_tail_shrink(du, du->skb->len - pci_length(&du->pci));
+
+	if (sdup_dec_check_lifetime_limit(n1_port->sdup_port, du)) {
+		LOG_ERR("Lifetime of PDU reached dropping PDU!");
+		n1pmap_release(rmt, n1_port);
+		du_destroy(du);
 		return -1;
 	}
-	stats_inc(rx, n1_port, bytes);
+	n1pmap_release(rmt, n1_port);
 
-	/* SDU Protection */
-	if (sdup_unprotect_pdu(n1_port->sdup_port, du)) {
-                LOG_ERR("Failed to unprotect PDU");
-                du_destroy(du);
-                return -1;
-        }
+	/* Forward PDU, egress protection is applied per N-1 port */
+	return rmt_send(rmt, du);
+}
+
+/*
+ * Second half of rmt_receive(), once SDU protection has been removed.
+ * Consumes the reference to the N-1 port.
+ */
+static int rmt_receive_unprotected(struct rmt *rmt,
+				   struct rmt_n1_port *n1_port,
+				   struct du * du)
+{
+	pdu_type_t pdu_type;
+	address_t dst_addr;
+	qos_id_t qos_id;
+	port_id_t from = n1_port->port_id;
+	int ret;
 
 	/* This one updates the pci->sdup_header and pdu->skb->data pointers */
 	if (sdup_get_lifetime_limit(n1_port->sdup_port, du)) {
                 LOG_ERR("Failed to get PDU's TTL");
+		n1pmap_release(rmt, n1_port);
                 du_destroy(du);
                 return -1;
         }
 	/* end SDU Protection */
 
+	/* Relays spend most of their time here, keep it short */
+	ret = rmt_relay(rmt, n1_port, du);
+	if (ret <= 0)
+		return ret;
+
 	n1pmap_release(rmt, n1_port);
 
 	if (unlikely(du_decap(du))) { /*Decap PDU */
@@ -1373,23 +1804,142 @@ int rmt_receive(struct rmt *rmt,
 	} else {
 		if (!dst_addr)
 			return process_mgmt_pdu(rmt, from, du);
-		else {
-			/* We need to rencap the pdu again to get pci properly
-			 * in rmt_send */
-			if (unlikely(du_encap(du, pdu_type)))
-				return -1;
-			if (sdup_dec_check_lifetime_limit(n1_port->sdup_port, du)) {
-				LOG_ERR("Lifetime of PDU reached dropping PDU!");
-				du_destroy(du);
-				return -1;
-			}
-			/* Forward PDU */
-			return rmt_send(rmt, du);
-		}
+
+		/* Transit PDUs are relayed by rmt_relay(), unless bogus */
+		LOG_ERR("Could not relay PDU to address %u", dst_addr);
+		du_destroy(du);
+		return -1;
+	}
+}
+
+int rmt_receive(struct rmt *rmt,
+		struct du * du,
+		port_id_t from)
+{
+	struct rmt_n1_port *n1_port;
+	ssize_t bytes;
+	int ret;
+
+	if (!rmt) {
+		LOG_ERR("No RMT passed");
+		du_destroy(du);
+		return -1;
+	}
+	if (!is_port_id_ok(from)) {
+		LOG_ERR("Wrong port-id %d", from);
+		du_destroy(du);
+		return -1;
+	}
+
+	/* SDUs reassembled by a lower DIF may come in pieces */
+	if (unlikely(du_linearize(du))) {
+		du_destroy(du);
+		return -1;
 	}
+
+	bytes = du_len(du);
+	du->cfg = rmt->efcpc->config;
+
+	n1_port = n1pmap_find(rmt, from);
+	if (!n1_port) {
+		LOG_ERR("Could not retrieve N-1 port for the received PDU...");
+                du_destroy(du);
+		return -1;
+	}
+	stats_inc(rx, n1_port, bytes);
+
+	/* SDU Protection */
+	rmt_sdup_pending_inc(rmt);
+	ret = sdup_unprotect_pdu(n1_port->sdup_port, du);
+	if (ret == -EINPROGRESS)
+		/*
+		 * Picked up again by rmt_sdup_unprotect_done(), which gets
+		 * our reference to the port
+		 */
+		return 0;
+	rmt_sdup_pending_dec(rmt);
+
+	if (ret) {
+                LOG_ERR("Failed to unprotect PDU");
+		n1pmap_release(rmt, n1_port);
+                du_destroy(du);
+                return -1;
+        }
+
+	return rmt_receive_unprotected(rmt, n1_port, du);
 }
 EXPORT_SYMBOL(rmt_receive);
 
+/*
+ * Called by SDU protection when it finishes unprotecting a PDU, usually
+ * from the crypto completion context. The rest of the RX path runs from
+ * the port's ingress work item.
+ */
+static void rmt_sdup_unprotect_done(void * opaque,
+				    struct sdup_port * sdup_port,
+				    struct du * du)
+{
+	struct rmt_n1_port *n1_port = opaque;
+	struct rmt *rmt = n1_port->rmt;
+
+	/* Dropped by SDU protection */
+	if (!du)
+		goto out;
+
+	n1_port_lock(n1_port);
+	if (add_du_to_list_ni(n1_port->rx_done, du)) {
+		LOG_ERR("Could not queue unprotected PDU, dropping it");
+		du_destroy(du);
+	} else {
+		/* A pending ingress work item holds a reference to the port */
+		atomic_inc(&n1_port->refs_c);
+		if (!queue_work(rmt->ingress_wq, &n1_port->rx_work))
+			atomic_dec(&n1_port->refs_c);
+	}
+	n1_port_unlock(n1_port);
+
+ out:
+	/* Taken by rmt_receive() */
+	n1pmap_release(rmt, n1_port);
+	rmt_sdup_pending_dec(rmt);
+}
+
+static void n1_port_ingress_worker(struct work_struct *work)
+{
+	struct rmt_n1_port *n1_port;
+	struct du_list_item *item;
+	struct rmt *rmt;
+	struct du *du;
+
+	n1_port = container_of(work, struct rmt_n1_port, rx_work);
+	rmt = n1_port->rmt;
+
+	/* Same context the N-1 IPCPs call rmt_receive() from */
+	local_bh_disable();
+
+	n1_port_lock(n1_port);
+	while (!list_empty(&n1_port->rx_done->dus)) {
+		item = list_first_entry(&n1_port->rx_done->dus,
+					struct du_list_item, next);
+		list_del(&item->next);
+		du = item->du;
+		du_list_item_destroy(item, false);
+		n1_port_unlock(n1_port);
+
+		/* Consumed by rmt_receive_unprotected() */
+		atomic_inc(&n1_port->refs_c);
+		rmt_receive_unprotected(rmt, n1_port, du);
+
+		n1_port_lock(n1_port);
+	}
+	n1_port_unlock(n1_port);
+
+	/* Drop the reference taken when this work was queued */
+	n1pmap_release(rmt, n1_port);
+
+	local_bh_enable();
+}
+
 struct rmt *rmt_create(struct kfa *kfa,
 		       struct efcp_container *efcpc,
 		       struct sdup *sdup,
@@ -1406,7 +1956,10 @@ struct rmt *rmt_create(struct kfa *kfa,
 	if (!tmp)
 		return NULL;
 
-	INIT_LIST_HEAD(&tmp->addresses);
+	spin_lock_init(&tmp->lock);
+	RCU_INIT_POINTER(tmp->addresses, NULL);
+	atomic_set(&tmp->sdup_pending, 0);
+	init_waitqueue_head(&tmp->sdup_wq);
 	tmp->parent = container_of(parent, struct ipcp_instance, robj);
 	tmp->kfa = kfa;
 	tmp->efcpc = efcpc;
@@ -1442,6 +1995,26 @@ struct rmt *rmt_create(struct kfa *kfa,
 		     send_worker,
 		     (unsigned long) tmp);
 
+	tmp->ingress_wq = alloc_workqueue("rmt-ingress",
+					  WQ_HIGHPRI | WQ_MEM_RECLAIM, 0);
+	if (!tmp->ingress_wq) {
+		LOG_ERR("Failed to create the ingress workqueue");
+		rmt_destroy(tmp);
+		return NULL;
+	}
+
+	atomic_set(&tmp->egress_next_cpu, 0);
+	if (rmt_egress_mq) {
+		tmp->egress_wq = alloc_workqueue("rmt-egress",
+						 WQ_HIGHPRI | WQ_MEM_RECLAIM,
+						 0);
+		if (!tmp->egress_wq) {
+			LOG_ERR("Failed to create the egress workqueue");
+			rmt_destroy(tmp);
+			return NULL;
+		}
+	}
+
 	LOG_DBG("Instance %pK initialized successfully", tmp);
 	return tmp;
 }
@@ -1497,3 +2070,143 @@ EXPORT_SYMBOL(rmt_ps_publish);
 int rmt_ps_unpublish(const char *name)
 { return ps_unpublish(&policy_sets, name); }
 EXPORT_SYMBOL(rmt_ps_unpublish);
+
+#ifdef CONFIG_RINA_RMT_REGRESSION_TESTS
+#include <linux/kthread.h>
+#include <linux/delay.h>
+
+#define RMT_TEST_PORTS	  16
+#define RMT_TEST_SENDERS  4
+#define RMT_TEST_DURATION 2000 /* ms */
+
+static atomic_t rmt_test_lookups;
+static atomic_t rmt_test_errors;
+
+/* Emulates the N-1 port lookups done on the send and receive paths */
+static int rmt_test_sender(void *data)
+{
+	struct rmt *rmt = data;
+	struct rmt_n1_port *n1_port;
+	unsigned int i = 0;
+	port_id_t id;
+
+	while (!kthread_should_stop()) {
+		id = (i++ % RMT_TEST_PORTS) + 1;
+
+		n1_port = n1pmap_find(rmt, id);
+		if (n1_port) {
+			n1_port_lock(n1_port);
+			if (n1_port->port_id != id ||
+			    atomic_read(&n1_port->refs_c) < 1)
+				atomic_inc(&rmt_test_errors);
+			n1_port->stats.tx_pdus++;
+			n1_port_unlock(n1_port);
+			n1pmap_release(rmt, n1_port);
+			atomic_inc(&rmt_test_lookups);
+		}
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/* Binds and unbinds ports continuously, with a different pattern */
+static int rmt_test_binder(void *data)
+{
+	struct rmt *rmt = data;
+	struct rmt_n1_port *n1_port;
+	unsigned int i = 0;
+
+	while (!kthread_should_stop()) {
+		n1_port = n1_port_create(rmt, (i % RMT_TEST_PORTS) + 1, NULL);
+		if (!n1_port) {
+			atomic_inc(&rmt_test_errors);
+			break;
+		}
+		if (n1pmap_add(rmt, n1_port))
+			n1_port_destroy(n1_port);
+
+		n1pmap_unbind(rmt, ((i * 7) % RMT_TEST_PORTS) + 1);
+		i++;
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+bool regression_tests_rmt(void)
+{
+	struct task_struct *senders[RMT_TEST_SENDERS];
+	struct task_struct *binder;
+	struct rmt *rmt;
+	bool ok = true;
+	port_id_t id;
+	int i;
+
+	rmt = rkzalloc(sizeof(*rmt), GFP_KERNEL);
+	if (!rmt)
+		return false;
+
+	/* No sysfs nor policy-set needed for the N-1 ports map */
+	rmt->n1_ports = rkzalloc(sizeof(*rmt->n1_ports), GFP_KERNEL);
+	if (!rmt->n1_ports) {
+		rkfree(rmt);
+		return false;
+	}
+	hash_init(rmt->n1_ports->n1_ports);
+	spin_lock_init(&rmt->n1_ports->lock);
+
+	atomic_set(&rmt_test_lookups, 0);
+	atomic_set(&rmt_test_errors, 0);
+
+	binder = kthread_run(rmt_test_binder, rmt, "rmt-test-bind");
+	if (IS_ERR(binder)) {
+		binder = NULL;
+		ok = false;
+	}
+
+	for (i = 0; i < RMT_TEST_SENDERS; i++) {
+		senders[i] = kthread_run(rmt_test_sender, rmt,
+					 "rmt-test-send/%d", i);
+		if (IS_ERR(senders[i])) {
+			senders[i] = NULL;
+			ok = false;
+		}
+	}
+
+	msleep(RMT_TEST_DURATION);
+
+	if (binder)
+		kthread_stop(binder);
+	for (i = 0; i < RMT_TEST_SENDERS; i++)
+		if (senders[i])
+			kthread_stop(senders[i]);
+
+	for (id = 1; id <= RMT_TEST_PORTS; id++)
+		n1pmap_unbind(rmt, id);
+
+	/* Wait for the ports to be reclaimed */
+	rcu_barrier();
+
+	if (!hash_empty(rmt->n1_ports->n1_ports)) {
+		LOG_ERR("N-1 ports left in the map after unbinding them all");
+		ok = false;
+	}
+	if (atomic_read(&rmt_test_errors)) {
+		LOG_ERR("%d inconsistent N-1 port lookups",
+			atomic_read(&rmt_test_errors));
+		ok = false;
+	}
+
+	LOG_INFO("N-1 ports map stress test done, %d successful lookups",
+		 atomic_read(&rmt_test_lookups));
+
+	rkfree(rmt->n1_ports);
+	rkfree(rmt);
+
+	return ok;
+}
+EXPORT_SYMBOL(regression_tests_rmt);
+#endif
@@ -24,6 +24,7 @@
 #define RINA_RMT_H
 
 #include <linux/hashtable.h>
+#include <linux/workqueue.h>
 
 #include "common.h"
 #include "du.h"
@@ -56,6 +57,9 @@ struct rmt;
 
 #define RMT_PS_HASHSIZE 7
 
+/* Max PDUs handed down to an N-1 port in a single du_write_batch */
+#define RMT_TX_BATCH_SIZE 10
+
 /* FIXME: Hide these structs */
 enum flow_state {
 	N1_PORT_STATE_ENABLED = 0,
@@ -81,12 +85,26 @@ struct rmt_n1_port {
 	struct hlist_node	hlist;
 	enum flow_state		state;
 	atomic_t		refs_c;
-	struct du		*pending_du;
+	/* PDUs pushed back by the N-1 IPCP, already protected */
+	struct du		*pending_dus[RMT_TX_BATCH_SIZE];
+	unsigned int		pending_n;
+	/*
+	 * PDUs SDU protection finished asynchronously: protected ones wait
+	 * for the egress worker, unprotected ones for rx_work
+	 */
+	struct du_list		*tx_done;
+	struct du_list		*rx_done;
+	struct work_struct	rx_work;
 	struct sdup_port 	*sdup_port;
 	struct n1_port_stats	stats;
 	bool			wbusy;
 	void 			*rmt_ps_queues;
 	struct robject		robj;
+	struct rcu_head		rcu;
+	/* Multi-queue egress: per-port scheduling context */
+	struct rmt		*rmt;
+	struct work_struct	egress_work;
+	int			egress_cpu;
 };
 
 struct rmt	  *rmt_create(struct kfa *kfa,
@@ -137,6 +155,9 @@ int		   rmt_address_add(struct rmt *instance,
 				   address_t address);
 int		   rmt_address_remove(struct rmt *instance,
 				      address_t address);
+#ifdef CONFIG_RINA_RMT_REGRESSION_TESTS
+bool		   regression_tests_rmt(void);
+#endif
 struct rmt	  *rmt_from_component(struct rina_component *component);
 struct robject    *rmt_robject(struct rmt * instance);
 #endif
@@ -0,0 +1,178 @@
+/*
+ * Shared-memory SDU rings for the flow I/O device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/string.h>
+
+#define RINA_PREFIX "sdu-ring"
+
+#include "logs.h"
+#include "debug.h"
+#include "rds/rmem.h"
+#include "sdu-ring.h"
+
+static void sdu_ring_init(struct sdu_ring * ring,
+			  void *            mem,
+			  uint32_t          num_slots,
+			  uint32_t          slot_size)
+{
+	ring->hdr       = mem;
+	ring->num_slots = num_slots;
+	ring->slot_size = slot_size;
+	ring->head      = 0;
+	ring->tail      = 0;
+}
+
+struct sdu_rings * sdu_rings_create(uint32_t num_slots, uint32_t slot_size)
+{
+	struct sdu_rings * rings;
+	size_t             ring_size;
+
+	if (!num_slots || !is_power_of_2(num_slots) ||
+	    num_slots > IRATI_RING_MAX_SLOTS) {
+		LOG_ERR("Bogus number of ring slots %u", num_slots);
+		return NULL;
+	}
+
+	if (!slot_size || slot_size > (1 << 20)) {
+		LOG_ERR("Bogus ring slot size %u", slot_size);
+		return NULL;
+	}
+
+	ring_size = PAGE_ALIGN(sizeof(struct irati_ring_hdr) +
+			       (size_t) num_slots *
+			       IRATI_RING_SLOT_STRIDE(slot_size));
+
+	rings = rkzalloc(sizeof(*rings), GFP_KERNEL);
+	if (!rings)
+		return NULL;
+
+	/* Zeroed and suitable for remap_vmalloc_range() */
+	rings->mem = vmalloc_user(2 * ring_size);
+	if (!rings->mem) {
+		rkfree(rings);
+		return NULL;
+	}
+
+	rings->ring_size = ring_size;
+	sdu_ring_init(&rings->rx, rings->mem, num_slots, slot_size);
+	sdu_ring_init(&rings->tx, rings->mem + ring_size,
+		      num_slots, slot_size);
+
+	LOG_DBG("Created SDU rings %pK (%u slots of %u bytes)",
+		rings, num_slots, slot_size);
+
+	return rings;
+}
+
+void sdu_rings_destroy(struct sdu_rings * rings)
+{
+	if (!rings)
+		return;
+
+	vfree(rings->mem);
+	rkfree(rings);
+}
+
+int sdu_rings_mmap(struct sdu_rings *       rings,
+		   struct vm_area_struct * vma)
+{
+	if (vma->vm_pgoff != 0 ||
+	    vma->vm_end - vma->vm_start > 2 * rings->ring_size)
+		return -EINVAL;
+
+	return remap_vmalloc_range(vma, rings->mem, 0);
+}
+
+/* The consumer index is written by user space, don't trust it */
+uint32_t sdu_ring_count(struct sdu_ring * ring)
+{
+	uint32_t used = ring->head - smp_load_acquire(&ring->hdr->tail);
+
+	return used > ring->num_slots ? ring->num_slots : used;
+}
+
+bool sdu_ring_is_empty(struct sdu_ring * ring)
+{
+	return sdu_ring_count(ring) == 0;
+}
+
+bool sdu_ring_is_full(struct sdu_ring * ring)
+{
+	return sdu_ring_count(ring) == ring->num_slots;
+}
+
+int sdu_ring_put(struct sdu_ring * ring, struct du * du)
+{
+	struct irati_ring_slot * slot;
+	size_t                   len;
+
+	if (sdu_ring_is_full(ring))
+		return -ENOSPC;
+
+	len = du_len(du);
+	if (len > ring->slot_size)
+		return -EMSGSIZE;
+
+	slot = IRATI_RING_SLOT(ring->hdr, ring->slot_size,
+			       ring->num_slots, ring->head);
+	memcpy(slot->data, du_buffer(du), len);
+	slot->len   = len;
+	slot->flags = 0;
+
+	/* Publish the slot contents before the new head */
+	ring->head++;
+	smp_store_release(&ring->hdr->head, ring->head);
+
+	return 0;
+}
+
+int sdu_ring_peek(struct sdu_ring * ring,
+		  unsigned char ** data,
+		  size_t *         len)
+{
+	struct irati_ring_slot * slot;
+	uint32_t                 head;
+
+	head = smp_load_acquire(&ring->hdr->head);
+	if (head == ring->tail)
+		return -EAGAIN;
+
+	if (head - ring->tail > ring->num_slots) {
+		LOG_ERR("Bogus TX ring head %u (tail %u)", head, ring->tail);
+		return -EINVAL;
+	}
+
+	slot = IRATI_RING_SLOT(ring->hdr, ring->slot_size,
+			       ring->num_slots, ring->tail);
+	*len = READ_ONCE(slot->len);
+	if (!*len || *len > ring->slot_size) {
+		LOG_ERR("Bogus TX ring slot length %zd", *len);
+		return -EINVAL;
+	}
+	*data = slot->data;
+
+	return 0;
+}
+
+void sdu_ring_consume(struct sdu_ring * ring)
+{
+	ring->tail++;
+	smp_store_release(&ring->hdr->tail, ring->tail);
+}
@@ -0,0 +1,67 @@
+/*
+ * Shared-memory SDU rings for the flow I/O device
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef RINA_SDU_RING_H
+#define RINA_SDU_RING_H
+
+#include <linux/types.h>
+#include <linux/mm.h>
+
+#include "du.h"
+#include "irati/kucommon.h"
+
+/*
+ * One direction of the shared memory. The ring header is shared with
+ * user space, so the kernel keeps its own copy of the index it owns
+ * (head for the RX ring, tail for the TX ring) and only publishes it.
+ */
+struct sdu_ring {
+	struct irati_ring_hdr * hdr;
+	uint32_t                num_slots;
+	uint32_t                slot_size;
+	uint32_t                head;
+	uint32_t                tail;
+};
+
+struct sdu_rings {
+	void *          mem;
+	size_t          ring_size;
+	struct sdu_ring rx;
+	struct sdu_ring tx;
+};
+
+struct sdu_rings * sdu_rings_create(uint32_t num_slots, uint32_t slot_size);
+void               sdu_rings_destroy(struct sdu_rings * rings);
+int                sdu_rings_mmap(struct sdu_rings *       rings,
+                                  struct vm_area_struct * vma);
+
+/* RX ring, kernel side is the producer */
+uint32_t           sdu_ring_count(struct sdu_ring * ring);
+bool               sdu_ring_is_empty(struct sdu_ring * ring);
+bool               sdu_ring_is_full(struct sdu_ring * ring);
+
+/* Copies the DU into the next slot, the caller keeps ownership of du */
+int                sdu_ring_put(struct sdu_ring * ring, struct du * du);
+
+/* TX ring, kernel side is the consumer */
+int                sdu_ring_peek(struct sdu_ring * ring,
+                                 unsigned char ** data,
+                                 size_t *         len);
+void               sdu_ring_consume(struct sdu_ring * ring);
+
+#endif
@@ -711,19 +711,30 @@ int sdup_protect_pdu(struct sdup_port * instance,
 {
 	struct sdup_crypto_ps * crypto_ps = NULL;
 	struct sdup_errc_ps * errc_ps = NULL;
+	int ret;
 
 	if (!instance) {
 		LOG_ERR("Bogus instance passed");
 		return -1;
 	}
 
+	/* Crypto and error check work on the bytes of the whole PDU */
+	if ((instance->crypto || instance->errc) && du_linearize(du))
+		return -1;
+
 	rcu_read_lock();
 	if (instance->crypto) {
 		crypto_ps = container_of(rcu_dereference(instance->crypto->base.ps),
 				         struct sdup_crypto_ps,
 				         base);
 
-		if (crypto_ps->sdup_apply_crypto(crypto_ps, du)) {
+		ret = crypto_ps->sdup_apply_crypto(crypto_ps, du);
+		if (ret == -EINPROGRESS) {
+			/* Error check goes in sdup_protect_pdu_done() */
+			rcu_read_unlock();
+			return ret;
+		}
+		if (ret) {
 			rcu_read_unlock();
 			return -1;
 		}
@@ -753,12 +764,16 @@ int sdup_unprotect_pdu(struct sdup_port * instance,
 {
 	struct sdup_crypto_ps * crypto_ps = NULL;
 	struct sdup_errc_ps * errc_ps = NULL;
+	int ret;
 
 	if (!instance) {
 		LOG_ERR("Bogus instance passed");
 		return -1;
 	}
 
+	if ((instance->crypto || instance->errc) && du_linearize(du))
+		return -1;
+
 	rcu_read_lock();
 
 	if (instance->errc) {
@@ -777,7 +792,12 @@ int sdup_unprotect_pdu(struct sdup_port * instance,
 				         struct sdup_crypto_ps,
 				         base);
 
-		if (crypto_ps->sdup_remove_crypto(crypto_ps, du)) {
+		ret = crypto_ps->sdup_remove_crypto(crypto_ps, du);
+		if (ret == -EINPROGRESS) {
+			rcu_read_unlock();
+			return ret;
+		}
+		if (ret) {
 			rcu_read_unlock();
 			return -1;
 		}
@@ -790,6 +810,65 @@ int sdup_unprotect_pdu(struct sdup_port * instance,
 }
 EXPORT_SYMBOL(sdup_unprotect_pdu);
 
+void sdup_protect_pdu_done(struct sdup_port * instance,
+			   struct du * du,
+			   int err)
+{
+	struct sdup_errc_ps * errc_ps;
+
+	if (err) {
+		LOG_ERR("Error Protecting serialized PDU (%d)", err);
+		goto drop;
+	}
+
+	rcu_read_lock();
+	if (instance->errc) {
+		errc_ps = container_of(rcu_dereference(instance->errc->base.ps),
+				       struct sdup_errc_ps,
+				       base);
+
+		if (errc_ps->sdup_add_error_check_policy(errc_ps, du)) {
+			rcu_read_unlock();
+			goto drop;
+		}
+	}
+	rcu_read_unlock();
+
+	if (!instance->protect_done)
+		goto drop;
+
+	instance->protect_done(instance->done_opaque, instance, du);
+	return;
+
+drop:
+	du_destroy(du);
+	if (instance->protect_done)
+		instance->protect_done(instance->done_opaque, instance, NULL);
+}
+EXPORT_SYMBOL(sdup_protect_pdu_done);
+
+void sdup_unprotect_pdu_done(struct sdup_port * instance,
+			     struct du * du,
+			     int err)
+{
+	if (err) {
+		LOG_DBG("Failed to unprotect PDU (%d)", err);
+		goto drop;
+	}
+
+	if (!instance->unprotect_done)
+		goto drop;
+
+	instance->unprotect_done(instance->done_opaque, instance, du);
+	return;
+
+drop:
+	du_destroy(du);
+	if (instance->unprotect_done)
+		instance->unprotect_done(instance->done_opaque, instance, NULL);
+}
+EXPORT_SYMBOL(sdup_unprotect_pdu_done);
+
 int sdup_set_lifetime_limit(struct sdup_port * instance,
 			    struct du * du)
 {
@@ -56,6 +56,21 @@ struct sdup_port {
 	/* Data transfer constants - needed to check max pdu size on RX */
 	struct dt_cons * dt_cons;
 
+	/*
+	 * Called when a protect/unprotect operation the crypto policy set
+	 * deferred (by returning -EINPROGRESS) is done, with the PDU, or
+	 * with NULL if the PDU was dropped. Called exactly once per deferred
+	 * operation, so that the owner of the port can tell when none is
+	 * left in flight.
+	 */
+	void (* protect_done)(void * opaque,
+			      struct sdup_port * port,
+			      struct du * du);
+	void (* unprotect_done)(void * opaque,
+				struct sdup_port * port,
+				struct du * du);
+	void * done_opaque;
+
 	/* Link it to the main IPCP SDU Protection component */
 	struct list_head list;
 };
@@ -129,6 +144,15 @@ int sdup_protect_pdu(struct sdup_port * instance,
 int sdup_unprotect_pdu(struct sdup_port * instance,
 		       struct du * du);
 
+/* For crypto policy sets completing a deferred operation */
+void sdup_protect_pdu_done(struct sdup_port * instance,
+			   struct du * du,
+			   int err);
+
+void sdup_unprotect_pdu_done(struct sdup_port * instance,
+			     struct du * du,
+			     int err);
+
 int sdup_set_lifetime_limit(struct sdup_port * instance,
 			    struct du * du);
 
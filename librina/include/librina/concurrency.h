@@ -223,16 +223,26 @@ private:
 class ConditionVariable : public Lockable {
 public:
         ConditionVariable();
+        /// Timed waits measure time with clock (e.g. CLOCK_MONOTONIC)
+        /// instead of CLOCK_REALTIME
+        explicit ConditionVariable(clockid_t clock);
         virtual ~ConditionVariable() throw();
 
         virtual void signal();
         virtual void broadcast();
         virtual void doWait();
         virtual void timedwait(long seconds, long nanoseconds);
+        /// Wait until signalled or until the absolute deadline, measured
+        /// with the clock of the condition variable. Returns false if the
+        /// deadline passed; throws on any other error.
+        virtual bool timedwait_until(const timespec& deadline);
 
 private:
+        void init(clockid_t clock);
+
         pthread_cond_t     cond_;
         pthread_condattr_t cond_attr_;
+        clockid_t          clock_;
 };
 
 
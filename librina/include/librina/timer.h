@@ -24,8 +24,11 @@
 
 #ifdef __cplusplus
 
+#include <list>
 #include <map>
+#include <vector>
 #include <sys/time.h>
+#include <time.h>
 
 #include "librina/concurrency.h"
 
@@ -53,32 +56,70 @@ public:
 	timeval time_;
 };
 
-class TaskScheduler : public Lockable {
+/// Pending tasks of a timer, kept in a binary min-heap ordered by expiry
+/// time. Each task remembers its position in the heap, so cancelling or
+/// rescheduling it costs O(log n).
+class TaskScheduler : public ConditionVariable {
 public:
 	TaskScheduler();
 	~TaskScheduler() throw();
-	void insert(Time time, TimerTask* timer_task);
-	void runTasks();
-	void cancelTask(TimerTask *task);
+	/// Schedule the task to expire after delay_ms. A task that is
+	/// already pending is rescheduled.
+	void insert(TimerTask* timer_task, long delay_ms);
+	/// Returns true if the task was pending (and has been deleted)
+	bool cancelTask(TimerTask *task);
+	/// Blocks until the earliest task expires and returns it, or returns
+	/// 0 once stop() has been called
+	TimerTask * wait_expired();
+	void stop();
 private:
-	std::map<Time, std::list<TimerTask*>* > tasks_;
+	struct Entry {
+		timespec deadline;
+		unsigned long seq;
+		size_t index;
+		TimerTask * task;
+	};
+
+	static bool before(const Entry * a, const Entry * b);
+	void place(Entry * entry, size_t index);
+	void sift_up(size_t index);
+	void sift_down(size_t index);
+	void remove(Entry * entry);
+
+	std::vector<Entry *> heap_;
+	std::map<TimerTask *, Entry *> entries_;
+	unsigned long seq_;
+	bool stopped_;
 };
 
-/// Class that implements a timer which contains a thread
+/// Class that implements a timer. A dispatcher thread waits for the
+/// earliest task to expire and hands it to a pool of worker threads.
+/// The pool starts with num_workers threads (none by default) and grows
+/// when a task expires with all the workers busy, up to MAX_WORKERS (or
+/// num_workers, if larger), so that a few tasks that block do not delay
+/// the others. Beyond that, expired tasks wait for a free worker.
 class Timer {
 public:
-	Timer();
+	static const unsigned int DEFAULT_WORKERS;
+	static const unsigned int MAX_WORKERS;
+
+	Timer(unsigned int num_workers = DEFAULT_WORKERS);
 	~Timer();
 	void scheduleTask(TimerTask* task, long delay_ms);
 	void cancelTask(TimerTask *task);
 	TaskScheduler* get_task_scheduler() const;
-	bool execute_tasks();
+	void dispatch(TimerTask * task);
+	TimerTask * next_ready_task();
 private:
 	void cancel();
 	Thread *thread_;
+	std::vector<Thread *> workers_;
 	TaskScheduler *task_scheduler;
+	ConditionVariable ready_cond_;
+	std::list<TimerTask *> ready_;
+	unsigned int idle_workers_;
+	unsigned int max_workers_;
 	bool continue_;
-	Lockable continue_lock_;
 };
 
 }
@@ -385,6 +385,16 @@ pthread_rwlock_t * ReadWriteLockable::getReadWriteLock(){
 
 /* CLASS CONDITION VARIABLE */
 ConditionVariable::ConditionVariable():Lockable() {
+	init(CLOCK_REALTIME);
+}
+
+ConditionVariable::ConditionVariable(clockid_t clock):Lockable() {
+	init(clock);
+}
+
+void ConditionVariable::init(clockid_t clock) {
+	clock_ = clock;
+
 	if (pthread_condattr_init(&cond_attr_)) {
 		LOG_CRIT("%s", ConcurrentException::error_initialize_cond_attributes.c_str());
 		throw ConcurrentException(
@@ -397,6 +407,12 @@ ConditionVariable::ConditionVariable():Lockable() {
 				ConcurrentException::error_set_cond_attributes);
 	}
 
+	if (pthread_condattr_setclock(&cond_attr_, clock_)) {
+		LOG_CRIT("%s", ConcurrentException::error_set_cond_attributes.c_str());
+		throw ConcurrentException(
+				ConcurrentException::error_set_cond_attributes);
+	}
+
 	if (pthread_cond_init(&cond_, &cond_attr_)) {
 		LOG_CRIT("%s", ConcurrentException::error_initialize_cond.c_str());
 		throw ConcurrentException(
@@ -444,7 +460,7 @@ void ConditionVariable::timedwait(long seconds, long nanoseconds){
 	timespec waitTime;
 
 	//Prepare timespec struct
-	clock_gettime(CLOCK_REALTIME, &waitTime);
+	clock_gettime(clock_, &waitTime);
 	waitTime.tv_nsec += nanoseconds;
 
 	//Make sure it does not overflow
@@ -469,6 +485,21 @@ void ConditionVariable::timedwait(long seconds, long nanoseconds){
 			ConcurrentException::error_wait_cond);
 }
 
+bool ConditionVariable::timedwait_until(const timespec& deadline){
+	int response = pthread_cond_timedwait(&cond_, getMutex(), &deadline);
+	if (response == 0){
+		return true;
+	}
+
+	if (response == ETIMEDOUT){
+		return false;
+	}
+
+	LOG_CRIT("%s", ConcurrentException::error_wait_cond.c_str());
+	throw ConcurrentException(
+			ConcurrentException::error_wait_cond);
+}
+
 // Class Sleep
 bool Sleep::sleep(int sec, int milisec) {
 	return usleep(sec * 1000000 + milisec * 1000);
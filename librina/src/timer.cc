@@ -63,116 +63,219 @@ int Time::get_time_in_ms()
 	return (int) time_seconds * 1000 + (int) (time_.tv_usec / 1000);
 }
 
-// CLASS LockableMap
-void* doWorkTask(void *arg) {
-	TimerTask *timer_task = (TimerTask*) arg;
-	timer_task->run();
-	delete timer_task;
-	timer_task = 0;
-	return (void *) 0;
-}
-
+// CLASS TaskScheduler
 TaskScheduler::TaskScheduler() :
-		Lockable() {
+		ConditionVariable(CLOCK_MONOTONIC) {
+	seq_ = 0;
+	stopped_ = false;
 }
+
 TaskScheduler::~TaskScheduler() throw () {
-  for (std::map<Time, std::list<TimerTask*>* >::iterator iter_map = tasks_.begin();
-      iter_map != tasks_.end(); ++iter_map) {
-    for (std::list<TimerTask*>::iterator iter_list = iter_map->second->begin();
-        iter_list != iter_map->second->end(); ++iter_list){
-      delete *iter_list;
-    }
-    iter_map->second->empty();
-    delete iter_map->second;
-  }
-  tasks_.empty();
-}
-void TaskScheduler::insert(Time time, TimerTask* timer_task) {
+	for (std::vector<Entry *>::iterator it = heap_.begin();
+			it != heap_.end(); ++it) {
+		delete (*it)->task;
+		delete *it;
+	}
+	heap_.clear();
+	entries_.clear();
+}
+
+bool TaskScheduler::before(const Entry * a, const Entry * b) {
+	if (a->deadline.tv_sec != b->deadline.tv_sec)
+		return a->deadline.tv_sec < b->deadline.tv_sec;
+	if (a->deadline.tv_nsec != b->deadline.tv_nsec)
+		return a->deadline.tv_nsec < b->deadline.tv_nsec;
+	return a->seq < b->seq;
+}
+
+void TaskScheduler::place(Entry * entry, size_t index) {
+	heap_[index] = entry;
+	entry->index = index;
+}
+
+void TaskScheduler::sift_up(size_t index) {
+	Entry * entry = heap_[index];
+	size_t parent;
+
+	while (index > 0) {
+		parent = (index - 1) / 2;
+		if (!before(entry, heap_[parent]))
+			break;
+		place(heap_[parent], index);
+		index = parent;
+	}
+	place(entry, index);
+}
+
+void TaskScheduler::sift_down(size_t index) {
+	Entry * entry = heap_[index];
+	size_t child;
+
+	while ((child = 2 * index + 1) < heap_.size()) {
+		if (child + 1 < heap_.size() &&
+				before(heap_[child + 1], heap_[child]))
+			child++;
+		if (!before(heap_[child], entry))
+			break;
+		place(heap_[child], index);
+		index = child;
+	}
+	place(entry, index);
+}
+
+void TaskScheduler::remove(Entry * entry) {
+	size_t index = entry->index;
+	Entry * last = heap_.back();
+
+	heap_.pop_back();
+	entries_.erase(entry->task);
+	if (last == entry)
+		return;
+
+	place(last, index);
+	if (index > 0 && before(last, heap_[(index - 1) / 2]))
+		sift_up(index);
+	else
+		sift_down(index);
+}
+
+void TaskScheduler::insert(TimerTask* timer_task, long delay_ms) {
+	std::map<TimerTask *, Entry *>::iterator it;
+	Entry * entry;
+
+	if (delay_ms < 0)
+		delay_ms = 0;
+
 	lock();
 
-	std::map<Time, std::list<TimerTask*>* >::iterator iter = tasks_.find(time);
-	if (iter != tasks_.end()) {
-		iter->second->push_back(timer_task);
+	it = entries_.find(timer_task);
+	if (it != entries_.end()) {
+		entry = it->second;
+		remove(entry);
 	} else {
-		std::list<TimerTask*> *list = new std::list<TimerTask*>;
-		list->push_back(timer_task);
-		std::pair<Time, std::list<TimerTask*>* > pair(time, list);
-		tasks_.insert(pair);
+		entry = new Entry();
+		entry->task = timer_task;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &entry->deadline);
+	entry->deadline.tv_sec += delay_ms / 1000;
+	entry->deadline.tv_nsec += (delay_ms % 1000) * 1000000;
+	if (entry->deadline.tv_nsec >= 1000000000) {
+		entry->deadline.tv_sec++;
+		entry->deadline.tv_nsec -= 1000000000;
 	}
+	entry->seq = seq_++;
+
+	entries_[timer_task] = entry;
+	heap_.push_back(entry);
+	sift_up(heap_.size() - 1);
+
+	// Only a new earliest expiry changes how long the dispatcher sleeps
+	if (heap_.front() == entry)
+		signal();
 
 	unlock();
 }
 
-void TaskScheduler::runTasks() {
-	std::stringstream ss;
+bool TaskScheduler::cancelTask(TimerTask *task) {
+	std::map<TimerTask *, Entry *>::iterator it;
+	Entry * entry;
 
 	lock();
-	Time now;
-	std::map<Time, std::list<TimerTask*>* >::iterator first = tasks_.begin();
-	std::map<Time, std::list<TimerTask*>* >::iterator last = tasks_.upper_bound(
-			now);
-	for (std::map<Time, std::list<TimerTask*>* >::iterator iter_map = first;
-			iter_map != last; ++iter_map) {
-		for (std::list<TimerTask*>::iterator iter_list = iter_map->second->begin();
-				iter_list != iter_map->second->end(); ++iter_list){
-			try {
-				Thread *t = new Thread(&doWorkTask,
-						       (void *) (*iter_list),
-						       ss.str(), true);
-				t->start();
-				delete t;
-				t = 0;
-			} catch (Exception &e) {
-				LOG_ERR("Problems creating thread: %s", e.what());
-			}
-		}
-		delete iter_map->second;
+	it = entries_.find(task);
+	if (it == entries_.end()) {
+		unlock();
+		return false;
 	}
-	tasks_.erase(first, last);
+
+	entry = it->second;
+	remove(entry);
 	unlock();
+
+	delete entry->task;
+	delete entry;
+	return true;
 }
 
-void TaskScheduler::cancelTask(TimerTask *task) {
+TimerTask * TaskScheduler::wait_expired() {
+	TimerTask * task = 0;
+	timespec now, deadline;
+	Entry * entry;
+
 	lock();
-	std::map<Time, std::list<TimerTask*>* >::iterator iter_map =
-	            tasks_.begin();
-	while(iter_map != tasks_.end()) {
-	    std::list<TimerTask*>::iterator iter_list = iter_map->second->begin();
-		while(iter_list != iter_map->second->end()){
-			if (*iter_list == task){
-				delete *iter_list;
-				iter_map->second->erase(iter_list++);
-			}
-			else
-			{
-			    ++iter_list;
-			}
+	while (!stopped_) {
+		if (heap_.empty()) {
+			doWait();
+			continue;
 		}
-		if (iter_map->second->size() == 0){
-			delete iter_map->second;
-			tasks_.erase(iter_map++);
+
+		entry = heap_.front();
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (entry->deadline.tv_sec < now.tv_sec ||
+				(entry->deadline.tv_sec == now.tv_sec &&
+				 entry->deadline.tv_nsec <= now.tv_nsec)) {
+			remove(entry);
+			task = entry->task;
+			delete entry;
+			break;
 		}
-		else
-		    ++iter_map;
+
+		// The entry may go away while waiting, wait on a copy of its
+		// deadline. A timeout just means it has probably expired.
+		deadline = entry->deadline;
+		timedwait_until(deadline);
 	}
-unlock();
+	unlock();
+
+	return task;
+}
+
+void TaskScheduler::stop() {
+	lock();
+	stopped_ = true;
+	broadcast();
+	unlock();
 }
 
 // CLASS Timer
 void* doWorkTimer(void *arg) {
 	Timer *timer = (Timer*) arg;
-	Sleep sleep;
-	while (timer->execute_tasks()) {
-                sleep.sleepForMili(100);
+	TimerTask *task;
+
+	while ((task = timer->get_task_scheduler()->wait_expired()))
+		timer->dispatch(task);
+
+	return (void *) 0;
+}
+
+void* doWorkTimerWorker(void *arg) {
+	Timer *timer = (Timer*) arg;
+	TimerTask *task;
+
+	while ((task = timer->next_ready_task())) {
+		task->run();
+		delete task;
 	}
+
 	return (void *) 0;
 }
 
-Timer::Timer() {
-	continue_lock_.lock();
+const unsigned int Timer::DEFAULT_WORKERS = 0;
+const unsigned int Timer::MAX_WORKERS = 16;
+
+Timer::Timer(unsigned int num_workers) {
+	Thread * worker;
+
 	continue_ = true;
-	continue_lock_.unlock();
+	idle_workers_ = 0;
+	max_workers_ = num_workers > MAX_WORKERS ? num_workers : MAX_WORKERS;
 	task_scheduler = new TaskScheduler();
+	for (unsigned int i = 0; i < num_workers; i++) {
+		worker = new Thread(&doWorkTimerWorker, (void *) this,
+				    std::string("Timer worker"), false);
+		worker->start();
+		workers_.push_back(worker);
+	}
 	thread_ = new Thread(&doWorkTimer, (void *) this,
 			     std::string("Timer"), false);
 	thread_->start();
@@ -181,6 +284,12 @@ Timer::Timer() {
 Timer::~Timer() {
 	cancel();
 
+	for (std::list<TimerTask *>::iterator it = ready_.begin();
+			it != ready_.end(); ++it) {
+		delete *it;
+	}
+	ready_.clear();
+
 	if (task_scheduler) {
 		delete task_scheduler;
 		task_scheduler = 0;
@@ -193,39 +302,89 @@ Timer::~Timer() {
 }
 
 void Timer::scheduleTask(TimerTask* task, long delay_ms) {
-	Time executeTime;
-	timeval t;
-	int milisecondsNotNorm = executeTime.get_only_milliseconds() + (delay_ms % 1000);
-	int miliseconds = milisecondsNotNorm % 1000;
-	int seconds = executeTime.get_time_seconds() + (delay_ms / 1000) + (milisecondsNotNorm / 1000);
-	t.tv_sec = seconds;
-	t.tv_usec = miliseconds * 1000;
-	executeTime.set_timeval(t);
-	task_scheduler->insert(executeTime, task);
+	task_scheduler->insert(task, delay_ms);
 }
 void Timer::cancelTask(TimerTask* task) {
-	task_scheduler->cancelTask(task);
+	if (task_scheduler->cancelTask(task))
+		return;
+
+	// It may have expired but not be running yet
+	ready_cond_.lock();
+	for (std::list<TimerTask *>::iterator it = ready_.begin();
+			it != ready_.end(); ++it) {
+		if (*it == task) {
+			ready_.erase(it);
+			delete task;
+			break;
+		}
+	}
+	ready_cond_.unlock();
 }
 void Timer::cancel() {
-	continue_lock_.lock();
-	continue_ = false;
-	continue_lock_.unlock();
 	void *r;
+
+	task_scheduler->stop();
 	LOG_DBG("Waiting for the timer %d to join", thread_);
 	thread_->join(&r);
+
+	ready_cond_.lock();
+	continue_ = false;
+	ready_cond_.broadcast();
+	ready_cond_.unlock();
+
+	for (std::vector<Thread *>::iterator it = workers_.begin();
+			it != workers_.end(); ++it) {
+		(*it)->join(&r);
+		delete *it;
+	}
+	workers_.clear();
 	LOG_DBG("Timer with ID %d ended", thread_);
 }
 TaskScheduler* Timer::get_task_scheduler() const {
 	return task_scheduler;
 }
-bool Timer::execute_tasks() {
-	continue_lock_.lock();
-        bool result = continue_;
-	if (result)
-	{
-	        get_task_scheduler()->runTasks();
+void Timer::dispatch(TimerTask * task) {
+	Thread * worker;
+
+	ready_cond_.lock();
+	ready_.push_back(task);
+	if (idle_workers_ >= ready_.size()) {
+		ready_cond_.signal();
+		ready_cond_.unlock();
+		return;
 	}
-	continue_lock_.unlock();
-	return result;
+	ready_cond_.unlock();
+
+	// All the workers are busy. Add one more, unless the pool is full;
+	// then the task waits for a worker to be free. Only this thread
+	// touches workers_ until cancel() has joined it.
+	if (workers_.size() >= max_workers_)
+		return;
+
+	try {
+		worker = new Thread(&doWorkTimerWorker, (void *) this,
+				    std::string("Timer worker"), false);
+		worker->start();
+		workers_.push_back(worker);
+	} catch (Exception &e) {
+		LOG_ERR("Problems creating timer worker: %s", e.what());
+	}
+}
+TimerTask * Timer::next_ready_task() {
+	TimerTask * task = 0;
+
+	ready_cond_.lock();
+	while (continue_ && ready_.empty()) {
+		idle_workers_++;
+		ready_cond_.doWait();
+		idle_workers_--;
+	}
+	if (continue_) {
+		task = ready_.front();
+		ready_.pop_front();
+	}
+	ready_cond_.unlock();
+
+	return task;
 }
 }
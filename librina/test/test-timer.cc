@@ -21,6 +21,7 @@
 //
 
 #include <iostream>
+#include <cstdlib>
 
 #include "librina/timer.h"
 
@@ -58,6 +59,73 @@ public:
 	bool check_;
 };
 
+static Lockable counter_lock;
+static int counter = 0;
+
+class CountingTimerTask: public TimerTask {
+public:
+	CountingTimerTask(){ };
+	void run() {
+		counter_lock.lock();
+		counter++;
+		counter_lock.unlock();
+	};
+
+	std::string name() const {
+		return "Counting";
+	}
+};
+
+class DeadlineTimerTask: public TimerTask {
+public:
+	DeadlineTimerTask(long * late_ms){
+		late_ms_ = late_ms;
+		clock_gettime(CLOCK_MONOTONIC, &scheduled_);
+	};
+	void run() {
+		timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		*late_ms_ = (now.tv_sec - scheduled_.tv_sec) * 1000 +
+			(now.tv_nsec - scheduled_.tv_nsec) / 1000000 - 10;
+	};
+
+	std::string name() const {
+		return "Deadline";
+	}
+
+	timespec scheduled_;
+	long * late_ms_;
+};
+
+static int running = 0;
+static int max_running = 0;
+
+class BlockingTimerTask: public TimerTask {
+public:
+	BlockingTimerTask(){ };
+	void run() {
+		Sleep sleep;
+
+		counter_lock.lock();
+		running++;
+		if (running > max_running)
+			max_running = running;
+		counter_lock.unlock();
+
+		sleep.sleepForMili(50);
+
+		counter_lock.lock();
+		running--;
+		counter++;
+		counter_lock.unlock();
+	};
+
+	std::string name() const {
+		return "Blocking";
+	}
+};
+
 int main()
 {
 	bool result = true;
@@ -138,6 +206,79 @@ int main()
 
 	delete timer;
 
+	std::cout<<std::endl <<	"////////////////////////////////////////////////////" << std::endl <<
+							"/ test-timer TEST 5 : Cancel half of many tasks    /" << std::endl <<
+							"////////////////////////////////////////////////////" << std::endl;
+	timer = new Timer();
+
+	{
+		CountingTimerTask * tasks[2000];
+		unsigned int seed = 1;
+
+		for (int i = 0; i < 2000; i++) {
+			tasks[i] = new CountingTimerTask();
+			timer->scheduleTask(tasks[i], 100 + rand_r(&seed) % 200);
+		}
+		// Rescheduling a pending task must not run it twice
+		timer->scheduleTask(tasks[1], 150);
+		for (int i = 0; i < 2000; i += 2)
+			timer->cancelTask(tasks[i]);
+	}
+
+	sleep.sleepForMili(1000);
+
+	counter_lock.lock();
+	if (counter != 1000){
+		result = false;
+		std::cout<< "TEST 5 FAILED: " << counter << " tasks run" <<std::endl;
+	}
+	counter_lock.unlock();
+
+	delete timer;
+
+	std::cout<<std::endl <<	"////////////////////////////////////////////////////" << std::endl <<
+							"/ test-timer TEST 6 : Precision of a 10 ms timer   /" << std::endl <<
+							"////////////////////////////////////////////////////" << std::endl;
+	timer = new Timer();
+
+	{
+		long late_ms = -1000;
+
+		timer->scheduleTask(new DeadlineTimerTask(&late_ms), 10);
+		sleep.sleepForMili(200);
+
+		if (late_ms < 0 || late_ms > 50){
+			result = false;
+			std::cout<< "TEST 6 FAILED: " << late_ms << " ms late" <<std::endl;
+		}
+	}
+
+	delete timer;
+
+	std::cout<<std::endl <<	"////////////////////////////////////////////////////" << std::endl <<
+							"/ test-timer TEST 7 : Bounded workers for blocking /" << std::endl <<
+							"////////////////////////////////////////////////////" << std::endl;
+	timer = new Timer();
+
+	counter_lock.lock();
+	counter = 0;
+	counter_lock.unlock();
+	for (int i = 0; i < 100; i++)
+		timer->scheduleTask(new BlockingTimerTask(), 10);
+
+	sleep.sleepForMili(1500);
+
+	counter_lock.lock();
+	if (counter != 100 || max_running < 2 ||
+			max_running > (int) Timer::MAX_WORKERS){
+		result = false;
+		std::cout<< "TEST 7 FAILED: " << counter << " tasks run, "
+			 << max_running << " at a time" <<std::endl;
+	}
+	counter_lock.unlock();
+
+	delete timer;
+
 	if (result) {
 		std::cout<<std::endl <<	"//////////////////////////////////////" << std::endl <<
 								"//////////////////////////////////////" << std::endl <<
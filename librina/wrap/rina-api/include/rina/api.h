@@ -223,6 +223,98 @@ void rina_flow_spec_unreliable(struct rina_flow_spec *spec);
  */
 unsigned int rina_flow_mss_get(int fd);
 
+/*
+ * Batched I/O, to move several SDUs with a single system call while
+ * preserving message boundaries. The buffer holds a sequence of records,
+ * each made of a 32 bit SDU length in host byte order followed by the
+ * SDU itself, padded so that the next record starts at a multiple of 4
+ * bytes. RINA_BATCH_REC_SIZE() gives the size of the record of an SDU.
+ */
+#define RINA_BATCH_REC_SIZE(len) (((uint32_t)sizeof(uint32_t) + (len) + 3) & ~3U)
+
+/*
+ * Read up to @max_sdus SDUs from the flow @fd into the @len bytes of @buf,
+ * laid out as records. It blocks only until the first SDU is available
+ * (unless @fd is non-blocking), then takes the SDUs already queued. Returns
+ * the number of SDUs read, 0 if the flow has been deallocated, -1 on error,
+ * with the errno code properly set (EMSGSIZE if the first SDU does not
+ * fit in @buf).
+ */
+int rina_flow_read_batch(int fd, void *buf, unsigned int len,
+                         unsigned int max_sdus);
+
+/*
+ * Write the first @count records of the @len bytes of @buf to the flow
+ * @fd. Returns the number of SDUs written, which can be less than @count
+ * if the flow cannot accept more SDUs for the moment, -1 on error, with
+ * the errno code properly set.
+ */
+int rina_flow_write_batch(int fd, const void *buf, unsigned int len,
+                          unsigned int count);
+
+/*
+ * Shared-memory SDU rings, to exchange batches of SDUs on the flow
+ * identified by @fd without a system call per SDU. Once the rings are
+ * set up, the flow should be accessed only through the rina_flow_ring_*()
+ * functions. Whether they block or not depends on the O_NONBLOCK flag
+ * of @fd, as for read() and write().
+ */
+struct rina_flow_ring;
+
+struct rina_sdu_desc {
+    void *data;
+    uint32_t len;
+};
+
+/*
+ * Set up and map a RX and a TX ring of @num_slots slots (a power of two)
+ * on the flow I/O file descriptor @fd. Each slot holds an SDU of up
+ * to @slot_size bytes, which must not be smaller than the MSS of the flow.
+ * Returns NULL on error, with the errno code properly set.
+ */
+struct rina_flow_ring *rina_flow_ring_setup(int fd, unsigned int num_slots,
+                                            unsigned int slot_size);
+
+/*
+ * Unmap the rings. The rings are destroyed when @fd is closed.
+ */
+void rina_flow_ring_close(struct rina_flow_ring *ring);
+
+/*
+ * Fill in up to @max descriptors pointing to the SDUs received in the
+ * RX ring. The SDUs stay in the ring (and calling this function again
+ * returns the same ones) until they are released with
+ * rina_flow_ring_recv_done(). Returns the number of descriptors filled,
+ * 0 if the flow has been deallocated, -1 on error, with the errno code
+ * properly set.
+ */
+int rina_flow_ring_recv(struct rina_flow_ring *ring,
+                        struct rina_sdu_desc *descs, unsigned int max);
+
+/*
+ * Give back to the kernel the first @count SDUs returned by
+ * rina_flow_ring_recv().
+ */
+void rina_flow_ring_recv_done(struct rina_flow_ring *ring, unsigned int count);
+
+/*
+ * Fill in up to @max descriptors pointing to free slots of the TX ring,
+ * with len set to the slot size. Returns the number of descriptors
+ * filled, which is 0 if the TX ring is full.
+ */
+int rina_flow_ring_send_get(struct rina_flow_ring *ring,
+                            struct rina_sdu_desc *descs, unsigned int max);
+
+/*
+ * Post the first @count descriptors returned by rina_flow_ring_send_get(),
+ * after writing the SDUs and setting their length, and ask the kernel to
+ * transmit all the SDUs pending in the TX ring. A @count of 0 only
+ * retries the transmission of the SDUs still pending. Returns the number
+ * of SDUs transmitted, -1 on error, with the errno code properly set.
+ */
+int rina_flow_ring_send(struct rina_flow_ring *ring,
+                        const struct rina_sdu_desc *descs, unsigned int count);
+
 #ifdef __cplusplus
 }
 #endif
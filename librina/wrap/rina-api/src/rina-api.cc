@@ -27,6 +27,7 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <librina/librina.h>
 #include <rina/api.h>
 #include "ctrl.h"
@@ -640,4 +641,176 @@ rina_flow_mss_get(int fd)
 	return data.port_id;
 }
 
+
+int
+rina_flow_read_batch(int fd, void *buf, unsigned int len, unsigned int max_sdus)
+{
+	struct irati_iodev_batch batch;
+
+	batch.buf = (uintptr_t) buf;
+	batch.buf_len = len;
+	batch.count = max_sdus;
+
+	return ioctl(fd, IRATI_IOCTL_READ_BATCH, &batch);
+}
+
+int
+rina_flow_write_batch(int fd, const void *buf, unsigned int len,
+		      unsigned int count)
+{
+	struct irati_iodev_batch batch;
+
+	batch.buf = (uintptr_t) buf;
+	batch.buf_len = len;
+	batch.count = count;
+
+	return ioctl(fd, IRATI_IOCTL_WRITE_BATCH, &batch);
+}
+
+struct rina_flow_ring {
+	int fd;
+	void *mem;
+	size_t size;
+	struct irati_ring_hdr *rx;
+	struct irati_ring_hdr *tx;
+	uint32_t num_slots;
+	uint32_t slot_size;
+};
+
+static inline uint32_t
+ring_load(uint32_t *idx)
+{
+	return __atomic_load_n(idx, __ATOMIC_ACQUIRE);
+}
+
+static inline void
+ring_store(uint32_t *idx, uint32_t val)
+{
+	__atomic_store_n(idx, val, __ATOMIC_RELEASE);
+}
+
+struct rina_flow_ring *
+rina_flow_ring_setup(int fd, unsigned int num_slots, unsigned int slot_size)
+{
+	struct irati_iodev_ringreq req;
+	struct rina_flow_ring *ring;
+	void *mem;
+
+	req.num_slots = num_slots;
+	req.slot_size = slot_size;
+	req.ring_size = 0;
+	if (ioctl(fd, IRATI_IOCTL_RING_SETUP, &req)) {
+		return NULL;
+	}
+
+	mem = mmap(NULL, 2 * req.ring_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED, fd, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
+	}
+
+	ring = (struct rina_flow_ring *) malloc(sizeof(*ring));
+	if (!ring) {
+		munmap(mem, 2 * req.ring_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ring->fd = fd;
+	ring->mem = mem;
+	ring->size = 2 * req.ring_size;
+	ring->rx = (struct irati_ring_hdr *) mem;
+	ring->tx = (struct irati_ring_hdr *)((char *) mem + req.ring_size);
+	ring->num_slots = num_slots;
+	ring->slot_size = slot_size;
+
+	return ring;
+}
+
+void
+rina_flow_ring_close(struct rina_flow_ring *ring)
+{
+	munmap(ring->mem, ring->size);
+	free(ring);
+}
+
+int
+rina_flow_ring_recv(struct rina_flow_ring *ring,
+		    struct rina_sdu_desc *descs, unsigned int max)
+{
+	struct irati_ring_slot *slot;
+	uint32_t tail = ring->rx->tail;
+	uint32_t avail;
+	unsigned int i;
+	int ret;
+
+	avail = ring_load(&ring->rx->head) - tail;
+	if (avail == 0) {
+		/* Let the kernel refill the ring, waiting if needed */
+		ret = ioctl(ring->fd, IRATI_IOCTL_RING_RXSYNC);
+		if (ret <= 0) {
+			return ret;
+		}
+		avail = ring_load(&ring->rx->head) - tail;
+	}
+
+	for (i = 0; i < avail && i < max; i++) {
+		slot = IRATI_RING_SLOT(ring->rx, ring->slot_size,
+				       ring->num_slots, tail + i);
+		descs[i].data = slot->data;
+		descs[i].len = slot->len;
+	}
+
+	return i;
+}
+
+void
+rina_flow_ring_recv_done(struct rina_flow_ring *ring, unsigned int count)
+{
+	ring_store(&ring->rx->tail, ring->rx->tail + count);
+}
+
+int
+rina_flow_ring_send_get(struct rina_flow_ring *ring,
+			struct rina_sdu_desc *descs, unsigned int max)
+{
+	struct irati_ring_slot *slot;
+	uint32_t head = ring->tx->head;
+	uint32_t space;
+	unsigned int i;
+
+	space = ring->num_slots - (head - ring_load(&ring->tx->tail));
+	for (i = 0; i < space && i < max; i++) {
+		slot = IRATI_RING_SLOT(ring->tx, ring->slot_size,
+				       ring->num_slots, head + i);
+		descs[i].data = slot->data;
+		descs[i].len = ring->slot_size;
+	}
+
+	return i;
+}
+
+int
+rina_flow_ring_send(struct rina_flow_ring *ring,
+		    const struct rina_sdu_desc *descs, unsigned int count)
+{
+	struct irati_ring_slot *slot;
+	uint32_t head = ring->tx->head;
+	unsigned int i;
+
+	for (i = 0; i < count; i++) {
+		if (descs[i].len == 0 || descs[i].len > ring->slot_size) {
+			errno = EINVAL;
+			return -1;
+		}
+		slot = IRATI_RING_SLOT(ring->tx, ring->slot_size,
+				       ring->num_slots, head + i);
+		slot->len = descs[i].len;
+		slot->flags = 0;
+	}
+	ring_store(&ring->tx->head, head + count);
+
+	return ioctl(ring->fd, IRATI_IOCTL_RING_TXSYNC);
+}
+
 }
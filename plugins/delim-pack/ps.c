@@ -0,0 +1,453 @@
+/*
+ * SDU packing policy set for Delimiting
+ *
+ * Small SDUs are not sent in a PDU each: they are appended to a pending
+ * User Data Field, which goes down to DTP when the next SDU does not fit
+ * in the maximum fragment size, or when the flush deadline expires.
+ * Packed UDFs carry the "length present" delimiting flags followed by
+ * one <16-bit big endian length> <SDU data> record per SDU. SDUs too big
+ * to be packed, and UDFs without lengths, are handled by the default
+ * policy set: the receiver needs this policy set to unpack, but it still
+ * understands a sender running the default one.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/export.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/version.h>
+#include <asm/unaligned.h>
+
+#define RINA_PREFIX "delim-pack"
+
+#include "logs.h"
+#include "rds/rmem.h"
+#include "rds/rtimer.h"
+#include "delim.h"
+#include "delim-ps.h"
+#include "delim-ps-default.h"
+#include "du.h"
+
+/* Complete SDUs, each one preceded by its length */
+#define PACK_FLAGS	 0x03
+#define PACK_REC_HDR	 sizeof(__u16)
+
+/* Flush deadline, in ms */
+#define PACK_DEF_DEADLINE 1
+
+struct pack_priv {
+	struct delim *	  delim;
+
+	/* The default policy set, for fragments and unpacked UDFs */
+	struct delim_ps * def;
+
+	spinlock_t	  lock;
+	/* UDF being filled, NULL if none */
+	struct du *	  pending;
+	/* UDFs ready to go down, in order */
+	struct du_list *  ready;
+	/* Somebody is already handing the ready UDFs to DTP */
+	bool		  draining;
+	unsigned int	  deadline;
+	struct timer_list flush_timer;
+};
+
+/*
+ * Hands the ready UDFs down to DTP. Only one context does it at a time,
+ * the others just queue, so UDFs get their sequence numbers in order
+ * without holding the lock across dtp_write().
+ */
+static void pack_drain(struct pack_priv * priv)
+{
+	struct du_list_item * item;
+	struct du * du;
+
+	spin_lock_bh(&priv->lock);
+	if (priv->draining) {
+		spin_unlock_bh(&priv->lock);
+		return;
+	}
+	priv->draining = true;
+
+	while (!list_empty(&priv->ready->dus)) {
+		item = list_first_entry(&priv->ready->dus,
+					struct du_list_item, next);
+		list_del(&item->next);
+		du = item->du;
+		du_list_item_destroy(item, false);
+		spin_unlock_bh(&priv->lock);
+
+		if (delim_write(priv->delim, du))
+			LOG_ERR("Could not write packed UDF to DTP");
+
+		spin_lock_bh(&priv->lock);
+	}
+
+	priv->draining = false;
+	spin_unlock_bh(&priv->lock);
+}
+
+/* Called with priv->lock held */
+static int pack_close_pending(struct pack_priv * priv)
+{
+	struct du * du = priv->pending;
+
+	if (!du)
+		return 0;
+
+	priv->pending = NULL;
+	if (add_du_to_list_ni(priv->ready, du)) {
+		LOG_ERR("Problems adding DU to list");
+		du_destroy(du);
+		return -1;
+	}
+
+	return 0;
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+static void tf_pack_flush(void * data)
+#else
+static void tf_pack_flush(struct timer_list * tl)
+#endif
+{
+	struct pack_priv * priv;
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,15,0)
+	priv = (struct pack_priv *) data;
+#else
+	priv = from_timer(priv, tl, flush_timer);
+#endif
+
+	spin_lock_bh(&priv->lock);
+	pack_close_pending(priv);
+	spin_unlock_bh(&priv->lock);
+
+	pack_drain(priv);
+}
+
+/* Called with priv->lock held */
+static int pack_append(struct pack_priv * priv,
+		       struct du * du,
+		       uint32_t max_udf)
+{
+	struct du * udf = priv->pending;
+	size_t len = du_len(du);
+	size_t off;
+
+	if (udf && du_len(udf) + PACK_REC_HDR + len > max_udf)
+		if (pack_close_pending(priv))
+			return -1;
+
+	if (!priv->pending) {
+		/* Room for a full UDF, so that appending never reallocates */
+		udf = du_create_ni(max_udf);
+		if (!udf)
+			return -1;
+		du_tail_shrink(udf, max_udf - 1);
+		*du_buffer(udf) = PACK_FLAGS;
+		udf->cfg = du->cfg;
+		priv->pending = udf;
+
+		rtimer_start(&priv->flush_timer, priv->deadline);
+	}
+
+	off = du_len(udf);
+	if (du_tail_grow(udf, PACK_REC_HDR + len))
+		return -1;
+	put_unaligned_be16((__u16) len, du_buffer(udf) + off);
+	memcpy(du_buffer(udf) + off + PACK_REC_HDR, du_buffer(du), len);
+
+	/* No other SDU would fit, do not wait for the deadline */
+	if (du_len(udf) + PACK_REC_HDR >= max_udf)
+		return pack_close_pending(priv);
+
+	return 0;
+}
+
+static int pack_delim_fragment(struct delim_ps * ps, struct du * du,
+			       struct du_list * du_list)
+{
+	struct pack_priv * priv = ps->priv;
+	uint32_t max_udf;
+	int ret;
+
+	/* The UDF includes the delimiting flags */
+	max_udf = priv->delim->max_fragment_size + 1;
+
+	/* The record length is 16 bits, whatever the fragment size */
+	if (!priv->deadline || du_len(du) + PACK_REC_HDR + 1 > max_udf ||
+	    du_len(du) > U16_MAX || du_linearize(du)) {
+		/* Not worth packing, but keep it behind what is pending */
+		ret = priv->def->delim_fragment(priv->def, du, du_list);
+
+		spin_lock_bh(&priv->lock);
+		pack_close_pending(priv);
+		if (!ret)
+			list_splice_tail_init(&du_list->dus, &priv->ready->dus);
+		spin_unlock_bh(&priv->lock);
+
+		pack_drain(priv);
+		return ret;
+	}
+
+	spin_lock_bh(&priv->lock);
+	ret = pack_append(priv, du, max_udf);
+	spin_unlock_bh(&priv->lock);
+
+	du_destroy(du);
+	pack_drain(priv);
+
+	return ret;
+}
+
+static int pack_delim_num_udfs(struct delim_ps * ps, struct du * du)
+{
+	struct pack_priv * priv = ps->priv;
+
+	return priv->def->delim_num_udfs(priv->def, du);
+}
+
+static int pack_delim_process_udf(struct delim_ps * ps, struct du * du,
+				  struct du_list * du_list)
+{
+	struct pack_priv * priv = ps->priv;
+	struct du * sdu;
+	unsigned char * data;
+	size_t left, len;
+
+	data = du_buffer(du);
+	if (*data & 0x04)
+		return priv->def->delim_process_udf(priv->def, du, du_list);
+
+	if ((*data & 0x0F) != PACK_FLAGS) {
+		LOG_ERR("Only packed complete SDUs are supported, flags %d",
+			*data);
+		du_destroy(du);
+		return -1;
+	}
+
+	left = du_len(du) - 1;
+	data++;
+	while (left >= PACK_REC_HDR) {
+		len = get_unaligned_be16(data);
+		if (len > left - PACK_REC_HDR) {
+			LOG_ERR("Bogus SDU length %zu in packed UDF", len);
+			du_destroy(du);
+			return -1;
+		}
+		data += PACK_REC_HDR;
+		left -= PACK_REC_HDR;
+
+		if (len == left) {
+			/* The last one, reuse the UDF buffer */
+			du_head_shrink(du, data - du_buffer(du));
+			sdu = du;
+			du = NULL;
+		} else {
+			sdu = du_create_ni(len);
+			if (!sdu) {
+				du_destroy(du);
+				return -1;
+			}
+			memcpy(du_buffer(sdu), data, len);
+		}
+
+		if (add_du_to_list_ni(du_list, sdu)) {
+			LOG_ERR("Problems adding DU to list");
+			du_destroy(sdu);
+			if (du)
+				du_destroy(du);
+			return -1;
+		}
+
+		if (!du)
+			return 0;
+
+		data += len;
+		left -= len;
+	}
+
+	/* Padding from lower layers, if any */
+	du_destroy(du);
+
+	return 0;
+}
+
+static int pack_set_policy_set_param(struct ps_base * bps,
+				     const char * name,
+				     const char * value)
+{
+	struct delim_ps * ps = container_of(bps, struct delim_ps, base);
+	struct pack_priv * priv = ps->priv;
+	int int_value;
+	int ret;
+
+	if (!name) {
+		LOG_ERR("Null parameter name");
+		return -1;
+	}
+
+	if (!value) {
+		LOG_ERR("Null parameter value");
+		return -1;
+	}
+
+	if (strcmp(name, "flushDeadline") == 0) {
+		ret = kstrtoint(value, 10, &int_value);
+		if (ret || int_value < 0) {
+			LOG_ERR("Invalid value for flushDeadline: %s", value);
+			return -1;
+		}
+		priv->deadline = int_value;
+		LOG_DBG("Packing flush deadline is %u ms", priv->deadline);
+
+		return 0;
+	}
+
+	/* Parameters of the default policy set, e.g. zeroCopy */
+	if (priv->def->base.set_policy_set_param)
+		return priv->def->base.set_policy_set_param(&priv->def->base,
+							    name, value);
+
+	LOG_ERR("Unknown parameter %s", name);
+	return -1;
+}
+
+static struct ps_base * delim_ps_pack_create(struct rina_component * component)
+{
+	struct delim * delim = delim_from_component(component);
+	struct delim_ps * ps;
+	struct pack_priv * priv;
+	struct ps_base * def;
+
+	ps = rkzalloc(sizeof(*ps), GFP_KERNEL);
+	if (!ps)
+		return NULL;
+
+	priv = rkzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		rkfree(ps);
+		return NULL;
+	}
+
+	def = delim_ps_default_create(component);
+	if (!def) {
+		rkfree(priv);
+		rkfree(ps);
+		return NULL;
+	}
+
+	priv->ready = du_list_create();
+	if (!priv->ready) {
+		delim_ps_default_destroy(def);
+		rkfree(priv);
+		rkfree(ps);
+		return NULL;
+	}
+
+	priv->delim    = delim;
+	priv->def      = container_of(def, struct delim_ps, base);
+	priv->deadline = PACK_DEF_DEADLINE;
+	spin_lock_init(&priv->lock);
+	rtimer_init(tf_pack_flush, &priv->flush_timer, priv);
+
+	ps->base.set_policy_set_param = pack_set_policy_set_param;
+	ps->dm                        = delim;
+	ps->priv                      = priv;
+	ps->delim_fragment            = pack_delim_fragment;
+	ps->delim_num_udfs            = pack_delim_num_udfs;
+	ps->delim_process_udf         = pack_delim_process_udf;
+
+	return &ps->base;
+}
+
+static void delim_ps_pack_destroy(struct ps_base * bps)
+{
+	struct delim_ps * ps = container_of(bps, struct delim_ps, base);
+	struct pack_priv * priv;
+
+	if (!bps)
+		return;
+
+	priv = ps->priv;
+	if (priv) {
+		/* rtimer_stop() does not wait for a running callback */
+		del_timer_sync(&priv->flush_timer);
+
+		/*
+		 * Nobody writes through this policy set any more (it is being
+		 * replaced, or delimiting goes away before DTP does), so send
+		 * what is still pending instead of dropping it.
+		 */
+		spin_lock_bh(&priv->lock);
+		pack_close_pending(priv);
+		spin_unlock_bh(&priv->lock);
+		pack_drain(priv);
+
+		du_list_destroy(priv->ready, true);
+		delim_ps_default_destroy(&priv->def->base);
+		rkfree(priv);
+	}
+
+	rkfree(ps);
+}
+
+struct ps_factory delim_factory = {
+	.owner   = THIS_MODULE,
+	.create  = delim_ps_pack_create,
+	.destroy = delim_ps_pack_destroy,
+};
+
+#define RINA_DELIM_PACK_NAME "pack"
+
+static int __init mod_init(void)
+{
+	int ret;
+
+	strcpy(delim_factory.name, RINA_DELIM_PACK_NAME);
+
+	ret = delim_ps_publish(&delim_factory);
+	if (ret) {
+		LOG_ERR("Failed to publish policy set factory");
+		return -1;
+	}
+
+	LOG_INFO("Delimiting packing policy set loaded successfully");
+
+	return 0;
+}
+
+static void __exit mod_exit(void)
+{
+	int ret;
+
+	ret = delim_ps_unpublish(RINA_DELIM_PACK_NAME);
+	if (ret) {
+		LOG_ERR("Failed to unpublish policy set factory");
+		return;
+	}
+
+	LOG_INFO("Delimiting packing policy set unloaded successfully");
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
+
+MODULE_DESCRIPTION("Delimiting SDU packing policy set");
+
+MODULE_LICENSE("GPL");
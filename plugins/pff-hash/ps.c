@@ -0,0 +1,722 @@
+/*
+ * Hash-indexed policy set for PFF
+ *
+ * Entries are kept in a hash table keyed by destination address and
+ * published through RCU: lookups in the forwarding path take no lock,
+ * writers serialize on priv->lock and never modify an entry in place
+ * (they replace it with an updated copy), and pff_modify builds a new
+ * table off-line and swaps it in with a single pointer assignment.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/export.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/rculist.h>
+
+#define RINA_PREFIX "pff-hash"
+
+#include "logs.h"
+#include "rds/rmem.h"
+#include "pff-ps.h"
+#include "debug.h"
+
+/* Bounds on the number of buckets (log2), the table is resized in between */
+#define PFT_HASH_MIN_BITS 4
+#define PFT_HASH_MAX_BITS 12
+
+/*
+ * An entry is immutable once it is reachable from the table: adding or
+ * removing ports creates a new entry that replaces the old one.
+ */
+struct pft_entry {
+	struct hlist_node hlist;
+	struct rcu_head rcu;
+	address_t destination;
+	qos_id_t qos_id;
+	size_t num_ports;
+	port_id_t ports[0];
+};
+
+struct pft_table {
+	struct rcu_head rcu;
+	unsigned int bits;
+	size_t count;
+	struct hlist_head buckets[0];
+};
+
+struct pff_ps_priv {
+	/* Serializes writers, readers only use RCU */
+	spinlock_t lock;
+	struct pft_table __rcu *table;
+};
+
+static bool priv_is_ok(struct pff_ps_priv *priv)
+{ return priv != NULL; }
+
+static struct pft_entry *pfte_create_ni(address_t destination,
+					qos_id_t qos_id,
+					size_t num_ports)
+{
+	struct pft_entry *tmp;
+
+	tmp = rkzalloc(sizeof(*tmp) + num_ports * sizeof(port_id_t),
+		       GFP_ATOMIC);
+	if (!tmp)
+		return NULL;
+
+	INIT_HLIST_NODE(&tmp->hlist);
+	tmp->destination = destination;
+	tmp->qos_id = qos_id;
+	tmp->num_ports = num_ports;
+
+	return tmp;
+}
+
+static struct pft_entry *pfte_dup_ni(struct pft_entry *entry,
+				     size_t num_ports)
+{
+	struct pft_entry *tmp;
+
+	tmp = pfte_create_ni(entry->destination, entry->qos_id, num_ports);
+	if (!tmp)
+		return NULL;
+
+	memcpy(tmp->ports, entry->ports,
+	       min(num_ports, entry->num_ports) * sizeof(port_id_t));
+
+	return tmp;
+}
+
+static void pfte_free_rcu(struct rcu_head *head)
+{ rkfree(container_of(head, struct pft_entry, rcu)); }
+
+static bool pfte_has_port(struct pft_entry *entry,
+			  port_id_t port_id)
+{
+	size_t i;
+
+	for (i = 0; i < entry->num_ports; i++)
+		if (entry->ports[i] == port_id)
+			return true;
+
+	return false;
+}
+
+static unsigned int pft_bits_for(size_t count)
+{
+	unsigned int bits = PFT_HASH_MIN_BITS;
+
+	while (bits < PFT_HASH_MAX_BITS && (1UL << bits) < count)
+		bits++;
+
+	return bits;
+}
+
+static struct pft_table *pft_table_create_ni(unsigned int bits)
+{
+	struct pft_table *tmp;
+	size_t i;
+
+	tmp = rkzalloc(sizeof(*tmp) + (1UL << bits) * sizeof(struct hlist_head),
+		       GFP_ATOMIC);
+	if (!tmp)
+		return NULL;
+
+	tmp->bits = bits;
+	tmp->count = 0;
+	for (i = 0; i < (1UL << bits); i++)
+		INIT_HLIST_HEAD(&tmp->buckets[i]);
+
+	return tmp;
+}
+
+static void pft_table_destroy(struct pft_table *table)
+{
+	struct pft_entry *pos;
+	struct hlist_node *tmp;
+	size_t i;
+
+	for (i = 0; i < (1UL << table->bits); i++)
+		hlist_for_each_entry_safe(pos, tmp, &table->buckets[i], hlist)
+			rkfree(pos);
+
+	rkfree(table);
+}
+
+static void pft_table_free_rcu(struct rcu_head *head)
+{ pft_table_destroy(container_of(head, struct pft_table, rcu)); }
+
+static struct hlist_head *pft_bucket(struct pft_table *table,
+				     address_t destination)
+{ return &table->buckets[hash_32(destination, table->bits)]; }
+
+/* Must be called under RCU read lock or with priv->lock held */
+static struct pft_entry *pft_find(struct pft_table *table,
+				  address_t destination,
+				  qos_id_t qos_id)
+{
+	struct pft_entry *pos;
+
+	hlist_for_each_entry_rcu(pos, pft_bucket(table, destination), hlist)
+		if ((pos->destination == destination) &&
+		    ((pos->qos_id == 0) || (pos->qos_id == qos_id)))
+			return pos;
+
+	return NULL;
+}
+
+static void pft_insert(struct pft_table *table,
+		       struct pft_entry *entry)
+{
+	hlist_add_head_rcu(&entry->hlist,
+			   pft_bucket(table, entry->destination));
+	table->count++;
+}
+
+static struct pft_table *pft_deref(struct pff_ps_priv *priv)
+{ return rcu_dereference_protected(priv->table,
+				   lockdep_is_held(&priv->lock)); }
+
+/*
+ * Grows the table when it becomes too crowded. The new table holds copies
+ * of the entries, the old one is reclaimed after a grace period.
+ * Must be called with priv->lock held.
+ */
+static void pft_maybe_grow(struct pff_ps_priv *priv)
+{
+	struct pft_table *old, *new;
+	struct pft_entry *pos, *tmp;
+	size_t i;
+
+	old = pft_deref(priv);
+	if (old->bits >= PFT_HASH_MAX_BITS || old->count <= (2UL << old->bits))
+		return;
+
+	new = pft_table_create_ni(pft_bits_for(old->count));
+	if (!new) {
+		LOG_WARN("Could not grow PFF hash table, keeping %u bits",
+			 old->bits);
+		return;
+	}
+
+	for (i = 0; i < (1UL << old->bits); i++)
+		hlist_for_each_entry(pos, &old->buckets[i], hlist) {
+			tmp = pfte_dup_ni(pos, pos->num_ports);
+			if (!tmp) {
+				pft_table_destroy(new);
+				return;
+			}
+			pft_insert(new, tmp);
+		}
+
+	rcu_assign_pointer(priv->table, new);
+	call_rcu(&old->rcu, pft_table_free_rcu);
+}
+
+static int __pff_add(struct pft_table *table,
+		     struct mod_pff_entry *entry)
+{
+	struct pft_entry *old, *new;
+	struct port_id_altlist *alts;
+	size_t num_ports;
+
+	old = pft_find(table, entry->fwd_info, entry->qos_id);
+
+	/* Upper bound on the number of ports of the updated entry */
+	num_ports = old ? old->num_ports : 0;
+	list_for_each_entry(alts, &entry->port_id_altlists, next)
+		num_ports++;
+
+	new = old ? pfte_dup_ni(old, num_ports) :
+		pfte_create_ni(entry->fwd_info, entry->qos_id, num_ports);
+	if (!new)
+		return -1;
+
+	new->num_ports = old ? old->num_ports : 0;
+	list_for_each_entry(alts, &entry->port_id_altlists, next) {
+		if (alts->num_ports < 1) {
+			LOG_INFO("Port id alternative set is empty");
+			continue;
+		}
+
+		/* Just add the first alternative and ignore the others. */
+		if (!pfte_has_port(new, alts->ports[0]))
+			new->ports[new->num_ports++] = alts->ports[0];
+	}
+
+	if (old) {
+		hlist_replace_rcu(&old->hlist, &new->hlist);
+		call_rcu(&old->rcu, pfte_free_rcu);
+	} else
+		pft_insert(table, new);
+
+	return 0;
+}
+
+static int hash_add(struct pff_ps *ps,
+		    struct mod_pff_entry *entry)
+{
+	struct pff_ps_priv *priv;
+	int result;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	if (!entry) {
+		LOG_ERR("Bogus output parameters, won't add");
+		return -1;
+	}
+
+	if (!is_address_ok(entry->fwd_info)) {
+		LOG_ERR("Bogus destination address passed, cannot add");
+		return -1;
+	}
+	if (!is_qos_id_ok(entry->qos_id)) {
+		LOG_ERR("Bogus qos-id passed, cannot add");
+		return -1;
+	}
+
+	spin_lock_bh(&priv->lock);
+	result = __pff_add(pft_deref(priv), entry);
+	if (!result)
+		pft_maybe_grow(priv);
+	spin_unlock_bh(&priv->lock);
+
+	return result;
+}
+
+static int hash_remove(struct pff_ps *ps,
+		       struct mod_pff_entry *entry)
+{
+	struct pff_ps_priv *priv;
+	struct port_id_altlist *alts;
+	struct pft_table *table;
+	struct pft_entry *old, *new;
+	size_t i;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	if (!entry) {
+		LOG_ERR("Bogus output parameters, won't remove");
+		return -1;
+	}
+
+	if (!is_address_ok(entry->fwd_info)) {
+		LOG_ERR("Bogus destination address passed, cannot remove");
+		return -1;
+	}
+	if (!is_qos_id_ok(entry->qos_id)) {
+		LOG_ERR("Bogus qos-id passed, cannot remove");
+		return -1;
+	}
+
+	spin_lock_bh(&priv->lock);
+
+	table = pft_deref(priv);
+	old = pft_find(table, entry->fwd_info, entry->qos_id);
+	if (!old) {
+		spin_unlock_bh(&priv->lock);
+		return -1;
+	}
+
+	new = pfte_create_ni(old->destination, old->qos_id, old->num_ports);
+	if (!new) {
+		spin_unlock_bh(&priv->lock);
+		return -1;
+	}
+
+	/* Keep the ports that are not the first alternative of any altlist */
+	for (i = 0; i < old->num_ports; i++) {
+		bool removed = false;
+
+		list_for_each_entry(alts, &entry->port_id_altlists, next) {
+			if (alts->num_ports < 1)
+				continue;
+			if (alts->ports[0] == old->ports[i]) {
+				removed = true;
+				break;
+			}
+		}
+
+		if (!removed)
+			new->ports[new->num_ports++] = old->ports[i];
+	}
+
+	/* If the list of port-ids is empty, remove the entry */
+	if (new->num_ports == 0) {
+		rkfree(new);
+		hlist_del_rcu(&old->hlist);
+		table->count--;
+	} else
+		hlist_replace_rcu(&old->hlist, &new->hlist);
+	call_rcu(&old->rcu, pfte_free_rcu);
+
+	spin_unlock_bh(&priv->lock);
+
+	return 0;
+}
+
+static bool hash_is_empty(struct pff_ps *ps)
+{
+	struct pff_ps_priv *priv;
+	bool empty;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return false;
+
+	rcu_read_lock();
+	empty = rcu_dereference(priv->table)->count == 0;
+	rcu_read_unlock();
+
+	return empty;
+}
+
+static void __pff_flush(struct pft_table *table)
+{
+	struct pft_entry *pos;
+	struct hlist_node *tmp;
+	size_t i;
+
+	for (i = 0; i < (1UL << table->bits); i++)
+		hlist_for_each_entry_safe(pos, tmp, &table->buckets[i], hlist) {
+			hlist_del_rcu(&pos->hlist);
+			call_rcu(&pos->rcu, pfte_free_rcu);
+		}
+
+	table->count = 0;
+}
+
+static int hash_flush(struct pff_ps *ps)
+{
+	struct pff_ps_priv *priv;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	spin_lock_bh(&priv->lock);
+	__pff_flush(pft_deref(priv));
+	spin_unlock_bh(&priv->lock);
+
+	return 0;
+}
+
+static int hash_modify(struct pff_ps *ps,
+		       struct list_head *entries)
+{
+	struct pff_ps_priv *priv;
+	struct mod_pff_entry *entry;
+	struct pft_table *old, *new;
+	size_t count;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	count = 0;
+	list_for_each_entry(entry, entries, next)
+		count++;
+
+	/* Build the new table aside, readers keep using the old one */
+	new = pft_table_create_ni(pft_bits_for(count));
+	if (!new)
+		return -1;
+
+	list_for_each_entry(entry, entries, next) {
+		if (!entry)
+			continue;
+
+		if (!is_address_ok(entry->fwd_info))
+			continue;
+
+		if (!is_qos_id_ok(entry->qos_id))
+			continue;
+
+		if (__pff_add(new, entry)) {
+			pft_table_destroy(new);
+			return -1;
+		}
+	}
+
+	spin_lock_bh(&priv->lock);
+	old = pft_deref(priv);
+	rcu_assign_pointer(priv->table, new);
+	spin_unlock_bh(&priv->lock);
+
+	call_rcu(&old->rcu, pft_table_free_rcu);
+
+	return 0;
+}
+
+static int pfte_ports_copy(struct pft_entry *entry,
+			   port_id_t **port_ids,
+			   size_t *entries)
+{
+	ASSERT(entries);
+
+	/* The caller array is reused as long as the next hop count holds */
+	if (*entries != entry->num_ports) {
+		if (*entries > 0)
+			rkfree(*port_ids);
+		if (entry->num_ports > 0) {
+			*port_ids = rkmalloc(entry->num_ports *
+					     sizeof(**port_ids), GFP_ATOMIC);
+			if (!*port_ids) {
+				*entries = 0;
+				return -1;
+			}
+		}
+		*entries = entry->num_ports;
+	}
+
+	memcpy(*port_ids, entry->ports, entry->num_ports * sizeof(port_id_t));
+
+	return 0;
+}
+
+static int hash_nhop(struct pff_ps *ps,
+		     struct pci *pci,
+		     port_id_t **ports,
+		     size_t *count)
+{
+	struct pff_ps_priv *priv;
+	address_t destination;
+	qos_id_t qos_id;
+	struct pft_entry *tmp;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	destination = pci_destination(pci);
+	if (!is_address_ok(destination)) {
+		LOG_ERR("Bogus destination address, cannot get NHOP");
+		return -1;
+	}
+
+	qos_id = pci_qos_id(pci);
+	if (!is_qos_id_ok(qos_id)) {
+		LOG_ERR("Bogus qos-id, cannot get NHOP");
+		return -1;
+	}
+
+	if (!ports || !count) {
+		LOG_ERR("Bogus output parameters, won't get NHOP");
+		return -1;
+	}
+
+	rcu_read_lock();
+
+	tmp = pft_find(rcu_dereference(priv->table), destination, qos_id);
+	if (!tmp) {
+		rcu_read_unlock();
+		LOG_ERR("Could not find any entry for dest address: %u and "
+			"qos_id %d", destination, qos_id);
+		return -1;
+	}
+
+	if (pfte_ports_copy(tmp, ports, count)) {
+		rcu_read_unlock();
+		return -1;
+	}
+
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static int pfte_port_id_altlists_copy(struct pft_entry *entry,
+				      struct list_head *port_id_altlists)
+{
+	struct port_id_altlist *alt;
+	size_t i;
+
+	for (i = 0; i < entry->num_ports; i++) {
+		alt = rkmalloc(sizeof(*alt), GFP_ATOMIC);
+		if (!alt)
+			return -1;
+
+		alt->ports = rkmalloc(sizeof(*(alt->ports)), GFP_ATOMIC);
+		if (!alt->ports) {
+			rkfree(alt);
+			return -1;
+		}
+
+		alt->ports[0] = entry->ports[i];
+		alt->num_ports = 1;
+
+		list_add_tail(&alt->next, port_id_altlists);
+	}
+
+	return 0;
+}
+
+static int hash_dump(struct pff_ps *ps,
+		     struct list_head *entries)
+{
+	struct pff_ps_priv *priv;
+	struct pft_table *table;
+	struct pft_entry *pos;
+	struct mod_pff_entry *entry;
+	size_t i;
+
+	priv = (struct pff_ps_priv *) ps->priv;
+	if (!priv_is_ok(priv))
+		return -1;
+
+	rcu_read_lock();
+	table = rcu_dereference(priv->table);
+	for (i = 0; i < (1UL << table->bits); i++)
+		hlist_for_each_entry_rcu(pos, &table->buckets[i], hlist) {
+			entry = rkmalloc(sizeof(*entry), GFP_ATOMIC);
+			if (!entry) {
+				rcu_read_unlock();
+				return -1;
+			}
+
+			entry->fwd_info = pos->destination;
+			entry->qos_id = pos->qos_id;
+			INIT_LIST_HEAD(&entry->port_id_altlists);
+			if (pfte_port_id_altlists_copy(pos,
+						&entry->port_id_altlists)) {
+				rkfree(entry);
+				rcu_read_unlock();
+				return -1;
+			}
+
+			list_add(&entry->next, entries);
+		}
+	rcu_read_unlock();
+
+	return 0;
+}
+
+static struct ps_base *
+pff_ps_hash_create(struct rina_component *component)
+{
+	struct pff_ps *ps;
+	struct pff_ps_priv *priv;
+	struct pff *pff = pff_from_component(component);
+	struct pft_table *table;
+
+	priv = rkzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return NULL;
+
+	spin_lock_init(&priv->lock);
+
+	table = pft_table_create_ni(PFT_HASH_MIN_BITS);
+	if (!table) {
+		rkfree(priv);
+		return NULL;
+	}
+	RCU_INIT_POINTER(priv->table, table);
+
+	ps = rkzalloc(sizeof(*ps), GFP_KERNEL);
+	if (!ps) {
+		pft_table_destroy(table);
+		rkfree(priv);
+		return NULL;
+	}
+
+	ps->base.set_policy_set_param = NULL; /* default */
+	ps->dm = pff;
+	ps->priv = (void *) priv;
+
+	ps->pff_add = hash_add;
+	ps->pff_remove = hash_remove;
+	ps->pff_port_state_change = NULL;
+	ps->pff_is_empty = hash_is_empty;
+	ps->pff_flush = hash_flush;
+	ps->pff_nhop = hash_nhop;
+	ps->pff_dump = hash_dump;
+	ps->pff_modify = hash_modify;
+
+	return &ps->base;
+}
+
+static void pff_ps_hash_destroy(struct ps_base *bps)
+{
+	struct pff_ps *ps = container_of(bps, struct pff_ps, base);
+
+	if (bps) {
+		struct pff_ps_priv *priv;
+
+		priv = (struct pff_ps_priv *) ps->priv;
+		if (!priv_is_ok(priv))
+			return;
+
+		/* The policy set is already unpublished, no readers left */
+		pft_table_destroy(rcu_dereference_protected(priv->table, 1));
+
+		rkfree(priv);
+		rkfree(ps);
+	}
+}
+
+struct ps_factory pff_factory = {
+	.owner   = THIS_MODULE,
+	.create  = pff_ps_hash_create,
+	.destroy = pff_ps_hash_destroy,
+};
+
+#define RINA_PFF_HASH_NAME "hash"
+
+static int __init mod_init(void)
+{
+	int ret;
+
+	strcpy(pff_factory.name, RINA_PFF_HASH_NAME);
+
+	ret = pff_ps_publish(&pff_factory);
+	if (ret) {
+		LOG_ERR("Failed to publish policy set factory");
+		return -1;
+	}
+
+	LOG_INFO("PFF hash policy set loaded successfully");
+
+	return 0;
+}
+
+static void __exit mod_exit(void)
+{
+	int ret;
+
+	ret = pff_ps_unpublish(RINA_PFF_HASH_NAME);
+	if (ret) {
+		LOG_ERR("Failed to unpublish policy set factory");
+		return;
+	}
+
+	/* Wait for pending entry and table reclamation callbacks */
+	rcu_barrier();
+
+	LOG_INFO("PFF hash policy set unloaded successfully");
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
+
+MODULE_DESCRIPTION("PFF hash-indexed policy set");
+
+MODULE_LICENSE("GPL");
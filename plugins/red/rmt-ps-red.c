@@ -66,7 +66,7 @@ static struct red_rmt_queue * red_queue_create(port_id_t          port_id,
         tmp = rkzalloc(sizeof(*tmp), GFP_ATOMIC);
         if (!tmp)
                 return NULL;
-        tmp->queue = rfifo_create_ni();
+        tmp->queue = rfifo_create_ring_ni(cfg.limit ? cfg.limit : 1, 0);
         if (!tmp->queue) {
                 rkfree(tmp);
                 return NULL;
@@ -219,7 +219,13 @@ static int red_rmt_enqueue_policy(struct rmt_ps *      ps,
 	if (!must_enqueue && rfifo_is_empty(q->queue))
 		return RMT_PS_ENQ_SEND;
 
-	rfifo_push_ni(q->queue, du);
+	if (rfifo_push_ni(q->queue, du)) {
+		/* qmax_p raised after the queue was sized */
+		q->stats.forced_drop++;
+		du_destroy(du);
+		ret = RMT_PS_ENQ_DROP;
+		goto exit;
+	}
 	ret = RMT_PS_ENQ_SCHED;
 
 exit:
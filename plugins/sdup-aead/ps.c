@@ -0,0 +1,816 @@
+/*
+ * AEAD SDU protection policy set
+ *
+ * Encrypts and authenticates each PDU in a single pass with an AEAD
+ * transform (AES-GCM or ChaCha20-Poly1305), instead of the separate
+ * cipher, HMAC and padding passes of the default policy set. Protected
+ * PDUs carry a 12 byte nonce, made of a random per-key salt and a 64 bit
+ * counter, in front of the ciphertext and the 16 byte tag after it; the
+ * nonce is authenticated as associated data and its counter feeds the
+ * replay window on the receiving side.
+ *
+ * Requests are handed to the crypto API with a completion callback, so
+ * asynchronous implementations (cryptd, pcrypt, hardware engines) work
+ * off the RMT egress and ingress paths: SDU protection gets the PDU
+ * back through sdup_protect_pdu_done() and sdup_unprotect_pdu_done().
+ * The "parallel" parameter wraps the transform in pcrypt, which spreads
+ * the work over the CPUs and still completes the requests in order.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <linux/export.h>
+#include <linux/module.h>
+#include <linux/string.h>
+#include <linux/list.h>
+#include <linux/random.h>
+#include <linux/scatterlist.h>
+#include <linux/spinlock.h>
+#include <linux/version.h>
+#include <linux/workqueue.h>
+#include <crypto/aead.h>
+#include <asm/unaligned.h>
+
+#define RINA_PREFIX "sdup-aead"
+
+#include "logs.h"
+#include "policies.h"
+#include "rds/rmem.h"
+#include "sdup.h"
+#include "sdup-crypto-ps.h"
+#include "du.h"
+
+#define AEAD_SALT_LEN	 4
+#define AEAD_NONCE_LEN	 (AEAD_SALT_LEN + sizeof(__u64))
+#define AEAD_TAG_LEN	 16
+
+/* Replay window, in PDUs */
+#define AEAD_MAX_WIN	 64
+#define AEAD_DEF_WIN	 AEAD_MAX_WIN
+
+#define AEAD_ALG_NAME_LEN 64
+
+/* A keyed transform, for one direction */
+struct aead_state {
+	struct crypto_aead * tfm;
+	/* First bytes of the nonces built with this key (TX only) */
+	u8		     salt[AEAD_SALT_LEN];
+	/* Requests in flight, protected by aead_priv.lock */
+	unsigned int	     users;
+	struct list_head     list;
+};
+
+struct aead_priv {
+	/* The policy set goes away first if requests are still in flight */
+	struct sdup_port *	port;
+
+	/*
+	 * Taken from the crypto completion callbacks as well, which may
+	 * run in any context
+	 */
+	spinlock_t		lock;
+	/* States in use, NULL while protection is off */
+	struct aead_state *	tx;
+	struct aead_state *	rx;
+	/* Replaced states, freed once their requests are done */
+	struct list_head	retired;
+	/* Requests in flight, the last one frees us once dying */
+	unsigned int		users;
+	bool			dying;
+	struct work_struct	free_work;
+
+	/* States being set up by update_crypto_state */
+	struct aead_state *	next_tx;
+	struct aead_state *	next_rx;
+
+	atomic64_t		tx_seq;
+
+	/*
+	 * Replay window: highest counter authenticated so far, and the
+	 * counters below it already seen, bit n standing for rx_seq - n
+	 */
+	unsigned int		win_size;
+	u64			rx_seq;
+	u64			rx_bmap;
+
+	/* Wrap the transforms in pcrypt */
+	bool			parallel;
+};
+
+/* Frees the instances destroyed while requests were in flight */
+static struct workqueue_struct * aead_wq;
+
+/* One PDU being encrypted or decrypted */
+struct aead_req_ctx {
+	struct aead_priv *   priv;
+	struct aead_state *  state;
+	struct du *	     du;
+	struct scatterlist   sg;
+	u8		     iv[AEAD_NONCE_LEN];
+	/* Must be last, followed by the transform request context */
+	struct aead_request  req;
+};
+
+static struct aead_state * aead_state_create(const char * alg_name,
+					     const struct buffer * key)
+{
+	struct aead_state * state;
+
+	state = rkzalloc(sizeof(*state), GFP_KERNEL);
+	if (!state)
+		return NULL;
+
+	INIT_LIST_HEAD(&state->list);
+	get_random_bytes(state->salt, AEAD_SALT_LEN);
+
+	state->tfm = crypto_alloc_aead(alg_name, 0, 0);
+	if (IS_ERR(state->tfm)) {
+		LOG_ERR("Could not allocate AEAD transform %s", alg_name);
+		rkfree(state);
+		return NULL;
+	}
+
+	if (crypto_aead_ivsize(state->tfm) != AEAD_NONCE_LEN ||
+	    crypto_aead_setauthsize(state->tfm, AEAD_TAG_LEN)) {
+		LOG_ERR("AEAD transform %s has the wrong IV or tag size",
+			alg_name);
+		goto fail;
+	}
+
+	if (crypto_aead_setkey(state->tfm,
+			       buffer_data_ro(key),
+			       buffer_length(key))) {
+		LOG_ERR("Could not set the %s key", alg_name);
+		goto fail;
+	}
+
+	return state;
+
+fail:
+	crypto_free_aead(state->tfm);
+	rkfree(state);
+	return NULL;
+}
+
+static void aead_state_destroy(struct aead_state * state)
+{
+	if (!state)
+		return;
+
+	crypto_free_aead(state->tfm);
+	rkfree(state);
+}
+
+/*
+ * Takes a user of the state in *slot, and of priv, NULL if protection is
+ * off. Both are dropped separately, with aead_state_put() and
+ * aead_priv_put().
+ */
+static struct aead_state * aead_state_get(struct aead_priv * priv,
+					  struct aead_state ** slot)
+{
+	struct aead_state * state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	state = *slot;
+	if (state) {
+		state->users++;
+		priv->users++;
+	}
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return state;
+}
+
+static void aead_state_put(struct aead_priv * priv,
+			   struct aead_state * state)
+{
+	unsigned long flags;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	state->users--;
+	spin_unlock_irqrestore(&priv->lock, flags);
+}
+
+/* May be called from any context, so the freeing is deferred */
+static void aead_priv_put(struct aead_priv * priv)
+{
+	unsigned long flags;
+	bool last;
+
+	spin_lock_irqsave(&priv->lock, flags);
+	last = !--priv->users && priv->dying;
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	if (last)
+		queue_work(aead_wq, &priv->free_work);
+}
+
+/* Replaces *slot with state, must be called with priv->lock held */
+static void aead_state_swap(struct aead_priv * priv,
+			    struct aead_state ** slot,
+			    struct aead_state * state)
+{
+	if (*slot)
+		list_add_tail(&(*slot)->list, &priv->retired);
+	*slot = state;
+}
+
+/* Frees the retired states no request is using anymore */
+static void aead_reap(struct aead_priv * priv)
+{
+	struct aead_state * state, * next;
+	unsigned long flags;
+	LIST_HEAD(idle);
+
+	spin_lock_irqsave(&priv->lock, flags);
+	list_for_each_entry_safe(state, next, &priv->retired, list) {
+		if (!state->users)
+			list_move(&state->list, &idle);
+	}
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	list_for_each_entry_safe(state, next, &idle, list) {
+		list_del(&state->list);
+		aead_state_destroy(state);
+	}
+}
+
+static void aead_priv_free(struct work_struct * work)
+{
+	struct aead_priv * priv = container_of(work, struct aead_priv,
+					       free_work);
+
+	aead_reap(priv);
+	aead_state_destroy(priv->next_tx);
+	aead_state_destroy(priv->next_rx);
+	rkfree(priv);
+
+	/* Taken by sdup_aead_destroy(), aead_wq is drained on unload */
+	module_put(THIS_MODULE);
+}
+
+/*
+ * Whether a received counter is new to the replay window, recording it
+ * if mark is set. Must be called with priv->lock held.
+ */
+static bool aead_replay_check(struct aead_priv * priv, u64 seq, bool mark)
+{
+	u64 diff;
+
+	if (!priv->win_size)
+		return true;
+
+	if (seq > priv->rx_seq) {
+		if (mark) {
+			diff = seq - priv->rx_seq;
+			priv->rx_bmap = diff < AEAD_MAX_WIN ?
+				priv->rx_bmap << diff : 0;
+			priv->rx_bmap |= 1;
+			priv->rx_seq = seq;
+		}
+		return true;
+	}
+
+	diff = priv->rx_seq - seq;
+	if (diff >= priv->win_size || (priv->rx_bmap & (1ULL << diff)))
+		return false;
+
+	if (mark)
+		priv->rx_bmap |= 1ULL << diff;
+
+	return true;
+}
+
+static struct aead_req_ctx * aead_req_create(struct aead_priv * priv,
+					     struct aead_state * state,
+					     struct du * du)
+{
+	struct aead_req_ctx * ctx;
+
+	ctx = rkmalloc(sizeof(*ctx) + crypto_aead_reqsize(state->tfm),
+		       GFP_ATOMIC);
+	if (!ctx)
+		return NULL;
+
+	ctx->priv  = priv;
+	ctx->state = state;
+	ctx->du    = du;
+	memcpy(ctx->iv, du_buffer(du), AEAD_NONCE_LEN);
+	sg_init_one(&ctx->sg, du_buffer(du), du_len(du));
+	aead_request_set_tfm(&ctx->req, state->tfm);
+	aead_request_set_ad(&ctx->req, AEAD_NONCE_LEN);
+
+	return ctx;
+}
+
+/*
+ * Releases the request and the user of its state it was holding, the
+ * caller still has to drop its user of priv
+ */
+static void aead_req_destroy(struct aead_req_ctx * ctx)
+{
+	struct aead_priv * priv = ctx->priv;
+	struct aead_state * state = ctx->state;
+
+	rkfree(ctx);
+	aead_state_put(priv, state);
+}
+
+static int aead_decrypt_finish(struct aead_req_ctx * ctx, int err)
+{
+	struct aead_priv * priv = ctx->priv;
+	struct du * du = ctx->du;
+	unsigned long flags;
+	bool fresh;
+
+	if (err) {
+		LOG_DBG("PDU failed authentication (%d)", err);
+		return -1;
+	}
+
+	spin_lock_irqsave(&priv->lock, flags);
+	fresh = aead_replay_check(priv,
+				  get_unaligned_be64(ctx->iv + AEAD_SALT_LEN),
+				  true);
+	spin_unlock_irqrestore(&priv->lock, flags);
+	if (!fresh) {
+		LOG_DBG("Replayed PDU dropped");
+		return -1;
+	}
+
+	du_head_shrink(du, AEAD_NONCE_LEN);
+	du_tail_shrink(du, AEAD_TAG_LEN);
+
+	return 0;
+}
+
+/*
+ * The callbacks may be called with -EINPROGRESS, when a backlogged
+ * request enters the queue: the real completion comes later.
+ */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+static void aead_encrypt_done(struct crypto_async_request * areq, int err)
+{
+	struct aead_req_ctx * ctx = areq->data;
+#else
+static void aead_encrypt_done(void * data, int err)
+{
+	struct aead_req_ctx * ctx = data;
+#endif
+
+	struct aead_priv * priv;
+	struct du * du;
+
+	if (err == -EINPROGRESS)
+		return;
+
+	/* Done with the request before RMT, which may destroy us */
+	priv = ctx->priv;
+	du   = ctx->du;
+	aead_req_destroy(ctx);
+
+	sdup_protect_pdu_done(priv->port, du, err);
+	aead_priv_put(priv);
+}
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(6,3,0)
+static void aead_decrypt_done(struct crypto_async_request * areq, int err)
+{
+	struct aead_req_ctx * ctx = areq->data;
+#else
+static void aead_decrypt_done(void * data, int err)
+{
+	struct aead_req_ctx * ctx = data;
+#endif
+
+	struct aead_priv * priv;
+	struct du * du;
+
+	if (err == -EINPROGRESS)
+		return;
+
+	err  = aead_decrypt_finish(ctx, err);
+	priv = ctx->priv;
+	du   = ctx->du;
+	aead_req_destroy(ctx);
+
+	sdup_unprotect_pdu_done(priv->port, du, err);
+	aead_priv_put(priv);
+}
+
+static int aead_apply_crypto(struct sdup_crypto_ps * ps,
+			     struct du * du)
+{
+	struct aead_priv * priv = ps->priv;
+	struct aead_state * state;
+	struct aead_req_ctx * ctx;
+	unsigned char * nonce;
+	ssize_t len;
+	int ret;
+
+	state = aead_state_get(priv, &priv->tx);
+	if (!state)
+		return 0;
+
+	len = du_len(du);
+	if (du_head_grow(du, AEAD_NONCE_LEN) ||
+	    du_tail_grow(du, AEAD_TAG_LEN)) {
+		LOG_ERR("Could not make room for the AEAD nonce and tag");
+		aead_state_put(priv, state);
+		aead_priv_put(priv);
+		return -1;
+	}
+
+	nonce = du_buffer(du);
+	memcpy(nonce, state->salt, AEAD_SALT_LEN);
+	put_unaligned_be64(atomic64_inc_return(&priv->tx_seq),
+			   nonce + AEAD_SALT_LEN);
+
+	ctx = aead_req_create(priv, state, du);
+	if (!ctx) {
+		aead_state_put(priv, state);
+		aead_priv_put(priv);
+		return -1;
+	}
+
+	aead_request_set_callback(&ctx->req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+				  aead_encrypt_done, ctx);
+	aead_request_set_crypt(&ctx->req, &ctx->sg, &ctx->sg, len, ctx->iv);
+
+	ret = crypto_aead_encrypt(&ctx->req);
+	if (ret == -EINPROGRESS || ret == -EBUSY)
+		return -EINPROGRESS;
+
+	aead_req_destroy(ctx);
+	aead_priv_put(priv);
+	if (ret) {
+		LOG_ERR("Encryption failed (%d)", ret);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int aead_remove_crypto(struct sdup_crypto_ps * ps,
+			      struct du * du)
+{
+	struct aead_priv * priv = ps->priv;
+	struct aead_state * state;
+	struct aead_req_ctx * ctx;
+	unsigned long flags;
+	ssize_t len;
+	bool fresh;
+	int ret;
+
+	state = aead_state_get(priv, &priv->rx);
+	if (!state)
+		return 0;
+
+	len = du_len(du);
+	if (len < AEAD_NONCE_LEN + AEAD_TAG_LEN) {
+		LOG_ERR("PDU too short to be protected (%zd bytes)", len);
+		aead_state_put(priv, state);
+		aead_priv_put(priv);
+		return -1;
+	}
+
+	/* Cheap check first, the counter is trusted only once authenticated */
+	spin_lock_irqsave(&priv->lock, flags);
+	fresh = aead_replay_check(priv,
+				  get_unaligned_be64(du_buffer(du) +
+						     AEAD_SALT_LEN),
+				  false);
+	spin_unlock_irqrestore(&priv->lock, flags);
+	if (!fresh) {
+		LOG_DBG("Replayed or too old PDU dropped");
+		aead_state_put(priv, state);
+		aead_priv_put(priv);
+		return -1;
+	}
+
+	ctx = aead_req_create(priv, state, du);
+	if (!ctx) {
+		aead_state_put(priv, state);
+		aead_priv_put(priv);
+		return -1;
+	}
+
+	aead_request_set_callback(&ctx->req, CRYPTO_TFM_REQ_MAY_BACKLOG,
+				  aead_decrypt_done, ctx);
+	aead_request_set_crypt(&ctx->req, &ctx->sg, &ctx->sg,
+			       len - AEAD_NONCE_LEN, ctx->iv);
+
+	ret = crypto_aead_decrypt(&ctx->req);
+	if (ret == -EINPROGRESS || ret == -EBUSY)
+		return -EINPROGRESS;
+
+	ret = aead_decrypt_finish(ctx, ret);
+	aead_req_destroy(ctx);
+	aead_priv_put(priv);
+
+	return ret;
+}
+
+static int aead_alg_name(struct aead_priv * priv,
+			 const string_t * enc_alg,
+			 char * name)
+{
+	const char * alg;
+
+	if (strcmp(enc_alg, "AES128") == 0 ||
+	    strcmp(enc_alg, "AES256") == 0) {
+		alg = "gcm(aes)";
+	} else if (strcmp(enc_alg, "CHACHA20") == 0) {
+		alg = "rfc7539(chacha20,poly1305)";
+	} else {
+		LOG_ERR("Unsupported encryption algorithm %s", enc_alg);
+		return -1;
+	}
+
+	if (priv->parallel)
+		snprintf(name, AEAD_ALG_NAME_LEN, "pcrypt(%s)", alg);
+	else
+		snprintf(name, AEAD_ALG_NAME_LEN, "%s", alg);
+
+	return 0;
+}
+
+static int aead_update_crypto_state(struct sdup_crypto_ps * ps,
+				    struct sdup_crypto_state * state)
+{
+	struct aead_priv * priv;
+	char name[AEAD_ALG_NAME_LEN];
+	unsigned long flags;
+
+	if (!ps || !state) {
+		LOG_ERR("Bogus input parameters passed");
+		return -1;
+	}
+
+	priv = ps->priv;
+
+	/* States replaced by the previous updates */
+	aead_reap(priv);
+
+	if (state->mac_alg && strcmp(state->mac_alg, "") != 0)
+		LOG_DBG("PDUs are authenticated by the AEAD, ignoring %s",
+			state->mac_alg);
+	if (state->compress_alg && strcmp(state->compress_alg, "") != 0)
+		LOG_INFO("Compression is not supported, ignoring %s",
+			 state->compress_alg);
+
+	if (state->enc_alg && strcmp(state->enc_alg, "") != 0) {
+		if (aead_alg_name(priv, state->enc_alg, name))
+			return -1;
+
+		if (state->encrypt_key_tx) {
+			aead_state_destroy(priv->next_tx);
+			priv->next_tx = aead_state_create(name,
+							  state->encrypt_key_tx);
+			if (!priv->next_tx)
+				return -1;
+		}
+
+		if (state->encrypt_key_rx) {
+			aead_state_destroy(priv->next_rx);
+			priv->next_rx = aead_state_create(name,
+							  state->encrypt_key_rx);
+			if (!priv->next_rx)
+				return -1;
+		}
+	}
+
+	if ((state->enable_crypto_tx && !priv->next_tx) ||
+	    (state->enable_crypto_rx && !priv->next_rx)) {
+		LOG_ERR("No algorithm and key to enable protection for N-1 port %d",
+			ps->dm->port_id);
+		return -1;
+	}
+
+	spin_lock_irqsave(&priv->lock, flags);
+	if (state->enable_crypto_tx) {
+		aead_state_swap(priv, &priv->tx, priv->next_tx);
+		priv->next_tx = NULL;
+	}
+	if (state->enable_crypto_rx) {
+		aead_state_swap(priv, &priv->rx, priv->next_rx);
+		priv->next_rx = NULL;
+		/* The counters start over with the new peer key */
+		priv->rx_seq  = 0;
+		priv->rx_bmap = 0;
+	}
+	spin_unlock_irqrestore(&priv->lock, flags);
+
+	return 0;
+}
+
+static int aead_set_policy_set_param(struct ps_base * bps,
+				     const char * name,
+				     const char * value)
+{
+	struct sdup_crypto_ps * ps = container_of(bps,
+						  struct sdup_crypto_ps,
+						  base);
+	struct aead_priv * priv = ps->priv;
+	unsigned int win;
+	bool parallel;
+
+	if (!name) {
+		LOG_ERR("Null parameter name");
+		return -1;
+	}
+
+	if (!value) {
+		LOG_ERR("Null parameter value");
+		return -1;
+	}
+
+	if (strcmp(name, "seq_win_size") == 0) {
+		if (kstrtouint(value, 10, &win) || win > AEAD_MAX_WIN) {
+			LOG_ERR("Invalid value for seq_win_size: %s", value);
+			return -1;
+		}
+		priv->win_size = win;
+		LOG_DBG("Replay window is %u PDUs", priv->win_size);
+
+		return 0;
+	}
+
+	/* Applies to the transforms allocated from now on */
+	if (strcmp(name, "parallel") == 0) {
+		if (kstrtobool(value, &parallel)) {
+			LOG_ERR("Invalid value for parallel: %s", value);
+			return -1;
+		}
+		priv->parallel = parallel;
+
+		return 0;
+	}
+
+	LOG_ERR("Unknown parameter %s", name);
+	return -1;
+}
+
+static struct ps_base * sdup_aead_create(struct rina_component * component)
+{
+	struct sdup_comp * sdup_comp;
+	struct sdup_port * sdup_port;
+	struct sdup_crypto_ps * ps;
+	struct aead_priv * priv;
+	struct policy_parm * parameter;
+	static const char * params[] = { "seq_win_size", "parallel" };
+	int i;
+
+	sdup_comp = sdup_comp_from_component(component);
+	if (!sdup_comp)
+		return NULL;
+
+	sdup_port = sdup_comp->parent;
+	if (!sdup_port || !sdup_port->conf)
+		return NULL;
+
+	ps = rkzalloc(sizeof(*ps), GFP_KERNEL);
+	if (!ps)
+		return NULL;
+
+	priv = rkzalloc(sizeof(*priv), GFP_KERNEL);
+	if (!priv) {
+		rkfree(ps);
+		return NULL;
+	}
+
+	priv->port     = sdup_port;
+	priv->win_size = AEAD_DEF_WIN;
+	spin_lock_init(&priv->lock);
+	INIT_LIST_HEAD(&priv->retired);
+	INIT_WORK(&priv->free_work, aead_priv_free);
+	atomic64_set(&priv->tx_seq, 0);
+
+	ps->base.set_policy_set_param = aead_set_policy_set_param;
+	ps->dm                        = sdup_port;
+	ps->priv                      = priv;
+	ps->sdup_apply_crypto         = aead_apply_crypto;
+	ps->sdup_remove_crypto        = aead_remove_crypto;
+	ps->sdup_update_crypto_state  = aead_update_crypto_state;
+
+	for (i = 0; sdup_port->conf->encrypt && i < ARRAY_SIZE(params); i++) {
+		parameter = policy_param_find(sdup_port->conf->encrypt,
+					      params[i]);
+		if (!parameter)
+			continue;
+
+		if (aead_set_policy_set_param(&ps->base, params[i],
+					      policy_param_value(parameter))) {
+			rkfree(priv);
+			rkfree(ps);
+			return NULL;
+		}
+	}
+
+	return &ps->base;
+}
+
+static void sdup_aead_destroy(struct ps_base * bps)
+{
+	struct sdup_crypto_ps * ps = container_of(bps,
+						  struct sdup_crypto_ps,
+						  base);
+	struct aead_priv * priv;
+	unsigned long flags;
+	bool idle;
+
+	if (!bps)
+		return;
+
+	/*
+	 * Called under rcu_read_lock or spinlocks, and from the completion
+	 * of our own requests, so it must not wait for them: the last one
+	 * frees priv instead.
+	 */
+	priv = ps->priv;
+	if (priv) {
+		/* Until aead_priv_free(), completions run our code */
+		__module_get(THIS_MODULE);
+
+		spin_lock_irqsave(&priv->lock, flags);
+		priv->dying = true;
+		aead_state_swap(priv, &priv->tx, NULL);
+		aead_state_swap(priv, &priv->rx, NULL);
+		idle = !priv->users;
+		spin_unlock_irqrestore(&priv->lock, flags);
+
+		if (idle)
+			queue_work(aead_wq, &priv->free_work);
+	}
+
+	rkfree(ps);
+}
+
+struct ps_factory sdup_aead_factory = {
+	.owner   = THIS_MODULE,
+	.create  = sdup_aead_create,
+	.destroy = sdup_aead_destroy,
+};
+
+#define RINA_SDUP_AEAD_NAME "aead"
+
+static int __init mod_init(void)
+{
+	int ret;
+
+	strcpy(sdup_aead_factory.name, RINA_SDUP_AEAD_NAME);
+
+	aead_wq = alloc_workqueue("sdup-aead", WQ_MEM_RECLAIM, 0);
+	if (!aead_wq) {
+		LOG_ERR("Failed to create the workqueue");
+		return -1;
+	}
+
+	ret = sdup_crypto_ps_publish(&sdup_aead_factory);
+	if (ret) {
+		LOG_ERR("Failed to publish policy set factory");
+		destroy_workqueue(aead_wq);
+		return -1;
+	}
+
+	LOG_INFO("SDU protection AEAD policy set loaded successfully");
+
+	return 0;
+}
+
+static void __exit mod_exit(void)
+{
+	int ret;
+
+	ret = sdup_crypto_ps_unpublish(RINA_SDUP_AEAD_NAME);
+	if (ret) {
+		LOG_ERR("Failed to unpublish policy set factory");
+		return;
+	}
+
+	/* Waits for aead_priv_free() calls still running */
+	destroy_workqueue(aead_wq);
+
+	LOG_INFO("SDU protection AEAD policy set unloaded successfully");
+}
+
+module_init(mod_init);
+module_exit(mod_exit);
+
+MODULE_DESCRIPTION("AEAD SDU protection policy set");
+
+MODULE_LICENSE("GPL");
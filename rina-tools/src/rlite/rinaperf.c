@@ -184,6 +184,7 @@ struct rinaperf {
     int cli_flow_allocated; /* client flows allocated ? */
     int background;         /* server runs as a daemon process */
     int cdf;                /* report CDF percentiles */
+    int batch;              /* SDUs per syscall in perf mode */
 
     /* Synchronization between client threads and main thread. */
     sem_t cli_barrier;
@@ -535,29 +536,67 @@ perf_client(struct worker *w)
     unsigned int burst    = w->burst;
     struct rinaperf *rp   = w->rp;
     unsigned int cdown    = burst;
+    unsigned int batch    = rp->batch;
     struct timespec t_start, t_end;
     struct timespec w1, w2;
     char buf[SDU_SIZE_MAX];
+    char *bbuf = NULL;
     unsigned long long ns;
     unsigned int i = 0;
+    unsigned int sent;
     int ret;
 
     memset(buf, 'x', size);
 
+    if (batch > 1) {
+        /* Prepare 'batch' records carrying the same SDU. */
+        bbuf = malloc(batch * RINA_BATCH_REC_SIZE(size));
+        if (!bbuf) {
+            PRINTF("Out of memory\n");
+            return -1;
+        }
+        for (i = 0; i < batch; i++) {
+            char *rec = bbuf + i * RINA_BATCH_REC_SIZE(size);
+
+            *(uint32_t *)rec = size;
+            memcpy(rec + sizeof(uint32_t), buf, size);
+        }
+    }
+
     clock_gettime(CLOCK_MONOTONIC, &t_start);
 
-    for (i = 0; !rp->cli_stop && (!limit || i < limit); i++) {
-        ret = write(w->dfd, buf, size);
-        if (ret != size) {
-            if (ret < 0) {
-                perror("write(buf)");
-            } else {
-                PRINTF("Partial write %d/%d\n", ret, size);
+    for (i = 0; !rp->cli_stop && (!limit || i < limit); i += sent) {
+        if (batch > 1) {
+            sent = batch;
+            if (limit && limit - i < sent) {
+                sent = limit - i;
             }
-            break;
+            ret = rina_flow_write_batch(w->dfd, bbuf,
+                                        sent * RINA_BATCH_REC_SIZE(size), sent);
+            if (ret <= 0) {
+                if (ret < 0) {
+                    perror("rina_flow_write_batch()");
+                } else {
+                    PRINTF("Batched write did not send anything\n");
+                }
+                break;
+            }
+            sent = ret;
+        } else {
+            ret = write(w->dfd, buf, size);
+            if (ret != size) {
+                if (ret < 0) {
+                    perror("write(buf)");
+                } else {
+                    PRINTF("Partial write %d/%d\n", ret, size);
+                }
+                break;
+            }
+            sent = 1;
         }
 
-        if (interval && --cdown == 0) {
+        cdown = cdown > sent ? cdown - sent : 0;
+        if (interval && cdown == 0) {
             if (interval > 50) { /* slack default is 50 us*/
                 stoppable_usleep(rp, interval);
             } else {
@@ -590,6 +629,8 @@ perf_client(struct worker *w)
 
     w->test_config.cnt = i; /* write back packet count */
 
+    free(bbuf);
+
     return 0;
 }
 
@@ -641,11 +682,15 @@ perf_server(struct worker *w)
     unsigned long long rate_bytes       = 0;
     struct timespec rate_ts, t_start, t_end;
     char buf[SDU_SIZE_MAX];
+    unsigned int batch = w->rp->batch;
+    unsigned int blen  = 0;
+    char *bbuf         = NULL;
     unsigned long long ns;
     struct pollfd pfd[2];
     unsigned int i;
     int verb    = w->rp->verbose;
     int timeout = 0;
+    int ret     = 0;
     int n;
 
     n = fcntl(w->dfd, F_SETFL, O_NONBLOCK);
@@ -654,6 +699,15 @@ perf_server(struct worker *w)
         return -1;
     }
 
+    if (batch > 1) {
+        blen = batch * RINA_BATCH_REC_SIZE(SDU_SIZE_MAX);
+        bbuf = malloc(blen);
+        if (!bbuf) {
+            PRINTF("Out of memory\n");
+            return -1;
+        }
+    }
+
     pfd[0].fd     = w->dfd;
     pfd[1].fd     = w->cfd;
     pfd[0].events = pfd[1].events = POLLIN;
@@ -674,12 +728,20 @@ perf_server(struct worker *w)
          * an additional syscall when the receiver is not under pressure, but
          * this is acceptable if we want to maximize throughput.
          */
-        n = read(w->dfd, buf, sizeof(buf));
+        if (batch > 1) {
+            /* Here n is the number of SDUs, rather than bytes. */
+            n = rina_flow_read_batch(w->dfd, bbuf, blen,
+                                     limit && limit - i < batch ? limit - i
+                                                                : batch);
+        } else {
+            n = read(w->dfd, buf, sizeof(buf));
+        }
         if (n < 0 && errno == EAGAIN) {
             n = poll(pfd, 2, RP_DATA_WAIT_MSECS);
             if (n < 0) {
                 perror("poll(flow)");
-                return -1;
+                ret = -1;
+                goto out;
             } else if (n == 0) {
                 /* Timeout */
                 timeout = 1;
@@ -695,7 +757,6 @@ perf_server(struct worker *w)
                 continue;
             } else {
                 struct rp_config_msg stop;
-                int ret;
 
                 /* Nothing to read and stop signal received. */
                 assert(pfd[1].revents & POLLIN);
@@ -706,7 +767,7 @@ perf_server(struct worker *w)
 
                 ret = config_msg_read(w->cfd, &stop);
                 if (ret) {
-                    return ret;
+                    goto out;
                 }
 
                 if (!stop.cnt) {
@@ -736,15 +797,28 @@ perf_server(struct worker *w)
         }
         if (n < 0) {
             perror("read(flow)");
-            return -1;
+            ret = -1;
+            goto out;
 
         } else if (n == 0) {
             PRINTF("Flow deallocated remotely\n");
             break;
         }
 
-        rate_bytes += n;
-        rate_cnt++;
+        if (batch > 1) {
+            char *rec = bbuf;
+            int j;
+
+            for (j = 0; j < n; j++) {
+                rate_bytes += *(uint32_t *)rec;
+                rec += RINA_BATCH_REC_SIZE(*(uint32_t *)rec);
+            }
+            rate_cnt += n;
+            i += n - 1;
+        } else {
+            rate_bytes += n;
+            rate_cnt++;
+        }
 
         if (rate_bytes >= rate_bytes_limit && verb) {
             rate_print(&rate_bytes, &rate_cnt, &rate_bytes_limit, &rate_ts,
@@ -774,7 +848,10 @@ perf_server(struct worker *w)
         PRINTF("Received %u PDUs out of %u\n", i, limit);
     }
 
-    return 0;
+out:
+    free(bbuf);
+
+    return ret;
 }
 
 static void
@@ -1443,6 +1520,8 @@ usage(void)
         "   -B NUM : average bandwidth for the data flow, in bits per second\n"
         "   -b NUM : how many SDUs to send before waiting as "
         "specified by -i option (default b=1)\n"
+        "   -k NUM : in perf mode, move NUM SDUs per system call with "
+        "batched I/O (default k=1)\n"
         "   -a APNAME : application process name and instance of the rinaperf "
         "client\n"
         "   -z APNAME : application process name and instance of the rinaperf "
@@ -1497,11 +1576,12 @@ main(int argc, char **argv)
     pthread_mutex_init(&rp->ticket_lock, NULL);
     rp->background = 0;
     rp->cdf        = 0; /* Don't report CDF percentiles. */
+    rp->batch      = 1; /* One SDU per syscall. */
 
     /* Start with a default flow configuration (unreliable flow). */
     rina_flow_spec_unreliable(&rp->flowspec);
 
-    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:a:z:p:D:L:E:TwvC")) !=
+    while ((opt = getopt(argc, argv, "hlt:d:c:s:i:B:g:b:k:a:z:p:D:L:E:TwvC")) !=
            -1) {
         switch (opt) {
         case 'h':
@@ -1564,6 +1644,14 @@ main(int argc, char **argv)
             }
             break;
 
+        case 'k':
+            rp->batch = atoi(optarg);
+            if (rp->batch <= 0) {
+                PRINTF("    Invalid 'batch' %d\n", rp->batch);
+                return -1;
+            }
+            break;
+
         case 'a':
             rp->cli_appl_name = optarg;
             break;
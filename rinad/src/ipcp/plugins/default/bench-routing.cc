@@ -0,0 +1,149 @@
+//
+// Benchmark of the link-state routing algorithms
+//
+// Reports, for growing topologies, the time taken by a full SPF run, an
+// incremental SPF run after a single link cost change, and the Loop Free
+// Alternates computation with one and with several threads.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301  USA
+//
+
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+#include <time.h>
+
+#define IPCP_MODULE "lsr-bench"
+#include "../../ipcp-logging.h"
+
+#include "routing-ps.h"
+
+int ipcp_id = 1;
+
+static std::string nodeName(int i)
+{
+	std::stringstream ss;
+
+	ss << "n" << i;
+	return ss.str();
+}
+
+static double nowMs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void freeTable(std::list<rina::RoutingTableEntry *>& rt)
+{
+	for (std::list<rina::RoutingTableEntry *>::iterator
+			it = rt.begin(); it != rt.end(); ++it) {
+		delete *it;
+	}
+	rt.clear();
+}
+
+// A ring with one pseudo-random chord per node, costs between 1 and 10
+static void buildTopology(int n,
+			  unsigned int changed_cost,
+			  std::list<rinad::FlowStateObject>& objects)
+{
+	unsigned int seed = 12345;
+	unsigned int cost;
+	int peer;
+
+	for (int i = 0; i < n; i++) {
+		cost = i == 0 ? changed_cost : 1 + rand_r(&seed) % 10;
+		objects.push_back(rinad::FlowStateObject(nodeName(i),
+				nodeName((i + 1) % n), cost, true, 1, 1));
+		objects.push_back(rinad::FlowStateObject(nodeName((i + 1) % n),
+				nodeName(i), cost, true, 1, 1));
+
+		peer = (i + 2 + rand_r(&seed) % (n - 3)) % n;
+		cost = 1 + rand_r(&seed) % 10;
+		objects.push_back(rinad::FlowStateObject(nodeName(i),
+				nodeName(peer), cost, true, 1, 1));
+		objects.push_back(rinad::FlowStateObject(nodeName(peer),
+				nodeName(i), cost, true, 1, 1));
+	}
+}
+
+int main(int argc, char * argv[])
+{
+	static const int sizes[] = { 100, 250, 500, 1000, 2000 };
+	unsigned int threads = argc > 1 ? atoi(argv[1]) : 0;
+	std::list<rina::RoutingTableEntry *> rt;
+	double t0, full, incr, lfa1, lfan;
+	unsigned int full_runs;
+
+	setLogLevel("INFO");
+
+	printf("%8s %8s %12s %12s %12s %12s\n", "nodes", "edges",
+	       "full SPF", "incr SPF", "LFA 1 thr", "LFA N thr");
+
+	for (unsigned int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		std::list<rinad::FlowStateObject> objects, changed, delta;
+		std::list<rinad::FlowStateObject>::iterator it, cit;
+		rinad::IncrementalSPFAlgorithm spf;
+		rinad::LoopFreeAlternateAlgorithm lfa_single(spf, 1);
+		rinad::LoopFreeAlternateAlgorithm lfa_multi(spf, threads);
+
+		buildTopology(sizes[s], 5, objects);
+		buildTopology(sizes[s], 9, changed);
+		rinad::Graph graph(objects);
+
+		// Same topology, only the n0 <-> n1 link cost differs
+		for (it = objects.begin(), cit = changed.begin();
+				it != objects.end(); ++it, ++cit) {
+			if (cit->cost != it->cost) {
+				delta.push_back(*cit);
+			}
+		}
+
+		t0 = nowMs();
+		spf.computeRoutingTable(graph, objects, nodeName(0), rt);
+		full = nowMs() - t0;
+
+		t0 = nowMs();
+		lfa_single.fortifyRoutingTable(graph, nodeName(0), rt);
+		lfa1 = nowMs() - t0;
+
+		t0 = nowMs();
+		lfa_multi.fortifyRoutingTable(graph, nodeName(0), rt);
+		lfan = nowMs() - t0;
+		freeTable(rt);
+
+		full_runs = spf.getFullRuns();
+		t0 = nowMs();
+		if (!spf.updateRoutingTable(delta, nodeName(0), rt)) {
+			fprintf(stderr, "Incremental SPF refused the update\n");
+			return 1;
+		}
+		incr = nowMs() - t0;
+		freeTable(rt);
+		if (spf.getFullRuns() != full_runs) {
+			fprintf(stderr, "Incremental SPF went for a full run\n");
+			return 1;
+		}
+
+		printf("%8d %8zu %9.3f ms %9.3f ms %9.3f ms %9.3f ms\n",
+		       sizes[s], graph.edges_.size(), full, incr, lfa1, lfan);
+	}
+
+	return 0;
+}
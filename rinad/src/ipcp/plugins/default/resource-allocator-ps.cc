@@ -193,14 +193,7 @@ void DefaultPDUFTGeneratorPs::routingTableUpdated(const std::list<rina::RoutingT
 		}
 	}
 
-	try {
-		rina::kernelIPCProcess->modifyPDUForwardingTableEntries(pduft, 2);
-	} catch (rina::Exception & e) {
-		LOG_IPCP_ERR("Error setting PDU Forwarding Table in the kernel: %s",
-				e.what());
-	}
-
-	//Update resource allocator
+	//Update resource allocator, which pushes the changes to the kernel
 	res_alloc->set_rt_entries(rt);
 	res_alloc->set_pduft_entries(pduft);
 }
@@ -22,11 +22,15 @@
 // MA  02110-1301  USA
 //
 
+#include <algorithm>
 #include <assert.h>
 #include <climits>
+#include <functional>
+#include <queue>
 #include <set>
 #include <sstream>
 #include <string>
+#include <unistd.h>
 
 #define IPCP_MODULE "routing-ps-link-state"
 #include "../../ipcp-logging.h"
@@ -195,11 +199,11 @@ void Graph::init_vertices()
 	std::list<FlowStateObject>::const_iterator it;
 	for (it = flow_state_objects_.begin(); it != flow_state_objects_.end();
 			++it) {
-		if (!contains_vertex(it->name)) {
+		if (vertex_index_.insert(it->name).second) {
 			vertices_.push_back(it->name);
 		}
 
-		if (!contains_vertex(it->neighbor_name)) {
+		if (vertex_index_.insert(it->neighbor_name).second) {
 			vertices_.push_back(it->neighbor_name);
 		}
 	}
@@ -207,14 +211,7 @@ void Graph::init_vertices()
 
 bool Graph::contains_vertex(const std::string& name) const
 {
-	std::list<std::string>::const_iterator it;
-	for (it = vertices_.begin(); it != vertices_.end(); ++it) {
-		if ((*it) == name) {
-			return true;
-		}
-	}
-
-	return false;
+	return vertex_index_.find(name) != vertex_index_.end();
 }
 
 bool Graph::contains_edge(const std::string& name1,
@@ -236,7 +233,12 @@ void Graph::init_edges()
 	std::list<FlowStateObject>::const_iterator flowIt;
 
 	for (it = vertices_.begin(); it != vertices_.end(); ++it) {
+		if (checked_index_.find(*it) != checked_index_.end()) {
+			continue;
+		}
+
 		checked_vertices_.push_back(new CheckedVertex((*it)));
+		checked_index_[*it] = checked_vertices_.back();
 	}
 
 	CheckedVertex * origin = 0;
@@ -280,14 +282,14 @@ void Graph::init_edges()
 
 Graph::CheckedVertex * Graph::get_checked_vertex(const std::string& name) const
 {
-	std::list<Graph::CheckedVertex *>::const_iterator it;
-	for (it = checked_vertices_.begin(); it != checked_vertices_.end(); ++it) {
-		if ((*it)->name_ == name) {
-			return (*it);
-		}
+	std::map<std::string, CheckedVertex *>::const_iterator it;
+
+	it = checked_index_.find(name);
+	if (it == checked_index_.end()) {
+		return 0;
 	}
 
-	return 0;
+	return it->second;
 }
 
 void Graph::print() const
@@ -359,9 +361,24 @@ void DijkstraAlgorithm::computeRoutingTable(const Graph& graph,
 		}
 	}
 
+	last_source_ = source_name;
+	last_distances_.swap(distances_);
+
 	clear();
 }
 
+bool DijkstraAlgorithm::getLastDistances(const std::string& source_name,
+					 std::map<std::string, int>& distances)
+{
+	if (last_source_.empty() || last_source_ != source_name) {
+		return false;
+	}
+
+	distances = last_distances_;
+
+	return true;
+}
+
 void DijkstraAlgorithm::execute(const Graph& graph, const std::string& source)
 {
 	distances_[source] = 0;
@@ -729,6 +746,626 @@ bool ECMPDijkstraAlgorithm::isSettled(const std::string& node) const
 	return false;
 }
 
+// Incremental SPF algorithm
+
+// Room left in each row when it is (re)allocated
+#define CSR_ROW_SLACK 2
+
+CSRGraph::CSRGraph()
+{
+	unused_ = 0;
+}
+
+unsigned int CSRGraph::size() const
+{
+	return degree.size();
+}
+
+void CSRGraph::build(unsigned int num_vertices, const EdgeMap& edges)
+{
+	EdgeMap::const_iterator it;
+	unsigned int i, next;
+
+	degree.assign(num_vertices, 0);
+	for (it = edges.begin(); it != edges.end(); ++it) {
+		degree[it->first.first]++;
+		degree[it->first.second]++;
+	}
+
+	start.resize(num_vertices);
+	capacity.resize(num_vertices);
+	next = 0;
+	for (i = 0; i < num_vertices; i++) {
+		start[i] = next;
+		capacity[i] = degree[i] + degree[i] / 2 + CSR_ROW_SLACK;
+		next += capacity[i];
+		degree[i] = 0;
+	}
+
+	to.resize(next);
+	weight.resize(next);
+	unused_ = 0;
+	for (it = edges.begin(); it != edges.end(); ++it) {
+		i = start[it->first.first] + degree[it->first.first]++;
+		to[i] = it->first.second;
+		weight[i] = it->second;
+
+		i = start[it->first.second] + degree[it->first.second]++;
+		to[i] = it->first.first;
+		weight[i] = it->second;
+	}
+}
+
+void CSRGraph::addVertex()
+{
+	start.push_back(to.size());
+	degree.push_back(0);
+	capacity.push_back(CSR_ROW_SLACK);
+	to.resize(to.size() + CSR_ROW_SLACK);
+	weight.resize(weight.size() + CSR_ROW_SLACK);
+}
+
+void CSRGraph::setEdge(unsigned int a, unsigned int b, int w)
+{
+	setArc(a, b, w);
+	setArc(b, a, w);
+}
+
+void CSRGraph::removeEdge(unsigned int a, unsigned int b)
+{
+	removeArc(a, b);
+	removeArc(b, a);
+}
+
+void CSRGraph::setArc(unsigned int u, unsigned int v, int w)
+{
+	unsigned int i;
+
+	for (i = start[u]; i < start[u] + degree[u]; i++) {
+		if (to[i] == v) {
+			weight[i] = w;
+			return;
+		}
+	}
+
+	if (degree[u] == capacity[u]) {
+		moveRow(u, 2 * capacity[u] + CSR_ROW_SLACK);
+	}
+
+	i = start[u] + degree[u]++;
+	to[i] = v;
+	weight[i] = w;
+}
+
+void CSRGraph::removeArc(unsigned int u, unsigned int v)
+{
+	unsigned int i, last;
+
+	if (!degree[u]) {
+		return;
+	}
+
+	last = start[u] + degree[u] - 1;
+	for (i = start[u]; i <= last; i++) {
+		if (to[i] == v) {
+			to[i] = to[last];
+			weight[i] = weight[last];
+			degree[u]--;
+			return;
+		}
+	}
+}
+
+// Moves row u to the end of the arrays, with room for new_capacity entries
+void CSRGraph::moveRow(unsigned int u, unsigned int new_capacity)
+{
+	unsigned int old_start = start[u];
+	unsigned int i;
+
+	start[u] = to.size();
+	to.resize(to.size() + new_capacity);
+	weight.resize(weight.size() + new_capacity);
+	for (i = 0; i < degree[u]; i++) {
+		to[start[u] + i] = to[old_start + i];
+		weight[start[u] + i] = weight[old_start + i];
+	}
+
+	unused_ += capacity[u];
+	capacity[u] = new_capacity;
+
+	if (unused_ > to.size() / 2) {
+		compact();
+	}
+}
+
+// Packs the rows together again, dropping the slots left by moved rows
+void CSRGraph::compact()
+{
+	std::vector<unsigned int> new_to;
+	std::vector<int> new_weight;
+	unsigned int u, i, next;
+
+	next = 0;
+	for (u = 0; u < size(); u++) {
+		capacity[u] = degree[u] + degree[u] / 2 + CSR_ROW_SLACK;
+		next += capacity[u];
+	}
+
+	new_to.resize(next);
+	new_weight.resize(next);
+	next = 0;
+	for (u = 0; u < size(); u++) {
+		for (i = 0; i < degree[u]; i++) {
+			new_to[next + i] = to[start[u] + i];
+			new_weight[next + i] = weight[start[u] + i];
+		}
+		start[u] = next;
+		next += capacity[u];
+	}
+
+	to.swap(new_to);
+	weight.swap(new_weight);
+	unused_ = 0;
+}
+
+typedef std::pair<int, unsigned int> SPFHeapEntry;
+typedef std::priority_queue<SPFHeapEntry, std::vector<SPFHeapEntry>,
+			    std::greater<SPFHeapEntry> > SPFHeap;
+
+// Dijkstra from the vertices in the heap, lowering dist and parent
+static void spf_run(const CSRGraph& g,
+		    SPFHeap& heap,
+		    std::vector<int>& dist,
+		    std::vector<int>& parent)
+{
+	SPFHeapEntry top;
+	unsigned int u, v, i;
+	int d;
+
+	while (!heap.empty()) {
+		top = heap.top();
+		heap.pop();
+		u = top.second;
+
+		// Stale entry, u was reached through a shorter path since
+		if (top.first > dist[u]) {
+			continue;
+		}
+
+		for (i = g.start[u]; i < g.start[u] + g.degree[u]; i++) {
+			v = g.to[i];
+			d = dist[u] + g.weight[i];
+			if (d < dist[v]) {
+				dist[v] = d;
+				parent[v] = u;
+				heap.push(SPFHeapEntry(d, v));
+			}
+		}
+	}
+}
+
+static void spf_full(const CSRGraph& g,
+		     unsigned int source,
+		     std::vector<int>& dist,
+		     std::vector<int>& parent)
+{
+	SPFHeap heap;
+
+	dist.assign(g.size(), INT_MAX);
+	parent.assign(g.size(), -1);
+	dist[source] = 0;
+	heap.push(SPFHeapEntry(0, source));
+	spf_run(g, heap, dist, parent);
+}
+
+IncrementalSPFAlgorithm::IncrementalSPFAlgorithm()
+{
+	valid_ = false;
+	source_ = 0;
+	full_runs_ = 0;
+}
+
+unsigned int IncrementalSPFAlgorithm::getFullRuns() const
+{
+	return full_runs_;
+}
+
+void IncrementalSPFAlgorithm::reset()
+{
+	ids_.clear();
+	names_.clear();
+	arcs_.clear();
+	edges_.clear();
+	csr_.build(0, edges_);
+	dist_.clear();
+	parent_.clear();
+	valid_ = false;
+}
+
+unsigned int IncrementalSPFAlgorithm::intern(const std::string& name)
+{
+	std::map<std::string, unsigned int>::iterator it;
+
+	it = ids_.find(name);
+	if (it != ids_.end()) {
+		return it->second;
+	}
+
+	ids_[name] = names_.size();
+	names_.push_back(name);
+
+	// Not reachable until an edge says otherwise
+	csr_.addVertex();
+	dist_.push_back(INT_MAX);
+	parent_.push_back(-1);
+
+	return names_.size() - 1;
+}
+
+void IncrementalSPFAlgorithm::buildEdges(const Graph& graph,
+					 CSRGraph::EdgeMap& edges)
+{
+	std::list<std::string>::const_iterator vit;
+	std::list<Edge *>::const_iterator eit;
+	CSRGraph::EdgeMap::iterator it;
+	unsigned int a, b;
+
+	for (vit = graph.vertices_.begin(); vit != graph.vertices_.end(); ++vit) {
+		intern(*vit);
+	}
+
+	// Parallel flows between two IPCPs collapse into the cheapest one
+	for (eit = graph.edges_.begin(); eit != graph.edges_.end(); ++eit) {
+		a = intern((*eit)->name1_);
+		b = intern((*eit)->name2_);
+		if (a == b) {
+			continue;
+		}
+
+		CSRGraph::VertexPair key(std::min(a, b), std::max(a, b));
+		it = edges.find(key);
+		if (it == edges.end() || it->second > (*eit)->weight_) {
+			edges[key] = (*eit)->weight_;
+		}
+	}
+}
+
+// Records the state of a flow, returns false if it does not make an edge
+// and sets key to the edge it belongs to otherwise
+bool IncrementalSPFAlgorithm::applyFSO(const FlowStateObject& fso,
+				       CSRGraph::VertexPair& key)
+{
+	unsigned int a, b;
+
+	a = intern(fso.name);
+	b = intern(fso.neighbor_name);
+	if (a == b) {
+		return false;
+	}
+
+	if (fso.state_up) {
+		arcs_[CSRGraph::VertexPair(a, b)] = fso.cost;
+	} else {
+		arcs_.erase(CSRGraph::VertexPair(a, b));
+	}
+
+	key = CSRGraph::VertexPair(std::min(a, b), std::max(a, b));
+
+	return true;
+}
+
+// There is an edge when the flow is up in both directions. Like Graph, which
+// gets the FSOs sorted by key, it costs what the FSO with the highest key
+// says. Returns -1 if there is no edge.
+int IncrementalSPFAlgorithm::edgeWeight(unsigned int a, unsigned int b) const
+{
+	CSRGraph::EdgeMap::const_iterator ab, ba;
+
+	ab = arcs_.find(CSRGraph::VertexPair(a, b));
+	ba = arcs_.find(CSRGraph::VertexPair(b, a));
+	if (ab == arcs_.end() || ba == arcs_.end()) {
+		return -1;
+	}
+
+	if (names_[a] + "-" + names_[b] > names_[b] + "-" + names_[a]) {
+		return ab->second;
+	}
+
+	return ba->second;
+}
+
+// Brings the tree of the last run up to date with the edges that got worse
+// (or went away) and better (or appeared), already applied to csr_
+void IncrementalSPFAlgorithm::updateTree(const std::vector<CSRGraph::VertexPair>& worse,
+					 const std::vector<CSRGraph::VertexPair>& better)
+{
+	std::vector<int> first_child, next_sibling;
+	std::vector<unsigned int> stack, affected;
+	std::vector<char> is_affected;
+	unsigned int nv = names_.size();
+	unsigned int a, b, u, v, i, j;
+	SPFHeap heap;
+	int child, w;
+
+	// Roots of the subtrees hanging from tree edges that got worse
+	for (i = 0; i < worse.size(); i++) {
+		a = worse[i].first;
+		b = worse[i].second;
+		if (parent_[b] == (int) a) {
+			stack.push_back(b);
+		} else if (parent_[a] == (int) b) {
+			stack.push_back(a);
+		}
+	}
+
+	// Their vertices lose their paths
+	if (!stack.empty()) {
+		first_child.assign(nv, -1);
+		next_sibling.assign(nv, -1);
+		for (v = 0; v < nv; v++) {
+			if (parent_[v] >= 0) {
+				next_sibling[v] = first_child[parent_[v]];
+				first_child[parent_[v]] = v;
+			}
+		}
+
+		is_affected.assign(nv, 0);
+		while (!stack.empty()) {
+			u = stack.back();
+			stack.pop_back();
+			if (is_affected[u]) {
+				continue;
+			}
+
+			is_affected[u] = 1;
+			affected.push_back(u);
+			dist_[u] = INT_MAX;
+			parent_[u] = -1;
+			for (child = first_child[u]; child >= 0;
+					child = next_sibling[child]) {
+				stack.push_back(child);
+			}
+		}
+	}
+
+	// Reattach them through their best neighbour still in the tree
+	for (j = 0; j < affected.size(); j++) {
+		v = affected[j];
+		for (i = csr_.start[v]; i < csr_.start[v] + csr_.degree[v]; i++) {
+			u = csr_.to[i];
+			if (is_affected[u] || dist_[u] == INT_MAX) {
+				continue;
+			}
+
+			if (dist_[u] + csr_.weight[i] < dist_[v]) {
+				dist_[v] = dist_[u] + csr_.weight[i];
+				parent_[v] = u;
+			}
+		}
+
+		if (dist_[v] != INT_MAX) {
+			heap.push(SPFHeapEntry(dist_[v], v));
+		}
+	}
+
+	// Edges that got better may shorten paths anywhere
+	for (i = 0; i < better.size(); i++) {
+		a = better[i].first;
+		b = better[i].second;
+		w = edges_.find(better[i])->second;
+
+		if (dist_[a] != INT_MAX && dist_[a] + w < dist_[b]) {
+			dist_[b] = dist_[a] + w;
+			parent_[b] = a;
+			heap.push(SPFHeapEntry(dist_[b], b));
+		}
+
+		if (dist_[b] != INT_MAX && dist_[b] + w < dist_[a]) {
+			dist_[a] = dist_[b] + w;
+			parent_[a] = b;
+			heap.push(SPFHeapEntry(dist_[a], a));
+		}
+	}
+
+	spf_run(csr_, heap, dist_, parent_);
+}
+
+void IncrementalSPFAlgorithm::fullRun()
+{
+	spf_full(csr_, source_, dist_, parent_);
+	full_runs_++;
+	LOG_IPCP_DBG("Full SPF run over %u vertices", csr_.size());
+}
+
+void IncrementalSPFAlgorithm::fillRoutingTable(std::list<rina::RoutingTableEntry *>& rt)
+{
+	std::vector<int> next_hop;
+	std::vector<unsigned int> path;
+	rina::RoutingTableEntry * entry;
+	rina::IPCPNameAddresses ipcpna;
+	unsigned int nv = names_.size();
+	unsigned int u, v, i;
+	int hop;
+
+	// The next hop of a vertex is the one of its parent, unless the
+	// parent is the source
+	next_hop.assign(nv, -1);
+	for (v = 0; v < nv; v++) {
+		if (v == source_ || dist_[v] == INT_MAX) {
+			continue;
+		}
+
+		path.clear();
+		u = v;
+		while (next_hop[u] < 0 && parent_[u] != (int) source_) {
+			path.push_back(u);
+			u = parent_[u];
+		}
+
+		hop = next_hop[u] >= 0 ? next_hop[u] : (int) u;
+		next_hop[u] = hop;
+		for (i = 0; i < path.size(); i++) {
+			next_hop[path[i]] = hop;
+		}
+	}
+
+	for (v = 0; v < nv; v++) {
+		if (v == source_ || next_hop[v] < 0) {
+			continue;
+		}
+
+		ipcpna.name = names_[next_hop[v]];
+		entry = new rina::RoutingTableEntry();
+		entry->destination.name = names_[v];
+		entry->nextHopNames.push_back(rina::NHopAltList(ipcpna));
+		entry->qosId = 0;
+		entry->cost = 1;
+		rt.push_back(entry);
+		LOG_IPCP_DBG("Added entry to routing table: destination %s, next-hop %s",
+				entry->destination.name.c_str(), ipcpna.name.c_str());
+	}
+}
+
+void IncrementalSPFAlgorithm::computeRoutingTable(const Graph& graph,
+						  const std::list<FlowStateObject>& fsoList,
+						  const std::string& source_name,
+						  std::list<rina::RoutingTableEntry *>& rt)
+{
+	std::list<FlowStateObject>::const_iterator it;
+	CSRGraph::EdgeMap::const_iterator ait;
+	CSRGraph::VertexPair key;
+	int w;
+
+	// Start over, forgetting about the vertices that left the graph
+	reset();
+
+	source_ = intern(source_name);
+	for (it = fsoList.begin(); it != fsoList.end(); ++it) {
+		applyFSO(*it, key);
+	}
+
+	for (ait = arcs_.begin(); ait != arcs_.end(); ++ait) {
+		if (ait->first.first > ait->first.second) {
+			continue;
+		}
+
+		w = edgeWeight(ait->first.first, ait->first.second);
+		if (w >= 0) {
+			edges_[ait->first] = w;
+		}
+	}
+
+	csr_.build(names_.size(), edges_);
+	fullRun();
+	valid_ = true;
+
+	fillRoutingTable(rt);
+}
+
+bool IncrementalSPFAlgorithm::updateRoutingTable(const std::list<FlowStateObject>& changed,
+						 const std::string& source_name,
+						 std::list<rina::RoutingTableEntry *>& rt)
+{
+	std::list<FlowStateObject>::const_iterator it;
+	std::map<std::string, unsigned int>::iterator sit;
+	std::set<CSRGraph::VertexPair> touched;
+	std::set<CSRGraph::VertexPair>::iterator tit;
+	std::vector<CSRGraph::VertexPair> worse, better;
+	CSRGraph::EdgeMap::iterator eit;
+	CSRGraph::VertexPair key;
+	int w;
+
+	sit = ids_.find(source_name);
+	if (!valid_ || sit == ids_.end() || sit->second != source_) {
+		return false;
+	}
+
+	for (it = changed.begin(); it != changed.end(); ++it) {
+		if (applyFSO(*it, key)) {
+			touched.insert(key);
+		}
+	}
+
+	for (tit = touched.begin(); tit != touched.end(); ++tit) {
+		w = edgeWeight(tit->first, tit->second);
+		eit = edges_.find(*tit);
+
+		if (w < 0) {
+			if (eit == edges_.end()) {
+				continue;
+			}
+			worse.push_back(*tit);
+			edges_.erase(eit);
+			csr_.removeEdge(tit->first, tit->second);
+			continue;
+		}
+
+		if (eit == edges_.end()) {
+			better.push_back(*tit);
+		} else if (w > eit->second) {
+			worse.push_back(*tit);
+		} else if (w < eit->second) {
+			better.push_back(*tit);
+		} else {
+			continue;
+		}
+
+		edges_[*tit] = w;
+		csr_.setEdge(tit->first, tit->second, w);
+	}
+
+	if (4 * (worse.size() + better.size()) > edges_.size() + 4) {
+		fullRun();
+	} else {
+		updateTree(worse, better);
+	}
+
+	fillRoutingTable(rt);
+
+	return true;
+}
+
+bool IncrementalSPFAlgorithm::getLastDistances(const std::string& source_name,
+					       std::map<std::string, int>& distances)
+{
+	std::map<std::string, unsigned int>::iterator it;
+	unsigned int v;
+
+	it = ids_.find(source_name);
+	if (!valid_ || it == ids_.end() || it->second != source_) {
+		return false;
+	}
+
+	for (v = 0; v < dist_.size(); v++) {
+		if (dist_[v] != INT_MAX) {
+			distances[names_[v]] = dist_[v];
+		}
+	}
+
+	return true;
+}
+
+void IncrementalSPFAlgorithm::computeShortestDistances(const Graph& graph,
+						       const std::string& source_name,
+						       std::map<std::string, int>& distances)
+{
+	CSRGraph::EdgeMap edges;
+	std::vector<int> dist, parent;
+	unsigned int source, v;
+	CSRGraph g;
+
+	source = intern(source_name);
+	buildEdges(graph, edges);
+	g.build(names_.size(), edges);
+	spf_full(g, source, dist, parent);
+
+	for (v = 0; v < names_.size(); v++) {
+		if (dist[v] != INT_MAX) {
+			distances[names_[v]] = dist[v];
+		}
+	}
+}
+
 //Class IResiliencyAlgorithm
 IResiliencyAlgorithm::IResiliencyAlgorithm(IRoutingAlgorithm& ra)
 						: routing_algorithm(ra)
@@ -736,102 +1373,240 @@ IResiliencyAlgorithm::IResiliencyAlgorithm(IRoutingAlgorithm& ra)
 }
 
 //Class LoopFreeAlternateAlgorithm
-LoopFreeAlternateAlgorithm::LoopFreeAlternateAlgorithm(IRoutingAlgorithm& ra)
+
+// Per-neighbour SPF runs, shared out among the threads working on them
+class NeighbourSPFJob {
+public:
+	NeighbourSPFJob(const CSRGraph& graph,
+			const std::vector<unsigned int>& roots,
+			std::vector<std::vector<int> >& dists)
+		: graph_(graph), roots_(roots), dists_(dists), next_(0) {};
+
+	void work()
+	{
+		std::vector<int> parent;
+		size_t i;
+
+		while (take(i)) {
+			spf_full(graph_, roots_[i], dists_[i], parent);
+		}
+	}
+
+private:
+	const CSRGraph& graph_;
+	const std::vector<unsigned int>& roots_;
+	std::vector<std::vector<int> >& dists_;
+	rina::Lockable lock_;
+	size_t next_;
+
+	bool take(size_t& i)
+	{
+		rina::ScopedLock g(lock_);
+
+		if (next_ >= roots_.size()) {
+			return false;
+		}
+
+		i = next_++;
+		return true;
+	}
+};
+
+class NeighbourSPFWorker : public rina::SimpleThread {
+public:
+	NeighbourSPFWorker(NeighbourSPFJob& job)
+		: rina::SimpleThread(std::string("lfa-spf-worker"), false),
+		  job_(job) {};
+
+	int run()
+	{
+		job_.work();
+		return 0;
+	}
+
+private:
+	NeighbourSPFJob& job_;
+};
+
+LoopFreeAlternateAlgorithm::LoopFreeAlternateAlgorithm(IRoutingAlgorithm& ra,
+						       unsigned int num_threads)
 						: IResiliencyAlgorithm(ra)
 {
+	long cpus;
+
+	num_threads_ = num_threads;
+	if (!num_threads_) {
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		num_threads_ = cpus > 0 ? cpus : 1;
+	}
+
+	if (num_threads_ > MAX_THREADS) {
+		num_threads_ = MAX_THREADS;
+	}
 }
 
-void LoopFreeAlternateAlgorithm::extendRoutingTableEntry(
-			std::list<rina::RoutingTableEntry *>& rt,
-			const std::string& target_name,
-			const std::string& nexthop)
+void LoopFreeAlternateAlgorithm::computeNeighbourDistances(
+			const CSRGraph& graph,
+			const std::vector<unsigned int>& roots,
+			std::vector<std::vector<int> >& dists)
 {
-	std::list<rina::RoutingTableEntry *>::iterator rit;
-	bool found = false;
-	rina::IPCPNameAddresses ipcpna;
+	std::list<NeighbourSPFWorker *> workers;
+	std::list<NeighbourSPFWorker *>::iterator it;
+	NeighbourSPFJob job(graph, roots, dists);
+	NeighbourSPFWorker * worker;
+	unsigned int i;
+	void * status;
 
-	// Find the involved routing table entry
-	for (rit = rt.begin(); rit != rt.end(); rit++) {
-		if ((*rit)->destination.name == target_name) {
+	// This thread does its share too
+	for (i = 1; i < num_threads_ && i < roots.size(); i++) {
+		worker = new NeighbourSPFWorker(job);
+		try {
+			worker->start();
+		} catch (rina::Exception &e) {
+			LOG_WARN("LFA: could not start SPF worker thread: %s",
+				 e.what());
+			delete worker;
 			break;
 		}
+		workers.push_back(worker);
 	}
 
-	if (rit == rt.end()) {
-		LOG_WARN("LFA: Couldn't find routing table entry for "
-			 "target name %s", target_name.c_str());
-		return;
+	job.work();
+
+	for (it = workers.begin(); it != workers.end(); ++it) {
+		(*it)->join(&status);
+		delete *it;
 	}
+}
+
+void LoopFreeAlternateAlgorithm::extendRoutingTableEntry(
+			rina::RoutingTableEntry * entry,
+			const std::string& nexthop)
+{
+	rina::IPCPNameAddresses ipcpna;
 
 	// Assume unicast and try to extend the routing table entry
 	// with the new alternative 'nexthop'
-	rina::NHopAltList& altlist = (*rit)->nextHopNames.front();
+	rina::NHopAltList& altlist = entry->nextHopNames.front();
 
 	for (std::list<rina::IPCPNameAddresses>::iterator
 			hit = altlist.alts.begin();
 				hit != altlist.alts.end(); hit++) {
 		if (hit->name == nexthop) {
 			// The nexthop is already in the alternatives
-			found = true;
-			break;
+			return;
 		}
 	}
 
-	if (!found) {
-		ipcpna.name = nexthop;
-		altlist.alts.push_back(ipcpna);
-		LOG_DBG("Node %s selected as LFA node towards the "
-			 "destination node %s", nexthop.c_str(), target_name.c_str());
-	}
+	ipcpna.name = nexthop;
+	altlist.alts.push_back(ipcpna);
+	LOG_DBG("Node %s selected as LFA node towards the "
+		 "destination node %s", nexthop.c_str(),
+		 entry->destination.name.c_str());
 }
 
 void LoopFreeAlternateAlgorithm::fortifyRoutingTable(const Graph& graph,
 						     const std::string& source_name,
 						     std::list<rina::RoutingTableEntry *>& rt)
 {
-	std::map<std::string, std::map< std::string, int > > neighbors_dist_trees;
-	std::map<std::string, int> src_dist_tree;
+	std::map<std::string, unsigned int> ids;
+	std::map<std::string, unsigned int>::iterator iit;
+	std::map<std::string, int> last_dist;
+	std::map<std::string, int>::iterator dit;
+	std::vector<std::string> names;
+	std::vector<rina::RoutingTableEntry *> entries;
+	std::list<rina::RoutingTableEntry *>::iterator rit;
+	std::list<std::string>::const_iterator vit;
+	std::list<Edge *>::const_iterator eit;
+	std::vector<unsigned int> neighbours;
+	std::vector<std::vector<int> > neigh_dist;
+	std::vector<int> src_dist, parent;
+	CSRGraph::EdgeMap edges;
+	CSRGraph::EdgeMap::iterator edit;
+	CSRGraph csr;
+	unsigned int source, a, b, x, i;
+
+	// Integer-indexed copy of the graph, ids in vertices_ order
+	for (vit = graph.vertices_.begin(); vit != graph.vertices_.end(); ++vit) {
+		ids[*vit] = names.size();
+		names.push_back(*vit);
+	}
+
+	iit = ids.find(source_name);
+	if (iit == ids.end()) {
+		return;
+	}
+	source = iit->second;
 
-	// TODO avoid this, can be computed when invoke computeRoutingTable()
-	routing_algorithm.computeShortestDistances(graph, source_name, src_dist_tree);
+	for (eit = graph.edges_.begin(); eit != graph.edges_.end(); ++eit) {
+		a = ids[(*eit)->name1_];
+		b = ids[(*eit)->name2_];
+		if (a == b) {
+			continue;
+		}
 
-	// Collect all the neighbors, and for each one use the routing algorithm to
-	// compute the shortest distance map rooted at that neighbor
-	for (std::list<std::string>::const_iterator it = graph.vertices_.begin();
-						it != graph.vertices_.end(); ++it) {
-		if ((*it) != source_name && graph.contains_edge(source_name, *it)) {
-			neighbors_dist_trees[*it] = std::map<std::string, int>();
-			routing_algorithm.computeShortestDistances(graph,
-						*it, neighbors_dist_trees[*it]);
+		CSRGraph::VertexPair key(std::min(a, b), std::max(a, b));
+		edit = edges.find(key);
+		if (edit == edges.end() || edit->second > (*eit)->weight_) {
+			edges[key] = (*eit)->weight_;
+		}
+	}
+	csr.build(names.size(), edges);
+
+	// The routing algorithm has usually just computed these
+	if (routing_algorithm.getLastDistances(source_name, last_dist)) {
+		src_dist.assign(names.size(), INT_MAX);
+		for (dit = last_dist.begin(); dit != last_dist.end(); ++dit) {
+			iit = ids.find(dit->first);
+			if (iit != ids.end()) {
+				src_dist[iit->second] = dit->second;
+			}
+		}
+	} else {
+		spf_full(csr, source, src_dist, parent);
+	}
+
+	// Shortest distances from each neighbour of the source
+	for (i = csr.start[source]; i < csr.start[source] + csr.degree[source];
+			i++) {
+		neighbours.push_back(csr.to[i]);
+	}
+	neigh_dist.resize(neighbours.size());
+	computeNeighbourDistances(csr, neighbours, neigh_dist);
+
+	entries.assign(names.size(), 0);
+	for (rit = rt.begin(); rit != rt.end(); ++rit) {
+		iit = ids.find((*rit)->destination.name);
+		if (iit != ids.end() && !(*rit)->nextHopNames.empty()) {
+			entries[iit->second] = *rit;
 		}
 	}
 
 	// For each node X other than than the source node
-	for (std::list<std::string>::const_iterator it = graph.vertices_.begin();
-						it != graph.vertices_.end(); ++it) {
-		if ((*it) == source_name) {
+	for (x = 0; x < names.size(); x++) {
+		if (x == source || src_dist[x] == INT_MAX) {
 			continue;
 		}
 
-		// For each neighbor of the source node, excluding X
-		for (std::map<std::string, std::map<std::string, int> >::iterator
-			nit = neighbors_dist_trees.begin();
-				nit != neighbors_dist_trees.end(); nit++) {
-			// If this neighbor is a LFA node for the current
-			// destination (*it) extend the routing table to take it
-			// into account
-			std::map< std::string, int>& neigh_dist_map = nit->second;
-			std::string neigh = nit->first;
+		if (!entries[x]) {
+			LOG_WARN("LFA: Couldn't find routing table entry for "
+				 "target name %s", names[x].c_str());
+			continue;
+		}
 
-			if (neigh == *it) {
+		// For each neighbor of the source node, excluding X, check
+		// dist(neigh, X) < dist(neigh, source) + dist(source, X)
+		for (i = 0; i < neighbours.size(); i++) {
+			if (neighbours[i] == x ||
+			    neigh_dist[i][x] == INT_MAX ||
+			    src_dist[neighbours[i]] == INT_MAX) {
 				continue;
 			}
 
-			// dist(neigh, target) < dist(neigh, source) + dist(source, target)
-			if (neigh_dist_map[*it] < src_dist_tree[neigh] + src_dist_tree[*it]) {
-				//LOG_DBG("Node %u is a possible LFA for destination %u",
-				//	neigh, *it);
-				extendRoutingTableEntry(rt, *it, neigh);
+			if ((long long) neigh_dist[i][x] <
+			    (long long) src_dist[neighbours[i]] + src_dist[x]) {
+				extendRoutingTableEntry(entries[x],
+							names[neighbours[i]]);
 			}
 		}
 	}
@@ -1133,6 +1908,7 @@ void FlowStateObjects::addCheckedObject(const FlowStateObject& object)
 	fso->set_neighboraddresses(object.neighbor_addresses);
 
 	objects[object.object_name] = fso;
+	journal(fso);
 	rina::rib::RIBObj* rib_obj = new FlowStateRIBObject(fso);
 	IPCPRIBDaemon* rib_daemon = (IPCPRIBDaemon*)IPCPFactory::getIPCP()->get_rib_daemon();
 	rib_daemon->addObjRIB(fso->object_name, &rib_obj);
@@ -1149,6 +1925,7 @@ void FlowStateObjects::deprecateObject(const std::string& fqn,
 	if(it != objects.end())
 	{
 		it->second->deprecateObject(max_age);
+		journal(it->second);
 	}
 }
 
@@ -1164,6 +1941,7 @@ void FlowStateObjects::deprecateObjects(const std::string& neigh_name,
 		if (it->second->neighbor_name == neigh_name &&
 				it->second->name == name) {
 			it->second->deprecateObject(max_age);
+			journal(it->second);
 			modified_ = true;
 		}
 	}
@@ -1183,6 +1961,7 @@ void FlowStateObjects::updateCost(const std::string& neigh_name,
 			it->second->cost = cost;
 			it->second->seq_num = it->second->seq_num + 1;
 			it->second->modified = true;
+			journal(it->second);
 			modified_ = true;
 		}
 	}
@@ -1200,10 +1979,12 @@ void FlowStateObjects::deprecateObjectsWithName(const std::string& name,
 			++it) {
 		if (!neighbor && it->second->name == name) {
 			it->second->deprecateObject(max_age);
+			journal(it->second);
 			modified_ = true;
 		} else if (neighbor && it->second->neighbor_name == name &&
 				it->second->name == my_name) {
 			it->second->deprecateObject(max_age);
+			journal(it->second);
 			modified_ = true;
 		}
 	}
@@ -1224,8 +2005,9 @@ void FlowStateObjects::removeObject(const std::string& fqn)
 	IPCPRIBDaemon* rib_daemon = (IPCPRIBDaemon*) IPCPFactory::getIPCP()->get_rib_daemon();
 	rib_daemon->removeObjRIB(it->second->object_name);
 
-	objects.erase(it);
+	journal(it->second);
 	delete it->second;
+	objects.erase(it);
 }
 
 FlowStateObject* FlowStateObjects::getObject(const std::string& fqn)
@@ -1259,6 +2041,41 @@ void FlowStateObjects::getModifiedFSOs(std::list<FlowStateObject *>& result)
 	}
 }
 
+// Called with the lock held
+void FlowStateObjects::journal(const FlowStateObject * object)
+{
+	changed_[object->object_name] =
+		std::make_pair(object->name, object->neighbor_name);
+}
+
+void FlowStateObjects::objectChanged(const FlowStateObject * object)
+{
+	rina::ScopedLock g(lock);
+
+	journal(object);
+}
+
+void FlowStateObjects::getChangedFSOs(std::list<FlowStateObject>& result)
+{
+	rina::ScopedLock g(lock);
+	std::map<std::string, std::pair<std::string, std::string> >::iterator it;
+	std::map<std::string, FlowStateObject*>::iterator jt;
+
+	for (it = changed_.begin(); it != changed_.end(); ++it) {
+		jt = objects.find(it->first);
+		if (jt != objects.end()) {
+			result.push_back(*(jt->second));
+		} else {
+			// Removed, the flow is as good as down
+			result.push_back(FlowStateObject(it->second.first,
+							 it->second.second,
+							 0, false, 0, 0));
+		}
+	}
+
+	changed_.clear();
+}
+
 void FlowStateObjects::getAllFSOs(std::list<FlowStateObject>& result)
 {
 	rina::ScopedLock g(lock);
@@ -1307,6 +2124,7 @@ void FlowStateObjects::updateObject(const std::string& fqn,
 	obj->state_up = true;
 	obj->seq_num = 1;
 	obj->modified = true;
+	journal(obj);
 }
 
 void FlowStateObjects::encodeAllFSOs(rina::ser_obj_t& obj)
@@ -1511,6 +2329,7 @@ void FlowStateManager::updateObjects(const std::list<FlowStateObject>& newObject
 				}
 
 				obj_to_up->modified = true;
+				fsos->objectChanged(obj_to_up);
 				fsos->has_modified(true);
 			}
 		}
@@ -1603,6 +2422,11 @@ void FlowStateManager::getAllFSOs(std::list<FlowStateObject>& list) const
 	fsos->getAllFSOs(list);
 }
 
+void FlowStateManager::getChangedFSOs(std::list<FlowStateObject>& list) const
+{
+	fsos->getChangedFSOs(list);
+}
+
 void FlowStateManager::getAllFSOsForPropagation(std::list< std::list<FlowStateObject> >& fsolist,
 						unsigned int max_objects)
 {
@@ -1738,6 +2562,9 @@ const std::string LinkStateRoutingPolicy::ROUTING_ALGORITHM = "routingAlgorithm"
 const int LinkStateRoutingPolicy::MAXIMUM_BUFFER_SIZE = 4096;
 const std::string LinkStateRoutingPolicy::DIJKSTRA_ALG = "Dijkstra";
 const std::string LinkStateRoutingPolicy::ECMP_DIJKSTRA_ALG = "ECMPDijkstra";
+const std::string LinkStateRoutingPolicy::INCREMENTAL_SPF_ALG = "IncrementalSPF";
+const std::string LinkStateRoutingPolicy::RESILIENCY_ALGORITHM = "resiliencyAlgorithm";
+const std::string LinkStateRoutingPolicy::LFA_ALG = "LFA";
 const std::string LinkStateRoutingPolicy::MAXIMUM_OBJECTS_PER_ROUTING_UPDATE = "maxObjectsPerUpdate";
 
 LinkStateRoutingPolicy::LinkStateRoutingPolicy(IPCProcess * ipcp)
@@ -1802,12 +2629,22 @@ void LinkStateRoutingPolicy::set_dif_configuration(
         } else if (routing_alg == ECMP_DIJKSTRA_ALG)  {
                 routing_algorithm_ = new ECMPDijkstraAlgorithm();
                 LOG_IPCP_DBG("Using ECMP Dijkstra as routing algorithm");
+        } else if (routing_alg == INCREMENTAL_SPF_ALG)  {
+                routing_algorithm_ = new IncrementalSPFAlgorithm();
+                LOG_IPCP_DBG("Using incremental SPF as routing algorithm");
         } else {
         	throw rina::Exception("Unsupported routing algorithm");
         }
-#if 0
-	resiliency_algorithm_ = new LoopFreeAlternateAlgorithm(*routing_algorithm_);
-#endif
+
+        try {
+                if (psconf.get_param_value_as_string(RESILIENCY_ALGORITHM) == LFA_ALG) {
+                        resiliency_algorithm_ =
+                                new LoopFreeAlternateAlgorithm(*routing_algorithm_);
+                        LOG_IPCP_DBG("Using LFA as resiliency algorithm");
+                }
+        } catch (rina::Exception &e) {
+                LOG_IPCP_DBG("No resiliency algorithm specified");
+        }
 
 
 	if (!test_) {
@@ -2117,26 +2954,29 @@ void LinkStateRoutingPolicy::printNhopTable(std::list<rina::RoutingTableEntry *>
 	}
 }
 
-void LinkStateRoutingPolicy::populateAddresses(std::list<rina::RoutingTableEntry *>& rt,
-		      	      	               const std::list<rinad::FlowStateObject>& fsos)
+void LinkStateRoutingPolicy::learnAddresses(const std::list<rinad::FlowStateObject>& fsos)
 {
-	std::map<std::string, std::list<unsigned int> > name_address_map;
 	std::list<rinad::FlowStateObject>::const_iterator it;
+
+	// The first FSO of each IPCP gives its addresses; removed FSOs come
+	// without any
+	for (it = fsos.begin(); it != fsos.end(); ++it) {
+		if (!it->addresses.empty())
+			name_addresses_.insert(std::make_pair(it->name,
+							      it->addresses));
+	}
+}
+
+void LinkStateRoutingPolicy::populateAddresses(std::list<rina::RoutingTableEntry *>& rt)
+{
 	std::map<std::string, std::list<unsigned int> >::iterator jt;
 	std::list<rina::RoutingTableEntry *>::iterator kt;
 	std::list<rina::NHopAltList>::iterator nt;
 	std::list<rina::IPCPNameAddresses>::iterator ot;
-	std::list<unsigned int> aux;
-
-	for (it = fsos.begin(); it != fsos.end(); ++it) {
-		jt = name_address_map.find(it->name);
-		if (jt == name_address_map.end())
-			name_address_map[it->name] = it->addresses;
-	}
 
 	for (kt = rt.begin(); kt != rt.end(); ++kt) {
-		jt = name_address_map.find((*kt)->destination.name);
-		if (jt == name_address_map.end()) {
+		jt = name_addresses_.find((*kt)->destination.name);
+		if (jt == name_addresses_.end()) {
 			LOG_IPCP_WARN("Could not find addresses for IPCP %s",
 				      (*kt)->destination.name.c_str());
 			continue;
@@ -2147,8 +2987,8 @@ void LinkStateRoutingPolicy::populateAddresses(std::list<rina::RoutingTableEntry
 				nt != (*kt)->nextHopNames.end(); ++nt) {
 
 			for (ot = nt->alts.begin(); ot != nt->alts.end(); ++ot) {
-				jt = name_address_map.find(ot->name);
-				if (jt == name_address_map.end()) {
+				jt = name_addresses_.find(ot->name);
+				if (jt == name_addresses_.end()) {
 					LOG_IPCP_WARN("Could not find addresses for IPCP %s",
 							ot->name.c_str());
 					continue;
@@ -2171,36 +3011,57 @@ void LinkStateRoutingPolicy::_routingTableUpdate()
 	std::list<rina::RoutingTableEntry *> rt;
 	std::string my_name = ipc_process_->get_name();
 	std::list<FlowStateObject> flow_state_objects;
+	std::list<FlowStateObject> changed_objects;
+	std::list<FlowStateObject>::iterator it;
 
 	if (!db_->tableUpdate()) {
 		return;
 	}
 
-	db_->getAllFSOs(flow_state_objects);
-
-	// Build a graph out of the FSO database
-	Graph graph(flow_state_objects);
-
-	// Invoke the routing algorithm to compute the routing table
-	// Main arguments are the graph and the source vertex.
-	// The list of FSOs may be useless, but has been left there
-	// for the moment (and it is currently unused by the Dijkstra
-	// algorithm).
-	routing_algorithm_->computeRoutingTable(graph,
-						flow_state_objects,
-						my_name,
-						rt);
-
-	// Run the resiliency algorithm, if any, to extend the routing table
-	if (resiliency_algorithm_) {
-		resiliency_algorithm_->fortifyRoutingTable(graph,
-							   my_name,
-							   rt);
+	db_->getChangedFSOs(changed_objects);
+
+	// Algorithms that keep their graph between runs only need what
+	// changed. The resiliency algorithm works on the whole graph.
+	if (resiliency_algorithm_ ||
+	    !routing_algorithm_->updateRoutingTable(changed_objects,
+						    my_name,
+						    rt)) {
+		db_->getAllFSOs(flow_state_objects);
+		name_addresses_.clear();
+		learnAddresses(flow_state_objects);
+
+		// Build a graph out of the FSO database
+		Graph graph(flow_state_objects);
+
+		// Invoke the routing algorithm to compute the routing table
+		// Main arguments are the graph and the source vertex.
+		// The list of FSOs may be useless, but has been left there
+		// for the moment (and it is currently unused by the Dijkstra
+		// algorithm).
+		routing_algorithm_->computeRoutingTable(graph,
+							flow_state_objects,
+							my_name,
+							rt);
+
+		// Run the resiliency algorithm, if any, to extend the routing
+		// table
+		if (resiliency_algorithm_) {
+			resiliency_algorithm_->fortifyRoutingTable(graph,
+								   my_name,
+								   rt);
+		}
+	} else {
+		// Changed FSOs carry the current addresses of their IPCP
+		for (it = changed_objects.begin();
+				it != changed_objects.end(); ++it) {
+			if (!it->addresses.empty())
+				name_addresses_.erase(it->name);
+		}
+		learnAddresses(changed_objects);
 	}
 
-
 	//Populate addresses (right now there are only names int he RT entries)
-	populateAddresses(rt, flow_state_objects);
+	populateAddresses(rt);
 
 	LOG_IPCP_DBG("Computed new Next Hop and PDU Forwarding Tables");
 	printNhopTable(rt);
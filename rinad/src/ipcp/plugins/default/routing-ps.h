@@ -23,7 +23,9 @@
 #ifndef IPCP_LINK_STATE_ROUTING_HH
 #define IPCP_LINK_STATE_ROUTING_HH
 
+#include <map>
 #include <set>
+#include <vector>
 #include <stdint.h>
 #include <librina/internal-events.h>
 #include <librina/timer.h>
@@ -140,6 +142,10 @@ private:
 	std::list<FlowStateObject> flow_state_objects_;
 	std::list<CheckedVertex *> checked_vertices_;
 
+	// Lookup indexes over vertices_ and checked_vertices_
+	std::set<std::string> vertex_index_;
+	std::map<std::string, CheckedVertex *> checked_index_;
+
 	void init_vertices();
 	CheckedVertex * get_checked_vertex(const std::string& name) const;
 	void init_edges();
@@ -161,6 +167,24 @@ public:
 	virtual void computeShortestDistances(const Graph& graph,
 					      const std::string& source_name,
 				              std::map<std::string, int>& distances) = 0;
+
+	//Get the distances from source_name found by the last call to
+	//computeRoutingTable(), if the algorithm keeps them. Returns false
+	//otherwise.
+	virtual bool getLastDistances(const std::string& source_name,
+				      std::map<std::string, int>& distances) {
+		return false;
+	};
+
+	//Compute the routing table again from the one of the last run, given
+	//the FSOs that changed since (removed ones come with state_up unset).
+	//Returns false if the algorithm cannot, so that the caller goes for
+	//computeRoutingTable().
+	virtual bool updateRoutingTable(const std::list<FlowStateObject>& changed,
+					const std::string& source_name,
+					std::list<rina::RoutingTableEntry *>& rt) {
+		return false;
+	};
 };
 
 /// Contains the information of a predecessor, needed by the Dijkstra Algorithm
@@ -185,11 +209,15 @@ public:
 	void computeShortestDistances(const Graph& graph,
 				      const std::string& source_name,
 				      std::map<std::string, int>& distances);
+	bool getLastDistances(const std::string& source_name,
+			      std::map<std::string, int>& distances);
 private:
 	std::set<std::string> settled_nodes_;
 	std::set<std::string> unsettled_nodes_;
 	std::map<std::string, PredecessorInfo *> predecessors_;
 	std::map<std::string, int> distances_;
+	std::string last_source_;
+	std::map<std::string, int> last_distances_;
 
 	void execute(const Graph& graph, const std::string& source);
 	std::string getMinimum() const;
@@ -239,6 +267,93 @@ private:
 	void clear();
 };
 
+/// Adjacency of an undirected graph whose vertices are dense integer ids,
+/// in compressed sparse row form: the neighbours of vertex v are
+/// to[start[v]] ... to[start[v] + degree[v] - 1], reached with the same
+/// weights. Rows have room for capacity[v] neighbours, and move to the end
+/// of the arrays when they need more, so edges and vertices can be added
+/// or removed without building the whole graph again.
+struct CSRGraph {
+	typedef std::pair<unsigned int, unsigned int> VertexPair;
+	/// Edges keyed by their endpoints, lowest id first
+	typedef std::map<VertexPair, int> EdgeMap;
+
+	std::vector<unsigned int> start;
+	std::vector<unsigned int> degree;
+	std::vector<unsigned int> capacity;
+	std::vector<unsigned int> to;
+	std::vector<int> weight;
+
+	CSRGraph();
+	unsigned int size() const;
+	void build(unsigned int num_vertices, const EdgeMap& edges);
+	void addVertex();
+	void setEdge(unsigned int a, unsigned int b, int w);
+	void removeEdge(unsigned int a, unsigned int b);
+
+private:
+	// Slots of the rows that moved, reclaimed by compact()
+	unsigned int unused_;
+
+	void setArc(unsigned int u, unsigned int v, int w);
+	void removeArc(unsigned int u, unsigned int v);
+	void moveRow(unsigned int u, unsigned int new_capacity);
+	void compact();
+};
+
+/// Shortest Path First over an integer-indexed copy of the graph, with a
+/// binary heap. The graph and the shortest path tree are kept between
+/// runs: updateRoutingTable() applies the FSOs that changed to them, and
+/// only recomputes the vertices whose paths may have changed (those
+/// hanging from tree edges that got worse, and those reachable through
+/// edges that got better).
+class IncrementalSPFAlgorithm : public IRoutingAlgorithm {
+public:
+	IncrementalSPFAlgorithm();
+	void computeRoutingTable(const Graph& graph,
+	 	 	    	 const std::list<FlowStateObject>& fsoList,
+				 const std::string& source_name,
+				 std::list<rina::RoutingTableEntry *>& rt);
+	void computeShortestDistances(const Graph& graph,
+				      const std::string& source_name,
+				      std::map<std::string, int>& distances);
+	bool getLastDistances(const std::string& source_name,
+			      std::map<std::string, int>& distances);
+	bool updateRoutingTable(const std::list<FlowStateObject>& changed,
+				const std::string& source_name,
+				std::list<rina::RoutingTableEntry *>& rt);
+
+	// Number of runs that went over the whole graph
+	unsigned int getFullRuns() const;
+
+private:
+	// Interned vertex names
+	std::map<std::string, unsigned int> ids_;
+	std::vector<std::string> names_;
+
+	// Flows up, from the FSOs, keyed by (name, neighbor_name)
+	CSRGraph::EdgeMap arcs_;
+
+	// The graph and the shortest path tree of the last run
+	CSRGraph::EdgeMap edges_;
+	CSRGraph csr_;
+	bool valid_;
+	unsigned int source_;
+	std::vector<int> dist_;
+	std::vector<int> parent_;
+	unsigned int full_runs_;
+
+	unsigned int intern(const std::string& name);
+	void buildEdges(const Graph& graph, CSRGraph::EdgeMap& edges);
+	bool applyFSO(const FlowStateObject& fso, CSRGraph::VertexPair& key);
+	int edgeWeight(unsigned int a, unsigned int b) const;
+	void updateTree(const std::vector<CSRGraph::VertexPair>& worse,
+			const std::vector<CSRGraph::VertexPair>& better);
+	void fullRun();
+	void fillRoutingTable(std::list<rina::RoutingTableEntry *>& rt);
+	void reset();
+};
+
 class IResiliencyAlgorithm {
 public:
 	IResiliencyAlgorithm(IRoutingAlgorithm& ra);
@@ -255,15 +370,28 @@ protected:
 	IRoutingAlgorithm& routing_algorithm;
 };
 
+/// Loop Free Alternates: a neighbour N of the source S is an alternate next
+/// hop towards D if dist(N, D) < dist(N, S) + dist(S, D). The distances from
+/// S are the ones the routing algorithm just computed, when it keeps them;
+/// the ones from every neighbour are computed over an integer-indexed copy
+/// of the graph, spread over up to num_threads threads (0 picks one per
+/// CPU).
 class LoopFreeAlternateAlgorithm : public IResiliencyAlgorithm {
 public:
-	LoopFreeAlternateAlgorithm(IRoutingAlgorithm& ra);
+	LoopFreeAlternateAlgorithm(IRoutingAlgorithm& ra,
+				   unsigned int num_threads = 0);
 	void fortifyRoutingTable(const Graph& graph,
 				 const std::string& source_name,
 				 std::list<rina::RoutingTableEntry *>& rt);
+
+	static const unsigned int MAX_THREADS = 8;
 private:
-	void extendRoutingTableEntry(std::list<rina::RoutingTableEntry *>& rt,
-				     const std::string& target_name,
+	unsigned int num_threads_;
+
+	void computeNeighbourDistances(const CSRGraph& graph,
+				       const std::vector<unsigned int>& roots,
+				       std::vector<std::vector<int> >& dists);
+	void extendRoutingTableEntry(rina::RoutingTableEntry * entry,
 				     const std::string& nexthop);
 };
 
@@ -391,6 +519,8 @@ public:
 	FlowStateObject * getObject(const std::string& fqn);
 	void getModifiedFSOs(std::list<FlowStateObject *>& result);
 	void getAllFSOs(std::list<FlowStateObject>& result);
+	void getChangedFSOs(std::list<FlowStateObject>& result);
+	void objectChanged(const FlowStateObject * object);
 	void incrementAge(unsigned int max_age,
 			  rina::Timer* timer);
 	void updateObject(const std::string& fqn, 
@@ -405,9 +535,13 @@ public:
 
 private:
 	void addCheckedObject(const FlowStateObject& object);
+	void journal(const FlowStateObject * object);
 	std::map<std::string,FlowStateObject*> objects;
 	//Signals a modification in the FlowStateDB
 	bool modified_;
+	//The FSOs whose state or cost changed since the last call to
+	//getChangedFSOs(), with their endpoints in case they are removed
+	std::map<std::string, std::pair<std::string, std::string> > changed_;
 	LinkStateRoutingPolicy * ps_;
 	unsigned int wait_until_remove_object;
 	rina::Lockable lock;
@@ -494,6 +628,7 @@ public:
 				   unsigned int max_objects) const;
 	void encodeAllFSOs(rina::ser_obj_t& obj) const;
 	void getAllFSOs(std::list<FlowStateObject>& list) const;
+	void getChangedFSOs(std::list<FlowStateObject>& list) const;
 	bool tableUpdate() const;
 	void removeObject(const std::string& fqn);
 	void getAllFSOsForPropagation(std::list< std::list<FlowStateObject> >& fsos,
@@ -617,6 +752,9 @@ public:
         static const unsigned int MAX_OBJECTS_PER_ROUTING_UPDATE_DEFAULT = 15;
         static const std::string DIJKSTRA_ALG;
         static const std::string ECMP_DIJKSTRA_ALG;
+        static const std::string INCREMENTAL_SPF_ALG;
+        static const std::string RESILIENCY_ALGORITHM;
+        static const std::string LFA_ALG;
 
 	LinkStateRoutingPolicy(IPCProcess * ipcp);
 	~LinkStateRoutingPolicy();
@@ -676,6 +814,9 @@ private:
 	bool test_;
 	FlowStateManager *db_;
 	rina::Lockable lock_;
+	// Addresses of each IPCP name, from the FSOs seen by the last
+	// routing table updates
+	std::map<std::string, std::list<unsigned int> > name_addresses_;
 
 	void subscribeToEvents();
 
@@ -716,8 +857,9 @@ private:
 
 	void printNhopTable(std::list<rina::RoutingTableEntry *>& rt);
 
-	void populateAddresses(std::list<rina::RoutingTableEntry *>& rt,
-			       const std::list<FlowStateObject>& fsos);
+	void learnAddresses(const std::list<FlowStateObject>& fsos);
+
+	void populateAddresses(std::list<rina::RoutingTableEntry *>& rt);
 
 	void _routingTableUpdate();
 };
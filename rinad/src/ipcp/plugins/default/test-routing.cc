@@ -21,6 +21,8 @@
 //
 
 #include <iostream>
+#include <set>
+#include <sstream>
 
 #define IPCP_MODULE "lsr-tests"
 #include "../../ipcp-logging.h"
@@ -1120,6 +1122,241 @@ int test_mp_dijkstra() {
 	return result;
 }
 
+static void addLink(std::list<rinad::FlowStateObject>& objects,
+		    const std::string& a,
+		    const std::string& b,
+		    unsigned int cost,
+		    bool up)
+{
+	objects.push_back(rinad::FlowStateObject(a, b, cost, up, 1, 1));
+	objects.push_back(rinad::FlowStateObject(b, a, cost, up, 1, 1));
+}
+
+static std::string nodeName(int i)
+{
+	std::stringstream ss;
+
+	ss << "n" << i;
+	return ss.str();
+}
+
+// Checks that every entry of rtable leads through a shortest path, and that
+// all the reachable destinations are there
+static int checkShortestPaths(const rinad::Graph& graph,
+			      const std::string& source,
+			      std::list<rina::RoutingTableEntry *>& rtable)
+{
+	rinad::DijkstraAlgorithm dijkstra;
+	std::map<std::string, int> src_dist, nh_dist;
+	std::string nhop;
+
+	dijkstra.computeShortestDistances(graph, source, src_dist);
+	if (rtable.size() + 1 != src_dist.size()) {
+		return -1;
+	}
+
+	for (std::list<rina::RoutingTableEntry *>::iterator
+			rit = rtable.begin(); rit != rtable.end(); rit++) {
+		const std::string& dest = (*rit)->destination.name;
+
+		nhop = (*rit)->nextHopNames.front().alts.front().name;
+		if (!graph.contains_edge(source, nhop)) {
+			return -1;
+		}
+
+		nh_dist.clear();
+		dijkstra.computeShortestDistances(graph, nhop, nh_dist);
+		if (src_dist[dest] != src_dist[nhop] + nh_dist[dest]) {
+			LOG_IPCP_ERR("Next hop %s towards %s is not on a shortest path",
+				     nhop.c_str(), dest.c_str());
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int getRoutingTable_IncrementalSPFChanges_True() {
+	const int N = 40;
+	std::vector<unsigned int> costs(2 * N);
+	std::vector<bool> up(2 * N, true);
+	rinad::IncrementalSPFAlgorithm * routingAlgorithm;
+	std::list<rinad::FlowStateObject> changed;
+	int result = 0;
+
+	routingAlgorithm = new rinad::IncrementalSPFAlgorithm();
+
+	// A ring with chords, links 0..N-1 in the ring and N..2N-1 chords
+	for (int i = 0; i < 2 * N; i++) {
+		costs[i] = 1 + (i * 13) % 5;
+	}
+
+	for (int round = 0; round < 20 && result == 0; round++) {
+		std::list<rinad::FlowStateObject> objects;
+		std::list<rina::RoutingTableEntry *> rtable;
+		std::set<int> links;
+
+		// A few links change in each round, some go down and up
+		if (round > 0) {
+			links.insert((round * 7) % (2 * N));
+			costs[(round * 7) % (2 * N)] = 1 + (round * 3) % 6;
+			links.insert((round * 11) % (2 * N));
+			costs[(round * 11) % (2 * N)] += 2;
+			links.insert((round * 5) % (2 * N));
+			up[(round * 5) % (2 * N)] = !up[(round * 5) % (2 * N)];
+		}
+
+		for (int i = 0; i < N; i++) {
+			addLink(objects, nodeName(i), nodeName((i + 1) % N),
+				costs[i], up[i]);
+			addLink(objects, nodeName(i), nodeName((i + 7) % N),
+				costs[N + i], up[N + i]);
+		}
+
+		// Somebody new joins half way, through a single link
+		if (round >= 10) {
+			addLink(objects, nodeName(3), nodeName(N), 2, true);
+		}
+
+		// The changes only, as the FSO database would report them
+		changed.clear();
+		for (std::set<int>::iterator lit = links.begin();
+				lit != links.end(); ++lit) {
+			int i = *lit % N;
+			int j = *lit < N ? (i + 1) % N : (i + 7) % N;
+
+			addLink(changed, nodeName(i), nodeName(j),
+				costs[*lit], up[*lit]);
+		}
+		if (round == 10) {
+			addLink(changed, nodeName(3), nodeName(N), 2, true);
+		}
+
+		rinad::Graph graph(objects);
+
+		if (round == 0) {
+			routingAlgorithm->computeRoutingTable(graph, objects,
+							      nodeName(0),
+							      rtable);
+		} else if (!routingAlgorithm->updateRoutingTable(changed,
+								  nodeName(0),
+								  rtable)) {
+			LOG_IPCP_ERR("Incremental update refused in round %d",
+				     round);
+			result = -1;
+		}
+
+		if (result == 0) {
+			result = checkShortestPaths(graph, nodeName(0), rtable);
+		}
+
+		for (std::list<rina::RoutingTableEntry *>::iterator
+				rit = rtable.begin(); rit != rtable.end(); rit++) {
+			delete *rit;
+		}
+	}
+
+	// Only the first run went over the whole graph
+	if (result == 0 && routingAlgorithm->getFullRuns() != 1) {
+		LOG_IPCP_ERR("Expected 1 full SPF run, got %u",
+			     routingAlgorithm->getFullRuns());
+		result = -1;
+	}
+
+	delete routingAlgorithm;
+	return result;
+}
+
+// Checks the alternates added by LFA on a ring with chords against the
+// definition, with the distances computed by plain Dijkstra
+int fortifyRoutingTable_LFAAlternates_True(unsigned int num_threads) {
+	const int N = 30;
+	std::list<rinad::FlowStateObject> objects;
+	std::list<rina::RoutingTableEntry *> rtable;
+	std::map<std::string, std::map<std::string, int> > dist;
+	rinad::IncrementalSPFAlgorithm spf;
+	rinad::DijkstraAlgorithm dijkstra;
+	std::string source = nodeName(0);
+	int result = 0;
+
+	for (int i = 0; i < N; i++) {
+		addLink(objects, nodeName(i), nodeName((i + 1) % N),
+			1 + (i * 7) % 4, true);
+		addLink(objects, nodeName(i), nodeName((i + 5) % N),
+			2 + (i * 3) % 5, true);
+	}
+
+	rinad::Graph graph(objects);
+	rinad::LoopFreeAlternateAlgorithm lfa(spf, num_threads);
+
+	spf.computeRoutingTable(graph, objects, source, rtable);
+	lfa.fortifyRoutingTable(graph, source, rtable);
+
+	for (int i = 0; i < N; i++) {
+		dijkstra.computeShortestDistances(graph, nodeName(i),
+						  dist[nodeName(i)]);
+	}
+
+	for (std::list<rina::RoutingTableEntry *>::iterator
+			rit = rtable.begin(); rit != rtable.end(); rit++) {
+		const std::string& dest = (*rit)->destination.name;
+		const std::list<rina::IPCPNameAddresses>& alts =
+			(*rit)->nextHopNames.front().alts;
+		std::set<std::string> expected, got;
+
+		expected.insert(alts.front().name);
+		for (int i = 1; i < N; i++) {
+			std::string n = nodeName(i);
+
+			if (n != dest && graph.contains_edge(source, n) &&
+			    dist[n][dest] < dist[source][n] + dist[source][dest])
+				expected.insert(n);
+		}
+
+		for (std::list<rina::IPCPNameAddresses>::const_iterator
+				ait = alts.begin(); ait != alts.end(); ait++) {
+			got.insert(ait->name);
+		}
+
+		if (got != expected || got.size() != alts.size()) {
+			LOG_IPCP_ERR("Wrong LFA alternates towards %s",
+				     dest.c_str());
+			result = -1;
+		}
+
+		delete *rit;
+	}
+
+	return result;
+}
+
+int test_incremental_spf() {
+	int result = 0;
+
+	result = getRoutingTable_IncrementalSPFChanges_True();
+	if (result < 0) {
+		LOG_IPCP_ERR("getRoutingTable_IncrementalSPFChanges_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("getRoutingTable_IncrementalSPFChanges_True test passed");
+
+	result = fortifyRoutingTable_LFAAlternates_True(1);
+	if (result < 0) {
+		LOG_IPCP_ERR("fortifyRoutingTable_LFAAlternates_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("fortifyRoutingTable_LFAAlternates_True test passed");
+
+	result = fortifyRoutingTable_LFAAlternates_True(4);
+	if (result < 0) {
+		LOG_IPCP_ERR("fortifyRoutingTable_LFAAlternatesThreads_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("fortifyRoutingTable_LFAAlternatesThreads_True test passed");
+
+	return result;
+}
+
 int main()
 {
 	int result = 0;
@@ -1151,5 +1388,12 @@ int main()
 		return result;
 	}
 	LOG_IPCP_INFO("test_mp_dijkstra tests passed");
+
+	result = test_incremental_spf();
+	if (result < 0) {
+		LOG_IPCP_ERR("test_incremental_spf tests failed");
+		return result;
+	}
+	LOG_IPCP_INFO("test_incremental_spf tests passed");
 	return 0;
 }
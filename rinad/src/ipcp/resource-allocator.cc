@@ -434,6 +434,7 @@ ResourceAllocator::ResourceAllocator() : IResourceAllocator() {
 	n_minus_one_flow_manager_ = new NMinusOneFlowManager();
 	ipcp = 0;
 	rib_daemon_ = 0;
+	kernel_pft_synced = false;
 }
 
 ResourceAllocator::~ResourceAllocator() {
@@ -650,92 +651,327 @@ void ResourceAllocator::addQoSCube(const rina::QoSCube& cube)
 	cubes.push_back(qos_cube);
 }
 
-std::list<rina::PDUForwardingTableEntry> ResourceAllocator::get_pduft_entries()
+static bool same_entry(const rina::PDUForwardingTableEntry& a,
+		       const rina::PDUForwardingTableEntry& b)
 {
-	std::list<rina::PDUForwardingTableEntry> result;
-	std::map<std::string, rina::PDUForwardingTableEntry *>::iterator it;
+	std::list<rina::PortIdAltlist>::const_iterator it, jt;
 
-	rina::ReadScopedLock g(pduft_lock);
+	if (a.address != b.address || a.qosId != b.qosId || a.cost != b.cost ||
+			a.portIdAltlists.size() != b.portIdAltlists.size())
+		return false;
 
-	for (it = pduft.begin(); it != pduft.end(); ++it) {
-		result.push_back(*(it->second));
+	for (it = a.portIdAltlists.begin(), jt = b.portIdAltlists.begin();
+			it != a.portIdAltlists.end(); ++it, ++jt) {
+		if (it->alts != jt->alts)
+			return false;
 	}
 
-	return result;
+	return true;
 }
 
-/// This operation takes ownership of the entries
-void ResourceAllocator::set_pduft_entries(const std::list<rina::PDUForwardingTableEntry*>& pduft_entries)
+static bool same_entry(const rina::RoutingTableEntry& a,
+		       const rina::RoutingTableEntry& b)
 {
-	rina::PDUForwardingTableEntry * pdufte;
-	std::map<std::string, rina::PDUForwardingTableEntry *>::iterator it;
-	std::list<rina::PDUForwardingTableEntry*>::const_iterator it2;
+	std::list<rina::NHopAltList>::const_iterator it, jt;
+	std::list<rina::IPCPNameAddresses>::const_iterator kt, lt;
+
+	if (a.qosId != b.qosId || a.cost != b.cost ||
+			a.destination.name != b.destination.name ||
+			a.destination.addresses != b.destination.addresses ||
+			a.nextHopNames.size() != b.nextHopNames.size())
+		return false;
+
+	for (it = a.nextHopNames.begin(), jt = b.nextHopNames.begin();
+			it != a.nextHopNames.end(); ++it, ++jt) {
+		if (it->alts.size() != jt->alts.size())
+			return false;
+
+		for (kt = it->alts.begin(), lt = jt->alts.begin();
+				kt != it->alts.end(); ++kt, ++lt) {
+			if (kt->name != lt->name || kt->addresses != lt->addresses)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/// Replace the contents of table with entries, touching only the RIB objects
+/// of the entries that were added, removed or changed. Takes ownership of
+/// the entries; the ones equal to an existing entry are freed and the
+/// existing entry (and RIB object) is kept. A changed entry whose RIB object
+/// cannot be added is freed too, and the old one stays in the table.
+template<class Entry, class EntryRIBObj>
+static void update_table(IPCPRIBDaemon * rib_daemon,
+			 std::map<std::string, Entry *>& table,
+			 const std::list<Entry *>& entries,
+			 const char * table_name)
+{
+	typename std::map<std::string, Entry *>::iterator it, jt;
+	typename std::list<Entry *>::const_iterator lt;
+	std::map<std::string, Entry *> next;
 	rina::rib::RIBObj * ribObj;
 	std::string obj_name;
 	std::stringstream ss;
+	int added = 0;
+	int removed = 0;
+	int changed = 0;
 
-	rina::WriteScopedLock g(pduft_lock);
+	for (lt = entries.begin(); lt != entries.end(); ++lt) {
+		ss << EntryRIBObj::object_name_prefix;
+		ss << (*lt)->getKey();
+		obj_name = ss.str();
+		ss.str(std::string());
+		ss.clear();
+
+		if (!next.insert(std::make_pair(obj_name, *lt)).second) {
+			LOG_IPCP_WARN("Duplicated %s entry %s, ignoring it",
+				      table_name, obj_name.c_str());
+			delete *lt;
+		}
+	}
+
+	//1 Scrap the entries that are gone, replace the ones that have changed
+	for (it = table.begin(); it != table.end(); ++it) {
+		jt = next.find(it->first);
+		if (jt != next.end() && same_entry(*it->second, *jt->second)) {
+			delete jt->second;
+			jt->second = it->second;
+			continue;
+		}
 
-	//1 Scrap the old entries
-	for (it = pduft.begin(); it != pduft.end(); ++it) {
 		try {
-			rib_daemon_->removeObjRIB(it->first);
+			rib_daemon->removeObjRIB(it->first);
 		} catch (rina::Exception &e) {
 			LOG_WARN("Problems removing RIB obj: %s", e.what());
 		}
 
-		pdufte = it->second;
-		delete pdufte;
-		pdufte = 0;
-	}
+		if (jt == next.end()) {
+			delete it->second;
+			it->second = 0;
+			removed++;
+			continue;
+		}
 
-	pduft.clear();
+		ribObj = 0;
+		try {
+			ribObj = new EntryRIBObj(jt->second);
+			rib_daemon->addObjRIB(jt->first, &ribObj);
+		} catch (rina::Exception &e) {
+			LOG_WARN("Problems adding RIB obj, keeping the old one: %s",
+				 e.what());
+			delete ribObj;
+			delete jt->second;
+			jt->second = it->second;
+
+			ribObj = 0;
+			try {
+				ribObj = new EntryRIBObj(it->second);
+				rib_daemon->addObjRIB(it->first, &ribObj);
+			} catch (rina::Exception &e) {
+				LOG_WARN("Problems restoring RIB obj: %s", e.what());
+				delete ribObj;
+			}
+			continue;
+		}
 
-	//2 Add the new entries
-	for (it2 = pduft_entries.begin();
-			it2 != pduft_entries.end(); ++it2) {
-		ss << PDUFTEntryRIBObj::object_name_prefix;
-		ss << (*it2)->getKey();
-		obj_name = ss.str();
-		ss.str(std::string());
-		ss.clear();
+		delete it->second;
+		it->second = 0;
+		changed++;
+	}
+
+	//2 Add the new ones
+	for (jt = next.begin(); jt != next.end();) {
+		if (table.find(jt->first) != table.end()) {
+			++jt;
+			continue;
+		}
 
+		ribObj = 0;
 		try {
-			ribObj = new PDUFTEntryRIBObj(*it2);
-			rib_daemon_->addObjRIB(obj_name, &ribObj);
+			ribObj = new EntryRIBObj(jt->second);
+			rib_daemon->addObjRIB(jt->first, &ribObj);
 		} catch (rina::Exception &e) {
-			//LOG_WARN("Problems adding RIB obj: %s", e.what());
+			LOG_WARN("Problems adding RIB obj: %s", e.what());
+			delete ribObj;
+			delete jt->second;
+			next.erase(jt++);
 			continue;
 		}
 
-		pduft[obj_name] = *it2;
+		added++;
+		++jt;
 	}
 
-	//3 Update temp entries
-	update_temp_entries();
+	table.swap(next);
+
+	LOG_IPCP_DBG("Updated %s: %d entries added, %d removed, %d changed",
+		     table_name, added, removed, changed);
 }
 
-void ResourceAllocator::update_temp_entries()
+static void add_to_kernel_pft(std::map<std::pair<unsigned int, unsigned int>,
+				       std::set<unsigned int> >& kpft,
+			      const rina::PDUForwardingTableEntry& entry)
 {
-	std::list<rina::PDUForwardingTableEntry*>::iterator it;
-	std::list<rina::PDUForwardingTableEntry*> to_add;
+	std::list<rina::PortIdAltlist>::const_iterator it;
+	std::set<unsigned int>& ports =
+		kpft[std::make_pair(entry.address, entry.qosId)];
+
+	for (it = entry.portIdAltlists.begin();
+			it != entry.portIdAltlists.end(); ++it) {
+		if (it->alts.size())
+			ports.insert(it->alts.front());
+	}
+}
+
+static rina::PDUForwardingTableEntry * kernel_pft_entry(unsigned int address,
+							unsigned int qos_id,
+							const std::set<unsigned int>& ports)
+{
+	rina::PDUForwardingTableEntry * entry;
+	std::set<unsigned int>::const_iterator it;
+
+	entry = new rina::PDUForwardingTableEntry();
+	entry->address = address;
+	entry->qosId = qos_id;
+	for (it = ports.begin(); it != ports.end(); ++it)
+		entry->portIdAltlists.push_back(rina::PortIdAltlist(*it));
+
+	return entry;
+}
 
-	for(it = temp_entries.begin(); it != temp_entries.end(); ++it) {
-		if (!entry_is_in_pduft((*it)->address)) {
-			to_add.push_back(*it);
+void ResourceAllocator::push_kernel_pft(const std::list<rina::PDUForwardingTableEntry *>& entries,
+					int mode)
+{
+	rina::kernelIPCProcess->modifyPDUForwardingTableEntries(entries, mode);
+}
+
+void ResourceAllocator::modify_kernel_pft(std::list<rina::PDUForwardingTableEntry *>& entries,
+					  int mode)
+{
+	std::list<rina::PDUForwardingTableEntry *>::iterator it;
+
+	if (entries.size()) {
+		try {
+			push_kernel_pft(entries, mode);
+		} catch (rina::Exception & e) {
+			for (it = entries.begin(); it != entries.end(); ++it)
+				delete *it;
+			entries.clear();
+			throw;
 		}
 	}
 
-	if (to_add.size() == 0) {
+	for (it = entries.begin(); it != entries.end(); ++it)
+		delete *it;
+	entries.clear();
+}
+
+std::list<rina::PDUForwardingTableEntry> ResourceAllocator::get_pduft_entries()
+{
+	std::list<rina::PDUForwardingTableEntry> result;
+	std::map<std::string, rina::PDUForwardingTableEntry *>::iterator it;
+
+	rina::ReadScopedLock g(pduft_lock);
+
+	for (it = pduft.begin(); it != pduft.end(); ++it) {
+		result.push_back(*(it->second));
+	}
+
+	return result;
+}
+
+/// This operation takes ownership of the entries
+void ResourceAllocator::set_pduft_entries(const std::list<rina::PDUForwardingTableEntry*>& pduft_entries)
+{
+	rina::WriteScopedLock g(pduft_lock);
+
+	update_table<rina::PDUForwardingTableEntry, PDUFTEntryRIBObj>(rib_daemon_,
+			pduft, pduft_entries, "PDU forwarding table");
+	update_kernel_pft();
+}
+
+void ResourceAllocator::update_kernel_pft()
+{
+	std::map<std::string, rina::PDUForwardingTableEntry *>::iterator it;
+	std::list<rina::PDUForwardingTableEntry*>::iterator lt;
+	std::list<rina::PDUForwardingTableEntry*> to_add;
+	std::list<rina::PDUForwardingTableEntry*> to_remove;
+	std::set<unsigned int> ports;
+	std::set<unsigned int>::iterator pt;
+	KernelPFT::iterator kt, nt;
+	KernelPFT next;
+
+	for (it = pduft.begin(); it != pduft.end(); ++it)
+		add_to_kernel_pft(next, *it->second);
+
+	for (lt = temp_entries.begin(); lt != temp_entries.end(); ++lt) {
+		if (!entry_is_in_pduft((*lt)->address))
+			add_to_kernel_pft(next, **lt);
+	}
+
+	if (!kernel_pft_synced) {
+		// Nothing known about the kernel PFF yet, replace all of it
+		for (nt = next.begin(); nt != next.end(); ++nt)
+			to_add.push_back(kernel_pft_entry(nt->first.first,
+							  nt->first.second,
+							  nt->second));
+		try {
+			modify_kernel_pft(to_add, 2);
+		} catch (rina::Exception & e) {
+			LOG_IPCP_ERR("Error setting PDU Forwarding Table in the kernel: %s",
+				     e.what());
+			return;
+		}
+
+		kernel_pft.swap(next);
+		kernel_pft_synced = true;
 		return;
 	}
 
+	// New ports are added before the stale ones are removed, so that a
+	// destination whose next hop changes is reachable all the time
+	for (nt = next.begin(); nt != next.end(); ++nt) {
+		kt = kernel_pft.find(nt->first);
+		ports.clear();
+		for (pt = nt->second.begin(); pt != nt->second.end(); ++pt) {
+			if (kt == kernel_pft.end() || !kt->second.count(*pt))
+				ports.insert(*pt);
+		}
+		if (ports.size())
+			to_add.push_back(kernel_pft_entry(nt->first.first,
+							  nt->first.second,
+							  ports));
+	}
+
+	for (kt = kernel_pft.begin(); kt != kernel_pft.end(); ++kt) {
+		nt = next.find(kt->first);
+		ports.clear();
+		for (pt = kt->second.begin(); pt != kt->second.end(); ++pt) {
+			if (nt == next.end() || !nt->second.count(*pt))
+				ports.insert(*pt);
+		}
+		if (ports.size())
+			to_remove.push_back(kernel_pft_entry(kt->first.first,
+							     kt->first.second,
+							     ports));
+	}
+
+	LOG_IPCP_DBG("Updating kernel PDU Forwarding Table: %d entries added, %d removed",
+		     (int) to_add.size(), (int) to_remove.size());
+
 	try {
-		rina::kernelIPCProcess->modifyPDUForwardingTableEntries(to_add, 0);
+		modify_kernel_pft(to_add, 0);
+		modify_kernel_pft(to_remove, 1);
 	} catch (rina::Exception & e) {
-		LOG_IPCP_ERR("Error adding entries to PDU Forwarding Table in the kernel: %s",
-				e.what());
+		LOG_IPCP_ERR("Error updating PDU Forwarding Table in the kernel: %s",
+			     e.what());
+		// Resynchronize the whole table next time
+		kernel_pft_synced = false;
+		return;
 	}
+
+	kernel_pft.swap(next);
 }
 
 std::list<rina::RoutingTableEntry> ResourceAllocator::get_rt_entries()
@@ -752,51 +988,13 @@ std::list<rina::RoutingTableEntry> ResourceAllocator::get_rt_entries()
 	return result;
 }
 
+/// This operation takes ownership of the entries
 void ResourceAllocator::set_rt_entries(const std::list<rina::RoutingTableEntry*>& rt_entries)
 {
-	rina::RoutingTableEntry * rte;
-	std::map<std::string, rina::RoutingTableEntry *>::iterator it;
-	std::list<rina::RoutingTableEntry*>::const_iterator it2;
-	rina::rib::RIBObj * ribObj;
-	std::string obj_name;
-	std::stringstream ss;
-
 	rina::WriteScopedLock g(rt_lock);
 
-	//1 Scrap the old entries
-	for (it = rt.begin(); it != rt.end(); ++it) {
-		try {
-			rib_daemon_->removeObjRIB(it->first);
-		} catch (rina::Exception &e) {
-			LOG_WARN("Problems removing RIB obj: %s", e.what());
-		}
-
-		rte = it->second;
-		delete rte;
-		rte = 0;
-	}
-
-	rt.clear();
-
-	//2 Add the new entries
-	for (it2 = rt_entries.begin();
-			it2 != rt_entries.end(); ++it2) {
-		ss << NextHopTEntryRIBObj::object_name_prefix;
-		ss << (*it2)->getKey();
-		obj_name = ss.str();
-		ss.str(std::string());
-		ss.clear();
-
-		try {
-			ribObj = new NextHopTEntryRIBObj(*it2);
-			rib_daemon_->addObjRIB(obj_name, &ribObj);
-		} catch (rina::Exception &e) {
-			LOG_WARN("Problems adding RIB obj: %s", e.what());
-			continue;
-		}
-
-		rt[obj_name] = *it2;
-	}
+	update_table<rina::RoutingTableEntry, NextHopTEntryRIBObj>(rib_daemon_,
+			rt, rt_entries, "routing table");
 }
 
 int ResourceAllocator::get_next_hop_addresses(unsigned int dest_address,
@@ -900,11 +1098,14 @@ void ResourceAllocator::add_temp_pduft_entry(unsigned int dest_address, int port
 	temp_entries.push_back(entry);
 
 	try {
-		rina::kernelIPCProcess->modifyPDUForwardingTableEntries(to_add, 0);
+		push_kernel_pft(to_add, 0);
 	} catch (rina::Exception & e) {
 		LOG_IPCP_ERR("Error adding entry to PDU Forwarding Table in the kernel: %s",
 				e.what());
+		return;
 	}
+
+	kernel_pft[std::make_pair(entry->address, entry->qosId)].insert(port_id);
 }
 
 void ResourceAllocator::remove_temp_pduft_entry(unsigned int dest_address)
@@ -23,6 +23,8 @@
 #ifndef IPCP_RESOURCE_ALLOCATOR_HH
 #define IPCP_RESOURCE_ALLOCATOR_HH
 
+#include <set>
+
 #include "ipcp/components.h"
 
 namespace rinad {
@@ -234,6 +236,14 @@ public:
 
 	void sync_with_kernel();
 
+protected:
+	/// Send entries to the kernel PFF; mode 0 adds them, 1 removes them
+	/// and 2 replaces the whole table
+	virtual void push_kernel_pft(const std::list<rina::PDUForwardingTableEntry*>& entries,
+				     int mode);
+
+	IPCPRIBDaemon * rib_daemon_;
+
 private:
 	/// Create initial RIB objects
 	void populateRIB();
@@ -248,18 +258,34 @@ private:
 	// @param portId
 	void nMinusOneFlowAllocated(rina::NMinusOneFlowAllocatedEvent * flowEvent);
 
+	/// Ports used by the kernel PFF for each (address, qos-id) pair. The
+	/// kernel only honours the first alternative of each port-id list.
+	typedef std::map<std::pair<unsigned int, unsigned int>,
+			 std::set<unsigned int> > KernelPFT;
+
 	bool contains_temp_entry(unsigned int dest_address);
 	bool entry_is_in_pduft(unsigned int dest_address);
-	void update_temp_entries(void);
+
+	/// Bring the kernel PFF in line with the PDU forwarding table plus
+	/// the temp entries, sending only the entries that changed since the
+	/// last update. Must be called with pduft_lock held for writing.
+	void update_kernel_pft(void);
+
+	/// Push entries to the kernel PFF and free them, also on error
+	void modify_kernel_pft(std::list<rina::PDUForwardingTableEntry*>& entries,
+			       int mode);
 
 	INMinusOneFlowManager * n_minus_one_flow_manager_;
-	IPCPRIBDaemon * rib_daemon_;
 	rina::Lockable lock;
 
 	std::list<rina::PDUForwardingTableEntry*> temp_entries;
 	std::map<std::string, rina::PDUForwardingTableEntry *> pduft;
 	rina::ReadWriteLockable pduft_lock;
 
+	/// What has been pushed to the kernel PFF, protected by pduft_lock
+	KernelPFT kernel_pft;
+	bool kernel_pft_synced;
+
 	std::map<std::string, rina::RoutingTableEntry *> rt;
 	rina::ReadWriteLockable rt_lock;
 
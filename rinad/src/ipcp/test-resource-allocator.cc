@@ -0,0 +1,439 @@
+//
+// test-resource-allocator
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+// MA  02110-1301  USA
+//
+
+#include <list>
+#include <map>
+#include <set>
+#include <sstream>
+
+#define IPCP_MODULE "resource-allocator-tests"
+
+#include "ipcp-logging.h"
+
+#include "ipcp/resource-allocator.h"
+
+int ipcp_id = 1;
+
+/// Keeps the RIB objects in a map; adding a name in "failing" throws once
+class FakeRIBDaemon: public rinad::IPCPRIBDaemon {
+public:
+	FakeRIBDaemon() : handle(1), next_id(1) { };
+	~FakeRIBDaemon() {
+		std::map<std::string, rina::rib::RIBObj *>::iterator it;
+
+		for (it = objs.begin(); it != objs.end(); ++it)
+			delete it->second;
+	}
+	rina::rib::RIBDaemonProxy * getProxy() {
+		return 0;
+	}
+	void set_dif_configuration(const rina::DIFInformation& dif_information) {
+	}
+	void processQueryRIBRequestEvent(const rina::QueryRIBRequestEvent& event) {
+	}
+	const rina::rib::rib_handle_t & get_rib_handle() {
+		return handle;
+	}
+	int64_t addObjRIB(const std::string& fqn, rina::rib::RIBObj** obj) {
+		if (failing.erase(fqn) || objs.count(fqn))
+			throw rina::Exception("Cannot add object");
+
+		objs[fqn] = *obj;
+		return next_id++;
+	}
+	void removeObjRIB(const std::string& fqn) {
+		std::map<std::string, rina::rib::RIBObj *>::iterator it;
+
+		it = objs.find(fqn);
+		if (it == objs.end())
+			throw rina::Exception("No such object");
+
+		delete it->second;
+		objs.erase(it);
+	}
+	void processReadManagementSDUEvent(rina::ReadMgmtSDUResponseEvent& event) {
+	}
+
+	std::map<std::string, rina::rib::RIBObj *> objs;
+	std::set<std::string> failing;
+
+private:
+	rina::rib::rib_handle_t handle;
+	int64_t next_id;
+};
+
+struct KernelCall {
+	int mode;
+	std::string entries;
+};
+
+/// Records what would be sent to the kernel PFF instead of sending it
+class FakeResourceAllocator: public rinad::ResourceAllocator {
+public:
+	FakeResourceAllocator(FakeRIBDaemon * rib) : fail(false) {
+		rib_daemon_ = rib;
+	}
+	void push_kernel_pft(const std::list<rina::PDUForwardingTableEntry*>& entries,
+			     int mode) {
+		std::list<rina::PDUForwardingTableEntry*>::const_iterator it;
+		std::list<rina::PortIdAltlist>::const_iterator pt;
+		KernelCall call;
+		std::stringstream ss;
+
+		if (fail) {
+			fail = false;
+			throw rina::Exception("Kernel error");
+		}
+
+		for (it = entries.begin(); it != entries.end(); ++it) {
+			ss << (*it)->address << ":";
+			for (pt = (*it)->portIdAltlists.begin();
+					pt != (*it)->portIdAltlists.end(); ++pt)
+				ss << pt->alts.front() << ",";
+			ss << " ";
+		}
+
+		call.mode = mode;
+		call.entries = ss.str();
+		calls.push_back(call);
+	}
+
+	std::list<KernelCall> calls;
+	bool fail;
+};
+
+rina::PDUForwardingTableEntry * pduftEntry(unsigned int address,
+					   unsigned int port,
+					   unsigned int cost)
+{
+	rina::PDUForwardingTableEntry * entry;
+
+	entry = new rina::PDUForwardingTableEntry();
+	entry->address = address;
+	entry->cost = cost;
+	entry->portIdAltlists.push_back(rina::PortIdAltlist(port));
+
+	return entry;
+}
+
+std::string pduftName(unsigned int address, unsigned int port)
+{
+	std::stringstream ss;
+
+	ss << rinad::PDUFTEntryRIBObj::object_name_prefix << address
+	   << "-0-" << port;
+
+	return ss.str();
+}
+
+int checkCalls(FakeResourceAllocator& ra, const std::string& expected)
+{
+	std::list<KernelCall>::iterator it;
+	std::stringstream ss;
+
+	for (it = ra.calls.begin(); it != ra.calls.end(); ++it)
+		ss << it->mode << "[" << it->entries << "]";
+	ra.calls.clear();
+
+	if (ss.str() != expected) {
+		LOG_IPCP_ERR("Wrong kernel PFF calls: got %s, expected %s",
+			     ss.str().c_str(), expected.c_str());
+		return -1;
+	}
+
+	return 0;
+}
+
+unsigned int entryCost(rinad::ResourceAllocator& ra, unsigned int address)
+{
+	std::list<rina::PDUForwardingTableEntry> entries;
+	std::list<rina::PDUForwardingTableEntry>::iterator it;
+
+	entries = ra.get_pduft_entries();
+	for (it = entries.begin(); it != entries.end(); ++it) {
+		if (it->address == address)
+			return it->cost;
+	}
+
+	return 0;
+}
+
+int setPDUFTEntries_Deltas_True()
+{
+	FakeRIBDaemon rib;
+	FakeResourceAllocator ra(&rib);
+	std::list<rina::PDUForwardingTableEntry*> entries;
+	rina::rib::RIBObj * kept;
+
+	// The first update replaces the whole kernel table
+	entries.push_back(pduftEntry(10, 1, 1));
+	entries.push_back(pduftEntry(11, 1, 2));
+	entries.push_back(pduftEntry(12, 2, 1));
+	entries.push_back(pduftEntry(13, 2, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "2[10:1, 11:1, 12:2, 13:2, ]") < 0)
+		return -1;
+
+	if (rib.objs.size() != 4) {
+		LOG_IPCP_ERR("Wrong number of RIB objects: %d",
+			     (int) rib.objs.size());
+		return -1;
+	}
+	kept = rib.objs[pduftName(10, 1)];
+
+	// 10 unchanged, 11 changes its cost, 12 moves to port 3, 13 is
+	// gone and 14 is new
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 1));
+	entries.push_back(pduftEntry(11, 1, 5));
+	entries.push_back(pduftEntry(12, 3, 1));
+	entries.push_back(pduftEntry(14, 2, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "0[12:3, 14:2, ]1[12:2, 13:2, ]") < 0)
+		return -1;
+
+	if (rib.objs.size() != 4 || rib.objs[pduftName(10, 1)] != kept ||
+			rib.objs.count(pduftName(12, 2)) ||
+			rib.objs.count(pduftName(13, 2)) ||
+			!rib.objs.count(pduftName(12, 3)) ||
+			!rib.objs.count(pduftName(14, 2))) {
+		LOG_IPCP_ERR("Wrong RIB objects after the update");
+		return -1;
+	}
+
+	if (entryCost(ra, 11) != 5) {
+		LOG_IPCP_ERR("Entry to 11 was not updated");
+		return -1;
+	}
+
+	// Nothing changes, nothing is sent
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 1));
+	entries.push_back(pduftEntry(11, 1, 5));
+	entries.push_back(pduftEntry(12, 3, 1));
+	entries.push_back(pduftEntry(14, 2, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "") < 0)
+		return -1;
+
+	return 0;
+}
+
+int setPDUFTEntries_TempEntries_True()
+{
+	FakeRIBDaemon rib;
+	FakeResourceAllocator ra(&rib);
+	std::list<rina::PDUForwardingTableEntry*> entries;
+
+	entries.push_back(pduftEntry(10, 1, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "2[10:1, ]") < 0)
+		return -1;
+
+	// A temp entry goes straight to the kernel, and is kept there while
+	// the routing policy does not provide the destination
+	ra.add_temp_pduft_entry(20, 4);
+	if (checkCalls(ra, "0[20:4, ]") < 0)
+		return -1;
+
+	entries.clear();
+	entries.push_back(pduftEntry(10, 2, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "0[10:2, ]1[10:1, ]") < 0)
+		return -1;
+
+	// Once it does, the routing policy entry replaces the temp one
+	entries.clear();
+	entries.push_back(pduftEntry(10, 2, 1));
+	entries.push_back(pduftEntry(20, 5, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "0[20:5, ]1[20:4, ]") < 0)
+		return -1;
+
+	ra.remove_temp_pduft_entry(20);
+	entries.clear();
+	entries.push_back(pduftEntry(10, 2, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "1[20:5, ]") < 0)
+		return -1;
+
+	return 0;
+}
+
+int setPDUFTEntries_KernelError_FullReplace()
+{
+	FakeRIBDaemon rib;
+	FakeResourceAllocator ra(&rib);
+	std::list<rina::PDUForwardingTableEntry*> entries;
+
+	entries.push_back(pduftEntry(10, 1, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "2[10:1, ]") < 0)
+		return -1;
+
+	// The kernel rejects the delta, so its state is unknown
+	ra.fail = true;
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 1));
+	entries.push_back(pduftEntry(11, 1, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "") < 0)
+		return -1;
+
+	// and the next update replaces the whole table again
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 1));
+	entries.push_back(pduftEntry(11, 1, 1));
+	ra.set_pduft_entries(entries);
+	if (checkCalls(ra, "2[10:1, 11:1, ]") < 0)
+		return -1;
+
+	return 0;
+}
+
+int setPDUFTEntries_RIBError_KeepOld()
+{
+	FakeRIBDaemon rib;
+	FakeResourceAllocator ra(&rib);
+	std::list<rina::PDUForwardingTableEntry*> entries;
+
+	entries.push_back(pduftEntry(10, 1, 1));
+	ra.set_pduft_entries(entries);
+	ra.calls.clear();
+
+	// The changed entry cannot be added to the RIB: the old one stays,
+	// in the table and in the RIB
+	rib.failing.insert(pduftName(10, 1));
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 7));
+	ra.set_pduft_entries(entries);
+	if (entryCost(ra, 10) != 1) {
+		LOG_IPCP_ERR("Old entry to 10 was not kept");
+		return -1;
+	}
+
+	if (!rib.objs.count(pduftName(10, 1))) {
+		LOG_IPCP_ERR("Old RIB object of the entry to 10 is gone");
+		return -1;
+	}
+
+	entries.clear();
+	entries.push_back(pduftEntry(10, 1, 7));
+	ra.set_pduft_entries(entries);
+	if (entryCost(ra, 10) != 7) {
+		LOG_IPCP_ERR("Entry to 10 was not updated");
+		return -1;
+	}
+
+	return 0;
+}
+
+int setRTEntries_Deltas_True()
+{
+	FakeRIBDaemon rib;
+	FakeResourceAllocator ra(&rib);
+	std::list<rina::RoutingTableEntry*> entries;
+	rina::RoutingTableEntry * entry;
+	rina::rib::RIBObj * kept;
+	rina::IPCPNameAddresses nhop;
+	const char * names[] = { "b", "c", "d" };
+
+	nhop.name = "b";
+	nhop.addresses.push_back(2);
+	for (int i = 0; i < 3; i++) {
+		entry = new rina::RoutingTableEntry();
+		entry->destination.name = names[i];
+		entry->cost = 1;
+		entry->nextHopNames.push_back(rina::NHopAltList(nhop));
+		entries.push_back(entry);
+	}
+	ra.set_rt_entries(entries);
+	if (rib.objs.size() != 3) {
+		LOG_IPCP_ERR("Wrong number of RIB objects: %d",
+			     (int) rib.objs.size());
+		return -1;
+	}
+	kept = rib.objs.begin()->second;
+
+	// "b" unchanged, "c" gets a new next hop address, "d" is gone
+	entries.clear();
+	for (int i = 0; i < 2; i++) {
+		entry = new rina::RoutingTableEntry();
+		entry->destination.name = names[i];
+		entry->cost = 1;
+		entry->nextHopNames.push_back(rina::NHopAltList(nhop));
+		entries.push_back(entry);
+	}
+	entries.back()->nextHopNames.front().alts.front().addresses.push_back(3);
+	ra.set_rt_entries(entries);
+
+	if (rib.objs.size() != 2 || rib.objs.begin()->second != kept) {
+		LOG_IPCP_ERR("Wrong RIB objects after the update");
+		return -1;
+	}
+
+	if (ra.get_rt_entries().back().nextHopNames.front().alts.front().addresses.size() != 2) {
+		LOG_IPCP_ERR("Entry to c was not updated");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main()
+{
+	int result = 0;
+
+	result = setPDUFTEntries_Deltas_True();
+	if (result < 0) {
+		LOG_IPCP_ERR("setPDUFTEntries_Deltas_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("setPDUFTEntries_Deltas_True test passed");
+
+	result = setPDUFTEntries_TempEntries_True();
+	if (result < 0) {
+		LOG_IPCP_ERR("setPDUFTEntries_TempEntries_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("setPDUFTEntries_TempEntries_True test passed");
+
+	result = setPDUFTEntries_KernelError_FullReplace();
+	if (result < 0) {
+		LOG_IPCP_ERR("setPDUFTEntries_KernelError_FullReplace test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("setPDUFTEntries_KernelError_FullReplace test passed");
+
+	result = setPDUFTEntries_RIBError_KeepOld();
+	if (result < 0) {
+		LOG_IPCP_ERR("setPDUFTEntries_RIBError_KeepOld test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("setPDUFTEntries_RIBError_KeepOld test passed");
+
+	result = setRTEntries_Deltas_True();
+	if (result < 0) {
+		LOG_IPCP_ERR("setRTEntries_Deltas_True test failed");
+		return result;
+	}
+	LOG_IPCP_INFO("setRTEntries_Deltas_True test passed");
+
+	return 0;
+}